@@ -0,0 +1,101 @@
+#!/usr/bin/python
+# HTTP/1.1 pipelining benchmark
+#
+# Each connection writes `depth` requests at once and waits for all the
+# responses before writing next batch, so depth 1 is plain keep-alive.
+#
+# Usage: ./pipeline.py [-c connections] [-d depth] [-n requests] [url]
+
+from __future__ import print_function
+
+import getopt
+import select
+import socket
+import sys
+import time
+
+try:
+    from urlparse import urlparse
+except ImportError:
+    from urllib.parse import urlparse
+
+
+def count_responses(buf):
+    """Return (complete responses, bytes they take) in `buf`, responses
+    must have Content-Length or be chunked."""
+    count = pos = 0
+    while True:
+        end = buf.find(b"\r\n\r\n", pos)
+        if end == -1:
+            break
+        head = buf[pos:end].lower()
+        body = end + 4
+        if b"transfer-encoding: chunked" in head:
+            while True:
+                line = buf.find(b"\r\n", body)
+                if line == -1:
+                    return count, pos
+                size = int(buf[body:line].split(b";")[0], 16)
+                body = line + 2 + size + 2
+                if body > len(buf):
+                    return count, pos
+                if size == 0:
+                    break
+        else:
+            length = 0
+            for field in head.split(b"\r\n"):
+                if field.startswith(b"content-length:"):
+                    length = int(field.split(b":")[1])
+            body += length
+            if body > len(buf):
+                break
+        count += 1
+        pos = body
+    return count, pos
+
+
+def run(host, port, path, conns, depth, total):
+    request = ("GET %s HTTP/1.1\r\nHost: %s:%d\r\n\r\n" % (path, host, port)).encode()
+    batch = request * depth
+    socks = {}
+    for i in range(conns):
+        s = socket.create_connection((host, port))
+        s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        socks[s.fileno()] = [s, b"", 0]
+    sent = done = 0
+    start = time.time()
+    for state in socks.values():
+        state[0].sendall(batch)
+        state[2] = depth
+        sent += depth
+    while done < total:
+        readable = select.select(list(socks.keys()), [], [], 5)[0]
+        if not readable:
+            print("timeout, %d responses received" % done)
+            return
+        for fd in readable:
+            state = socks[fd]
+            data = state[0].recv(262144)
+            if not data:
+                print("connection closed by server")
+                return
+            state[1] += data
+            count, used = count_responses(state[1])
+            state[1] = state[1][used:]
+            state[2] -= count
+            done += count
+            if state[2] == 0 and sent < total:
+                state[0].sendall(batch)
+                state[2] = depth
+                sent += depth
+    elapsed = time.time() - start
+    print("connections %d depth %d: %d requests in %.2fs, %.0f requests/sec"
+          % (conns, depth, done, elapsed, done / elapsed))
+
+
+if __name__ == "__main__":
+    opts, args = getopt.getopt(sys.argv[1:], "c:d:n:")
+    opts = dict(opts)
+    url = urlparse(args[0] if args else "http://127.0.0.1:10828/")
+    run(url.hostname, url.port or 80, url.path or "/", int(opts.get("-c", 10)),
+        int(opts.get("-d", 16)), int(opts.get("-n", 100000)))
@@ -0,0 +1,153 @@
+#!/usr/bin/python
+# WheatRedis pipelining benchmark
+#
+# Each connection writes `depth` commands at once and waits for all the
+# replies before writing next batch, so depth 1 is plain request/reply.
+# Commands are GET and SET of random keys, `-r` is the percent of GET.
+# Keys are uniform unless `-z` gives the exponent of zipf distribution,
+# with 1.0 the hottest key takes about 10% of 10000 keys' requests.
+# Latency percentiles are of batches, from written to all replies received.
+#
+# Usage: ./redis_pipeline.py [-c connections] [-d depth] [-n requests]
+#                            [-k keys] [-r read percent] [-z zipf]
+#                            [host:port]
+
+from __future__ import print_function
+
+import bisect
+import getopt
+import random
+import select
+import socket
+import sys
+import time
+
+
+def command(*args):
+    out = [b"*%d\r\n" % len(args)]
+    for arg in args:
+        out.append(b"$%d\r\n%s\r\n" % (len(arg), arg))
+    return b"".join(out)
+
+
+def reply_end(buf, pos):
+    """Return end of the reply starting at `pos`, -1 if it's incomplete."""
+    line = buf.find(b"\r\n", pos)
+    if line == -1:
+        return -1
+    kind = buf[pos:pos + 1]
+    if kind == b"$":
+        size = int(buf[pos + 1:line])
+        if size < 0:
+            return line + 2
+        end = line + 2 + size + 2
+        return end if end <= len(buf) else -1
+    if kind == b"*":
+        count = int(buf[pos + 1:line])
+        pos = line + 2
+        for i in range(count):
+            pos = reply_end(buf, pos)
+            if pos == -1:
+                return -1
+        return pos
+    return line + 2
+
+
+def count_replies(buf):
+    """Return (complete replies, bytes they take) in `buf`."""
+    count = pos = 0
+    while pos < len(buf):
+        end = reply_end(buf, pos)
+        if end == -1:
+            break
+        count += 1
+        pos = end
+    return count, pos
+
+
+def zipf_weights(keys, s):
+    """Return cumulative weights of keys, None if uniform."""
+    if not s:
+        return None
+    total, weights = 0.0, []
+    for i in range(keys):
+        total += 1.0 / (i + 1) ** s
+        weights.append(total)
+    return weights
+
+
+def pick(keys, weights):
+    if not weights:
+        return random.randrange(keys)
+    return bisect.bisect(weights, random.random() * weights[-1])
+
+
+def batch(depth, keys, reads, weights=None):
+    out = []
+    for i in range(depth):
+        key = b"key:%d" % pick(keys, weights)
+        if random.randrange(100) < reads:
+            out.append(command(b"GET", key))
+        else:
+            out.append(command(b"SET", key, b"value:" + key))
+    return b"".join(out)
+
+
+def percentile(latencies, p):
+    return latencies[min(len(latencies) - 1, int(len(latencies) * p))]
+
+
+def run(host, port, conns, depth, total, keys, reads, zipf=0):
+    socks = {}
+    latencies = []
+    weights = zipf_weights(keys, zipf)
+    for i in range(conns):
+        s = socket.create_connection((host, port))
+        s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        socks[s.fileno()] = [s, b"", 0, 0]
+    sent = done = 0
+    start = time.time()
+    for state in socks.values():
+        state[0].sendall(batch(depth, keys, reads, weights))
+        state[2] = depth
+        state[3] = time.time()
+        sent += depth
+    while done < total:
+        readable = select.select(list(socks.keys()), [], [], 5)[0]
+        if not readable:
+            print("timeout, %d replies received" % done)
+            return
+        for fd in readable:
+            state = socks[fd]
+            data = state[0].recv(262144)
+            if not data:
+                print("connection closed by server")
+                return
+            state[1] += data
+            count, used = count_replies(state[1])
+            state[1] = state[1][used:]
+            state[2] -= count
+            done += count
+            if state[2] == 0:
+                latencies.append(time.time() - state[3])
+            if state[2] == 0 and sent < total:
+                state[0].sendall(batch(depth, keys, reads, weights))
+                state[2] = depth
+                state[3] = time.time()
+                sent += depth
+    elapsed = time.time() - start
+    latencies.sort()
+    print("latency p50 %.2fms p99 %.2fms p999 %.2fms max %.2fms"
+          % tuple(percentile(latencies, p) * 1000
+                  for p in (0.5, 0.99, 0.999, 1)))
+    print("connections %d depth %d: %d requests in %.2fs, %.0f requests/sec"
+          % (conns, depth, done, elapsed, done / elapsed))
+
+
+if __name__ == "__main__":
+    opts, args = getopt.getopt(sys.argv[1:], "c:d:n:k:r:z:")
+    opts = dict(opts)
+    host, port = (args[0] if args else "127.0.0.1:10828").split(":")
+    run(host, int(port), int(opts.get("-c", 10)), int(opts.get("-d", 16)),
+        int(opts.get("-n", 100000)), int(opts.get("-k", 10000)),
+        int(opts.get("-r", 90)), float(opts.get("-z", 0)))
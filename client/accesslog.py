@@ -0,0 +1,55 @@
+#!/usr/bin/python
+
+# Convert binary access log(access-log-format Binary) to Apache combined
+# log format. Usage: ./accesslog.py binary_log_file [output_file]
+
+import struct
+import sys
+import time
+
+MAGIC = 0xA7
+# Version 1 kept response length in 4 bytes, version 1 and 2 only kept
+# http minor version
+HEADERS = {
+    1: struct.Struct("<BBHIHIBBHHHH"),
+    2: struct.Struct("<BBHIHQBBHHHH"),
+    3: struct.Struct("<BBHIHQBBBHHHH"),
+}
+
+def records(data):
+    pos = 0
+    while pos + 2 <= len(data):
+        header = HEADERS.get(ord(data[pos+1]))
+        if ord(data[pos]) != MAGIC or not header or pos + header.size > len(data):
+            raise ValueError("corrupted record at offset %d" % pos)
+        values = header.unpack_from(data, pos)
+        if values[1] < 3:
+            values = values[:7] + (1,) + values[7:]
+        (magic, version, length, timestamp, status, res_length, method_len,
+         major, minor, addr_len, path_len, refer_len, agent_len) = values
+        if length < header.size:
+            raise ValueError("corrupted record at offset %d" % pos)
+        fields = []
+        start = pos + header.size
+        for l in (method_len, addr_len, path_len, refer_len, agent_len):
+            fields.append(data[start:start+l])
+            start += l
+        yield timestamp, status, res_length, major, minor, fields
+        pos += length
+
+def format_record(timestamp, status, res_length, major, minor, fields):
+    method, addr, path, refer, agent = fields
+    date = time.strftime("%d/%b/%Y:%H:%M:%S +0000", time.gmtime(timestamp))
+    return '%s - - [%s] "%s %s HTTP/%d.%d" %d %d "%s" "%s"\n' % (
+            addr, date, method, path, major, minor, status, res_length, refer, agent)
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print "Usage: ./accesslog.py binary_log_file [output_file]"
+        sys.exit(1)
+    data = open(sys.argv[1], "rb").read()
+    out = sys.stdout
+    if len(sys.argv) > 2:
+        out = open(sys.argv[2], "w")
+    for record in records(data):
+        out.write(format_record(*record))
@@ -1,13 +1,74 @@
+import hashlib
+import os
+import time
+
 HELLO_WORLD = b"Hello world!\n"
 COMPLEX = b"Hello world!\n" * 20000
+# Like a template rendered piece by piece
+FRAGMENTS = [b"<li>item %d</li>\n" % i for i in range(500)]
+# Times /cached called application
+CACHED_CALLS = [0]
+IMAGE = os.path.join(os.path.dirname(os.path.dirname(os.path.abspath(__file__))),
+                     'static', 'example.jpg')
+
+def upload(environ, start_response):
+    """Length and md5 of whole body"""
+    md5, length = hashlib.md5(), 0
+    while True:
+        piece = environ['wsgi.input'].read(65536)
+        if not piece:
+            break
+        md5.update(piece)
+        length += len(piece)
+    ret = b"%d %s\n" % (length, md5.hexdigest())
+    start_response('200 OK', [('Content-type', 'text/plain'), ('Content-Length', str(len(ret)))])
+    return [ret]
 
 def application(environ, start_response):
     """Simplest possible application object"""
     status = '200 OK'
+    if environ['PATH_INFO'] == '/upload':
+        return upload(environ, start_response)
     post = environ['wsgi.input'].read(1000)
     ret = HELLO_WORLD
     if environ['PATH_INFO'] == '/complex':
         ret = COMPLEX
+    elif environ['PATH_INFO'] == '/fragments':
+        start_response(status, [('Content-type', 'text/html')])
+        return iter(FRAGMENTS)
+    elif environ['PATH_INFO'] == '/stream':
+        # Pieces given slowly, like events pushed to client
+        start_response(status, [('Content-type', 'text/plain')])
+        def stream():
+            yield b"first\n"
+            time.sleep(0.5)
+            yield b"second\n"
+        return stream()
+    elif environ['PATH_INFO'] == '/cached':
+        # Slow page shareable for seconds given by query string
+        CACHED_CALLS[0] += 1
+        ret = b"call %d\n" % CACHED_CALLS[0]
+        time.sleep(0.3)
+        start_response(status, [('Content-type', 'text/plain'),
+                                ('Cache-Control', 'max-age=%s' % (environ['QUERY_STRING'] or 60)),
+                                ('Content-Length', str(len(ret)))])
+        return [ret]
+    elif environ['PATH_INFO'] == '/cookies':
+        ret = b"cookies\n"
+        start_response(status, [('Content-type', 'text/plain'), ('Set-Cookie', 'a=1'),
+                                ('Set-Cookie', 'b=2'), ('Content-Length', str(len(ret)))])
+        return [ret]
+    elif environ['PATH_INFO'].startswith('/environ'):
+        # Values of environ keys given by query string
+        ret = b"".join(b"%s=%s\n" % (k, environ.get(k)) for k in environ['QUERY_STRING'].split(','))
+        start_response(status, [('Content-type', 'text/plain'), ('Content-Length', str(len(ret)))])
+        return [ret]
+    elif environ['PATH_INFO'] == '/file_wrapper':
+        # Sent from offset given by query string
+        f = open(IMAGE, 'rb')
+        f.seek(int(environ['QUERY_STRING'] or 0))
+        start_response(status, [('Content-type', 'img/jpg')])
+        return environ['wsgi.file_wrapper'](f)
     elif environ['PATH_INFO'] == '/file':
         ret = open('example/static/example.jpg')
         response_headers = [('Content-type', 'img/jpg')]
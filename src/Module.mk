@@ -1,24 +1,32 @@
-WSGI_APP_MODULE = app/wsgi/app_wsgi.c app/wsgi/wsgiwrapper.c app/wsgi/wsgiinput.c
+WSGI_APP_MODULE = app/wsgi/app_wsgi.c app/wsgi/wsgiwrapper.c app/wsgi/wsgiinput.c app/wsgi/wsgicache.c \
+				  app/wsgi/wsgipool.c
 PYTHON_VERSION = $(shell python -c "import distutils.sysconfig;print distutils.sysconfig.get_python_version()")
 MODULE_ATTRS += AppWsgiAttr
 
 CFLAGS += -I$(shell python -c "import distutils.sysconfig;print distutils.sysconfig.get_python_inc()")
-LIBS += -lpython$(PYTHON_VERSION) -lramcloud
+LIBS += -lpython$(PYTHON_VERSION) -lramcloud -lpthread
 MODULE_SOURCES += $(WSGI_APP_MODULE)
 
 ################################ Module Separtor ###############################
-STATIC_APP_MODULE = app/static/app_static_file.c
+STATIC_APP_MODULE = app/static/app_static_file.c app/static/static_cache.c
 
 MODULE_SOURCES += $(STATIC_APP_MODULE)
 MODULE_ATTRS += AppStaticAttr
 
 ################################ Module Separtor ###############################
 REDIS_APP_MODULE = app/wheatredis/redis.c app/wheatredis/hashkit.c \
-				   app/wheatredis/md5.c app/wheatredis/redis_config.c
+				   app/wheatredis/md5.c app/wheatredis/redis_config.c \
+				   app/wheatredis/hash.c app/wheatredis/redis_cache.c
 
 MODULE_SOURCES += $(REDIS_APP_MODULE)
 MODULE_ATTRS += AppRedisAttr
 
+################################ Module Separtor ###############################
+HTTP_PROXY_APP_MODULE = app/proxy/app_http_proxy.c
+
+MODULE_SOURCES += $(HTTP_PROXY_APP_MODULE)
+MODULE_ATTRS += AppHttpProxyAttr
+
 ################################ Module Separtor ###############################
 RAMCLOUD_APP_MODULE = app/ramcloud/app_ramcloud.c
 
@@ -26,7 +34,10 @@ MODULE_SOURCES += $(RAMCLOUD_APP_MODULE)
 MODULE_ATTRS += AppRamcloudAttr
 
 ################################ Module Separtor ###############################
-HTTP_PROTOCOL_MODULE = protocol/http/http_parser.c protocol/http/proto_http.c
+HTTP_PROTOCOL_MODULE = protocol/http/http_parser.c protocol/http/proto_http.c \
+					   protocol/http/access_log.c protocol/http/http_router.c \
+					   protocol/http/hpack.c protocol/http/http2.c \
+					   protocol/http/http_scan.c
 
 MODULE_SOURCES += $(HTTP_PROTOCOL_MODULE)
 MODULE_ATTRS += ProtocolHttpAttr
@@ -0,0 +1,821 @@
+// Http reverse proxy module
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <sys/socket.h>
+
+#include "../application.h"
+#include "../../protocol/http/proto_http.h"
+
+#define WHEAT_PROXY_MAX_FAILS       3
+#define WHEAT_PROXY_FAIL_TIMEOUT    10
+#define WHEAT_PROXY_REPORT_INTERVAL 60
+#define WHEAT_PROXY_HEAD_LEN        512
+
+#define WHEAT_PROXY_ROUNDROBIN      0
+#define WHEAT_PROXY_LEASTOUTSTANDING 1
+
+int proxyCall(struct conn *, void *);
+int initProxy(struct protocol *);
+void deallocProxy();
+void proxyCron();
+void *initProxyData(struct conn *);
+void freeProxyData(void *app_data);
+
+static struct enumIdName ProxyBalances[] = {
+    {0, "RoundRobin"}, {1, "LeastOutstanding"}, {-1, NULL}
+};
+
+// Proxy Configuration
+static struct configuration ProxyConf[] = {
+    {"proxy-upstreams",   WHEAT_ARGS_NO_LIMIT,listValidator, {.ptr=NULL},
+        NULL,                   LIST_FORMAT},
+    {"proxy-balance",     2, enumValidator,        {.enum_ptr=&ProxyBalances[0]},
+        &ProxyBalances[0],      ENUM_FORMAT},
+    {"proxy-timeout",     2, unsignedIntValidator, {.val=30000},
+        NULL,                   INT_FORMAT},
+    {"proxy-max-idle",    2, unsignedIntValidator, {.val=32},
+        NULL,                   INT_FORMAT},
+};
+
+static struct statItem ProxyStats[] = {
+    {"Total proxy request", SUM_STAT, RAW, 0, 0},
+    {"Total proxy failed", SUM_STAT, RAW, 0, 0},
+    {"Max proxy latency", MAX_STAT, MICORSECONDS_TIME, 0, 0},
+};
+
+static struct app AppHttpProxy = {
+    "Http", proxyCron, proxyCall, initProxy, deallocProxy,
+    initProxyData, freeProxyData, 0
+};
+
+struct moduleAttr AppHttpProxyAttr = {
+    "http-proxy", APP, {.app=&AppHttpProxy},
+    ProxyStats, sizeof(ProxyStats)/sizeof(struct statItem),
+    ProxyConf, sizeof(ProxyConf)/sizeof(struct configuration),
+    NULL, 0
+};
+
+// Backend server. Connections kept alive are stored in `idle` and reused
+// by later requests of any client. After `WHEAT_PROXY_MAX_FAILS` failures
+// in a row upstream is skipped for `WHEAT_PROXY_FAIL_TIMEOUT` seconds.
+//
+// `latency`: moving average of the time to response headers in
+// microseconds
+struct upstream {
+    wstr ip;
+    int port;
+    struct list *idle;
+    int fails;
+    time_t down_until;
+    long outstanding;
+    long long requests;
+    long long failures;
+    long long latency;
+    long long max_latency;
+};
+
+// Backend servers requests are balanced between. `DefaultPool` is built
+// from `proxy-upstreams`, route with "upstreams=" option has its own pool
+// built when it's first used and kept in route's `app_data`.
+struct upstreamPool {
+    struct upstream *upstreams;
+    size_t count;
+    size_t next;
+};
+
+// Stored as `client_data` of each upstream client, freed when client freed
+struct proxyPeer {
+    struct upstream *upstream;
+    struct client *client;
+    struct proxyRequest *req;
+    struct listNode *idle_node;
+    unsigned reused:1;
+};
+
+// App data of client request.
+//
+// `response`: conn of upstream client parsing response for this request
+// `node`: position in `WaitingRequests` until response headers received
+struct proxyRequest {
+    struct conn *outer;
+    struct upstreamPool *pool;
+    struct proxyPeer *peer;
+    struct conn *response;
+    wstr head;
+    struct timeval start;
+    struct listNode *node;
+    unsigned retried:1;
+    unsigned headers_forwarded:1;
+    unsigned done:1;
+};
+
+static struct upstreamPool DefaultPool;
+static struct list *Pools = NULL;
+static int Balance = WHEAT_PROXY_ROUNDROBIN;
+static long long Timeout = 0;
+static unsigned long MaxIdle = 0;
+static time_t LastReport = 0;
+static struct list *WaitingRequests = NULL;
+static struct protocol *ProxyProtocol = NULL;
+static long long *TotalProxyRequest = NULL;
+static long long *TotalProxyFailed = NULL;
+static long long *MaxProxyLatency = NULL;
+
+static void proxyClientClosed(struct client *client);
+
+// Hop-by-hop headers only make sense for a single connection, so they are
+// never relayed. Headers of well-known id are checked in `isHopHeader`.
+static const struct {
+    const char *name;
+    size_t len;
+} HopHeaders[] = {
+    {"Keep-Alive", 10},
+    {"Proxy-Connection", 16},
+    {"TE", 2},
+    {"Trailer", 7},
+};
+
+static int isHopHeader(const struct httpHeader *header, int is_request)
+{
+    size_t i;
+
+    switch (header->id) {
+        case HTTP_HEADER_CONNECTION:
+        case HTTP_HEADER_TRANSFER_ENCODING:
+        case HTTP_HEADER_UPGRADE:
+            return 1;
+        // Regenerated by proxy
+        case HTTP_HEADER_CONTENT_LENGTH:
+        case HTTP_HEADER_X_FORWARDED_FOR:
+        case HTTP_HEADER_EXPECT:
+            return is_request;
+        case HTTP_HEADER_SERVER:
+        case HTTP_HEADER_DATE:
+            return !is_request;
+        case HTTP_HEADER_UNKNOWN:
+            break;
+        default:
+            return 0;
+    }
+    for (i = 0; i < sizeof(HopHeaders)/sizeof(HopHeaders[0]); i++) {
+        if (header->name.len == HopHeaders[i].len &&
+                !strncasecmp((const char *)header->name.data, HopHeaders[i].name,
+                    HopHeaders[i].len))
+            return 1;
+    }
+    return 0;
+}
+
+static wstr catHeader(wstr head, const char *field, size_t field_len,
+        const char *value, size_t value_len)
+{
+    head = wstrCatLen(head, field, field_len);
+    head = wstrCatLen(head, ": ", 2);
+    head = wstrCatLen(head, value, value_len);
+    return wstrCatLen(head, "\r\n", 2);
+}
+
+// Request line and headers sent to upstream, body is sent from client
+// request buffer directly
+static wstr buildRequestHead(struct conn *c, struct upstream *up)
+{
+    const struct slice *path, *query, *forward;
+    struct array *headers;
+    struct httpHeader *header;
+    wstr head, forward_for;
+    char buf[64];
+    size_t i;
+    int len;
+
+    path = httpGetPath(c);
+    query = httpGetQueryString(c);
+    head = wstrNewLen(NULL, WHEAT_PROXY_HEAD_LEN);
+    head = wstrCat(head, httpGetMethod(c));
+    head = wstrCatLen(head, " ", 1);
+    if (path->len)
+        head = wstrCatLen(head, (const char *)path->data, path->len);
+    else
+        head = wstrCatLen(head, "/", 1);
+    if (query->len) {
+        head = wstrCatLen(head, "?", 1);
+        head = wstrCatLen(head, (const char *)query->data, query->len);
+    }
+    head = wstrCatLen(head, " HTTP/1.1\r\n", 11);
+
+    headers = httpGetReqHeaders(c);
+    for (i = 0; i < narray(headers); i++) {
+        header = arrayIndex(headers, i);
+        if (isHopHeader(header, 1))
+            continue;
+        head = catHeader(head, (const char *)header->name.data,
+                header->name.len, (const char *)header->value.data,
+                header->value.len);
+    }
+    if (!httpGetReqHeader(c, HTTP_HEADER_HOST)) {
+        len = snprintf(buf, sizeof(buf), "%s:%d", up->ip, up->port);
+        head = catHeader(head, "Host", 4, buf, len);
+    }
+
+    forward_for = wstrEmpty();
+    forward = httpGetReqHeader(c, HTTP_HEADER_X_FORWARDED_FOR);
+    if (forward) {
+        forward_for = wstrCatLen(forward_for, (const char *)forward->data,
+                forward->len);
+        forward_for = wstrCatLen(forward_for, ", ", 2);
+    }
+    forward_for = wstrCat(forward_for, getConnIP(c));
+    head = catHeader(head, "X-Forwarded-For", 15, forward_for,
+            wstrlen(forward_for));
+    wstrFree(forward_for);
+
+    if (httpBodyGetSize(c) ||
+            httpGetReqHeader(c, HTTP_HEADER_CONTENT_LENGTH) ||
+            httpGetReqHeader(c, HTTP_HEADER_TRANSFER_ENCODING)) {
+        len = ll2string(buf, sizeof(buf), httpBodyGetSize(c));
+        head = catHeader(head, CONTENT_LENGTH, sizeof(CONTENT_LENGTH)-1,
+                buf, len);
+    }
+    return wstrCatLen(head, "\r\n", 2);
+}
+
+static void markUpstreamFailed(struct upstream *up)
+{
+    up->failures++;
+    (*TotalProxyFailed)++;
+    if (++up->fails >= WHEAT_PROXY_MAX_FAILS) {
+        up->fails = 0;
+        up->down_until = Server.cron_time.tv_sec + WHEAT_PROXY_FAIL_TIMEOUT;
+        wheatLog(WHEAT_WARNING, "upstream %s:%d failed %d times, skipped for %ds",
+                up->ip, up->port, WHEAT_PROXY_MAX_FAILS,
+                WHEAT_PROXY_FAIL_TIMEOUT);
+    }
+}
+
+static struct upstream *pickUpstream(struct upstreamPool *pool)
+{
+    struct upstream *up, *best = NULL;
+    size_t i;
+
+    for (i = 0; i < pool->count; i++) {
+        up = &pool->upstreams[(pool->next+i) % pool->count];
+        if (up->down_until > Server.cron_time.tv_sec)
+            continue;
+        if (Balance == WHEAT_PROXY_ROUNDROBIN) {
+            best = up;
+            break;
+        }
+        if (best == NULL || up->outstanding < best->outstanding)
+            best = up;
+    }
+    pool->next = (pool->next + 1) % pool->count;
+    return best;
+}
+
+static struct proxyPeer *getPeer(struct upstream *up)
+{
+    struct proxyPeer *peer;
+    struct listNode *node;
+    struct client *client;
+    char name[255];
+
+    // The most recently used connection is the least likely to be closed
+    // by upstream
+    node = listLast(up->idle);
+    if (node) {
+        peer = listNodeValue(node);
+        removeListNode(up->idle, node);
+        peer->idle_node = NULL;
+        peer->reused = 1;
+        return peer;
+    }
+
+    client = buildConn(up->ip, up->port, ProxyProtocol);
+    if (client == NULL)
+        return NULL;
+    peer = wmalloc(sizeof(*peer));
+    if (peer == NULL) {
+        freeClient(client);
+        return NULL;
+    }
+    peer->upstream = up;
+    peer->client = client;
+    peer->req = NULL;
+    peer->idle_node = NULL;
+    peer->reused = 0;
+    client->client_data = peer;
+    snprintf(name, sizeof(name), "Upstream %s:%d", up->ip, up->port);
+    setClientName(client, name);
+    setClientFreeNotify(client, proxyClientClosed);
+    return peer;
+}
+
+static void attachPeer(struct proxyRequest *req, struct proxyPeer *peer)
+{
+    req->peer = peer;
+    req->response = NULL;
+    peer->req = req;
+    peer->upstream->outstanding++;
+    peer->upstream->requests++;
+}
+
+static void detachPeer(struct proxyRequest *req)
+{
+    struct proxyPeer *peer = req->peer;
+
+    peer->upstream->outstanding--;
+    peer->req = NULL;
+    req->peer = NULL;
+    req->response = NULL;
+}
+
+// Client is freed by worker when it notices the shutdown, `peer` is freed
+// in `proxyClientClosed` then.
+static void closePeer(struct proxyPeer *peer)
+{
+    if (peer->req)
+        detachPeer(peer->req);
+    setClientUnvalid(peer->client);
+    shutdown(peer->client->clifd, SHUT_RDWR);
+}
+
+// Upstream connection is reused only if the whole request was written and
+// response was read completely, otherwise the stream state is unknown.
+static void releasePeer(struct proxyRequest *req)
+{
+    struct proxyPeer *peer = req->peer;
+    struct client *client;
+    int keep_alive;
+
+    if (peer == NULL)
+        return ;
+    client = peer->client;
+    keep_alive = req->done && req->response && httpIsKeepAlive(req->response);
+    if (req->response)
+        finishConn(req->response);
+    detachPeer(req);
+    if (keep_alive && isClientValid(client) && !listLength(client->conns) &&
+            listLength(peer->upstream->idle) < MaxIdle) {
+        msgClean(client->req_buf);
+        peer->idle_node = appendToListTail(peer->upstream->idle, peer);
+        return ;
+    }
+    closePeer(peer);
+}
+
+static int sendRequest(struct proxyRequest *req, struct proxyPeer *peer)
+{
+    struct conn *outer = req->outer, *send_conn;
+    const struct slice *next;
+    struct slice slice;
+    int fd, ret;
+
+    attachPeer(req, peer);
+    if (req->head == NULL)
+        req->head = buildRequestHead(outer, peer->upstream);
+    send_conn = connGet(peer->client);
+    sliceTo(&slice, (uint8_t *)req->head, wstrlen(req->head));
+    ret = sendClientData(send_conn, &slice);
+    fd = httpBodyGetFile(outer);
+    if (fd != -1) {
+        if (ret == WHEAT_OK)
+            ret = sendClientFile(send_conn, fd, httpBodyGetSize(outer));
+    } else {
+        // Body slices refer to client request buffer, which is kept until
+        // request finished
+        httpBodyRewind(outer);
+        while (ret == WHEAT_OK && (next = httpGetBodyNext(outer)) != NULL) {
+            slice = *next;
+            ret = sendClientData(send_conn, &slice);
+        }
+    }
+    finishConn(send_conn);
+    if (ret == WHEAT_WRONG) {
+        closePeer(peer);
+        return WHEAT_WRONG;
+    }
+    return WHEAT_OK;
+}
+
+static int dispatchRequest(struct proxyRequest *req)
+{
+    struct upstream *up;
+    struct proxyPeer *peer;
+    size_t i;
+
+    for (i = 0; i < req->pool->count; i++) {
+        up = pickUpstream(req->pool);
+        if (up == NULL)
+            break;
+        peer = getPeer(up);
+        if (peer && sendRequest(req, peer) == WHEAT_OK)
+            return WHEAT_OK;
+        // Kept alive connection may be closed by upstream meanwhile
+        if (!peer || !peer->reused)
+            markUpstreamFailed(up);
+    }
+    wheatLog(WHEAT_NOTICE, "no upstream available");
+    return WHEAT_WRONG;
+}
+
+// Finish client response, it may be the last one client waits for before
+// closing.
+static void finishRequest(struct proxyRequest *req)
+{
+    struct client *client = req->outer->client;
+
+    req->done = 1;
+    if (req->node) {
+        removeListNode(WaitingRequests, req->node);
+        req->node = NULL;
+    }
+    httpSendBodyEnd(req->outer);
+    httpFinishResponse(req->outer);
+    tryFreeClient(client);
+}
+
+static void replyError(struct proxyRequest *req, int status)
+{
+    if (status == 504)
+        sendResponse504(req->outer);
+    else
+        sendResponse502(req->outer);
+    finishRequest(req);
+}
+
+static void updateLatency(struct upstream *up, struct proxyRequest *req)
+{
+    struct timeval now;
+    long long latency;
+
+    gettimeofday(&now, NULL);
+    latency = getMicroseconds(now) - getMicroseconds(req->start);
+    up->latency = up->latency ? (up->latency * 7 + latency) / 8 : latency;
+    if (latency > up->max_latency)
+        up->max_latency = latency;
+    if (latency > *MaxProxyLatency)
+        *MaxProxyLatency = latency;
+}
+
+static void forwardHeaders(struct proxyRequest *req, struct conn *c)
+{
+    struct conn *outer = req->outer;
+    struct array *headers;
+    struct httpHeader *header;
+    size_t i;
+
+    req->response = c;
+    req->headers_forwarded = 1;
+    removeListNode(WaitingRequests, req->node);
+    req->node = NULL;
+    req->peer->upstream->fails = 0;
+    updateLatency(req->peer->upstream, req);
+
+    if (!strcasecmp(httpGetMethod(outer), "HEAD"))
+        httpSkipBody(c);
+    httpFillResStatus(outer, httpGetStatusCode(c));
+    headers = httpGetReqHeaders(c);
+    for (i = 0; i < narray(headers); i++) {
+        header = arrayIndex(headers, i);
+        if (isHopHeader(header, 0))
+            continue;
+        httpAppendResHeaderLen(outer, (const char *)header->name.data,
+                header->name.len, (const char *)header->value.data,
+                header->value.len);
+    }
+    httpSendHeaders(outer);
+}
+
+// Body received so far is copied because upstream buffer is released while
+// streaming. The last part stays in upstream buffer until client request
+// finished(see `releasePeer` and `proxyClientClosed`).
+static void forwardBody(struct proxyRequest *req, struct conn *c)
+{
+    const struct slice *next;
+    wstr copy = NULL;
+    int complete = httpIsComplete(c);
+
+    while ((next = httpGetBodyNext(c)) != NULL) {
+        if (complete) {
+            httpSendBody(req->outer, (const char *)next->data, next->len);
+            continue;
+        }
+        if (copy == NULL)
+            copy = wstrNewLen(NULL, (int)next->len);
+        copy = wstrCatLen(copy, (const char *)next->data, next->len);
+    }
+    if (copy) {
+        registerConnFree(req->outer, (void (*)(void *))wstrFree, copy);
+        httpSendBody(req->outer, copy, wstrlen(copy));
+    }
+}
+
+// Called at response headers complete, each time body is parsed and at
+// message complete.
+static int handleUpstreamResponse(struct conn *c)
+{
+    struct proxyPeer *peer = c->client->client_data;
+    struct proxyRequest *req = peer->req;
+
+    if (req == NULL) {
+        // Request is timeout or upstream sends garbage
+        if (httpIsComplete(c))
+            finishConn(c);
+        closePeer(peer);
+        return WHEAT_OK;
+    }
+    // Interim response such as "100 Continue" isn't relayed
+    if (httpGetStatusCode(c) / 100 == 1) {
+        if (httpIsComplete(c))
+            finishConn(c);
+        return WHEAT_OK;
+    }
+    if (!req->headers_forwarded)
+        forwardHeaders(req, c);
+    forwardBody(req, c);
+    if (httpIsComplete(c))
+        finishRequest(req);
+    return WHEAT_OK;
+}
+
+static void proxyClientClosed(struct client *client)
+{
+    struct proxyPeer *peer = client->client_data;
+    struct proxyRequest *req = peer->req;
+    struct upstream *up = peer->upstream;
+
+    if (peer->idle_node)
+        removeListNode(up->idle, peer->idle_node);
+    if (req == NULL) {
+        wfree(peer);
+        return ;
+    }
+
+    if (req->done) {
+        // Client is still sending response referring upstream buffer
+        registerConnFree(req->outer, (void (*)(void *))msgFree, client->req_buf);
+        client->req_buf = msgCreate(Server.mbuf_size);
+        detachPeer(req);
+    } else if (!req->headers_forwarded) {
+        detachPeer(req);
+        if (peer->reused && !req->retried) {
+            req->retried = 1;
+            if (dispatchRequest(req) == WHEAT_OK) {
+                wfree(peer);
+                return ;
+            }
+        } else {
+            markUpstreamFailed(up);
+        }
+        wheatLog(WHEAT_NOTICE, "upstream %s:%d closed before response",
+                up->ip, up->port);
+        replyError(req, 502);
+    } else if (httpIsBodyUntilEOF(req->response)) {
+        detachPeer(req);
+        finishRequest(req);
+    } else {
+        // Response is truncated, client can only know it by closing
+        wheatLog(WHEAT_NOTICE, "upstream %s:%d closed in response",
+                up->ip, up->port);
+        markUpstreamFailed(up);
+        detachPeer(req);
+        setClientUnvalid(req->outer->client);
+        tryFreeClient(req->outer->client);
+    }
+    wfree(peer);
+}
+
+static int addUpstream(struct upstreamPool *pool, const char *addr)
+{
+    struct upstream *up;
+    wstr *frags;
+    int count;
+
+    frags = wstrNewSplit((wstr)addr, ":", 1, &count);
+    if (frags == NULL || count != 2 || atoi(frags[1]) <= 0) {
+        wheatLog(WHEAT_WARNING, "upstream %s is unvalid", addr);
+        if (frags)
+            wstrFreeSplit(frags, count);
+        return WHEAT_WRONG;
+    }
+    up = &pool->upstreams[pool->count++];
+    memset(up, 0, sizeof(*up));
+    up->ip = wstrDup(frags[0]);
+    up->port = atoi(frags[1]);
+    up->idle = createList();
+    wstrFreeSplit(frags, count);
+    return WHEAT_OK;
+}
+
+// `upstreams`: "ip:port,ip:port" given by route option
+static struct upstreamPool *createPool(wstr upstreams)
+{
+    struct upstreamPool *pool;
+    wstr *addrs;
+    int count, i;
+
+    addrs = wstrNewSplit(upstreams, ",", 1, &count);
+    if (addrs == NULL)
+        return NULL;
+    pool = wmalloc(sizeof(*pool));
+    if (pool == NULL)
+        goto failed;
+    memset(pool, 0, sizeof(*pool));
+    pool->upstreams = wmalloc(sizeof(struct upstream)*count);
+    if (pool->upstreams == NULL)
+        goto failed;
+    for (i = 0; i < count; i++) {
+        if (addUpstream(pool, addrs[i]) == WHEAT_WRONG)
+            goto failed;
+    }
+    wstrFreeSplit(addrs, count);
+    appendToListTail(Pools, pool);
+    return pool;
+
+failed:
+    if (pool && pool->upstreams) {
+        for (i = 0; i < (int)pool->count; i++) {
+            wstrFree(pool->upstreams[i].ip);
+            freeList(pool->upstreams[i].idle);
+        }
+        wfree(pool->upstreams);
+    }
+    wfree(pool);
+    wstrFreeSplit(addrs, count);
+    return NULL;
+}
+
+static struct upstreamPool *getPool(struct conn *c)
+{
+    struct httpRoute *route = httpGetRoute(c);
+
+    if (route == NULL || route->upstreams == NULL)
+        return &DefaultPool;
+    if (route->app_data == NULL)
+        route->app_data = createPool(route->upstreams);
+    return route->app_data;
+}
+
+int proxyCall(struct conn *c, void *arg)
+{
+    struct proxyRequest *req;
+
+    if (!isOuterClient(c->client))
+        return handleUpstreamResponse(c);
+
+    req = c->app_private_data;
+    req->outer = c;
+    req->pool = getPool(c);
+    gettimeofday(&req->start, NULL);
+    (*TotalProxyRequest)++;
+    if (req->pool == NULL || dispatchRequest(req) == WHEAT_WRONG) {
+        sendResponse502(c);
+        return WHEAT_OK;
+    }
+    req->node = appendToListTail(WaitingRequests, req);
+    httpDeferResponse(c);
+    return WHEAT_OK;
+}
+
+static void reportUpstreams()
+{
+    struct listIterator *iter;
+    struct listNode *node;
+    struct upstreamPool *pool;
+    struct upstream *up;
+    size_t i;
+
+    iter = listGetIterator(Pools, START_HEAD);
+    while ((node = listNext(iter)) != NULL) {
+        pool = listNodeValue(node);
+        for (i = 0; i < pool->count; i++) {
+            up = &pool->upstreams[i];
+            wheatLog(WHEAT_VERBOSE, "upstream %s:%d requests: %lld failures: %lld "
+                    "outstanding: %ld idle: %ld latency: %lldus max latency: %lldus%s",
+                    up->ip, up->port, up->requests, up->failures, up->outstanding,
+                    listLength(up->idle), up->latency, up->max_latency,
+                    up->down_until > Server.cron_time.tv_sec ? " down" : "");
+        }
+    }
+    freeListIterator(iter);
+}
+
+void proxyCron()
+{
+    struct listNode *node;
+    struct proxyRequest *req;
+    long long now;
+
+    if (WaitingRequests == NULL)
+        return ;
+
+    // Requests are appended in time order, only the head can be expired
+    now = getMicroseconds(Server.cron_time);
+    while ((node = listFirst(WaitingRequests)) != NULL) {
+        req = listNodeValue(node);
+        if (now - getMicroseconds(req->start) <= Timeout)
+            break;
+        removeListNode(WaitingRequests, node);
+        req->node = NULL;
+        wheatLog(WHEAT_NOTICE, "upstream %s:%d response timeout",
+                req->peer->upstream->ip, req->peer->upstream->port);
+        markUpstreamFailed(req->peer->upstream);
+        closePeer(req->peer);
+        replyError(req, 504);
+    }
+
+    if (Server.cron_time.tv_sec - LastReport >= WHEAT_PROXY_REPORT_INTERVAL) {
+        LastReport = Server.cron_time.tv_sec;
+        reportUpstreams();
+    }
+}
+
+int initProxy(struct protocol *p)
+{
+    struct configuration *conf;
+    struct list *upstreams;
+    struct listIterator *iter;
+    struct listNode *node;
+
+    if (WaitingRequests)
+        return WHEAT_OK;
+
+    ProxyProtocol = p;
+    Balance = getConfiguration("proxy-balance")->target.enum_ptr->id;
+    Timeout = getConfiguration("proxy-timeout")->target.val * 1000LL;
+    MaxIdle = getConfiguration("proxy-max-idle")->target.val;
+    TotalProxyRequest = &getStatValByName("Total proxy request");
+    TotalProxyFailed = &getStatValByName("Total proxy failed");
+    MaxProxyLatency = &getStatValByName("Max proxy latency");
+
+    Pools = createList();
+    memset(&DefaultPool, 0, sizeof(DefaultPool));
+    appendToListTail(Pools, &DefaultPool);
+    conf = getConfiguration("proxy-upstreams");
+    upstreams = conf->target.ptr;
+    if (upstreams) {
+        DefaultPool.upstreams = wmalloc(sizeof(struct upstream)*listLength(upstreams));
+        if (DefaultPool.upstreams == NULL)
+            return WHEAT_WRONG;
+        iter = listGetIterator(upstreams, START_HEAD);
+        while ((node = listNext(iter)) != NULL) {
+            if (addUpstream(&DefaultPool, listNodeValue(node)) == WHEAT_WRONG) {
+                freeListIterator(iter);
+                return WHEAT_WRONG;
+            }
+        }
+        freeListIterator(iter);
+    }
+
+    WaitingRequests = createList();
+    LastReport = Server.cron_time.tv_sec;
+    return WHEAT_OK;
+}
+
+// Only kept alive connections are closed here, upstreams are still referred
+// by connections in use
+void deallocProxy()
+{
+    struct listIterator *iter;
+    struct listNode *node;
+    struct upstreamPool *pool;
+    struct proxyPeer *peer;
+    size_t i;
+
+    if (Pools == NULL)
+        return ;
+    iter = listGetIterator(Pools, START_HEAD);
+    while ((node = listNext(iter)) != NULL) {
+        pool = listNodeValue(node);
+        for (i = 0; i < pool->count; i++) {
+            while (listLength(pool->upstreams[i].idle)) {
+                peer = listNodeValue(listFirst(pool->upstreams[i].idle));
+                freeClient(peer->client);
+            }
+        }
+    }
+    freeListIterator(iter);
+}
+
+void *initProxyData(struct conn *c)
+{
+    struct proxyRequest *req = wmalloc(sizeof(*req));
+
+    if (req == NULL)
+        return NULL;
+    memset(req, 0, sizeof(*req));
+    return req;
+}
+
+void freeProxyData(void *app_data)
+{
+    struct proxyRequest *req = app_data;
+
+    if (req->node)
+        removeListNode(WaitingRequests, req->node);
+    releasePeer(req);
+    wstrFree(req->head);
+    wfree(req);
+}
@@ -9,10 +9,9 @@
 #include <sys/stat.h>
 #include <sys/uio.h>
 #include <sys/types.h>
-#include <libgen.h>
 
 #include "../application.h"
-#include "../../protocol/http/proto_http.h"
+#include "app_static_file.h"
 
 int staticFileCall(struct conn *, void *);
 int initStaticFile(struct protocol *);
@@ -30,6 +29,14 @@ static struct configuration StaticConf[] = {
         (void *)WHEAT_NOTFREE,  STRING_FORMAT},
     {"directory-index",   2, stringValidator,      {.ptr=NULL},
         NULL,                   STRING_FORMAT},
+    {"static-cache-ttl",  2, unsignedIntValidator, {.val=5},
+        NULL,                   INT_FORMAT},
+    {"static-cache-entries", 2, unsignedIntValidator, {.val=4096},
+        NULL,                   INT_FORMAT},
+    {"static-cache-size", 2, unsignedIntValidator, {.val=8*1024*1024},
+        NULL,                   INT_FORMAT},
+    {"static-cache-file-size", 2, unsignedIntValidator, {.val=16*1024},
+        NULL,                   INT_FORMAT},
 };
 
 static struct app AppStatic = {
@@ -37,15 +44,21 @@ static struct app AppStatic = {
     deallocStaticFile, initStaticFileData, freeStaticFileData, 0
 };
 
+static struct statItem StaticStats[] = {
+    {"Total static path cache hit", SUM_STAT, RAW, 0, 0},
+    {"Total static path cache miss", SUM_STAT, RAW, 0, 0},
+};
+
 struct moduleAttr AppStaticAttr = {
-    "static-file", APP, {.app=&AppStatic}, NULL, 0,
+    "static-file", APP, {.app=&AppStatic},
+    StaticStats, sizeof(StaticStats)/sizeof(struct statItem),
     StaticConf, sizeof(StaticConf)/sizeof(struct configuration),
     NULL, 0
 };
 
 static unsigned int MaxFileSize = WHEAT_MAX_BUFFER_SIZE;
+static unsigned int MaxCachedFileSize = 0;
 static struct dict *AllowExtensions = NULL;
-static wstr IfModifiedSince = NULL;
 static struct list *DirectoryIndex = NULL;
 
 struct contenttype {
@@ -192,109 +205,99 @@ static struct contenttype ContentTypes[] = {
     {"zip", "application/zip"},
 };
 
-static int fillResHeaders(struct conn *c, off_t rep_len, time_t m_time)
+static wstr renderHeader(wstr headers, int id, const char *value, size_t len)
+{
+    const char *name = getHttpHeaderName(id);
+
+    headers = wstrCat(headers, name);
+    headers = wstrCatLen(headers, ": ", 2);
+    headers = wstrCatLen(headers, value, len);
+    return wstrCatLen(headers, "\r\n", 2);
+}
+
+// Render headers of file once, they are cached with small file
+static wstr renderResHeaders(struct staticFileData *static_data,
+        off_t rep_len, time_t m_time)
 {
-    int ret = 0;
-    struct staticFileData *static_data = c->app_private_data;
-    int i;
+    wstr headers = wstrEmpty();
+    const char *type;
+    int ret, i, size;
     char buf[50];
 
     if (rep_len != 0) {
-        ret = snprintf(buf, sizeof(buf), "%lld", rep_len);
-        if (ret < 0 || ret > sizeof(buf))
-            return -1;
-        appendToResHeaders(c, CONTENT_LENGTH, buf);
+        ret = ll2string(buf, sizeof(buf), rep_len);
+        if (ret == 0)
+            goto failed;
+        headers = renderHeader(headers, HTTP_HEADER_CONTENT_LENGTH, buf, ret);
     }
 
     if (m_time != 0) {
         ret = convertHttpDate(m_time, buf, sizeof(buf));
         if (ret < 0)
-            return -1;
-        appendToResHeaders(c, LAST_MODIFIED, buf);
+            goto failed;
+        headers = renderHeader(headers, HTTP_HEADER_LAST_MODIFIED, buf, strlen(buf));
     }
 
     if (static_data->extension && static_data->filename) {
-        int size = sizeof(ContentTypes)/sizeof(struct contenttype);
+        size = sizeof(ContentTypes)/sizeof(struct contenttype);
+        type = "application/octet-stream";
         for (i = 0; i < size; ++i) {
             if (!strcmp(static_data->extension, ContentTypes[i].extension)) {
+                type = ContentTypes[i].mime_type;
                 break;
             }
         }
-        if (i != size) {
-            appendToResHeaders(c, CONTENT_TYPE, ContentTypes[i].mime_type);
-        } else {
-            appendToResHeaders(c, CONTENT_TYPE, "application/octet-stream");
-        }
+        headers = renderHeader(headers, HTTP_HEADER_CONTENT_TYPE, type, strlen(type));
     }
+    return headers;
+
+failed:
+    wstrFree(headers);
+    return NULL;
+}
+
+static int fillResHeaders(struct conn *c, off_t rep_len, time_t m_time)
+{
+    wstr headers = renderResHeaders(c->app_private_data, rep_len, m_time);
+    int ret;
+
+    if (headers == NULL)
+        return -1;
+    ret = httpAppendRenderedHeaders(c, headers, wstrlen(headers),
+            rep_len != 0 ? rep_len : -1);
+    wstrFree(headers);
     return ret;
 }
 
 int staticFileCall(struct conn *c, void *arg)
 {
-    wstr path = arg;
     struct staticFileData *static_data;
-    off_t len;
-    time_t m_time;
+    struct staticFile file;
+    wstr headers;
     int ret;
-    struct stat stat;
 
     static_data = c->app_private_data;
-    static_data->fd = open(path, O_RDONLY);
-
-    if (static_data->fd  == -1) {
-        wheatLog(WHEAT_VERBOSE, "open file failed: %s", strerror(errno));
-        goto failed404;
-    }
-
-    ret = lstat(path, &stat);
-    if (ret == -1)
-        goto failed404;
-
-    if (!S_ISREG(stat.st_mode)) {
-        close(static_data->fd);
-        static_data->fd = -1;
-        if (S_ISDIR(stat.st_mode) && DirectoryIndex) {
-            struct listNode *node;
-            struct listIterator *iter;
-            wstr last;
-            char append_path[255];
-            iter = listGetIterator(DirectoryIndex, START_HEAD);
-            while ((node = listNext(iter)) != NULL) {
-                last = listNodeValue(node);
-                snprintf(append_path, 255, "%s/%s", path, last);
-                static_data->fd = open(append_path, O_RDONLY);
-
-                if (static_data->fd  != -1) {
-                    break;
-                }
-            }
-        }
-        if (static_data->fd == -1) {
-            wheatLog(WHEAT_VERBOSE, "open file failed: %s", strerror(errno));
-            goto failed404;
-        }
-    }
     if (AllowExtensions && static_data->extension &&
             !dictFetchValue(AllowExtensions, static_data->extension)) {
         goto failed404;
     }
-    ret = getFileSizeAndMtime(static_data->fd , &len, &m_time);
-    if (ret == WHEAT_WRONG) {
+    if (staticOpen(httpGetRoute(c), httpGetPath(c), &file) == WHEAT_WRONG) {
         wheatLog(WHEAT_VERBOSE, "open file failed: %s", strerror(errno));
         goto failed404;
     }
-    if (len > MaxFileSize) {
-        wheatLog(WHEAT_NOTICE, "file exceed max limit %d", len);
-        wheatLog(WHEAT_VERBOSE, "open file failed: %s", strerror(errno));
+    static_data->fd = file.fd;
+    if (file.size > MaxFileSize) {
+        wheatLog(WHEAT_NOTICE, "file exceed max limit %d", file.size);
         goto failed404;
     }
 
-    wstr modified = dictFetchValue(httpGetReqHeaders(c), IfModifiedSince);
+    const struct slice *modified = httpGetReqHeader(c, HTTP_HEADER_IF_MODIFIED_SINCE);
     if (modified != NULL) {
-        char buf[wstrlen(modified)];
-        memcpy(buf, modified, wstrlen(modified));
+        char buf[modified->len+1];
+        memcpy(buf, modified->data, modified->len);
+        buf[modified->len] = '\0';
         time_t client_m_time = fromHttpDate(buf);
-        if (m_time <= client_m_time) {
+        if (file.m_time <= client_m_time) {
             fillResInfo(c, 304, "Not Modified");
             ret = fillResHeaders(c, 0, 0);
             if (ret == -1)
@@ -306,7 +309,24 @@ int staticFileCall(struct conn *c, void *arg)
         }
     }
     fillResInfo(c, 200, "OK");
-    ret = fillResHeaders(c, len, m_time);
+    if (file.body == NULL && file.size <= MaxCachedFileSize) {
+        headers = renderResHeaders(static_data, file.size, file.m_time);
+        if (headers)
+            staticCacheStore(&file, headers);
+    }
+    if (file.body) {
+        // Headers and content go out by one write
+        ret = httpAppendRenderedHeaders(c, file.headers, file.headers_len,
+                file.size);
+        if (ret == 0)
+            ret = httpSendHeadersWithBody(c, file.body, file.size);
+        if (ret == -1) {
+            wheatLog(WHEAT_WARNING, "send cached static file failed: %s", strerror(errno));
+            goto failed;
+        }
+        return WHEAT_OK;
+    }
+    ret = fillResHeaders(c, file.size, file.m_time);
     if (ret == -1) {
         wheatLog(WHEAT_WARNING, "fill Res Headers failes: %s", strerror(errno));
         goto failed;
@@ -316,8 +336,8 @@ int staticFileCall(struct conn *c, void *arg)
         wheatLog(WHEAT_WARNING, "static file send headers failed: %s", strerror(errno));
         goto failed;
     }
-    ret = sendClientFile(c, static_data->fd , len);
-    if (ret == WHEAT_WRONG) {
+    ret = httpSendFile(c, static_data->fd, 0, file.size);
+    if (ret == -1) {
         wheatLog(WHEAT_WARNING, "send static file failed: %s", strerror(errno));
         goto failed;
     }
@@ -339,6 +359,7 @@ int initStaticFile(struct protocol *p)
     wstr extensions, indexes;
     struct configuration *conf = getConfiguration("file-maxsize");
     MaxFileSize = conf->target.val;
+    MaxCachedFileSize = getConfiguration("static-cache-file-size")->target.val;
 
     conf = getConfiguration("allowed-extension");
     extensions = wstrNew(conf->target.ptr);
@@ -374,29 +395,25 @@ int initStaticFile(struct protocol *p)
             return WHEAT_WRONG;
         }
 
-        for (i = 0; i < args; ++i) {
+        for (i = 0; i < args; ++i)
             appendToListTail(DirectoryIndex, wstrNew(argvs[i]));
-            if (ret == DICT_WRONG)
-                break;
-        }
 
         wstrFreeSplit(argvs, args);
     } else {
         DirectoryIndex = NULL;
     }
 
-    IfModifiedSince = wstrNew(IF_MODIFIED_SINCE);
-    return WHEAT_OK;
+    return initStaticCache(DirectoryIndex);
 }
 
 void deallocStaticFile()
 {
+    deallocStaticCache();
     if (AllowExtensions)
         dictRelease(AllowExtensions);
     if (DirectoryIndex)
         freeList(DirectoryIndex);
     MaxFileSize = 0;
-    wstrFree(IfModifiedSince);
 }
 
 void *initStaticFileData(struct conn *c)
@@ -405,12 +422,18 @@ void *initStaticFileData(struct conn *c)
     if (!data)
         return NULL;
     memset(data, 0, sizeof(*data));
-    wstr path = httpGetPath(c);
-    if (path) {
-        char *base_name = basename(path);
-        char *point = strrchr(base_name, '.');
-        if (point && base_name && base_name < point) {
-            data->extension = wstrNew(point+1);
+    const struct slice *path = httpGetPath(c);
+    if (path->len) {
+        const char *start = (const char *)path->data;
+        const char *end = start + path->len;
+        const char *base_name = end, *point = NULL;
+        while (base_name > start && base_name[-1] != '/') {
+            base_name--;
+            if (!point && *base_name == '.')
+                point = base_name;
+        }
+        if (point && base_name < point) {
+            data->extension = wstrNewLen(point+1, (int)(end-point-1));
             data->filename = wstrNewLen(base_name, (int)(point-base_name));
         }
     }
@@ -5,4 +5,26 @@
 #ifndef WHEATSERVER_APP_STATIC_FILE_H
 #define WHEATSERVER_APP_STATIC_FILE_H
 
+#include <sys/stat.h>
+
+#include "../../protocol/http/proto_http.h"
+
+// File resolved from request path, `fd` is -1 if it's cached in memory,
+// then `body` and `headers` rendered for it are available.
+struct staticFile {
+    int fd;
+    off_t size;
+    time_t m_time;
+    const char *headers;
+    size_t headers_len;
+    const char *body;
+};
+
+// Path resolution and small file cache(static_cache.c)
+int initStaticCache(struct list *indexes);
+void deallocStaticCache();
+int staticOpen(struct httpRoute *route, const struct slice *path,
+        struct staticFile *file);
+void staticCacheStore(struct staticFile *file, wstr headers);
+
 #endif
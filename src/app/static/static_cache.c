@@ -0,0 +1,385 @@
+// Path resolution and small file cache of static file module
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "../application.h"
+#include "app_static_file.h"
+
+// Request path is normalized once into "root/dir/file", files are opened
+// relative to directory fd of root kept in route's `app_data`, so ".."
+// can't climb out of root and kernel doesn't walk root again.
+//
+// Lookups costing several failed opens are remembered for
+// `static-cache-ttl` seconds: directory is mapped to its index file and
+// missing path to 404. Cache holds at most `static-cache-entries` paths
+// and evicts least recently used ones.
+//
+// File not larger than `static-cache-file-size` is kept in entry with its
+// headers rendered, so it's sent by one write without opening it. Such
+// content is bounded by `static-cache-size` bytes in total, and expires
+// with the path like other entries.
+//
+// `index`: index file below root directory is resolved to
+// `body`: content of the file path is resolved to, NULL if not cached
+// Entry without both is a path not found.
+struct staticPathEntry {
+    wstr key;
+    wstr index;
+    wstr headers;
+    wstr body;
+    time_t m_time;
+    time_t expire;
+    struct listNode *node;
+};
+
+struct staticRoot {
+    int fd;
+};
+
+static struct staticCache {
+    struct dict *paths;
+    struct list *lru;
+    struct list *indexes;
+    time_t ttl;
+    size_t max_entries;
+    size_t size;
+    size_t used;
+    off_t max_file;
+    wstr key;
+    long long *hits;
+    long long *misses;
+} StaticCache;
+
+static unsigned int pathKeyHash(const void *key)
+{
+    return dictGenHashFunction(key, wstrlen((wstr)key));
+}
+
+static int pathKeyCompare(const void *key1, const void *key2)
+{
+    return wstrlen((wstr)key1) == wstrlen((wstr)key2) &&
+        !memcmp(key1, key2, wstrlen((wstr)key1));
+}
+
+// Entries own their keys
+static struct dictType StaticPathDictType = {
+    pathKeyHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    pathKeyCompare,             /* key compare */
+    NULL,                       /* key destructor */
+    NULL,                       /* val destructor */
+};
+
+static void evictPath(struct staticPathEntry *entry)
+{
+    dictDelete(StaticCache.paths, entry->key);
+    removeListNode(StaticCache.lru, entry->node);
+    if (entry->body)
+        StaticCache.used -= wstrlen(entry->headers) + wstrlen(entry->body);
+    wstrFree(entry->key);
+    wstrFree(entry->index);
+    wstrFree(entry->headers);
+    wstrFree(entry->body);
+    wfree(entry);
+}
+
+// `index` is taken by entry
+static struct staticPathEntry *rememberPath(const wstr key, wstr index)
+{
+    struct staticPathEntry *entry;
+
+    if (StaticCache.paths == NULL || (entry = wmalloc(sizeof(*entry))) == NULL) {
+        wstrFree(index);
+        return NULL;
+    }
+    memset(entry, 0, sizeof(*entry));
+    entry->key = wstrDup(key);
+    entry->index = index;
+    entry->expire = Server.cron_time.tv_sec + StaticCache.ttl;
+    if (dictAdd(StaticCache.paths, entry->key, entry) == DICT_WRONG) {
+        wstrFree(entry->key);
+        wstrFree(entry->index);
+        wfree(entry);
+        return NULL;
+    }
+    entry->node = appendToListTail(StaticCache.lru, entry);
+    if (listLength(StaticCache.lru) > StaticCache.max_entries)
+        evictPath(listNodeValue(listFirst(StaticCache.lru)));
+    return entry;
+}
+
+// Append segments of `path` to `out`, "." and empty segments are dropped
+// and ".." removes the last one. Return -1 if ".." climbs above `out`.
+static int normalizePath(const char *path, size_t len, wstr *out)
+{
+    const char *end = path + len, *seg;
+    size_t base = wstrlen(*out), n;
+
+    while (path < end) {
+        while (path < end && *path == '/')
+            path++;
+        seg = path;
+        while (path < end && *path != '/')
+            path++;
+        n = path - seg;
+        if (n == 0 || (n == 1 && seg[0] == '.'))
+            continue;
+        if (n == 2 && seg[0] == '.' && seg[1] == '.') {
+            n = wstrlen(*out);
+            if (n == base)
+                return -1;
+            while ((*out)[--n] != '/')
+                ;
+            wstrupdatelen(*out, (int)n);
+            continue;
+        }
+        *out = wstrCatLen(*out, "/", 1);
+        *out = wstrCatLen(*out, seg, n);
+    }
+    return 0;
+}
+
+static struct staticRoot *getRoot(struct httpRoute *route)
+{
+    struct staticRoot *root = route->app_data;
+
+    if (root == NULL) {
+        root = wmalloc(sizeof(*root));
+        if (root == NULL)
+            return NULL;
+        root->fd = open(route->root, O_RDONLY);
+        if (root->fd == -1) {
+            wheatLog(WHEAT_WARNING, "open document root %s failed: %s",
+                    route->root, strerror(errno));
+            wfree(root);
+            return NULL;
+        }
+        route->app_data = root;
+    }
+    return root;
+}
+
+// Missing path is remembered, but not running out of fds and the like
+static int isMissing(int err)
+{
+    return err == ENOENT || err == ENOTDIR || err == ELOOP || err == EACCES;
+}
+
+static int openRegular(int dir_fd, const char *name, struct stat *st)
+{
+    int fd = openat(dir_fd, name, O_RDONLY);
+
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, st) == -1 || !S_ISREG(st->st_mode)) {
+        close(fd);
+        errno = ENOENT;
+        return -1;
+    }
+    return fd;
+}
+
+static void fillFile(struct staticFile *file, int fd, struct stat *st)
+{
+    file->fd = fd;
+    file->size = st->st_size;
+    file->m_time = st->st_mtime;
+}
+
+// Resolve the file `path` of request refers to below `route->root`,
+// directory is served by its first `directory-index` file. As before,
+// symbolic link isn't followed at last component of path. Return
+// WHEAT_WRONG if there is no such file, otherwise `file` is cached in
+// memory or opened.
+int staticOpen(struct httpRoute *route, const struct slice *path,
+        struct staticFile *file)
+{
+    struct staticRoot *root = getRoot(route);
+    struct staticPathEntry *entry = NULL;
+    struct listIterator *iter;
+    struct listNode *node;
+    struct stat st;
+    const char *rel;
+    size_t root_len;
+    wstr key, name;
+    int fd, index_fd;
+
+    memset(file, 0, sizeof(*file));
+    file->fd = -1;
+    if (root == NULL)
+        return WHEAT_WRONG;
+    key = StaticCache.key;
+    wstrClear(key);
+    key = wstrCatLen(key, route->root, wstrlen(route->root));
+    root_len = wstrlen(key);
+    if (normalizePath((const char *)path->data, path->len, &key) == -1) {
+        StaticCache.key = key;
+        errno = EACCES;
+        return WHEAT_WRONG;
+    }
+    StaticCache.key = key;
+    rel = wstrlen(key) == root_len ? "." : key + root_len + 1;
+
+    if (StaticCache.paths)
+        entry = dictFetchValue(StaticCache.paths, key);
+    if (entry && entry->expire <= Server.cron_time.tv_sec) {
+        evictPath(entry);
+        entry = NULL;
+    }
+    if (entry) {
+        (*StaticCache.hits)++;
+        removeListNode(StaticCache.lru, entry->node);
+        entry->node = appendToListTail(StaticCache.lru, entry);
+        if (entry->body) {
+            file->size = wstrlen(entry->body);
+            file->m_time = entry->m_time;
+            file->headers = entry->headers;
+            file->headers_len = wstrlen(entry->headers);
+            file->body = entry->body;
+            return WHEAT_OK;
+        }
+        if (entry->index == NULL) {
+            errno = ENOENT;
+            return WHEAT_WRONG;
+        }
+        fd = openRegular(root->fd, entry->index, &st);
+        if (fd != -1) {
+            fillFile(file, fd, &st);
+            return WHEAT_OK;
+        }
+        // Index file is gone, look up directory again
+        evictPath(entry);
+    }
+    if (StaticCache.paths)
+        (*StaticCache.misses)++;
+
+    fd = openat(root->fd, rel, O_RDONLY|O_NOFOLLOW);
+    if (fd == -1) {
+        if (isMissing(errno))
+            rememberPath(key, NULL);
+        return WHEAT_WRONG;
+    }
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return WHEAT_WRONG;
+    }
+    if (S_ISREG(st.st_mode)) {
+        fillFile(file, fd, &st);
+        return WHEAT_OK;
+    }
+
+    index_fd = -1;
+    if (S_ISDIR(st.st_mode) && StaticCache.indexes) {
+        iter = listGetIterator(StaticCache.indexes, START_HEAD);
+        while ((node = listNext(iter)) != NULL) {
+            name = listNodeValue(node);
+            index_fd = openRegular(fd, name, &st);
+            if (index_fd != -1)
+                break;
+        }
+        freeListIterator(iter);
+    }
+    close(fd);
+    if (index_fd == -1) {
+        rememberPath(key, NULL);
+        errno = ENOENT;
+        return WHEAT_WRONG;
+    }
+    if (wstrlen(key) == root_len) {
+        rememberPath(key, wstrDup(name));
+    } else {
+        name = wstrCat(wstrCatLen(wstrNew(rel), "/", 1), name);
+        rememberPath(key, name);
+    }
+    fillFile(file, index_fd, &st);
+    return WHEAT_OK;
+}
+
+// Keep content of `file` just opened by staticOpen with `headers`
+// rendered for it, so it's served from memory until path expires.
+// `headers` is taken.
+void staticCacheStore(struct staticFile *file, wstr headers)
+{
+    struct staticPathEntry *entry;
+    size_t size = wstrlen(headers) + file->size;
+    wstr body;
+    ssize_t n;
+
+    if (StaticCache.paths == NULL || file->size == 0 ||
+            file->size > StaticCache.max_file || size > StaticCache.size) {
+        wstrFree(headers);
+        return ;
+    }
+    body = wstrNewLen(NULL, (int)file->size);
+    if (body == NULL) {
+        wstrFree(headers);
+        return ;
+    }
+    n = pread(file->fd, body, file->size, 0);
+    if (n != file->size) {
+        wstrFree(headers);
+        wstrFree(body);
+        return ;
+    }
+    wstrupdatelen(body, (int)n);
+
+    entry = dictFetchValue(StaticCache.paths, StaticCache.key);
+    if (entry == NULL)
+        entry = rememberPath(StaticCache.key, NULL);
+    if (entry == NULL || entry->body) {
+        wstrFree(headers);
+        wstrFree(body);
+        return ;
+    }
+    entry->headers = headers;
+    entry->body = body;
+    entry->m_time = file->m_time;
+    StaticCache.used += size;
+    while (StaticCache.used > StaticCache.size &&
+            listNodeValue(listFirst(StaticCache.lru)) != entry)
+        evictPath(listNodeValue(listFirst(StaticCache.lru)));
+    file->headers = entry->headers;
+    file->headers_len = wstrlen(entry->headers);
+    file->body = entry->body;
+}
+
+int initStaticCache(struct list *indexes)
+{
+    memset(&StaticCache, 0, sizeof(StaticCache));
+    StaticCache.indexes = indexes;
+    StaticCache.key = wstrEmpty();
+    StaticCache.ttl = getConfiguration("static-cache-ttl")->target.val;
+    StaticCache.max_entries = getConfiguration("static-cache-entries")->target.val;
+    StaticCache.size = getConfiguration("static-cache-size")->target.val;
+    StaticCache.max_file = getConfiguration("static-cache-file-size")->target.val;
+    if (StaticCache.key == NULL)
+        return WHEAT_WRONG;
+    if (!StaticCache.ttl || !StaticCache.max_entries)
+        return WHEAT_OK;
+    StaticCache.hits = &getStatValByName("Total static path cache hit");
+    StaticCache.misses = &getStatValByName("Total static path cache miss");
+    StaticCache.paths = dictCreate(&StaticPathDictType);
+    StaticCache.lru = createList();
+    if (StaticCache.paths == NULL || StaticCache.lru == NULL)
+        return WHEAT_WRONG;
+    return WHEAT_OK;
+}
+
+void deallocStaticCache()
+{
+    if (StaticCache.lru) {
+        while (listFirst(StaticCache.lru))
+            evictPath(listNodeValue(listFirst(StaticCache.lru)));
+        freeList(StaticCache.lru);
+    }
+    if (StaticCache.paths)
+        dictRelease(StaticCache.paths);
+    wstrFree(StaticCache.key);
+    memset(&StaticCache, 0, sizeof(StaticCache));
+}
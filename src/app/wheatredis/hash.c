@@ -0,0 +1,263 @@
+// Hash functions used by WheatRedis to dispatch keys to tokens
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <strings.h>
+
+#include "hash.h"
+
+extern uint32_t hash_md5(const char *key, size_t key_length);
+
+#define ROTL32(x, r)    (((x) << (r)) | ((x) >> (32 - (r))))
+
+#define XX_PRIME1       2654435761U
+#define XX_PRIME2       2246822519U
+#define XX_PRIME3       3266489917U
+#define XX_PRIME4       668265263U
+#define XX_PRIME5       374761393U
+
+#define MURMUR3_C1      0xcc9e2d51
+#define MURMUR3_C2      0x1b873593
+
+#define CRC16_POLY      0x1021
+
+static struct hashFunction {
+    const char *name;
+    hashFunc hash;
+} HashFunctions[] = {
+    {"Md5", hashMd5},
+    {"XxHash", hashXx},
+    {"Murmur3", hashMurmur3},
+    {"Crc16", hashCrc16},
+};
+
+// Both xxHash and murmur3 read key as little endian words
+static inline uint32_t read32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+        ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint32_t hashMd5(const char *key, size_t len)
+{
+    return hash_md5(key, len);
+}
+
+// xxHash32 with seed 0
+uint32_t hashXx(const char *key, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)key;
+    const uint8_t *end = p + len;
+    uint32_t h, v1, v2, v3, v4;
+
+    if (len >= 16) {
+        v1 = XX_PRIME1 + XX_PRIME2;
+        v2 = XX_PRIME2;
+        v3 = 0;
+        v4 = -XX_PRIME1;
+        do {
+            v1 = ROTL32(v1 + read32(p) * XX_PRIME2, 13) * XX_PRIME1;
+            v2 = ROTL32(v2 + read32(p+4) * XX_PRIME2, 13) * XX_PRIME1;
+            v3 = ROTL32(v3 + read32(p+8) * XX_PRIME2, 13) * XX_PRIME1;
+            v4 = ROTL32(v4 + read32(p+12) * XX_PRIME2, 13) * XX_PRIME1;
+            p += 16;
+        } while (p + 16 <= end);
+        h = ROTL32(v1, 1) + ROTL32(v2, 7) + ROTL32(v3, 12) + ROTL32(v4, 18);
+    } else {
+        h = XX_PRIME5;
+    }
+
+    h += (uint32_t)len;
+    for (; p + 4 <= end; p += 4)
+        h = ROTL32(h + read32(p) * XX_PRIME3, 17) * XX_PRIME4;
+    for (; p < end; p++)
+        h = ROTL32(h + *p * XX_PRIME5, 11) * XX_PRIME1;
+
+    h ^= h >> 15;
+    h *= XX_PRIME2;
+    h ^= h >> 13;
+    h *= XX_PRIME3;
+    h ^= h >> 16;
+    return h;
+}
+
+// MurmurHash3_x86_32 with seed 0
+uint32_t hashMurmur3(const char *key, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)key;
+    const uint8_t *tail = p + (len & ~(size_t)3);
+    uint32_t h = 0, k;
+
+    for (; p < tail; p += 4) {
+        k = read32(p) * MURMUR3_C1;
+        k = ROTL32(k, 15) * MURMUR3_C2;
+        h ^= k;
+        h = ROTL32(h, 13) * 5 + 0xe6546b64;
+    }
+
+    k = 0;
+    switch (len & 3) {
+        case 3:
+            k ^= tail[2] << 16;
+        case 2:
+            k ^= tail[1] << 8;
+        case 1:
+            k ^= tail[0];
+            k *= MURMUR3_C1;
+            k = ROTL32(k, 15) * MURMUR3_C2;
+            h ^= k;
+    }
+
+    h ^= (uint32_t)len;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+// CRC16-CCITT(XMODEM) used by Redis Cluster, table is filled by first call
+uint32_t hashCrc16(const char *key, size_t len)
+{
+    static uint16_t table[256];
+    static int table_ready = 0;
+    const uint8_t *p = (const uint8_t *)key;
+    uint16_t crc = 0;
+    int i, j;
+
+    if (!table_ready) {
+        for (i = 0; i < 256; i++) {
+            crc = i << 8;
+            for (j = 0; j < 8; j++)
+                crc = crc & 0x8000 ? (crc << 1) ^ CRC16_POLY : crc << 1;
+            table[i] = crc;
+        }
+        table_ready = 1;
+        crc = 0;
+    }
+    while (len--)
+        crc = (crc << 8) ^ table[((crc >> 8) ^ *p++) & 0xff];
+    return crc;
+}
+
+hashFunc getHashFunction(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(HashFunctions)/sizeof(HashFunctions[0]); i++) {
+        if (!strcasecmp(name, HashFunctions[i].name))
+            return HashFunctions[i].hash;
+    }
+    return NULL;
+}
+
+const char *getHashFunctionName(hashFunc hash)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(HashFunctions)/sizeof(HashFunctions[0]); i++) {
+        if (HashFunctions[i].hash == hash)
+            return HashFunctions[i].name;
+    }
+    return NULL;
+}
+
+#ifdef REDIS_HASH_TEST_MAIN
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "../../test_help.h"
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int check(hashFunc hash, const char *key, uint32_t expect)
+{
+    return hash(key, strlen(key)) == expect;
+}
+
+// Dispatch is hash of key modulo keyspace, keys look like ones in our
+// cache: "user:<id>" and "session:<id>:<40 bytes token>"
+static void benchmark(int nkey)
+{
+    char (*keys)[64] = malloc(sizeof(*keys) * nkey);
+    size_t *lens = malloc(sizeof(size_t) * nkey), total = 0, i, j;
+    size_t counts[200], max, keyspaces[] = {1024, 16384};
+    uint32_t sum = 0;
+    double start, cost;
+    hashFunc hash;
+
+    for (i = 0; i < nkey; i++) {
+        if (i % 2)
+            lens[i] = snprintf(keys[i], 64, "user:%zu", i * 7919);
+        else
+            lens[i] = snprintf(keys[i], 64,
+                    "session:%zu:%040zx", i, i * 2654435761U);
+        total += lens[i];
+    }
+    printf("%d keys(avg %zu bytes), keyspace 16384:\n", nkey, total / nkey);
+    for (j = 0; j < sizeof(HashFunctions)/sizeof(HashFunctions[0]); j++) {
+        hash = HashFunctions[j].hash;
+        start = now();
+        for (i = 0; i < nkey; i++)
+            sum += hash(keys[i], lens[i]) % 16384;
+        cost = now() - start;
+        printf("  %-8s %6.1f ns/key\n", HashFunctions[j].name,
+                cost * 1e9 / nkey);
+    }
+
+    // Tokens are assigned to instances round robin by hashInit, fewer
+    // tokens per instance makes instances more uneven
+    for (j = 0; j < sizeof(keyspaces)/sizeof(keyspaces[0]); j++) {
+        memset(counts, 0, sizeof(counts));
+        for (i = 0; i < nkey; i++)
+            counts[hashXx(keys[i], lens[i]) % keyspaces[j] % 200]++;
+        max = 0;
+        for (i = 0; i < 200; i++)
+            max = counts[i] > max ? counts[i] : max;
+        printf("  keyspace %zu over 200 instances: max instance takes "
+                "%.2fx average keys\n", keyspaces[j], max * 200.0 / nkey);
+    }
+    if (sum == 1)
+        printf("\n");
+    free(keys);
+    free(lens);
+}
+
+int main(int argc, const char *argv[])
+{
+    test_cond("xxHash32 of empty", check(hashXx, "", 0x02cc5d05));
+    test_cond("xxHash32 of short key", check(hashXx, "abc", 0x32d153ff));
+    test_cond("xxHash32 of long key",
+            check(hashXx, "Nobody inspects the spammish repetition",
+                0xe2293b2f));
+    test_cond("murmur3 of empty", check(hashMurmur3, "", 0));
+    test_cond("murmur3 of short key", check(hashMurmur3, "hello", 0x248bfa47));
+    test_cond("murmur3 of long key",
+            check(hashMurmur3, "The quick brown fox jumps over the lazy dog",
+                0x2e4ff723));
+    test_cond("crc16 check value", check(hashCrc16, "123456789", 0x31c3));
+    test_cond("crc16 is Redis Cluster slot",
+            hashCrc16("foo", 3) % 16384 == 12182 &&
+            hashCrc16("bar", 3) % 16384 == 5061);
+    test_cond("md5 keeps former dispatch",
+            check(hashMd5, "", 0xd98c1dd4));
+    test_cond("getHashFunction",
+            getHashFunction("xxhash") == hashXx &&
+            getHashFunction("Crc16") == hashCrc16 &&
+            getHashFunction("sha1") == NULL &&
+            !strcmp(getHashFunctionName(hashMurmur3), "Murmur3"));
+
+    benchmark(argc > 1 ? atoi(argv[1]) : 1000000);
+    test_report();
+    return 0;
+}
+#endif
@@ -0,0 +1,28 @@
+// Hash functions used by WheatRedis to dispatch keys to tokens
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef WHEATSERVER_APP_REDIS_CLUSTER_HASH_H
+#define WHEATSERVER_APP_REDIS_CLUSTER_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint32_t (*hashFunc)(const char *key, size_t len);
+
+// Md5 is the first 4 bytes of MD5 signature like ketama, all tokens saved
+// by former version are dispatched by it.
+// Crc16 is the same as Redis Cluster, with 16384 keyspace and "{}" hash tag
+// keys are dispatched to the token numbered by Redis Cluster slot.
+uint32_t hashMd5(const char *key, size_t len);
+uint32_t hashXx(const char *key, size_t len);
+uint32_t hashMurmur3(const char *key, size_t len);
+uint32_t hashCrc16(const char *key, size_t len);
+
+// Return NULL if `name` isn't one of "Md5", "XxHash", "Murmur3", "Crc16"
+hashFunc getHashFunction(const char *name);
+const char *getHashFunctionName(hashFunc hash);
+
+#endif
@@ -8,20 +8,6 @@
 
 #include "redis.h"
 
-extern void md5_signature(const unsigned char *key, unsigned int length, unsigned char *result);
-
-static uint32_t ketamaHash(const char *key, size_t key_length, uint32_t alignment)
-{
-    unsigned char results[16];
-
-    md5_signature((unsigned char*)key, (int)key_length, results);
-
-    return ((uint32_t) (results[3 + alignment * 4] & 0xFF) << 24)
-        | ((uint32_t) (results[2 + alignment * 4] & 0xFF) << 16)
-        | ((uint32_t) (results[1 + alignment * 4] & 0xFF) << 8)
-        | (results[0 + alignment * 4] & 0xFF);
-}
-
 // hashAdd is used when a new redis server add to rebalance tokens
 int hashAdd(struct redisServer *server, wstr ip, int port, int id)
 {
@@ -32,16 +18,18 @@ int hashAdd(struct redisServer *server, wstr ip, int port, int id)
     size_t *sub_ntoken;
     int i;
 
-    if (initInstance(&add_instance, id, ip, port, DIRTY) == WHEAT_WRONG)
-        return WHEAT_WRONG;
+    // Links of instance refer to it, so it's initialized in place
     arrayPush(server->instances, &add_instance);
+    instance = arrayLast(server->instances);
+    if (initInstance(instance, id, ip, port, DIRTY) == WHEAT_WRONG)
+        return WHEAT_WRONG;
 
     // `sub_ntoken`'s element is the amount of tokens every instance should
     // take out
     ninstance = narray(server->instances);
     sub_ntoken = wmalloc(sizeof(int)*ninstance);
-    ntoken_per_instance = WHEAT_KEYSPACE / ninstance;
-    extra_ntoken = WHEAT_KEYSPACE % ninstance;
+    ntoken_per_instance = server->ntoken / ninstance;
+    extra_ntoken = server->ntoken % ninstance;
     for (i = 0; i < ninstance; i++) {
         instance = arrayIndex(server->instances,i);
         sub_ntoken[i] = instance->ntoken - ntoken_per_instance;
@@ -76,7 +64,7 @@ int hashAdd(struct redisServer *server, wstr ip, int port, int id)
         instance = arrayIndex(server->instances,i);
         ntoken += instance->ntoken;
     }
-    ASSERT(ntoken == WHEAT_KEYSPACE);
+    ASSERT(ntoken == server->ntoken);
 
     wfree(sub_ntoken);
     return WHEAT_OK;
@@ -90,12 +78,14 @@ int hashInit(struct redisServer *server)
     struct redisInstance *instance;
     size_t ntoken, ninstance, swap;
     int i, prev_idx;
-    struct token *tokens = server->tokens, *last_token = NULL;
+    struct token *tokens, *last_token = NULL;
 
-    ntoken = WHEAT_KEYSPACE;
+    ntoken = server->ntoken;
     tokens = wmalloc(sizeof(struct token)*ntoken);
     if (!tokens)
         return WHEAT_WRONG;
+    if (server->tokens)
+        wfree(server->tokens);
     server->tokens = tokens;
 
     ninstance = narray(server->instances);
@@ -127,13 +117,15 @@ int hashInit(struct redisServer *server)
         }
         ++i;
     }
-    server->ntoken = ntoken;
     return WHEAT_OK;
 }
 
 struct token *hashDispatch(struct redisServer *server, struct slice *key)
 {
-    uint32_t hash = ketamaHash((const char *)key->data, key->len, 0);
+    struct slice hash_key;
+    uint32_t hash;
 
-    return &server->tokens[hash%WHEAT_KEYSPACE];
+    getRedisHashKey(key, &hash_key);
+    hash = server->hash((const char *)hash_key.data, hash_key.len);
+    return &server->tokens[hash%server->ntoken];
 }
@@ -9,8 +9,17 @@
 #define WHEAT_REDIS_UNIT_MIN        50
 #define WHEAT_REDIS_TIMEOUT         1000000
 #define WHEAT_REDIS_ERR             "-ERR Server keep this key all broken\r\n"
+#define WHEAT_REDIS_MSET_ERR        "-ERR wrong number of arguments for 'mset' command\r\n"
+#define WHEAT_REDIS_REPLY_ERR       "-ERR Server reply unexpected to multi-key command\r\n"
 #define WHEAT_REDIS_TIMEOUT_DIRTY   5
 #define WHEAT_REDIS_REQ_LEN         64
+#define WHEAT_REDIS_LINK_MAX        64
+#define WHEAT_REDIS_REPORT_INTERVAL 60
+#define WHEAT_REDIS_LATENCY_WEIGHT  8     // EWMA weight of sample is 1/8
+#define WHEAT_REDIS_LATENCY_DECAY   1     // Seconds latency is halved if idle
+#define WHEAT_REDIS_HEDGE_MIN_SAMPLE 100  // Samples needed to hedge by instance
+#define WHEAT_REDIS_HEDGE_WINDOW    10000 // Histogram is halved beyond it
+#define WHEAT_REDIS_HEDGE_BURST     10    // Max hedges saved by budget
 
 #define WHEAT_REDIS_USEFILE         0
 #define WHEAT_REDIS_USEREDIS        1
@@ -28,6 +37,15 @@ static struct enumIdName RedisSources[] = {
     {0, "UseFile"}, {1, "UseRedis"}, {2, "RedisThenFile"},
 };
 
+// Names are the same as getHashFunction
+static struct enumIdName RedisHashes[] = {
+    {0, "Md5"}, {1, "XxHash"}, {2, "Murmur3"}, {3, "Crc16"}, {-1, NULL}
+};
+
+static struct enumIdName RedisCachePolicies[] = {
+    {0, "LRU"}, {1, "LFU"}, {-1, NULL}
+};
+
 static struct configuration RedisConf[] = {
     {"redis-servers",     WHEAT_ARGS_NO_LIMIT,listValidator, {.ptr=NULL},
         NULL,                   LIST_FORMAT},
@@ -35,16 +53,48 @@ static struct configuration RedisConf[] = {
         NULL,                   INT_FORMAT},
     {"redis-timeout",     2, unsignedIntValidator, {.val=1000},
         NULL,                   INT_FORMAT},
+    {"redis-connections", 2, unsignedIntValidator, {.val=1},
+        (void *)WHEAT_REDIS_LINK_MAX, INT_FORMAT},
     {"config-server",     2, stringValidator,      {.ptr=NULL},
         NULL,                   STRING_FORMAT},
     {"config-source",     2, enumValidator,        {.enum_ptr=&RedisSources[2]},
         &RedisSources[0],       ENUM_FORMAT},
+    {"hash-function",     2, enumValidator,        {.enum_ptr=&RedisHashes[0]},
+        &RedisHashes[0],        ENUM_FORMAT},
+    {"keyspace",          2, unsignedIntValidator, {.val=WHEAT_KEYSPACE},
+        (void *)WHEAT_KEYSPACE_MAX, INT_FORMAT},
+    {"hedge-percentile",  2, unsignedIntValidator, {.val=0},
+        (void *)99,             INT_FORMAT},
+    {"hedge-budget",      2, unsignedIntValidator, {.val=5},
+        (void *)100,            INT_FORMAT},
+    {"redis-cache-size",  2, unsignedIntValidator, {.val=0},
+        NULL,                   INT_FORMAT},
+    {"redis-cache-ttl",   2, unsignedIntValidator, {.val=1000},
+        (void *)60000,          INT_FORMAT},
+    {"redis-cache-policy", 2, enumValidator,       {.enum_ptr=&RedisCachePolicies[0]},
+        &RedisCachePolicies[0], ENUM_FORMAT},
+    {"redis-cache-commands", 2, stringValidator,   {.ptr=NULL},
+        NULL,                   STRING_FORMAT},
+    {"redis-cache-hot-keys", 2, unsignedIntValidator, {.val=10},
+        (void *)100,            INT_FORMAT},
 };
 
 static struct statItem RedisStats[] = {
     {"Current redis unit count", ASSIGN_STAT, RAW, 0, 0},
     {"Total redis unit count", SUM_STAT, RAW, 0, 0},
     {"Total timeout response", SUM_STAT, RAW, 0, 0},
+    {"Total redis backend flush", SUM_STAT, RAW, 0, 0},
+    {"Total redis multi-key command", SUM_STAT, RAW, 0, 0},
+    {"Current redis live connection", ASSIGN_STAT, RAW, 0, 0},
+    {"Total redis connection closed", SUM_STAT, RAW, 0, 0},
+    {"Max redis connection outstanding", MAX_STAT, RAW, 0, 0},
+    {"Max redis instance latency", MAX_STAT, RAW, 0, 0},
+    {"Total redis read not to first backup", SUM_STAT, RAW, 0, 0},
+    {"Total redis hedged read", SUM_STAT, RAW, 0, 0},
+    {"Total redis hedged read won", SUM_STAT, RAW, 0, 0},
+    {"Total redis cache hit", SUM_STAT, RAW, 0, 0},
+    {"Total redis cache miss", SUM_STAT, RAW, 0, 0},
+    {"Current redis cache size", ASSIGN_STAT, RAW, 0, 0},
 };
 
 static struct command RedisCommand[] = {
@@ -54,10 +104,27 @@ static struct command RedisCommand[] = {
 static long long *CurrentUnitCount = NULL;
 static long long *TotalUnitCount = NULL;
 static long long *TotalTimeoutResponse = NULL;
+static long long *TotalBackendFlush = NULL;
+static long long *TotalMultiKeyCommand = NULL;
+static long long *CurrentLiveLink = NULL;
+static long long *TotalLinkClosed = NULL;
+static long long *MaxLinkOutstanding = NULL;
+static long long *MaxInstanceLatency = NULL;
+static long long *TotalReadNotFirst = NULL;
+static long long *TotalHedgedRead = NULL;
+static long long *TotalHedgedReadWon = NULL;
+static time_t LastHedgeUpdate = 0;
+static time_t LastReport = 0;
 
 struct redisAppData {
     struct redisUnit *unit;
+    struct redisMulti *multi;
     wstr header;
+    // Reply conn whose data is queued to outer conn without copy, or the
+    // outer conn it's lent to. Reply is finished when outer conn freed.
+    struct conn *lent;
+    // Index of link request is sent by, the same for all instances
+    int link_idx;
 };
 
 static struct app AppRedis = {
@@ -79,14 +146,53 @@ struct redisUnit {
     size_t sended;
     size_t pos;
     struct conn *outer_conn;
-    struct conn **redis_conns;
     struct redisInstance **sended_instances;
     struct token *first_token;
     struct listNode *node;
     struct timeval start;
+    // Time of request sent last, used to sample latency of instance
+    struct timeval sent;
+    // Read is sent to `hedge_instance` too after waiting long, the first
+    // reply is sent to client
+    struct redisInstance *hedge_instance;
+    struct timeval hedge_sent;
+    // Reply of read is cached if `cache_version` of `cache_slot` isn't
+    // changed when it comes. Write holds slots of its keys in
+    // `cache_writes`, read to them isn't cached until it's done.
+    long cache_slot;
+    uint32_t cache_version;
+    struct array *cache_writes;
     int retry;
+    // Sub-command of multi-key command, `request` is sent instead of
+    // outer request and reply is gathered by `multi`
+    struct redisMulti *multi;
+    size_t multi_idx;
+    wstr request;
+    // The first reply of write command copied, it's sent to client if
+    // other backups timeout
+    wstr reply;
     unsigned is_read:1;
     unsigned wait_free:1;
+    unsigned hedged:1;
+};
+
+// Multi-key command is split into one redisUnit per backup instances
+// group, keys whose tokens have the same instances go to the same unit.
+// `key_units` records which unit each key is sent to in original order,
+// so replies can be reassembled when all units done. Reply is copied when
+// it comes, its conn may be freed with backend connection before others.
+struct redisMulti {
+    struct conn *outer_conn;
+    int type;
+    size_t nkey;
+    size_t nunit;
+    size_t pending;
+    size_t *key_units;
+    // Set NULL when unit done
+    struct redisUnit **units;
+    // NULL means unit failed
+    wstr *bodies;
+    wstr reply;
 };
 
 static struct redisServer *RedisServer = NULL;
@@ -103,47 +209,135 @@ static struct redisInstance *getInstance(struct redisServer *server, size_t idx,
     return NULL;
 }
 
-static int wakeupInstance(struct redisInstance *instance)
+static int wakeupLink(struct redisLink *link)
 {
+    struct redisInstance *instance = link->instance;
     char name[255];
 
-    instance->redis_client = buildConn(instance->ip, instance->port, RedisProtocol);
-    if (!instance->redis_client)
+    link->redis_client = buildConn(instance->ip, instance->port, RedisProtocol);
+    if (!link->redis_client)
         return WHEAT_WRONG;
-    instance->redis_client->client_data = instance;
-    instance->live = 1;
-    instance->ntimeout = 0;
-    instance->timeout_duration = 0;
-    snprintf(name, 255, "Redis Instance %s:%d", instance->ip, instance->port);
-    setClientName(instance->redis_client, name);
-    setClientFreeNotify(instance->redis_client, redisClientClosed);
+    link->redis_client->client_data = link;
+    // Reply conns are kept until their outer conns sent, requests queued
+    // after them shouldn't wait for that
+    setClientMultiplexed(link->redis_client);
+    link->live = 1;
+    if (!instance->live_links++) {
+        instance->live = 1;
+        instance->ntimeout = 0;
+        instance->timeout_duration = 0;
+    }
+    snprintf(name, 255, "Redis Instance %s:%d #%zu", instance->ip,
+            instance->port, link->idx);
+    setClientName(link->redis_client, name);
+    setClientFreeNotify(link->redis_client, redisClientClosed);
     return WHEAT_OK;
 }
 
 int initInstance(struct redisInstance *instance, size_t pos, wstr ip,
         int port, int is_dirty)
 {
+    struct redisInstance *other;
+    struct redisLink *link;
+    size_t i, j;
+
+    // Instance is pushed to `instances` before initialized, the array may
+    // be moved so links of others are pointed to them again
+    for (i = 0; i < narray(RedisServer->instances); i++) {
+        other = arrayIndex(RedisServer->instances, i);
+        if (other == instance)
+            continue;
+        for (j = 0; j < other->nlink; j++)
+            other->links[j].instance = other;
+    }
+
     instance->id = pos;
     instance->ip = wstrDup(ip);
     instance->port = port;
     instance->is_dirty = is_dirty;
     instance->ntoken = 0;
     instance->reliability = 0;
-    instance->wait_units = createList();
-    if (wakeupInstance(instance) == WHEAT_WRONG) {
-        wheatLog(WHEAT_WARNING, "initInstance connect failed: %s:%d", ip, port);
-        return WHEAT_WRONG;
+    instance->latency = 0;
+    instance->latency_time = Server.cron_time.tv_sec;
+    instance->nread = 0;
+    memset(instance->latency_hist, 0, sizeof(instance->latency_hist));
+    instance->latency_nsample = 0;
+    instance->hedge_after = 0;
+    instance->live = 0;
+    instance->nlink = RedisServer->nlink;
+    instance->live_links = 0;
+    instance->links = wmalloc(sizeof(struct redisLink)*instance->nlink);
+    for (i = 0; i < instance->nlink; i++) {
+        link = &instance->links[i];
+        link->instance = instance;
+        link->idx = i;
+        link->redis_client = NULL;
+        link->wait_units = createList();
+        link->nrequest = 0;
+        link->nclosed = 0;
+        link->max_outstanding = 0;
+        link->live = 0;
+        if (wakeupLink(link) == WHEAT_WRONG) {
+            wheatLog(WHEAT_WARNING, "initInstance connect failed: %s:%d", ip, port);
+            return WHEAT_WRONG;
+        }
     }
     return WHEAT_OK;
 }
 
+// Requests of one client must reach instance in order, so the link former
+// request not yet replied is sent by is reused, otherwise the live link with
+// least outstanding units is picked. The first one wins ties so requests are
+// still batched to one link while links aren't busy.
+static struct redisLink *getLink(struct redisInstance *instance,
+        struct conn *outer_conn)
+{
+    struct redisAppData *redis_data, *former;
+    struct redisLink *link, *least;
+    struct listNode *node;
+    size_t i;
+
+    redis_data = outer_conn->app_private_data;
+    if (redis_data->link_idx == -1) {
+        node = listLast(outer_conn->client->conns);
+        while (node && listNodeValue(node) != outer_conn)
+            node = node->prev;
+        for (node = node ? node->prev : NULL; node; node = node->prev) {
+            former = ((struct conn *)listNodeValue(node))->app_private_data;
+            if (former && former->link_idx != -1) {
+                redis_data->link_idx = former->link_idx;
+                break;
+            }
+        }
+    }
+    if (redis_data->link_idx != -1) {
+        link = &instance->links[redis_data->link_idx];
+        if (link->live)
+            return link;
+    }
+
+    least = NULL;
+    for (i = 0; i < instance->nlink; i++) {
+        link = &instance->links[i];
+        if (!link->live)
+            continue;
+        if (!least ||
+                listLength(link->wait_units) < listLength(least->wait_units))
+            least = link;
+    }
+    if (least && redis_data->link_idx == -1)
+        redis_data->link_idx = least->idx;
+    return least;
+}
+
 static struct redisUnit *getRedisUnit()
 {
     uint8_t *p;
     size_t count;
     struct redisUnit *unit;
 
-    count = (RedisServer->nbackup) * sizeof(void*) * 2;
+    // Read may be sent to all backups and hedged once
+    count = (RedisServer->nbackup + 1) * sizeof(void*);
 
     p = wmalloc(sizeof(*unit)+count);
     unit = (struct redisUnit*)p;
@@ -154,9 +348,15 @@ static struct redisUnit *getRedisUnit()
     unit->first_token = NULL;
     unit->is_read = 0;
     unit->wait_free = 0;
+    unit->multi = NULL;
+    unit->multi_idx = 0;
+    unit->request = NULL;
+    unit->reply = NULL;
+    unit->hedge_instance = NULL;
+    unit->hedged = 0;
+    unit->cache_slot = -1;
+    unit->cache_writes = NULL;
     p += sizeof(*unit);
-    unit->redis_conns = (struct conn**)p;
-    p += (sizeof(void*) * RedisServer->nbackup);
     unit->sended_instances = (struct redisInstance **)p;
     unit->node = appendToListTail(RedisServer->message_center, unit);
     unit->start = Server.cron_time;
@@ -166,45 +366,42 @@ static struct redisUnit *getRedisUnit()
 
 static void redisUnitFinal(struct redisUnit *unit)
 {
+    struct redisAppData *redis_data;
+
     if (!unit->wait_free) {
-        finishConn(unit->outer_conn);
-        unit->outer_conn = NULL;
         unit->wait_free = 1;
+        // Outer conn of multi-key command is finished by redisMulti
+        if (!unit->multi) {
+            // Pipelined outer conn may be freed after unit
+            redis_data = unit->outer_conn->app_private_data;
+            redis_data->unit = NULL;
+            finishConn(unit->outer_conn);
+        }
+        unit->outer_conn = NULL;
     }
     if (unit->pos == unit->sended) {
         removeListNode(RedisServer->message_center, unit->node);
+        if (unit->request)
+            wstrFree(unit->request);
+        if (unit->reply)
+            wstrFree(unit->reply);
+        redisCacheWriteDone(unit->cache_writes);
         wfree(unit);
     }
 }
 
-static void redisClientClosed(struct client *redis_client)
-{
-    struct redisInstance *instance;
-    struct listIterator *iter;
-    struct listNode *node;
-    struct redisUnit *unit;
-
-    instance = redis_client->client_data;
-    RedisServer->live_instances--;
-    instance->live = 0;
-    instance->redis_client = NULL;
-    instance->is_dirty = 1;
-    iter = listGetIterator(instance->wait_units, START_HEAD);
-    while ((node = listNext(iter)) != NULL) {
-        unit = listNodeValue(node);
-        unit->sended--;
-        removeListNode(instance->wait_units, node);
-    }
-    freeListIterator(iter);
-    wheatLog(WHEAT_WARNING, "one redis server disconnect: %s:%d, lived: %d",
-            instance->ip, instance->port, RedisServer->live_instances);
-}
+static void multiUnitDone(struct redisUnit *unit);
 
 static int sendOuterError(struct redisUnit *unit)
 {
     struct slice error;
     char buf[255];
     int ret;
+    if (unit->multi) {
+        multiUnitDone(unit);
+        redisUnitFinal(unit);
+        return WHEAT_OK;
+    }
     ret = snprintf(buf, 255, WHEAT_REDIS_ERR);
     sliceTo(&error, (uint8_t *)buf, ret);
     ret = sendClientData(unit->outer_conn, &error);
@@ -212,30 +409,32 @@ static int sendOuterError(struct redisUnit *unit)
     return ret;
 }
 
-static int sendRedisData(struct conn *outer_conn,
-        struct redisInstance *instance, struct redisUnit *unit)
+// Header with token id prefixed key is rendered once and shared by all
+// instances request sent to, retry keeps the same key too.
+static int sendOuterRequest(struct conn *send_conn, struct conn *outer_conn,
+        struct redisUnit *unit)
 {
-    struct conn *send_conn;
     struct slice *next, key, temp, command;
     int ret, args;
     size_t pos, key_end_pos, intercross, key_token_id;
     struct redisAppData *redis_data;
 
-    send_conn = connGet(instance->redis_client);
     redis_data = outer_conn->app_private_data;
-    getRedisKey(outer_conn, &key);
-    getRedisCommand(outer_conn, &command);
-    args = getRedisArgs(outer_conn);
     key_end_pos = getRedisKeyEndPos(outer_conn);
     pos = intercross = 0;
-    key_token_id = unit->first_token->pos;
 
-    redis_data->header = wstrNewLen(NULL, (int)key.len+(int)command.len+32);
-    ret = snprintf(redis_data->header, wstrfree(redis_data->header),
-            "*%d\r\n$%lu\r\n%s\r\n$%lu\r\n%lu%s", args,
-            command.len, command.data,
-            key.len+getIntLen(key_token_id), key_token_id, key.data);
-    wstrupdatelen(redis_data->header, ret);
+    if (!redis_data->header) {
+        getRedisKey(outer_conn, &key);
+        getRedisCommand(outer_conn, &command);
+        args = getRedisArgs(outer_conn);
+        key_token_id = unit->first_token->pos;
+        redis_data->header = wstrNewLen(NULL, (int)key.len+(int)command.len+32);
+        ret = snprintf(redis_data->header, wstrfree(redis_data->header),
+                "*%d\r\n$%lu\r\n%s\r\n$%lu\r\n%lu%s", args,
+                command.len, command.data,
+                key.len+getIntLen(key_token_id), key_token_id, key.data);
+        wstrupdatelen(redis_data->header, ret);
+    }
 
     sliceTo(&temp, (uint8_t*)redis_data->header, wstrlen(redis_data->header));
     if (sendClientData(send_conn, &temp) == -1)
@@ -269,25 +468,113 @@ static int sendRedisData(struct conn *outer_conn,
         if (sendClientData(send_conn, next) == -1)
             return WHEAT_WRONG;
     }
+    return WHEAT_OK;
+}
+
+// Request is only queued to link of instance, requests queued to it within
+// one loop are written together by flushInstances, replies come back in
+// the same order as units appended to `wait_units`.
+static int sendRedisData(struct conn *outer_conn,
+        struct redisInstance *instance, struct redisUnit *unit)
+{
+    struct redisLink *link;
+    struct conn *send_conn;
+    struct slice request;
+
+    link = getLink(instance, outer_conn);
+    if (!link)
+        return WHEAT_WRONG;
+    corkClient(link->redis_client);
+    send_conn = connGet(link->redis_client);
+    if (unit->request) {
+        sliceTo(&request, (uint8_t *)unit->request, wstrlen(unit->request));
+        if (sendClientData(send_conn, &request) == -1)
+            return WHEAT_WRONG;
+    } else if (sendOuterRequest(send_conn, outer_conn, unit) == WHEAT_WRONG) {
+        return WHEAT_WRONG;
+    }
     finishConn(send_conn);
-    appendToListTail(instance->wait_units, unit);
+    appendToListTail(link->wait_units, unit);
+    link->nrequest++;
+    if (listLength(link->wait_units) > link->max_outstanding)
+        link->max_outstanding = listLength(link->wait_units);
+    if (listLength(link->wait_units) > *MaxLinkOutstanding)
+        *MaxLinkOutstanding = listLength(link->wait_units);
+    gettimeofday(&unit->sent, NULL);
     unit->sended_instances[unit->sended] = instance;
     unit->sended++;
     return WHEAT_OK;
 }
 
-// send response to client
-static int sendOuterData(struct redisUnit *unit)
+// Write requests queued to instances since last loop, each link by one
+// writev
+static void flushInstances(struct redisServer *server)
+{
+    struct redisInstance *instance;
+    struct client *client;
+    size_t i, j;
+
+    for (i = 0; i < narray(server->instances); i++) {
+        instance = arrayIndex(server->instances, i);
+        for (j = 0; j < instance->nlink; j++) {
+            client = instance->links[j].redis_client;
+            if (!instance->links[j].live || !client->corked ||
+                    !listLength(client->conns))
+                continue;
+            (*TotalBackendFlush)++;
+            uncorkClient(listNodeValue(listFirst(client->conns)), 0);
+        }
+    }
+}
+
+// Copy reply body, so its conn can be finished at once
+static wstr copyReply(struct conn *reply)
 {
     struct slice *next;
+    wstr body;
+
+    body = wstrEmpty();
+    redisBodyStart(reply);
+    while ((next = redisBodyNext(reply)) != NULL)
+        body = wstrCatLen(body, (char *)next->data, next->len);
+    return body;
+}
+
+// send response to client, `reply` is the last reply of unit. If NULL,
+// such as other backups timeout, the copied first reply is sent.
+static int sendOuterData(struct redisUnit *unit, struct conn *reply)
+{
+    struct slice *next, body;
     int ret;
-    struct conn *outer_conn, *redis_conn;
+    struct conn *outer_conn;
+    struct redisAppData *redis_data, *reply_data;
     ASSERT(unit->pos > 0);
 
-    redis_conn = unit->redis_conns[0];
+    if (unit->multi) {
+        multiUnitDone(unit);
+        redisUnitFinal(unit);
+        return WHEAT_OK;
+    }
     outer_conn = unit->outer_conn;
-    redisBodyStart(redis_conn);
-    while ((next = redisBodyNext(redis_conn)) != NULL) {
+    if (!reply) {
+        if (!unit->reply)
+            return sendOuterError(unit);
+        sliceTo(&body, (uint8_t *)unit->reply, wstrlen(unit->reply));
+        registerConnFree(outer_conn, (void (*)(void*))wstrFree, unit->reply);
+        unit->reply = NULL;
+        ret = sendClientData(outer_conn, &body);
+        redisUnitFinal(unit);
+        return ret == -1 ? WHEAT_WRONG : WHEAT_OK;
+    }
+
+    // Reply is sent without copy, redisClientClosed copies it if link
+    // closed before outer conn sent
+    redis_data = outer_conn->app_private_data;
+    reply_data = reply->app_private_data;
+    redis_data->lent = reply;
+    reply_data->lent = outer_conn;
+    redisBodyStart(reply);
+    while ((next = redisBodyNext(reply)) != NULL) {
         ret = sendClientData(outer_conn, next);
         if (ret == -1) {
             redisUnitFinal(unit);
@@ -298,37 +585,139 @@ static int sendOuterData(struct redisUnit *unit)
     return WHEAT_OK;
 }
 
-// When client requests comes, we iterate backup instances which keep this key.
-// If is read command, we choose the non-dirty instance. If non-dirty instance
-// is None, we choose the max reliability instance. If is write command, send
-// write command to all backup instances.
-// If all instance isn't alive, send error to client(very rare)
-static int handleClientRequests(struct conn *c)
+static size_t instanceOutstanding(struct redisInstance *instance)
 {
-    struct token *token;
+    size_t i, outstanding = 0;
+
+    for (i = 0; i < instance->nlink; i++) {
+        if (instance->links[i].live)
+            outstanding += listLength(instance->links[i].wait_units);
+    }
+    return outstanding;
+}
+
+// Microseconds the oldest request on links of instance has waited
+static long instanceWaited(struct redisInstance *instance, long now_micro)
+{
+    struct listNode *node;
     struct redisUnit *unit;
-    struct slice key;
-    int nwritted;
-    struct redisInstance *instance, *reliability_instance, *nondirty_instance;
-    struct redisServer *server;
-    struct redisAppData *redis_data;
+    struct timeval *sent;
+    long waited = 0;
+    size_t i;
 
-    server = RedisServer;
-    getRedisKey(c, &key);
-    token = hashDispatch(server, &key);
-    unit = getRedisUnit();
-    unit->outer_conn = c;
-    redis_data = c->app_private_data;
+    for (i = 0; i < instance->nlink; i++) {
+        if (!instance->links[i].live)
+            continue;
+        node = listFirst(instance->links[i].wait_units);
+        if (!node)
+            continue;
+        unit = listNodeValue(node);
+        sent = unit->hedge_instance == instance ? &unit->hedge_sent : &unit->sent;
+        if (now_micro - getMicroseconds((*sent)) > waited)
+            waited = now_micro - getMicroseconds((*sent));
+    }
+    return waited;
+}
+
+// Predicted latency of a new request sent to instance. A stalled instance
+// won't reply sooner than the oldest request waited, `latency` only
+// learns it when the stall is over.
+static unsigned long long instanceCost(struct redisInstance *instance,
+        long now_micro)
+{
+    long latency;
+
+    latency = instanceWaited(instance, now_micro);
+    if (latency < instance->latency)
+        latency = instance->latency;
+    return (unsigned long long)(latency + 1) *
+        (instanceOutstanding(instance) + 1);
+}
+
+static int latencyBucket(long us)
+{
+    int msb, idx;
+
+    if (us < 4)
+        return us < 0 ? 0 : us;
+    msb = 63 - __builtin_clzl(us);
+    idx = (msb - 1) * 4 + ((us >> (msb - 2)) & 3);
+    return idx < WHEAT_REDIS_LATENCY_BUCKETS ? idx : WHEAT_REDIS_LATENCY_BUCKETS - 1;
+}
+
+// Upper bound of latency in bucket
+static long latencyBucketMax(int idx)
+{
+    if (idx < 4)
+        return idx + 1;
+    return (long)(5 + idx % 4) << (idx / 4 - 1);
+}
+
+static void sampleLatency(struct redisInstance *instance, struct timeval *sent)
+{
+    struct timeval now;
+    long sample;
+
+    gettimeofday(&now, NULL);
+    sample = getMicroseconds(now) - getMicroseconds((*sent));
+    if (sample < 0)
+        sample = 0;
+    instance->latency += (sample - instance->latency) / WHEAT_REDIS_LATENCY_WEIGHT;
+    instance->latency_time = now.tv_sec;
+    instance->latency_hist[latencyBucket(sample)]++;
+    instance->latency_nsample++;
+}
+
+// Called every second, `hedge_after` follows recent latency
+static void updateHedgeAfter(struct redisInstance *instance, int percentile)
+{
+    uint32_t target, count;
+    int i;
+
+    if (instance->latency_nsample > WHEAT_REDIS_HEDGE_WINDOW) {
+        instance->latency_nsample = 0;
+        for (i = 0; i < WHEAT_REDIS_LATENCY_BUCKETS; i++) {
+            instance->latency_hist[i] /= 2;
+            instance->latency_nsample += instance->latency_hist[i];
+        }
+    }
+    instance->hedge_after = 0;
+    if (instance->latency_nsample < WHEAT_REDIS_HEDGE_MIN_SAMPLE)
+        return ;
+    target = (uint64_t)instance->latency_nsample * percentile / 100;
+    count = 0;
+    for (i = 0; i < WHEAT_REDIS_LATENCY_BUCKETS; i++) {
+        count += instance->latency_hist[i];
+        if (count > target)
+            break;
+    }
+    instance->hedge_after = latencyBucketMax(i);
+}
+
+// When client requests comes, we iterate backup instances which keep this key.
+// If is read command, we choose two of non-dirty instances randomly and send
+// to the one with less predicted latency. If non-dirty instance is None, we
+// choose the max reliability instance. If is write command, send write
+// command to all backup instances.
+// If all instance isn't alive, `unit->sended` is zero.
+static void dispatchUnit(struct redisServer *server, struct conn *c,
+        struct redisUnit *unit, struct token *token)
+{
+    int nwritted;
+    size_t ncandidate;
+    struct redisInstance *instance, *reliability_instance, *primary;
+    struct redisInstance *first, *second;
+    struct timeval now;
+    long now_micro;
 
     nwritted = 0;
-    reliability_instance = nondirty_instance = NULL;
-    unit->is_read = isReadCommand(c);
+    ncandidate = 0;
+    instance = reliability_instance = primary = first = second = NULL;
     while (nwritted < server->nbackup) {
         if (!unit->first_token)
             unit->first_token = token;
         nwritted++;
-        instance = getInstance(server, token->instance_id,
-                isReadCommand(c));
+        instance = getInstance(server, token->instance_id, unit->is_read);
         token = &server->tokens[token->next_instance];
         if (!instance)
             continue;
@@ -339,22 +728,441 @@ static int handleClientRequests(struct conn *c)
             else if (reliability_instance->reliability < instance->reliability)
                 reliability_instance = instance;
 
-            if (!instance->is_dirty)
-                nondirty_instance = instance;
+            if (instance->is_dirty)
+                continue;
+            // Keep two non-dirty instances chosen uniformly
+            ncandidate++;
+            if (ncandidate == 1) {
+                primary = first = instance;
+            } else if (ncandidate == 2) {
+                second = instance;
+            } else {
+                switch (random() % ncandidate) {
+                    case 0: first = instance; break;
+                    case 1: second = instance; break;
+                }
+            }
         } else {
             sendRedisData(c, instance, unit);
         }
     }
 
     if (unit->is_read) {
-        if (nondirty_instance) {
-            instance = nondirty_instance;
-        } else if (reliability_instance) {
-            instance = reliability_instance;
+        instance = first ? first : reliability_instance;
+        if (second) {
+            gettimeofday(&now, NULL);
+            now_micro = getMicroseconds(now);
+            if (instanceCost(second, now_micro) < instanceCost(first, now_micro))
+                instance = second;
         }
-        if (instance)
-            sendRedisData(c, instance, unit);
+        if (instance && sendRedisData(c, instance, unit) == WHEAT_OK) {
+            instance->nread++;
+            if (primary && instance != primary)
+                (*TotalReadNotFirst)++;
+            if (server->hedge_tokens < WHEAT_REDIS_HEDGE_BURST * 100)
+                server->hedge_tokens += server->hedge_budget;
+        }
+    }
+}
+
+// Unit lost its request with closed link. Read command is sent again by
+// another link or backup instance, write command isn't because it may be
+// applied already.
+static void failoverUnit(struct redisUnit *unit)
+{
+    if (unit->wait_free) {
+        redisUnitFinal(unit);
+    } else if (unit->is_read) {
+        // Hedged read is still waited by another instance
+        if (unit->sended)
+            return ;
+        dispatchUnit(RedisServer, unit->outer_conn, unit, unit->first_token);
+        if (!unit->sended)
+            sendOuterError(unit);
+    } else if (unit->pos == unit->sended) {
+        if (unit->pos)
+            sendOuterData(unit, NULL);
+        else
+            sendOuterError(unit);
+    }
+}
+
+static void redisClientClosed(struct client *redis_client)
+{
+    struct redisLink *link;
+    struct redisInstance *instance;
+    struct redisAppData *redis_data, *outer_data;
+    struct listNode *node;
+    struct redisUnit *unit;
+    struct conn *c;
+    int lost_write;
+
+    link = redis_client->client_data;
+    instance = link->instance;
+    link->live = 0;
+    link->redis_client = NULL;
+    link->nclosed++;
+    (*TotalLinkClosed)++;
+    if (!--instance->live_links) {
+        RedisServer->live_instances--;
+        instance->live = 0;
+        instance->is_dirty = 1;
+        wheatLog(WHEAT_WARNING, "one redis server disconnect: %s:%d, lived: %d",
+                instance->ip, instance->port, RedisServer->live_instances);
+    } else {
+        wheatLog(WHEAT_NOTICE, "redis connection #%zu disconnect: %s:%d, lived: %zu",
+                link->idx, instance->ip, instance->port, instance->live_links);
+    }
+
+    // Buffer of replies lent to outer conns is freed with client
+    for (node = listFirst(redis_client->conns); node; node = node->next) {
+        c = listNodeValue(node);
+        redis_data = c->app_private_data;
+        if (!redis_data || !redis_data->lent)
+            continue;
+        copyConnData(redis_data->lent);
+        outer_data = redis_data->lent->app_private_data;
+        outer_data->lent = NULL;
+        redis_data->lent = NULL;
+    }
+
+    lost_write = 0;
+    while ((node = listFirst(link->wait_units)) != NULL) {
+        unit = listNodeValue(node);
+        removeListNode(link->wait_units, node);
+        unit->sended--;
+        if (!unit->is_read)
+            lost_write = 1;
+        // Instance may miss the write queued ahead, other backups are
+        // preferred by read until it isn't live
+        if (unit->is_read && lost_write && instance->live &&
+                !unit->wait_free && !unit->sended) {
+            instance->live = 0;
+            dispatchUnit(RedisServer, unit->outer_conn, unit, unit->first_token);
+            instance->live = 1;
+            if (unit->sended)
+                continue;
+        }
+        failoverUnit(unit);
     }
+    if (lost_write)
+        instance->is_dirty = 1;
+}
+
+// Tokens are served by the same backup instances
+static int isSameInstances(struct redisServer *server, struct token *t1,
+        struct token *t2)
+{
+    size_t i;
+
+    for (i = 0; i < server->nbackup; i++) {
+        if (t1->instance_id != t2->instance_id)
+            return 0;
+        t1 = &server->tokens[t1->next_instance];
+        t2 = &server->tokens[t2->next_instance];
+    }
+    return 1;
+}
+
+static struct redisMulti *redisMultiCreate(struct conn *c, int type,
+        size_t nkey)
+{
+    uint8_t *p;
+    struct redisMulti *multi;
+
+    p = wmalloc(sizeof(*multi) + nkey*(sizeof(size_t)+sizeof(void*)*2));
+    multi = (struct redisMulti *)p;
+    multi->outer_conn = c;
+    multi->type = type;
+    multi->nkey = nkey;
+    multi->nunit = 0;
+    multi->pending = 0;
+    multi->reply = NULL;
+    p += sizeof(*multi);
+    multi->key_units = (size_t *)p;
+    p += sizeof(size_t) * nkey;
+    multi->units = (struct redisUnit **)p;
+    p += sizeof(void*) * nkey;
+    multi->bodies = (wstr *)p;
+    memset(multi->bodies, 0, sizeof(wstr) * nkey);
+    return multi;
+}
+
+static void redisMultiDealloc(struct redisMulti *multi)
+{
+    size_t i;
+
+    // Outer conn closed before all units done, leave replies to wait_free.
+    // Write unit may have its first reply copied and wait others.
+    for (i = 0; i < multi->nunit; i++) {
+        if (multi->units[i]) {
+            multi->units[i]->wait_free = 1;
+            multi->units[i]->outer_conn = NULL;
+            multi->units[i]->multi = NULL;
+        }
+        if (multi->bodies[i])
+            wstrFree(multi->bodies[i]);
+    }
+    if (multi->reply)
+        wstrFree(multi->reply);
+    wfree(multi);
+}
+
+static wstr catRedisArg(wstr s, const char *prefix, size_t prefix_len,
+        const char *data, size_t len)
+{
+    char buf[32];
+    int ret;
+
+    ret = snprintf(buf, sizeof(buf), "$%zu\r\n", prefix_len+len);
+    s = wstrCatLen(s, buf, ret);
+    if (prefix_len)
+        s = wstrCatLen(s, prefix, prefix_len);
+    s = wstrCatLen(s, data, len);
+    return wstrCatLen(s, "\r\n", 2);
+}
+
+// Multi-key command is split by tokens of keys, each sub-command only
+// contains keys stored in the same backup instances and is dispatched
+// as normal command. Reply is sent to client when all sub-commands done.
+static int handleMultiKeyRequest(struct conn *c)
+{
+    struct redisServer *server;
+    struct redisAppData *redis_data;
+    struct redisMulti *multi;
+    struct redisUnit *unit;
+    struct array *argv;
+    struct token **tokens, **key_tokens;
+    struct slice key, command;
+    wstr *arg, request;
+    char buf[64];
+    size_t i, j, k, step, nkey, count;
+    int ret;
+
+    server = RedisServer;
+    redis_data = c->app_private_data;
+    argv = getRedisArgv(c);
+    arg = arrayData(argv);
+    step = getRedisMultiKey(c) == REDIS_MULTI_MSET ? 2 : 1;
+    if (narray(argv) % step) {
+        sliceTo(&key, (uint8_t *)WHEAT_REDIS_MSET_ERR,
+                sizeof(WHEAT_REDIS_MSET_ERR)-1);
+        sendClientData(c, &key);
+        finishConn(c);
+        return WHEAT_OK;
+    }
+    nkey = narray(argv) / step;
+    multi = redisMultiCreate(c, getRedisMultiKey(c), nkey);
+    redis_data->multi = multi;
+    (*TotalMultiKeyCommand)++;
+
+    // `tokens` keeps first token of each unit
+    tokens = wmalloc(sizeof(struct token *) * nkey * 2);
+    key_tokens = tokens + nkey;
+    for (i = 0; i < nkey; i++) {
+        sliceTo(&key, (uint8_t *)arg[i*step], wstrlen(arg[i*step]));
+        key_tokens[i] = hashDispatch(server, &key);
+        for (j = 0; j < multi->nunit; j++) {
+            if (isSameInstances(server, tokens[j], key_tokens[i]))
+                break;
+        }
+        if (j == multi->nunit)
+            tokens[multi->nunit++] = key_tokens[i];
+        multi->key_units[i] = j;
+    }
+
+    getRedisCommand(c, &command);
+    multi->pending = multi->nunit;
+    for (j = 0; j < multi->nunit; j++) {
+        count = 0;
+        for (i = 0; i < nkey; i++) {
+            if (multi->key_units[i] == j)
+                count++;
+        }
+        request = wstrNewLen(NULL, (int)(count*step*32));
+        ret = snprintf(buf, sizeof(buf), "*%zu\r\n", count*step+1);
+        request = wstrCatLen(request, buf, ret);
+        request = catRedisArg(request, NULL, 0, (char *)command.data,
+                command.len);
+        for (i = 0; i < nkey; i++) {
+            if (multi->key_units[i] != j)
+                continue;
+            // Key is prefixed with its own token id as single key command
+            ret = snprintf(buf, sizeof(buf), "%zu", key_tokens[i]->pos);
+            request = catRedisArg(request, buf, ret, arg[i*step],
+                    wstrlen(arg[i*step]));
+            for (k = 1; k < step; k++)
+                request = catRedisArg(request, NULL, 0, arg[i*step+k],
+                        wstrlen(arg[i*step+k]));
+        }
+
+        unit = getRedisUnit();
+        unit->outer_conn = c;
+        unit->is_read = isReadCommand(c);
+        unit->multi = multi;
+        unit->multi_idx = j;
+        unit->request = request;
+        for (i = 0; i < nkey && !unit->is_read; i++) {
+            if (multi->key_units[i] != j)
+                continue;
+            sliceTo(&key, (uint8_t *)arg[i*step], wstrlen(arg[i*step]));
+            unit->cache_writes = redisCacheWrite(unit->cache_writes, &key);
+        }
+        multi->units[j] = unit;
+        dispatchUnit(server, c, unit, tokens[j]);
+        if (!unit->sended)
+            sendOuterError(unit);
+    }
+    wfree(tokens);
+    return WHEAT_OK;
+}
+
+// Return the end of bulk reply started at `pos`, 0 if it's not a bulk
+static size_t bulkReplyEnd(wstr reply, size_t pos)
+{
+    char *end;
+    long len;
+
+    if (pos >= wstrlen(reply) || reply[pos] != '$')
+        return 0;
+    len = strtol(&reply[pos+1], &end, 10);
+    if (end[0] != '\r')
+        return 0;
+    pos = end - reply + 2;
+    if (len < 0)
+        return pos;
+    pos += len + 2;
+    return pos > wstrlen(reply) ? 0 : pos;
+}
+
+static wstr buildMultiReply(struct redisMulti *multi)
+{
+    wstr reply, *bodies = multi->bodies;
+    char buf[64];
+    size_t i, j, end, *poses;
+    long long count, total;
+    int ret;
+
+    for (j = 0; j < multi->nunit; j++) {
+        if (bodies[j][0] == '-')
+            return wstrDup(bodies[j]);
+    }
+
+    reply = NULL;
+    switch (multi->type) {
+        case REDIS_MULTI_MSET:
+            for (j = 0; j < multi->nunit; j++) {
+                if (bodies[j][0] != '+')
+                    return NULL;
+            }
+            reply = wstrNew("+OK\r\n");
+            break;
+        case REDIS_MULTI_DEL:
+        case REDIS_MULTI_EXISTS:
+            total = 0;
+            for (j = 0; j < multi->nunit; j++) {
+                if (bodies[j][0] != ':' || string2ll(&bodies[j][1],
+                            wstrlen(bodies[j])-3, &count) == WHEAT_WRONG)
+                    return NULL;
+                total += count;
+            }
+            ret = snprintf(buf, sizeof(buf), ":%lld\r\n", total);
+            reply = wstrNewLen(buf, ret);
+            break;
+        case REDIS_MULTI_MGET:
+            // Each body is array of its keys in original order, so elements
+            // are picked in order of keys by the current pos of its unit
+            for (j = 0; j < multi->nunit; j++) {
+                if (bodies[j][0] != '*')
+                    return NULL;
+            }
+            poses = wmalloc(sizeof(size_t) * multi->nunit);
+            for (j = 0; j < multi->nunit; j++)
+                poses[j] = strchr(bodies[j], '\n') - bodies[j] + 1;
+            ret = snprintf(buf, sizeof(buf), "*%zu\r\n", multi->nkey);
+            reply = wstrNewLen(buf, ret);
+            for (i = 0; i < multi->nkey; i++) {
+                j = multi->key_units[i];
+                end = bulkReplyEnd(bodies[j], poses[j]);
+                if (!end) {
+                    wstrFree(reply);
+                    reply = NULL;
+                    break;
+                }
+                reply = wstrCatLen(reply, &bodies[j][poses[j]], end-poses[j]);
+                poses[j] = end;
+            }
+            wfree(poses);
+            break;
+    }
+    return reply;
+}
+
+static void sendMultiReply(struct redisMulti *multi)
+{
+    struct slice reply;
+    size_t j;
+
+    for (j = 0; j < multi->nunit; j++) {
+        if (!multi->bodies[j]) {
+            multi->reply = wstrNew(WHEAT_REDIS_ERR);
+            break;
+        }
+    }
+    if (!multi->reply) {
+        multi->reply = buildMultiReply(multi);
+        if (!multi->reply)
+            multi->reply = wstrNew(WHEAT_REDIS_REPLY_ERR);
+    }
+
+    sliceTo(&reply, (uint8_t *)multi->reply, wstrlen(multi->reply));
+    sendClientData(multi->outer_conn, &reply);
+    finishConn(multi->outer_conn);
+}
+
+// The first reply of unit is kept
+static void multiUnitReply(struct redisUnit *unit, struct conn *reply)
+{
+    unit->multi->bodies[unit->multi_idx] = copyReply(reply);
+}
+
+static void multiUnitDone(struct redisUnit *unit)
+{
+    struct redisMulti *multi = unit->multi;
+
+    multi->units[unit->multi_idx] = NULL;
+    if (--multi->pending == 0)
+        sendMultiReply(multi);
+}
+
+static int handleClientRequests(struct conn *c)
+{
+    struct token *token;
+    struct redisUnit *unit;
+    struct slice key;
+    struct redisServer *server;
+    struct redisAppData *redis_data;
+    long cache_slot;
+    uint32_t cache_version;
+
+    if (getRedisMultiKey(c) != REDIS_MULTI_NONE)
+        return handleMultiKeyRequest(c);
+    if (redisCacheGet(c, &cache_slot, &cache_version) == WHEAT_OK)
+        return WHEAT_OK;
+
+    server = RedisServer;
+    getRedisKey(c, &key);
+    token = hashDispatch(server, &key);
+    unit = getRedisUnit();
+    unit->outer_conn = c;
+    unit->is_read = isReadCommand(c);
+    unit->cache_slot = cache_slot;
+    unit->cache_version = cache_version;
+    // Cached replies of key are dropped before write sent
+    if (!unit->is_read)
+        unit->cache_writes = redisCacheWrite(NULL, &key);
+    redis_data = c->app_private_data;
+    dispatchUnit(server, c, unit, token);
 
     // Check last to ensure at least one request is sent to redis server,
     // otherwise send error to client.
@@ -370,31 +1178,54 @@ static int handleRedisResponse(struct conn *c)
 {
     struct listNode *node;
     struct client *redis_client;
+    struct redisLink *link;
     struct redisInstance *instance;
     struct redisUnit *unit;
 
     redis_client = c->client;
-    instance = redis_client->client_data;
-    node = listFirst(instance->wait_units);
+    link = redis_client->client_data;
+    instance = link->instance;
+    node = listFirst(link->wait_units);
     ASSERT(node && listNodeValue(node));
     unit = listNodeValue(node);
+    removeListNode(link->wait_units, node);
+    if (instance == unit->hedge_instance) {
+        sampleLatency(instance, &unit->hedge_sent);
+        if (!unit->wait_free)
+            (*TotalHedgedReadWon)++;
+    } else {
+        sampleLatency(instance, &unit->sent);
+    }
 
     if (!unit->wait_free) {
         // Means response to client isn't sent
-        registerConnFree(unit->outer_conn, (void (*)(void*))finishConn, c);
-        unit->redis_conns[unit->pos++] = c;
-        if (unit->is_read)
-            sendOuterData(unit);
-        else if (unit->pos == unit->sended)
-            sendOuterData(unit);
+        unit->pos++;
+        if (unit->multi) {
+            if (unit->pos == 1)
+                multiUnitReply(unit, c);
+            finishConn(c);
+            if (unit->is_read || unit->pos == unit->sended)
+                sendOuterData(unit, NULL);
+        } else if (unit->is_read || unit->pos == unit->sended) {
+            if (unit->cache_slot != -1)
+                redisCachePut(unit->outer_conn, c, unit->cache_slot,
+                        unit->cache_version);
+            sendOuterData(unit, c);
+        } else {
+            // Other backups don't reply yet, reply conn isn't kept in case
+            // of its link closed
+            if (!unit->reply)
+                unit->reply = copyReply(c);
+            finishConn(c);
+        }
     } else {
         // Means response to client have been sent, now only to finishConn
         finishConn(c);
+        unit->pos++;
+        redisUnitFinal(unit);
     }
     if (instance->ntimeout)
         instance->ntimeout--;
-
-    removeListNode(instance->wait_units, node);
     return WHEAT_OK;
 }
 
@@ -418,13 +1249,22 @@ int redisCall(struct conn *c, void *arg)
 void redisAppDeinit()
 {
     int pos;
+    size_t i;
     struct redisInstance *instance;
+    struct redisLink *link;
     struct redisServer *server = RedisServer;
 
     for (pos = 0; pos < narray(server->instances); pos++) {
         instance = arrayIndex(server->instances, pos);
-        freeClient(instance->redis_client);
-        freeList(instance->wait_units);
+        for (i = 0; i < instance->nlink; i++) {
+            link = &instance->links[i];
+            if (link->live) {
+                setClientFreeNotify(link->redis_client, NULL);
+                freeClient(link->redis_client);
+            }
+            freeList(link->wait_units);
+        }
+        wfree(instance->links);
     }
 
     listEach(server->pending_conns, (void (*)(void*))finishConn);
@@ -435,6 +1275,7 @@ void redisAppDeinit()
         wfree(server->tokens);
     if (server->config_server)
         configServerDealloc(server->config_server);
+    deallocRedisCache();
     wfree(server);
 }
 
@@ -556,6 +1397,18 @@ int redisAppInit(struct protocol *ptocol)
     CurrentUnitCount = &getStatValByName("Current redis unit count");
     TotalUnitCount = &getStatValByName("Total redis unit count");
     TotalTimeoutResponse = &getStatValByName("Total timeout response");
+    TotalBackendFlush = &getStatValByName("Total redis backend flush");
+    TotalMultiKeyCommand = &getStatValByName("Total redis multi-key command");
+    CurrentLiveLink = &getStatValByName("Current redis live connection");
+    TotalLinkClosed = &getStatValByName("Total redis connection closed");
+    MaxLinkOutstanding = &getStatValByName("Max redis connection outstanding");
+    MaxInstanceLatency = &getStatValByName("Max redis instance latency");
+    TotalReadNotFirst = &getStatValByName("Total redis read not to first backup");
+    TotalHedgedRead = &getStatValByName("Total redis hedged read");
+    TotalHedgedReadWon = &getStatValByName("Total redis hedged read won");
+    if (initRedisCache() == WHEAT_WRONG)
+        return WHEAT_WRONG;
+    LastReport = Server.cron_time.tv_sec;
 
     p = wmalloc(sizeof(struct redisServer));
     RedisServer = server = (struct redisServer*)p;
@@ -564,8 +1417,16 @@ int redisAppInit(struct protocol *ptocol)
     server->instances = arrayCreate(sizeof(struct redisInstance), 10);
     server->config_server = NULL;
     server->live_instances = 0;
-    server->tokens = wmalloc(sizeof(struct token)*WHEAT_KEYSPACE);
-    server->ntoken = WHEAT_KEYSPACE;
+    server->nlink = getConfiguration("redis-connections")->target.val;
+    if (!server->nlink)
+        server->nlink = 1;
+    server->hedge_percentile = getConfiguration("hedge-percentile")->target.val;
+    server->hedge_budget = getConfiguration("hedge-budget")->target.val;
+    server->hedge_tokens = 0;
+    server->hedge_after_min = 0;
+    server->tokens = NULL;
+    server->ntoken = 0;
+    server->hash = NULL;
     server->is_serve = 0;
 
     config_source = getConfiguration("config-source");
@@ -603,17 +1464,28 @@ static void *redisAppDataInit(struct conn *c)
 
     data = wmalloc(sizeof(*data));
     data->unit = NULL;
+    data->multi = NULL;
     data->header = NULL;
+    data->lent = NULL;
+    data->link_idx = -1;
     return data;
 }
 
 static void redisAppDataDeinit(void *data)
 {
-    struct redisAppData *redis_data;
+    struct redisAppData *redis_data, *lent_data;
 
     redis_data = data;
+    if (redis_data->lent) {
+        lent_data = redis_data->lent->app_private_data;
+        lent_data->lent = NULL;
+        if (!isOuterClient(redis_data->lent->client))
+            finishConn(redis_data->lent);
+    }
     if (redis_data->unit)
         redis_data->unit->wait_free = 1;
+    if (redis_data->multi)
+        redisMultiDealloc(redis_data->multi);
     if (redis_data->header)
         wstrFree(redis_data->header);
     wfree(redis_data);
@@ -634,14 +1506,14 @@ static void handleTimeout(struct redisUnit *unit)
     size_t i;
 
     server = RedisServer;
-    isreadcommand = isReadCommand(unit->outer_conn);
+    isreadcommand = unit->is_read;
 
     if (isreadcommand) {
         // Read command means we only send request to *one* redis server.
         // Now we should choose next server which keep this key to retry
         // this unit request.
-        instance = getInstance(server, unit->first_token->instance_id,
-                isreadcommand);
+        // Instance may be disconnected after request sent
+        instance = arrayIndex(server->instances, unit->first_token->instance_id);
         wheatLog(WHEAT_NOTICE, "Instance %s:%d timeout response, try another",
                 instance->ip, instance->port);
         instance->ntimeout++;
@@ -683,7 +1555,7 @@ static void handleTimeout(struct redisUnit *unit)
                     instance->ip, instance->port);
         }
         if (unit->pos > 0) {
-            sendOuterData(unit);
+            sendOuterData(unit, NULL);
         } else {
             wheatLog(WHEAT_NOTICE,
                     "Write command failed, none instance response data");
@@ -692,17 +1564,156 @@ static void handleTimeout(struct redisUnit *unit)
     }
 }
 
+// Hedge is sent after requests pipelined behind it by client, it can't
+// read the value they write. Any command not read, including MULTI and
+// ones already replied, is taken as write.
+static int isWriteBehind(struct conn *outer_conn)
+{
+    struct listNode *node;
+    struct conn *c;
+
+    for (node = listLast(outer_conn->client->conns); node; node = node->prev) {
+        c = listNodeValue(node);
+        if (c == outer_conn)
+            break;
+        if (!isReadCommand(c))
+            return 1;
+    }
+    return 0;
+}
+
+// Send read to the least loaded backup it isn't sent to, the late reply
+// is dropped as `wait_free` unit. Return WHEAT_WRONG if other backups are
+// all stalled now, it's tried again later.
+static int hedgeUnit(struct redisServer *server, struct redisUnit *unit,
+        long now_micro)
+{
+    struct redisInstance *instance, *best;
+    struct token *token;
+    struct timeval sent;
+    int i, nstalled;
+
+    if (isWriteBehind(unit->outer_conn)) {
+        unit->hedged = 1;
+        return WHEAT_OK;
+    }
+    best = NULL;
+    nstalled = 0;
+    token = unit->first_token;
+    for (i = 0; i < server->nbackup; i++) {
+        instance = getInstance(server, token->instance_id, unit->is_read);
+        token = &server->tokens[token->next_instance];
+        if (!instance || instance->is_dirty ||
+                instance == unit->sended_instances[0])
+            continue;
+        // Hedge sent to instance stalled would wait too
+        if (instance->hedge_after &&
+                instanceWaited(instance, now_micro) > instance->hedge_after) {
+            nstalled++;
+            continue;
+        }
+        if (!best || instanceCost(instance, now_micro) <
+                instanceCost(best, now_micro))
+            best = instance;
+    }
+    if (!best && nstalled)
+        return WHEAT_WRONG;
+    unit->hedged = 1;
+    if (!best)
+        return WHEAT_OK;
+
+    sent = unit->sent;
+    if (sendRedisData(unit->outer_conn, best, unit) == WHEAT_WRONG)
+        return WHEAT_OK;
+    unit->hedge_instance = best;
+    unit->hedge_sent = unit->sent;
+    unit->sent = sent;
+    server->hedge_tokens -= 100;
+    (*TotalHedgedRead)++;
+    return WHEAT_OK;
+}
+
+// Units are appended to `message_center` when created, so it stops at the
+// unit younger than `hedge_after` of all instances. Return microseconds
+// until the next unit may be hedged, -1 if none.
+static long hedgeUnits(struct redisServer *server)
+{
+    struct listNode *node;
+    struct redisUnit *unit;
+    struct redisInstance *instance;
+    struct timeval now;
+    long now_micro, wait, next;
+
+    gettimeofday(&now, NULL);
+    now_micro = getMicroseconds(now);
+    next = -1;
+    for (node = listFirst(server->message_center); node; node = node->next) {
+        if (server->hedge_tokens < 100)
+            break;
+        unit = listNodeValue(node);
+        wait = server->hedge_after_min - (now_micro - getMicroseconds(unit->start));
+        if (wait > 0) {
+            if (next == -1 || wait < next)
+                next = wait;
+            break;
+        }
+        if (!unit->is_read || unit->wait_free || unit->hedged ||
+                unit->sended != 1 || unit->pos)
+            continue;
+        instance = unit->sended_instances[0];
+        if (!instance->hedge_after)
+            continue;
+        wait = instance->hedge_after - (now_micro - getMicroseconds(unit->sent));
+        if (wait > 0) {
+            if (next == -1 || wait < next)
+                next = wait;
+            continue;
+        }
+        if (hedgeUnit(server, unit, now_micro) == WHEAT_WRONG &&
+                (next == -1 || server->hedge_after_min < next))
+            next = server->hedge_after_min;
+    }
+    return next;
+}
+
+static void reportInstances(struct redisServer *server)
+{
+    struct redisInstance *instance;
+    struct redisLink *link;
+    size_t i, j;
+
+    for (i = 0; i < narray(server->instances); i++) {
+        instance = arrayIndex(server->instances, i);
+        wheatLog(WHEAT_VERBOSE, "redis %s:%d latency: %ldus hedge after: %ldus "
+                "outstanding: %zu reads: %lld%s", instance->ip, instance->port,
+                instance->latency, instance->hedge_after,
+                instanceOutstanding(instance), instance->nread,
+                instance->is_dirty ? " dirty" : "");
+        for (j = 0; j < instance->nlink; j++) {
+            link = &instance->links[j];
+            wheatLog(WHEAT_VERBOSE, "redis %s:%d #%zu requests: %lld "
+                    "outstanding: %ld max outstanding: %ld closed: %lld%s",
+                    instance->ip, instance->port, link->idx, link->nrequest,
+                    listLength(link->wait_units), link->max_outstanding,
+                    link->nclosed, link->live ? "" : " down");
+        }
+    }
+}
+
 void redisAppCron()
 {
     struct redisServer *server;
     struct redisInstance *instance;
-    size_t i;
+    struct redisLink *link;
+    size_t i, j;
+    int was_live;
     struct listNode *node;
     struct redisUnit *unit;
     struct listIterator *iter;
     long length;
     long now_micro;
     long micro_seconds;
+    long hedge_after_min;
 
     server = RedisServer;
     length = listLength(server->message_center);
@@ -722,23 +1733,51 @@ void redisAppCron()
         return ;
     }
 
+    *CurrentLiveLink = 0;
+    hedge_after_min = 0;
     for (i = 0; i < narray(server->instances); i++) {
         instance = arrayIndex(server->instances, i);
-        // refresh client avoid being closed because timeout
-        if (!instance->live) {
-            if (wakeupInstance(instance) == WHEAT_WRONG)
-                continue;
+        was_live = instance->live;
+        for (j = 0; j < instance->nlink; j++) {
+            link = &instance->links[j];
+            // refresh client avoid being closed because timeout
+            if (link->live)
+                refreshClient(link->redis_client);
+            else
+                wakeupLink(link);
+        }
+        *CurrentLiveLink += instance->live_links;
+        if (!instance->live)
+            continue;
+        if (!was_live) {
             server->live_instances++;
             wheatLog(WHEAT_WARNING, "missed redis server connectd: %s:%d, lived: %d",
                     instance->ip, instance->port, RedisServer->live_instances);
-        } else {
-            refreshClient(instance->redis_client);
+        }
+        if (Server.cron_time.tv_sec - instance->latency_time >=
+                WHEAT_REDIS_LATENCY_DECAY) {
+            instance->latency /= 2;
+            instance->latency_time = Server.cron_time.tv_sec;
+        }
+        if (instance->latency > *MaxInstanceLatency)
+            *MaxInstanceLatency = instance->latency;
+        if (server->hedge_percentile &&
+                Server.cron_time.tv_sec != LastHedgeUpdate) {
+            updateHedgeAfter(instance, server->hedge_percentile);
+            if (instance->hedge_after && (!hedge_after_min ||
+                        instance->hedge_after < hedge_after_min))
+                hedge_after_min = instance->hedge_after;
         }
         if (!instance->ntimeout)
             instance->timeout_duration = 0;
         if (instance->timeout_duration > WHEAT_REDIS_TIMEOUT_DIRTY)
             instance->is_dirty = 1;
     }
+    if (server->hedge_percentile &&
+            Server.cron_time.tv_sec != LastHedgeUpdate) {
+        LastHedgeUpdate = Server.cron_time.tv_sec;
+        server->hedge_after_min = hedge_after_min;
+    }
 
     i = WHEAT_REDIS_UNIT_MIN > length ? WHEAT_REDIS_UNIT_MIN : length;
     iter = listGetIterator(server->message_center, START_HEAD);
@@ -752,7 +1791,7 @@ void redisAppCron()
         if (now_micro - micro_seconds > server->timeout) {
             wheatLog(WHEAT_NOTICE, "wait redis response timeout");
             handleTimeout(unit);
-            TotalTimeoutResponse++;
+            (*TotalTimeoutResponse)++;
         } else {
             break;
         }
@@ -766,4 +1805,21 @@ void redisAppCron()
                 (void (*)(void*, void*))redisCall, NULL);
         listClear(server->pending_conns);
     }
+
+    // Hedge may be due before the next loop when clients are all waiting
+    if (server->hedge_after_min) {
+        micro_seconds = hedgeUnits(server);
+        if (micro_seconds != -1)
+            wakeupWorkerIn(micro_seconds / 1000 + 1);
+    }
+
+    // App cron is called each loop after events handled, so requests
+    // queued by this loop are flushed here
+    flushInstances(server);
+
+    if (Server.cron_time.tv_sec - LastReport >= WHEAT_REDIS_REPORT_INTERVAL) {
+        LastReport = Server.cron_time.tv_sec;
+        reportInstances(server);
+        reportRedisCache();
+    }
 }
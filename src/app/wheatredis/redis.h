@@ -9,9 +9,15 @@
 
 #include "../application.h"
 #include "../../protocol/redis/proto_redis.h"
+#include "hash.h"
 
+// WHEAT_KEYSPACE is default `keyspace`, config server without "keyspace"
+// field is saved by former version which only supports it
 #define WHEAT_KEYSPACE                1024
+#define WHEAT_KEYSPACE_MAX            65536
 #define WHEAT_SERVE_WAIT_MILLISECONDS 100
+// Latency histogram buckets, four per power of two microseconds up to 16s
+#define WHEAT_REDIS_LATENCY_BUCKETS   96
 
 #define DIRTY    1
 #define NONDIRTY 0
@@ -44,24 +50,57 @@ struct redisServer {
     // server in config, we will append connection to pending_conns.
     struct list *pending_conns;
     struct array *instances;
+    // `redis-connections`, the amount of links to each instance
+    size_t nlink;
+    // Read waiting reply longer than `hedge-percentile` latency of instance
+    // is sent to another backup too. `hedge_tokens` is in 1/100 hedge,
+    // each read adds `hedge-budget` of them.
+    int hedge_percentile;
+    int hedge_budget;
+    long hedge_tokens;
+    long hedge_after_min;
     struct token *tokens;
-    // Now must be WHEAT_KEYSPACE
+    // `ntoken` is `keyspace`, key is dispatched to the token numbered
+    // hash(key) % ntoken. Both are saved to config server, changing
+    // either of them moves keys to other instances.
     size_t ntoken;
+    hashFunc hash;
     int is_serve;
 };
 
+struct redisInstance;
+
+// One of `redis-connections` connections to redis instance. Units sent by
+// it are appended to `wait_units`, replies come back in the same order.
+struct redisLink {
+    struct redisInstance *instance;
+    size_t idx;
+    struct client *redis_client;
+    struct list *wait_units;
+    // Statistic of this connection, reported by redisAppCron
+    long long nrequest;
+    long long nclosed;
+    long max_outstanding;
+    unsigned live:1;
+};
+
 struct redisInstance {
     // Unique identification ID, we use this id to track data owner
     size_t id;
     wstr ip;
     int port;
 
-    struct list *wait_units;
     size_t ntoken;
 
+    // Request is sent by the live link with least units waiting reply, a
+    // broken link is reconnected by redisAppCron alone. Instance is down
+    // only when all links failed.
+    struct redisLink *links;
+    size_t nlink;
+    size_t live_links;
+
     // Below fields all about the connection between redis and client,
     // it will lose effect when connection failed.
-    struct client *redis_client;
     time_t timeout_duration;
     // means the amount of timeout response under this instance
     int ntimeout;
@@ -70,6 +109,17 @@ struct redisInstance {
     // different select max reliability instance from responses.
     // `reliability` is affected by timeout, lose connection times
     int reliability;
+    // EWMA of response latency(microseconds) and the time it's updated.
+    // Read command is sent to the backup whose latency * (outstanding+1)
+    // is less, latency of idle instance decays so it's tried again.
+    long latency;
+    time_t latency_time;
+    long long nread;
+    // Recent latency distribution, halved when it's too many samples.
+    // `hedge_after` is latency percentile of it, 0 if samples not enough
+    uint32_t latency_hist[WHEAT_REDIS_LATENCY_BUCKETS];
+    uint32_t latency_nsample;
+    long hedge_after;
     unsigned live:1;
     // When a instance keep timeout_duration larger than threshold value,
     // this instance is marked as `dirty`. Only when `instance->ntimeout`
@@ -92,4 +142,14 @@ int configFromFile(struct redisServer *server);
 int handleConfig(struct redisServer *server, struct conn *c);
 int isStartServe(struct redisServer *server);
 
+// Hot key read cache(redis_cache.c)
+int initRedisCache();
+void deallocRedisCache();
+int redisCacheGet(struct conn *c, long *slot, uint32_t *version);
+void redisCachePut(struct conn *c, struct conn *reply, long slot,
+        uint32_t version);
+struct array *redisCacheWrite(struct array *slots, struct slice *key);
+void redisCacheWriteDone(struct array *slots);
+void reportRedisCache();
+
 #endif
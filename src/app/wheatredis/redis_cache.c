@@ -0,0 +1,496 @@
+// Hot key read cache of WheatRedis
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "redis.h"
+
+// Replies of single key read commands listed in `redis-cache-commands` are
+// kept per key, so requests to hot keys are replied by proxy without going
+// to backends. Reply expires `redis-cache-ttl` milliseconds after it's
+// filled, and all replies of a key are dropped when write to the key is
+// dispatched. Each worker keeps at most `redis-cache-size` bytes, keys are
+// evicted by `redis-cache-policy`:
+// LRU: the least recently hit key
+// LFU: the least hit one of the WHEAT_REDIS_CACHE_LFU_SAMPLE least
+// recently hit keys, hit counters are halved every report
+//
+// Read sent before a write may be replied after it with the old value.
+// Keys are hashed to WHEAT_REDIS_CACHE_SLOTS slots, `versions` of slot is
+// increased when write to its key dispatched and `writing` counts writes
+// not done yet. Reply is only cached if no write of its slot is waiting and
+// the slot version is the same as when read was sent.
+//
+// Cache is per worker, writes sent by other workers or not through proxy
+// aren't seen and only bounded by `redis-cache-ttl`.
+#define WHEAT_REDIS_CACHE_SLOTS       4096
+#define WHEAT_REDIS_CACHE_KEY_REPLIES 8     // Different requests kept per key
+#define WHEAT_REDIS_CACHE_LFU_SAMPLE  5
+#define WHEAT_REDIS_CACHE_MAX_REPLY   16    // Reply larger than size/16 isn't kept
+
+#define WHEAT_REDIS_CACHE_LRU         0
+#define WHEAT_REDIS_CACHE_LFU         1
+
+// `reply` may be queued to outer conns after dropped, it's freed when
+// the last of them freed
+struct redisCacheReply {
+    wstr request;
+    wstr reply;
+    long long expire;
+    int refcount;
+};
+
+// `key` is the dict key and refers to `name`
+struct redisCacheKey {
+    struct slice key;
+    wstr name;
+    struct list *replies;
+    struct listNode *node;
+    size_t size;
+    long long freq;
+    long long nhit;
+};
+
+static struct redisCache {
+    struct dict *keys;
+    struct list *lru;
+    struct list *commands;
+    int policy;
+    long long ttl;
+    size_t size;
+    size_t used;
+    size_t nhot;
+    wstr request;
+    uint32_t versions[WHEAT_REDIS_CACHE_SLOTS];
+    uint32_t writing[WHEAT_REDIS_CACHE_SLOTS];
+    long long nhit;
+    long long nmiss;
+    long long *hits;
+    long long *misses;
+    long long *current_size;
+} RedisCache;
+
+static unsigned int cacheKeyHash(const void *key)
+{
+    const struct slice *s = key;
+    return dictGenHashFunction(s->data, (int)s->len);
+}
+
+static int cacheKeyCompare(const void *key1, const void *key2)
+{
+    const struct slice *s1 = key1, *s2 = key2;
+    return s1->len == s2->len && !memcmp(s1->data, s2->data, s1->len);
+}
+
+// Entries own their keys
+static struct dictType RedisCacheDictType = {
+    cacheKeyHash,               /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    cacheKeyCompare,            /* key compare */
+    NULL,                       /* key destructor */
+    NULL,                       /* val destructor */
+};
+
+static long long nowMilliseconds()
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return getMicroseconds(now) / 1000;
+}
+
+static size_t keySlot(struct slice *key)
+{
+    return dictGenHashFunction(key->data, (int)key->len) &
+        (WHEAT_REDIS_CACHE_SLOTS - 1);
+}
+
+static size_t replySize(struct redisCacheReply *reply)
+{
+    return sizeof(*reply) + wstrlen(reply->request) + wstrlen(reply->reply);
+}
+
+static void releaseReply(void *data)
+{
+    struct redisCacheReply *reply = data;
+
+    if (--reply->refcount)
+        return ;
+    wstrFree(reply->request);
+    wstrFree(reply->reply);
+    wfree(reply);
+}
+
+static void dropReply(struct redisCacheKey *entry, struct listNode *node)
+{
+    struct redisCacheReply *reply = listNodeValue(node);
+
+    entry->size -= replySize(reply);
+    RedisCache.used -= replySize(reply);
+    removeListNode(entry->replies, node);
+    releaseReply(reply);
+}
+
+static void evictKey(struct redisCacheKey *entry)
+{
+    while (listFirst(entry->replies))
+        dropReply(entry, listFirst(entry->replies));
+    dictDelete(RedisCache.keys, &entry->key);
+    removeListNode(RedisCache.lru, entry->node);
+    RedisCache.used -= entry->size;
+    freeList(entry->replies);
+    wstrFree(entry->name);
+    wfree(entry);
+    *RedisCache.current_size = RedisCache.used;
+}
+
+static struct redisCacheKey *evictVictim()
+{
+    struct listNode *node;
+    struct redisCacheKey *entry, *victim;
+    int i;
+
+    node = listFirst(RedisCache.lru);
+    victim = listNodeValue(node);
+    if (RedisCache.policy != WHEAT_REDIS_CACHE_LFU)
+        return victim;
+    for (i = 1, node = node->next; node && i < WHEAT_REDIS_CACHE_LFU_SAMPLE;
+            i++, node = node->next) {
+        entry = listNodeValue(node);
+        if (entry->freq < victim->freq)
+            victim = entry;
+    }
+    return victim;
+}
+
+static int isCachedCommand(struct conn *c)
+{
+    struct listNode *node;
+    struct slice command;
+    wstr name;
+
+    if (!isReadCommand(c))
+        return 0;
+    getRedisCommand(c, &command);
+    for (node = listFirst(RedisCache.commands); node; node = node->next) {
+        name = listNodeValue(node);
+        if (!wstrCmpNocaseChars(name, (char *)command.data, command.len))
+            return 1;
+    }
+    return 0;
+}
+
+// Whole request is the identity of reply, such as "HGET key field"
+static wstr renderRequest(struct conn *c)
+{
+    struct slice *next;
+    wstr request = RedisCache.request;
+
+    wstrClear(request);
+    redisBodyStart(c);
+    while ((next = redisBodyNext(c)) != NULL) {
+        request = wstrCatLen(request, (char *)next->data, next->len);
+        if (request == NULL)
+            return NULL;
+        RedisCache.request = request;
+    }
+    return request;
+}
+
+static struct listNode *findReply(struct redisCacheKey *entry, wstr request)
+{
+    struct listNode *node;
+    struct redisCacheReply *reply;
+
+    if (request == NULL)
+        return NULL;
+    for (node = listFirst(entry->replies); node; node = node->next) {
+        reply = listNodeValue(node);
+        if (!wstrCmp(reply->request, request))
+            return node;
+    }
+    return NULL;
+}
+
+// Reply request of `c` from cache. If not cached, `slot` is set to the
+// slot of key when reply of it can be cached, otherwise -1. `slot` and
+// `version` are passed to redisCachePut with reply.
+int redisCacheGet(struct conn *c, long *slot, uint32_t *version)
+{
+    struct redisCacheKey *entry;
+    struct redisCacheReply *reply;
+    struct listNode *node;
+    struct slice key, body;
+
+    *slot = -1;
+    if (!RedisCache.keys || !isCachedCommand(c))
+        return WHEAT_WRONG;
+    getRedisKey(c, &key);
+    *slot = keySlot(&key);
+    *version = RedisCache.versions[*slot];
+    entry = dictFetchValue(RedisCache.keys, &key);
+    node = entry ? findReply(entry, renderRequest(c)) : NULL;
+    if (node) {
+        reply = listNodeValue(node);
+        if (reply->expire <= nowMilliseconds()) {
+            dropReply(entry, node);
+            if (!listLength(entry->replies))
+                evictKey(entry);
+            node = NULL;
+        }
+    }
+    if (!node) {
+        RedisCache.nmiss++;
+        (*RedisCache.misses)++;
+        return WHEAT_WRONG;
+    }
+
+    RedisCache.nhit++;
+    (*RedisCache.hits)++;
+    entry->freq++;
+    entry->nhit++;
+    removeListNode(RedisCache.lru, entry->node);
+    entry->node = appendToListTail(RedisCache.lru, entry);
+    reply->refcount++;
+    registerConnFree(c, releaseReply, reply);
+    sliceTo(&body, (uint8_t *)reply->reply, wstrlen(reply->reply));
+    sendClientData(c, &body);
+    finishConn(c);
+    return WHEAT_OK;
+}
+
+static struct redisCacheKey *createKey(struct slice *key)
+{
+    struct redisCacheKey *entry;
+
+    if ((entry = wmalloc(sizeof(*entry))) == NULL)
+        return NULL;
+    entry->name = wstrNewLen((char *)key->data, (int)key->len);
+    entry->replies = createList();
+    if (entry->name == NULL || entry->replies == NULL)
+        goto cleanup;
+    sliceTo(&entry->key, (uint8_t *)entry->name, key->len);
+    entry->size = sizeof(*entry) + key->len;
+    entry->freq = entry->nhit = 0;
+    if (dictAdd(RedisCache.keys, &entry->key, entry) == DICT_WRONG)
+        goto cleanup;
+    if ((entry->node = appendToListTail(RedisCache.lru, entry)) == NULL) {
+        dictDelete(RedisCache.keys, &entry->key);
+        goto cleanup;
+    }
+    RedisCache.used += entry->size;
+    return entry;
+
+cleanup:
+    if (entry->replies)
+        freeList(entry->replies);
+    wstrFree(entry->name);
+    wfree(entry);
+    return NULL;
+}
+
+// Keep `reply` of read request `c` unless a write to its slot is
+// dispatched after the read sent
+void redisCachePut(struct conn *c, struct conn *reply, long slot,
+        uint32_t version)
+{
+    struct redisCacheKey *entry;
+    struct redisCacheReply *cached;
+    struct listNode *node;
+    struct slice key, *next;
+    wstr request;
+    size_t len;
+
+    if (slot == -1 || !RedisCache.keys || RedisCache.writing[slot] ||
+            RedisCache.versions[slot] != version)
+        return ;
+    len = 0;
+    redisBodyStart(reply);
+    while ((next = redisBodyNext(reply)) != NULL)
+        len += next->len;
+    if (!len || len > RedisCache.size / WHEAT_REDIS_CACHE_MAX_REPLY)
+        return ;
+
+    if ((cached = wmalloc(sizeof(*cached))) == NULL)
+        return ;
+    cached->refcount = 1;
+    request = renderRequest(c);
+    cached->request = request ? wstrDup(request) : NULL;
+    cached->reply = wstrNewLen(NULL, (int)len);
+    if (cached->request == NULL || cached->reply == NULL) {
+        releaseReply(cached);
+        return ;
+    }
+    redisBodyStart(reply);
+    while ((next = redisBodyNext(reply)) != NULL)
+        cached->reply = wstrCatLen(cached->reply, (char *)next->data, next->len);
+    // Error may be transient, such as loading or OOM
+    if (cached->reply[0] == '-') {
+        releaseReply(cached);
+        return ;
+    }
+    cached->expire = nowMilliseconds() + RedisCache.ttl;
+
+    getRedisKey(c, &key);
+    entry = dictFetchValue(RedisCache.keys, &key);
+    if (!entry && (entry = createKey(&key)) == NULL) {
+        releaseReply(cached);
+        return ;
+    }
+    node = findReply(entry, cached->request);
+    if (node)
+        dropReply(entry, node);
+    else if (listLength(entry->replies) >= WHEAT_REDIS_CACHE_KEY_REPLIES)
+        dropReply(entry, listFirst(entry->replies));
+    if (appendToListTail(entry->replies, cached) == NULL) {
+        releaseReply(cached);
+        if (!listLength(entry->replies))
+            evictKey(entry);
+        return ;
+    }
+    entry->size += replySize(cached);
+    RedisCache.used += replySize(cached);
+    while (RedisCache.used > RedisCache.size)
+        evictKey(evictVictim());
+    *RedisCache.current_size = RedisCache.used;
+}
+
+// Called when write to `key` is dispatched, replies of key are dropped at
+// once. Slot of key is appended to `slots` which is created if NULL, and
+// it's passed to redisCacheWriteDone when write done. Return NULL if
+// cache disabled.
+struct array *redisCacheWrite(struct array *slots, struct slice *key)
+{
+    struct redisCacheKey *entry;
+    size_t slot;
+
+    if (!RedisCache.keys)
+        return NULL;
+    slot = keySlot(key);
+    RedisCache.versions[slot]++;
+    RedisCache.writing[slot]++;
+    entry = dictFetchValue(RedisCache.keys, key);
+    if (entry)
+        evictKey(entry);
+    if (!slots)
+        slots = arrayCreate(sizeof(size_t), 1);
+    arrayPush(slots, &slot);
+    return slots;
+}
+
+void redisCacheWriteDone(struct array *slots)
+{
+    size_t i, slot;
+
+    if (!slots)
+        return ;
+    for (i = 0; i < narray(slots); i++) {
+        slot = *(size_t *)arrayIndex(slots, i);
+        RedisCache.writing[slot]--;
+    }
+    arrayDealloc(slots);
+}
+
+// Log hit rate and the most hit keys since last report, LFU counters are
+// halved so keys not hit recently can be evicted
+void reportRedisCache()
+{
+    struct dictIterator *iter;
+    struct dictEntry *de;
+    struct redisCacheKey *entry, **hot;
+    size_t nhot, i;
+    long long total;
+
+    if (!RedisCache.keys)
+        return ;
+    total = RedisCache.nhit + RedisCache.nmiss;
+    wheatLog(WHEAT_VERBOSE, "redis cache hit: %lld miss: %lld hit rate: %.2f%% "
+            "keys: %lu used: %zu", RedisCache.nhit, RedisCache.nmiss,
+            total ? RedisCache.nhit * 100.0 / total : 0.0,
+            dictSize(RedisCache.keys), RedisCache.used);
+
+    hot = wmalloc(sizeof(*hot) * (RedisCache.nhot + 1));
+    nhot = 0;
+    iter = dictGetIterator(RedisCache.keys);
+    while ((de = dictNext(iter)) != NULL) {
+        entry = dictGetVal(de);
+        if (entry->nhit) {
+            // Insert into `hot` ordered by hits, the last one dropped
+            for (i = nhot; i > 0 && hot[i-1]->nhit < entry->nhit; i--)
+                hot[i] = hot[i-1];
+            hot[i] = entry;
+            if (nhot < RedisCache.nhot)
+                nhot++;
+        }
+    }
+    dictReleaseIterator(iter);
+    for (i = 0; i < nhot; i++) {
+        wheatLog(WHEAT_VERBOSE, "redis cache hot key #%zu %s hit: %lld",
+                i+1, hot[i]->name, hot[i]->nhit);
+    }
+    wfree(hot);
+
+    iter = dictGetIterator(RedisCache.keys);
+    while ((de = dictNext(iter)) != NULL) {
+        entry = dictGetVal(de);
+        entry->nhit = 0;
+        entry->freq /= 2;
+    }
+    dictReleaseIterator(iter);
+    RedisCache.nhit = RedisCache.nmiss = 0;
+}
+
+int initRedisCache()
+{
+    struct configuration *conf;
+    wstr commands, *argvs;
+    int args, i;
+
+    memset(&RedisCache, 0, sizeof(RedisCache));
+    RedisCache.size = getConfiguration("redis-cache-size")->target.val;
+    RedisCache.ttl = getConfiguration("redis-cache-ttl")->target.val;
+    RedisCache.nhot = getConfiguration("redis-cache-hot-keys")->target.val;
+    RedisCache.policy = getConfiguration("redis-cache-policy")->target.enum_ptr->id;
+    if (!RedisCache.size || !RedisCache.ttl)
+        return WHEAT_OK;
+
+    RedisCache.hits = &getStatValByName("Total redis cache hit");
+    RedisCache.misses = &getStatValByName("Total redis cache miss");
+    RedisCache.current_size = &getStatValByName("Current redis cache size");
+    RedisCache.commands = createList();
+    listSetFree(RedisCache.commands, (void (*)(void *))wstrFree);
+    conf = getConfiguration("redis-cache-commands");
+    commands = wstrNew(conf->target.ptr ? conf->target.ptr : "get");
+    argvs = wstrNewSplit(commands, ",", 1, &args);
+    wstrFree(commands);
+    if (!argvs)
+        return WHEAT_WRONG;
+    for (i = 0; i < args; i++)
+        appendToListTail(RedisCache.commands, wstrNew(argvs[i]));
+    wstrFreeSplit(argvs, args);
+
+    RedisCache.request = wstrEmpty();
+    RedisCache.keys = dictCreate(&RedisCacheDictType);
+    RedisCache.lru = createList();
+    if (!RedisCache.keys || !RedisCache.lru)
+        return WHEAT_WRONG;
+    return WHEAT_OK;
+}
+
+void deallocRedisCache()
+{
+    if (RedisCache.lru) {
+        while (listFirst(RedisCache.lru))
+            evictKey(listNodeValue(listFirst(RedisCache.lru)));
+        freeList(RedisCache.lru);
+    }
+    if (RedisCache.keys)
+        dictRelease(RedisCache.keys);
+    if (RedisCache.commands)
+        freeList(RedisCache.commands);
+    if (RedisCache.request)
+        wstrFree(RedisCache.request);
+    memset(&RedisCache, 0, sizeof(RedisCache));
+}
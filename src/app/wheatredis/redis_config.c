@@ -13,6 +13,8 @@ enum configReadStatus {
     READ_SERVER_MAX_ID,
     READ_SERVER_NBACKUP,
     READ_SERVER_TIMEOUT,
+    READ_SERVER_KEYSPACE,
+    READ_SERVER_HASH,
     READ_SERVER_NINSTANCE,
     READ_INSTANCE_ID,
     READ_INSTANCE_IP,
@@ -95,7 +97,7 @@ static int fillConfigValidate(struct redisServer *server)
     for (i = 0; i < server->ntoken; ++i) {
         token = &server->tokens[i];
         if (token->pos >= server->ntoken ||
-                token->instance_id >= server->ntoken ||
+                token->instance_id >= narray(server->instances) ||
                 token->next_instance >= server->ntoken) {
 
             wheatLog(WHEAT_NOTICE,
@@ -113,10 +115,10 @@ static int fillConfigValidate(struct redisServer *server)
         count += instance->ntoken;
     }
 
-    if (count != WHEAT_KEYSPACE) {
+    if (count != server->ntoken) {
         wheatLog(WHEAT_NOTICE,
-                "fillConfigValidate failed: the count of instances %d != %d",
-                count, WHEAT_KEYSPACE);
+                "fillConfigValidate failed: the count of instances %d != %lu",
+                count, server->ntoken);
         return WHEAT_WRONG;
     }
 
@@ -216,6 +218,20 @@ static int saveConfigToServer(struct redisServer *server)
     if (ret == WHEAT_WRONG)
         goto failed;
 
+    field_len = snprintf(field, sizeof(field), "keyspace");
+    val_len = snprintf(val, sizeof(val), "%lu", server->ntoken);
+    ret = sendCommand(config_server, WHEAT_REDIS_HSET, WHEAT_REDIS_REDIS_SERVER,
+            WHEAT_REDIS_REDIS_SERVER_LEN, field, field_len, val, val_len);
+    if (ret == WHEAT_WRONG)
+        goto failed;
+
+    field_len = snprintf(field, sizeof(field), "hash");
+    val_len = snprintf(val, sizeof(val), "%s", getHashFunctionName(server->hash));
+    ret = sendCommand(config_server, WHEAT_REDIS_HSET, WHEAT_REDIS_REDIS_SERVER,
+            WHEAT_REDIS_REDIS_SERVER_LEN, field, field_len, val, val_len);
+    if (ret == WHEAT_WRONG)
+        goto failed;
+
     field_len = snprintf(field, sizeof(field), "ninstance");
     val_len = snprintf(val, sizeof(val), "%lu", narray(server->instances));
     ret = sendCommand(config_server, WHEAT_REDIS_HSET, WHEAT_REDIS_REDIS_SERVER,
@@ -313,6 +329,22 @@ int getServerFromRedis(struct redisServer *server)
                 goto failed;
             break;
 
+        case READ_SERVER_KEYSPACE:
+            field_len = snprintf(field, sizeof(field), "keyspace");
+            ret = sendCommand(config_server, WHEAT_REDIS_HGET, WHEAT_REDIS_REDIS_SERVER,
+                    WHEAT_REDIS_REDIS_SERVER_LEN, field, field_len, NULL, 0);
+            if (ret == WHEAT_WRONG)
+                goto failed;
+            break;
+
+        case READ_SERVER_HASH:
+            field_len = snprintf(field, sizeof(field), "hash");
+            ret = sendCommand(config_server, WHEAT_REDIS_HGET, WHEAT_REDIS_REDIS_SERVER,
+                    WHEAT_REDIS_REDIS_SERVER_LEN, field, field_len, NULL, 0);
+            if (ret == WHEAT_WRONG)
+                goto failed;
+            break;
+
         case READ_SERVER_NINSTANCE:
             field_len = snprintf(field, sizeof(field), "ninstance");
             ret = sendCommand(config_server, WHEAT_REDIS_HGET, WHEAT_REDIS_REDIS_SERVER,
@@ -380,6 +412,12 @@ static int getStrFrom(wstr body, wstr *out)
     return WHEAT_OK;
 }
 
+// Field not exists in config server
+static int isNilFrom(wstr body)
+{
+    return body[0] == '$' && body[1] == '-';
+}
+
 static int getValFrom(wstr body, size_t *out)
 {
     long long long_val;
@@ -408,6 +446,7 @@ int handleConfigRead(struct redisServer *server, struct conn *c, wstr body)
     struct redisInstance *pending_instance_p;
     struct configServer *config_server;
     struct token *token;
+    wstr hash_name;
     int ret;
 
     ret = WHEAT_WRONG;
@@ -435,6 +474,42 @@ int handleConfigRead(struct redisServer *server, struct conn *c, wstr body)
         case READ_SERVER_TIMEOUT:
             if (getValFrom(body, (size_t*)&server->timeout) == WHEAT_WRONG)
                 goto cleanup;
+            config_server->read_status = READ_SERVER_KEYSPACE;
+            if (getServerFromRedis(server) == WHEAT_WRONG)
+                goto cleanup;
+            break;
+
+        // Config saved by former version hasn't "keyspace" and "hash", it
+        // must be dispatched by WHEAT_KEYSPACE and Md5
+        case READ_SERVER_KEYSPACE:
+            if (isNilFrom(body))
+                server->ntoken = WHEAT_KEYSPACE;
+            else if (getValFrom(body, &server->ntoken) == WHEAT_WRONG)
+                goto cleanup;
+            if (!server->ntoken || server->ntoken > WHEAT_KEYSPACE_MAX)
+                goto cleanup;
+            if (server->tokens)
+                wfree(server->tokens);
+            server->tokens = wmalloc(sizeof(struct token)*server->ntoken);
+            config_server->read_status = READ_SERVER_HASH;
+            if (getServerFromRedis(server) == WHEAT_WRONG)
+                goto cleanup;
+            break;
+
+        case READ_SERVER_HASH:
+            if (isNilFrom(body)) {
+                server->hash = hashMd5;
+            } else {
+                hash_name = wstrEmpty();
+                if (getStrFrom(body, &hash_name) == WHEAT_WRONG) {
+                    wstrFree(hash_name);
+                    goto cleanup;
+                }
+                server->hash = getHashFunction(hash_name);
+                wstrFree(hash_name);
+                if (!server->hash)
+                    goto cleanup;
+            }
             config_server->read_status = READ_SERVER_NINSTANCE;
             if (getServerFromRedis(server) == WHEAT_WRONG)
                 goto cleanup;
@@ -552,6 +627,7 @@ int configFromFile(struct redisServer *server)
         return WHEAT_WRONG;
 
     iter = listGetIterator(conf->target.ptr, START_HEAD);
+    frags = NULL;
     count = 0;
     pos = 0;
     while ((node = listNext(iter)) != NULL) {
@@ -567,25 +643,43 @@ int configFromFile(struct redisServer *server)
         server->max_id = pos;
         pos++;
         wstrFreeSplit(frags, count);
+        frags = NULL;
     }
     freeListIterator(iter);
+    iter = NULL;
     server->live_instances = narray(server->instances);
 
-    if (!server->live_instances ||
-            server->live_instances < server->nbackup)
-        goto cleanup;
-
     conf = getConfiguration("backup-size");
     if (!conf)
         return WHEAT_WRONG;
     server->nbackup = conf->target.val;
 
+    if (!server->live_instances ||
+            server->live_instances < server->nbackup)
+        goto cleanup;
+
     conf = getConfiguration("redis-timeout");
     if (!conf)
         return WHEAT_WRONG;
     // `redis-timeout` is millisecond, we want microsecond
     server->timeout = conf->target.val * 1000;
 
+    // Each instance should own one token at least
+    conf = getConfiguration("keyspace");
+    if (!conf)
+        return WHEAT_WRONG;
+    server->ntoken = conf->target.val;
+    if (server->ntoken < server->live_instances) {
+        wheatLog(WHEAT_WARNING, "keyspace %lu is less than redis-servers %lu",
+                server->ntoken, server->live_instances);
+        return WHEAT_WRONG;
+    }
+
+    conf = getConfiguration("hash-function");
+    if (!conf)
+        return WHEAT_WRONG;
+    server->hash = getHashFunction(conf->target.enum_ptr->name);
+
     ret = hashInit(server);
     if (ret == WHEAT_WRONG)
         return WHEAT_WRONG;
@@ -4,6 +4,8 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
+#include <sys/stat.h>
+
 #include "../application.h"
 #include "app_wsgi.h"
 
@@ -12,6 +14,7 @@ int initWsgi(struct protocol *);
 void deallocWsgi();
 void *initWsgiAppData(struct conn *);
 void freeWsgiAppData(void *app_data);
+void wsgiCron();
 
 // WSGI Configuration
 static struct configuration WsgiConf[] = {
@@ -21,32 +24,157 @@ static struct configuration WsgiConf[] = {
         NULL,                   STRING_FORMAT},
     {"app-name",          2, stringValidator,      {.ptr=NULL},
         NULL,                   STRING_FORMAT},
+    {"wsgi-cache-size",   2, unsignedIntValidator, {.val=0},
+        NULL,                   INT_FORMAT},
+    {"wsgi-cache-ttl",    2, unsignedIntValidator, {.val=60},
+        NULL,                   INT_FORMAT},
+    {"wsgi-cache-vary",   2, stringValidator,      {.ptr=NULL},
+        NULL,                   STRING_FORMAT},
+    {"wsgi-threads",      2, unsignedIntValidator, {.val=0},
+        (void *)256,            INT_FORMAT},
+    {"wsgi-queue-depth",  2, unsignedIntValidator, {.val=1024},
+        NULL,                   INT_FORMAT},
+    {"wsgi-flush-size",   2, unsignedIntValidator, {.val=65536},
+        NULL,                   INT_FORMAT},
+    {"wsgi-buffer-size",  2, unsignedIntValidator, {.val=1024*1024},
+        NULL,                   INT_FORMAT},
+};
+
+static struct statItem WsgiStats[] = {
+    {"Total wsgi cache hit", SUM_STAT, RAW, 0, 0},
+    {"Total wsgi cache miss", SUM_STAT, RAW, 0, 0},
+    {"Total wsgi pooled request", SUM_STAT, RAW, 0, 0},
+    {"Total wsgi rejected request", SUM_STAT, RAW, 0, 0},
+    {"Total wsgi queue wait", SUM_STAT, MICORSECONDS_TIME, 0, 0},
+    {"Max wsgi queue wait(us)", MAX_STAT, RAW, 0, 0},
 };
 
 static struct app AppWsgi = {
-    "Http", NULL, wsgiCall, initWsgi, deallocWsgi,
+    "Http", wsgiCron, wsgiCall, initWsgi, deallocWsgi,
         initWsgiAppData, freeWsgiAppData, 0
 };
 
 struct moduleAttr AppWsgiAttr = {
-    "wsgi", APP, {.app=&AppWsgi}, NULL, 0, WsgiConf,
-    sizeof(WsgiConf)/sizeof(struct configuration),
+    "wsgi", APP, {.app=&AppWsgi},
+    WsgiStats, sizeof(WsgiStats)/sizeof(struct statItem),
+    WsgiConf, sizeof(WsgiConf)/sizeof(struct configuration),
     NULL, 0
 };
 
 static PyObject *pApp = NULL;
 static PyObject *WsgiStderr = NULL;
 static PyObject *DefaultEnv = NULL;
+static int WsgiThreads = 0;
+static size_t WsgiFlushSize = 0;
+
+// Environ keys and frequent values are interned once by initWsgi, so
+// building environ doesn't create and hash a string for each of them.
+// Request header with known id is mapped to its CGI name by `HeaderKeys`,
+// only names of other headers are converted per request.
+enum {
+    ENV_URL_SCHEME,
+    ENV_INPUT,
+    ENV_REQUEST_METHOD,
+    ENV_SERVER_PROTOCOL,
+    ENV_QUERY_STRING,
+    ENV_PATH_INFO,
+    ENV_SCRIPT_NAME,
+    ENV_REMOTE_ADDR,
+    ENV_REMOTE_PORT,
+    ENV_SERVER_NAME,
+    ENV_SERVER_PORT,
+    ENV_KEY_COUNT
+};
+
+static const char *EnvKeyNames[ENV_KEY_COUNT] = {
+    "wsgi.url_scheme", "wsgi.input", "REQUEST_METHOD", "SERVER_PROTOCOL",
+    "QUERY_STRING", "PATH_INFO", "SCRIPT_NAME", "REMOTE_ADDR", "REMOTE_PORT",
+    "SERVER_NAME", "SERVER_PORT"
+};
+
+static const char *EnvValueNames[] = {
+    "", "GET", "POST", "HEAD", "PUT", "DELETE", "OPTIONS", "PATCH",
+    "HTTP/1.0", "HTTP/1.1", "HTTP/2.0", "http", "https", "80", "443"
+};
+
+#define ENV_VALUE_COUNT (int)(sizeof(EnvValueNames)/sizeof(char *))
+
+static PyObject *EnvKeys[ENV_KEY_COUNT];
+static PyObject *EnvValues[ENV_VALUE_COUNT];
+static PyObject *HeaderKeys[HTTP_HEADER_COUNT];
 
 static int wsgiSendResponse(struct conn *c, PyObject *result);
 
-int wsgiCall(struct conn *c, void *arg)
+// Wrapped file no larger than this is read into response body, so it's
+// written with headers and closed at once
+#define WSGI_FILE_BUFFERED_MAX  (16*1024)
+
+// Request handled by thread pool, whose I/O is left to worker
+#define isPooled(data)      ((data)->shadow != NULL)
+
+// Headers of pooled request are sent after app returned, app has started
+// response once it gives body
+static int isResponseStarted(struct conn *c)
+{
+    struct wsgiData *data = c->app_private_data;
+
+    return isPooled(data) ? data->started : ishttpHeaderSended(c);
+}
+
+// Client expecting "100 Continue" is answered before app is called
+static void sendContinue(struct conn *c)
+{
+    struct array *headers = httpGetReqHeaders(c);
+    struct httpHeader *header;
+    size_t i;
+
+    for (i = 0; i < narray(headers); i++) {
+        header = arrayIndex(headers, i);
+        if (header->id == HTTP_HEADER_EXPECT && header->value.len == 12 &&
+                !strncasecmp((const char *)header->value.data, "100-continue", 12)) {
+            httpSendContinue(c);
+            return ;
+        }
+    }
+}
+
+// Response is built with client corked, so headers and body items are
+// queued as slices referring to item buffers, kept alive by `body_items`,
+// and written together by writev once `wsgi-flush-size` bytes are queued
+// or response ends. 0 writes each item as app gives it.
+static int corkResponse(struct conn *c)
+{
+    if (!WsgiFlushSize)
+        return 1;
+    return corkClient(c->client);
+}
+
+static int sendBodyItem(struct conn *c, const char *data, size_t len,
+        size_t *queued)
+{
+    if (httpSendBody(c, data, len))
+        return -1;
+    *queued += len;
+    if (!WsgiFlushSize || *queued < WsgiFlushSize)
+        return 0;
+    *queued = 0;
+    if (flushClient(c) == WHEAT_WRONG)
+        return -1;
+    return 0;
+}
+
+// Call application and handle its response. Pooled request is run by
+// pool thread with the GIL, response is only collected in `data`.
+static void callApp(struct conn *c)
 {
     /* Create Request object, passing it the context as a CObject */
-    int is_ok = 1;
     PyObject *start_resp, *result, *args, *env;
     struct response *req_obj = NULL;
-    PyObject *res = PyCObject_FromVoidPtr(c, NULL);
+    struct wsgiData *data = c->app_private_data;
+    PyObject *res;
+    int ret, corked = 0;
+
+    res = PyCObject_FromVoidPtr(c, NULL);
     if (res == NULL)
         goto out;
 
@@ -81,55 +209,259 @@ int wsgiCall(struct conn *c, void *arg)
     Py_DECREF(args);
     if (result != NULL) {
         /* Handle the application response */
-        wsgiSendResponse(c, result); /* ignore return */
-        wsgiCallClose(result);
+        if (!isPooled(data))
+            corked = corkResponse(c);
+        ret = wsgiSendResponse(c, result);
+        if (isPooled(data)) {
+            data->failed = ret || PyErr_Occurred();
+        } else if (!ret && !PyErr_Occurred()) {
+            httpSendBodyEnd(c);
+            if (data->err == NULL)
+                wsgiCacheStore(c, data);
+        }
+        if (!isPooled(data) && uncorkClient(c, corked) == WHEAT_WRONG)
+            setClientClose(c);
+        // File wrapper is closed after file sent
+        if (result != data->result)
+            wsgiCallClose(result);
+        Py_DECREF(result);
     }
 
 out:
     if (PyErr_Occurred()) {
         PyErr_Print();
 
-        /* Display HTTP 500 error, if possible */
-        if (req_obj == NULL || !ishttpHeaderSended(c))
+        /* Display HTTP 500 error, if possible. Otherwise body is truncated,
+         * close connection to let client know */
+        if (isPooled(data))
+            data->failed = 1;
+        else if (req_obj == NULL || !ishttpHeaderSended(c))
             sendResponse500(c);
-        is_ok = 0;
+        else
+            setClientClose(c);
     }
 
     if (req_obj != NULL) {
         /* Don't rely on cyclic GC. Clear circular references NOW. */
         Py_DECREF(req_obj);
     }
+}
+
+// Pool thread doesn't touch `c` or its client, which may be freed while app
+// is running. Request is detached from client buffer and app is given
+// `shadow` sharing request and response data of `c`.
+static int prepareJob(struct conn *c, struct wsgiData *data)
+{
+    if (httpDetachRequest(c) == WHEAT_WRONG)
+        return WHEAT_WRONG;
+    data->shadow = wmalloc(sizeof(struct conn));
+    data->remote_ip = wstrDup(getConnIP(c));
+    if (data->shadow == NULL || data->remote_ip == NULL)
+        return WHEAT_WRONG;
+    memset(data->shadow, 0, sizeof(struct conn));
+    data->shadow->protocol_data = c->protocol_data;
+    data->shadow->app = c->app;
+    data->shadow->app_private_data = data;
+    data->remote_port = getConnPort(c);
+    data->c = c;
+    return WHEAT_OK;
+}
+
+// Queue request to thread pool, caller replies 503 if it fails
+int wsgiSubmitJob(struct conn *c)
+{
+    struct wsgiData *data = c->app_private_data;
+
+    if (prepareJob(c, data) == WHEAT_WRONG ||
+            wsgiPoolSubmit(data) == WHEAT_WRONG) {
+        wfree(data->shadow);
+        data->shadow = NULL;
+        data->c = NULL;
+        wsgiCacheDrop(data);
+        return WHEAT_WRONG;
+    }
+    return WHEAT_OK;
+}
 
+int wsgiCall(struct conn *c, void *arg)
+{
+    struct wsgiData *data = c->app_private_data;
+
+    if (wsgiCacheLookup(c, data))
+        return WHEAT_OK;
+    sendContinue(c);
+    if (!WsgiThreads) {
+        callApp(c);
+        return WHEAT_OK;
+    }
+
+    if (wsgiSubmitJob(c) == WHEAT_WRONG) {
+        sendResponse503(c);
+        return WHEAT_OK;
+    }
+    httpDeferResponse(c);
     return WHEAT_OK;
 }
 
+void wsgiRunJob(struct wsgiData *data)
+{
+    callApp(data->shadow);
+}
+
+// Send body items handed by pool thread while app is running, headers go
+// with the first of them. Return -1 if client is broken.
+int wsgiSendItems(struct wsgiData *data, PyObject **items, size_t count)
+{
+    struct conn *c = data->c;
+    size_t queued = 0, i;
+    int ret, corked;
+
+    corked = corkResponse(c);
+    ret = ishttpHeaderSended(c) ? 0 : httpSendHeaders(c);
+    for (i = 0; !ret && i < count; i++)
+        ret = sendBodyItem(c, PyString_AS_STRING(items[i]),
+                PyString_GET_SIZE(items[i]), &queued);
+    if (uncorkClient(c, corked) == WHEAT_WRONG)
+        ret = -1;
+    if (ret)
+        setClientClose(c);
+    return ret;
+}
+
+// Send the rest of response collected by pool thread, `data` may be freed
+// once conn finished
+void wsgiFinishJob(struct wsgiData *data)
+{
+    struct conn *c = data->c;
+    struct client *client = c->client;
+    size_t queued = 0, i;
+    PyObject *item;
+    int ret, corked;
+
+    if (data->failed && !data->started) {
+        sendResponse500(c);
+    } else {
+        corked = corkResponse(c);
+        ret = ishttpHeaderSended(c) ? 0 : httpSendHeaders(c);
+        for (i = data->sent; !ret && i < narray(data->body_items); i++) {
+            item = *(PyObject **)arrayIndex(data->body_items, i);
+            ret = sendBodyItem(c, PyString_AS_STRING(item),
+                    PyString_GET_SIZE(item), &queued);
+        }
+        if (!ret && data->file_fd != -1)
+            ret = httpSendFile(c, data->file_fd, data->file_off,
+                    data->file_len);
+        if (ret || data->failed) {
+            setClientClose(c);
+        } else {
+            httpSendBodyEnd(c);
+            if (data->err == NULL)
+                wsgiCacheStore(c, data);
+        }
+        if (uncorkClient(c, corked) == WHEAT_WRONG)
+            setClientClose(c);
+    }
+    wsgiCacheCancel(data);
+    httpFinishResponse(c);
+    tryFreeClient(client);
+}
+
+void wsgiCron()
+{
+    if (WsgiThreads) {
+        wsgiPoolCron();
+        wsgiCacheCron();
+    }
+}
+
 void *initWsgiAppData(struct conn *c)
 {
     struct wsgiData *data = wmalloc(sizeof(struct wsgiData));
     if (data == NULL)
         return NULL;
-    data->environ = NULL;
-    data->response = NULL;
-    data->err = NULL;
+    memset(data, 0, sizeof(*data));
+    data->file_fd = -1;
+    data->job = WSGI_JOB_NONE;
     data->body_items = arrayCreate(sizeof(PyObject*), 4);
 
     return data;
 }
 
+// Python objects of pooled request are released by pool thread
 void freeWsgiAppData(void *data)
 {
     struct wsgiData *d = data;
+
+    wsgiCacheCancel(d);
+    if (isPooled(d))
+        wsgiPoolRelease(d);
+    else
+        wsgiReleaseData(d);
+}
+
+void wsgiReleaseData(struct wsgiData *d)
+{
     int i = 0;
     PyObject *tmp;
 
     for (; i < narray(d->body_items); ++i) {
-        tmp = arrayIndex(d->body_items, i);
+        tmp = *(PyObject **)arrayIndex(d->body_items, i);
         Py_XDECREF(tmp);
     }
     arrayDealloc(d->body_items);
+    if (d->result) {
+        wsgiCallClose(d->result);
+        Py_DECREF(d->result);
+    }
+    wsgiCacheDrop(d);
+    if (d->request)
+        freeHttpData(d->request);
+    wstrFree(d->remote_ip);
+    wfree(d->shadow);
     wfree(d);
 }
 
+static int initEnvironKeys()
+{
+    const char *name;
+    char buf[64];
+    int i, j;
+
+    for (i = 0; i < ENV_KEY_COUNT; i++)
+        if ((EnvKeys[i] = PyString_InternFromString(EnvKeyNames[i])) == NULL)
+            return WHEAT_WRONG;
+    for (i = 0; i < ENV_VALUE_COUNT; i++)
+        if ((EnvValues[i] = PyString_InternFromString(EnvValueNames[i])) == NULL)
+            return WHEAT_WRONG;
+    for (i = HTTP_HEADER_UNKNOWN + 1; i < HTTP_HEADER_COUNT; i++) {
+        name = getHttpHeaderName(i);
+        /* CONTENT_TYPE and CONTENT_LENGTH have no HTTP_ prefix */
+        j = 0;
+        if (i != HTTP_HEADER_CONTENT_TYPE && i != HTTP_HEADER_CONTENT_LENGTH) {
+            memcpy(buf, "HTTP_", 5);
+            j = 5;
+        }
+        for (; *name && j < sizeof(buf) - 1; name++, j++)
+            buf[j] = *name == '-' ? '_' : toupper(*name);
+        buf[j] = '\0';
+        if ((HeaderKeys[i] = PyString_InternFromString(buf)) == NULL)
+            return WHEAT_WRONG;
+    }
+    return WHEAT_OK;
+}
+
+static void deallocEnvironKeys()
+{
+    int i;
+
+    for (i = 0; i < ENV_KEY_COUNT; i++)
+        Py_CLEAR(EnvKeys[i]);
+    for (i = 0; i < ENV_VALUE_COUNT; i++)
+        Py_CLEAR(EnvValues[i]);
+    for (i = 0; i < HTTP_HEADER_COUNT; i++)
+        Py_CLEAR(HeaderKeys[i]);
+}
+
 static PyObject *defaultEnviron()
 {
     PyObject *val;
@@ -145,10 +477,12 @@ static PyObject *defaultEnviron()
     Py_DECREF(val);
     if (PyDict_SetItemString(env, "wsgi.multiprocess", Server.worker_number > 1 ? Py_True: Py_False) != 0)
         goto cleanup;
-    if (PyDict_SetItemString(env, "wsgi.multithread", Py_False) != 0)
+    if (PyDict_SetItemString(env, "wsgi.multithread", WsgiThreads ? Py_True: Py_False) != 0)
         goto cleanup;
     if (PyDict_SetItemString(env, "wsgi.run_once", Py_False) != 0)
         goto cleanup;
+    if (PyDict_SetItemString(env, "wsgi.file_wrapper", (PyObject *)&FileWrapper_Type) != 0)
+        goto cleanup;
 
     return env;
 cleanup:
@@ -206,8 +540,19 @@ int initWsgi(struct protocol *p)
     Py_DECREF(pName);
     Py_DECREF(pModule);
 
+    WsgiThreads = getConfiguration("wsgi-threads")->target.val;
+    WsgiFlushSize = getConfiguration("wsgi-flush-size")->target.val;
     DefaultEnv = defaultEnviron();
-    if (!DefaultEnv)
+    if (!DefaultEnv || initEnvironKeys() == WHEAT_WRONG)
+        goto err;
+
+    if (initWsgiCache() == WHEAT_WRONG)
+        goto err;
+
+    if (WsgiThreads && initWsgiPool(WsgiThreads,
+                getConfiguration("wsgi-queue-depth")->target.val,
+                WsgiFlushSize,
+                getConfiguration("wsgi-buffer-size")->target.val) == WHEAT_WRONG)
         goto err;
 
     return WHEAT_OK;
@@ -219,26 +564,47 @@ err:
 
 void deallocWsgi()
 {
+    if (WsgiThreads)
+        deallocWsgiPool();
     Py_DECREF(pApp);
     Py_DECREF(WsgiStderr);
     Py_DECREF(DefaultEnv);
+    deallocEnvironKeys();
+    deallocWsgiCache();
     Py_Finalize();
 }
 
-int envPutString(PyObject *dict, const void *key, const void *value)
+// `val` is taken, NULL means it failed to be created
+static int envSet(PyObject *environ, PyObject *key, PyObject *val)
 {
-    PyObject *val;
     int ret;
 
-    if ((val = PyString_FromString(value)) == NULL)
+    if (val == NULL)
         return -1;
-    ret = PyDict_SetItemString(dict, key, val);
+    ret = PyDict_SetItem(environ, key, val);
     Py_DECREF(val);
-    if (ret)
-        return -1;
-    return 0;
+    return ret;
+}
+
+// Interned string for frequent value such as method, otherwise new one
+static PyObject *envValue(const char *s, size_t len)
+{
+    PyObject *val;
+    int i;
+
+    for (i = 0; i < ENV_VALUE_COUNT; i++) {
+        val = EnvValues[i];
+        if (PyString_GET_SIZE(val) == len &&
+                !memcmp(PyString_AS_STRING(val), s, len)) {
+            Py_INCREF(val);
+            return val;
+        }
+    }
+    return PyString_FromStringAndSize(s, len);
 }
 
+#define envString(s)        envValue((s), strlen(s))
+
 /* Assumes c is a valid hex digit */
 static inline int toxdigit(int c)
 {
@@ -251,171 +617,162 @@ static inline int toxdigit(int c)
     return -1;
 }
 
-/* Unquote an escaped path */
-const char *wsgiUnquote(const char *s)
+/* Unquote an escaped path into a new string */
+static PyObject *envPath(const struct slice *path)
 {
-    size_t len = strlen(s);
-    char *result, *t;
+    const char *s = (const char *)path->data, *end = s + path->len;
+    PyObject *result;
+    char *t;
 
-    if ((result = wmalloc(len + 1)) == NULL)
+    if (memchr(s, '%', path->len) == NULL)
+        return PyString_FromStringAndSize(s, path->len);
+    if ((result = PyString_FromStringAndSize(NULL, path->len)) == NULL)
         return NULL;
 
-    t = result;
-    while (*s) {
-        if (*s == '%') {
-            if (s[1] && s[2] && isxdigit(s[1]) && isxdigit(s[2])) {
-                *(t++) = (toxdigit(s[1]) << 4) | toxdigit(s[2]);
-                s += 3;
-            }
-            else
-                *(t++) = *(s++);
-        }
-        else
+    t = PyString_AS_STRING(result);
+    while (s < end) {
+        if (*s == '%' && end - s > 2 && isxdigit(s[1]) && isxdigit(s[2])) {
+            *(t++) = (toxdigit(s[1]) << 4) | toxdigit(s[2]);
+            s += 3;
+        } else {
             *(t++) = *(s++);
+        }
     }
-    *t = '\0';
-
+    if (_PyString_Resize(&result, t - PyString_AS_STRING(result)))
+        return NULL;
     return result;
 }
 
-PyObject *createEnviron(struct conn *c)
+// Known header is looked up, others are converted like "HTTP_X_REAL_IP"
+static PyObject *headerKey(const struct httpHeader *header)
 {
-    const char *req_uri = NULL;
-    PyObject *environ;
-    char buf[256];
-    int result = 1;
-    wstr host = NULL, port = NULL, server = NULL;
-    PyObject *args, *input;
-    PyObject *c_obj = PyCObject_FromVoidPtr(c, NULL);
-
-    environ = PyDict_Copy(DefaultEnv);
-    if (environ == NULL) {
+    const char *name = (const char *)header->name.data;
+    PyObject *key;
+    char *p;
+    size_t i;
+
+    if (header->id != HTTP_HEADER_UNKNOWN) {
+        Py_INCREF(HeaderKeys[header->id]);
+        return HeaderKeys[header->id];
+    }
+    if ((key = PyString_FromStringAndSize(NULL, header->name.len + 5)) == NULL)
         return NULL;
+    p = PyString_AS_STRING(key);
+    memcpy(p, "HTTP_", 5);
+    for (i = 0; i < header->name.len; i++)
+        p[5+i] = name[i] == '-' ? '_' : toupper(name[i]);
+    if (header->name.len == 11 && !memcmp(p, "HTTP_SCRIPT_NAME", 16)) {
+        Py_DECREF(key);
+        Py_INCREF(EnvKeys[ENV_SCRIPT_NAME]);
+        return EnvKeys[ENV_SCRIPT_NAME];
     }
+    return key;
+}
 
-    if (envPutString(environ, "wsgi.url_scheme", httpGetUrlScheme(c)))
-        goto cleanup;
+// Client address is taken from the last X-Forwarded-For if any
+static int envRemote(PyObject *environ, struct conn *c,
+        const struct httpHeader *forward)
+{
+    struct wsgiData *data = c->app_private_data;
+    wstr value, host = NULL, port = NULL;
+    char buf[16];
+    int ret;
 
-    if (envPutString(environ, "REQUEST_METHOD", httpGetMethod(c)))
-        goto cleanup;
+    if (forward) {
+        value = wstrNewLen(forward->value.data, (int)forward->value.len);
+        parserForward(value, &host, &port);
+        wstrFree(value);
+    }
+    if (host && port) {
+        ret = envSet(environ, EnvKeys[ENV_REMOTE_ADDR],
+                PyString_FromStringAndSize(host, wstrlen(host))) ||
+            envSet(environ, EnvKeys[ENV_REMOTE_PORT],
+                    envValue(port, wstrlen(port)));
+    } else {
+        snprintf(buf, sizeof(buf), "%d",
+                isPooled(data) ? data->remote_port : getConnPort(c));
+        ret = envSet(environ, EnvKeys[ENV_REMOTE_ADDR], PyString_FromString(
+                    isPooled(data) ? data->remote_ip : getConnIP(c))) ||
+            envSet(environ, EnvKeys[ENV_REMOTE_PORT], PyString_FromString(buf));
+    }
+    wstrFree(host);
+    wstrFree(port);
+    return ret;
+}
 
-    if (envPutString(environ, "SERVER_PROTOCOL", httpGetProtocolVersion(c)))
-        goto cleanup;
+// Server is named by Host "name[:port]", port defaults to one of scheme.
+// Request without Host is given bind address.
+static int envServer(PyObject *environ, struct conn *c,
+        const struct httpHeader *host)
+{
+    const char *name = Server.bind_addr ? Server.bind_addr : "localhost";
+    const char *port = strcmp(httpGetUrlScheme(c), "https") ? "80" : "443";
+    size_t name_len = strlen(name), port_len = strlen(port), i;
+
+    if (host) {
+        name = (const char *)host->value.data;
+        name_len = host->value.len;
+        // Colon of IPv6 literal is inside brackets
+        for (i = name_len; i > 0 && name[i-1] != ']'; i--) {
+            if (name[i-1] == ':') {
+                port = name + i;
+                port_len = name_len - i;
+                name_len = i - 1;
+                break;
+            }
+        }
+    }
+    return envSet(environ, EnvKeys[ENV_SERVER_NAME],
+            PyString_FromStringAndSize(name, name_len)) ||
+        envSet(environ, EnvKeys[ENV_SERVER_PORT], envValue(port, port_len));
+}
 
-    if (envPutString(environ, "QUERY_STRING", httpGetQueryString(c)))
-        goto cleanup;
+PyObject *createEnviron(struct conn *c)
+{
+    struct array *headers = httpGetReqHeaders(c);
+    const struct httpHeader *header, *host = NULL, *forward = NULL;
+    PyObject *environ, *key;
+    size_t i;
+    int ret;
 
-    // Add http body stream as wsgi.input
-    if ((args = Py_BuildValue("(O)", c_obj)) == NULL)
-        goto cleanup;
-    input = PyObject_CallObject((PyObject *)&InputStream_Type, args);
-    Py_DECREF(args);
-    Py_DECREF(c_obj);
-    if (input == NULL)
-        goto cleanup;
-    if (PyDict_SetItemString(environ, "wsgi.input", input) != 0)
+    environ = PyDict_Copy(DefaultEnv);
+    if (environ == NULL)
+        return NULL;
+
+    // Body isn't read until app reads wsgi.input
+    if (envSet(environ, EnvKeys[ENV_URL_SCHEME], envString(httpGetUrlScheme(c))) ||
+            envSet(environ, EnvKeys[ENV_REQUEST_METHOD], envString(httpGetMethod(c))) ||
+            envSet(environ, EnvKeys[ENV_SERVER_PROTOCOL],
+                envString(httpGetProtocolVersion(c))) ||
+            envSet(environ, EnvKeys[ENV_QUERY_STRING],
+                envValue((const char *)httpGetQueryString(c)->data,
+                    httpGetQueryString(c)->len)) ||
+            envSet(environ, EnvKeys[ENV_PATH_INFO], envPath(httpGetPath(c))) ||
+            envSet(environ, EnvKeys[ENV_INPUT], createInputStream(c)))
         goto cleanup;
 
     /* HTTP headers */
-    struct dictIterator *iter = dictGetIterator(httpGetReqHeaders(c));
-    struct dictEntry *entry;
-    while ((entry = dictNext(iter)) != NULL) {
-        int k, j;
-        wstr header = dictGetKey(entry);
-        wstr value = dictGetVal(entry);
-
-        /* Copy/convert header name */
-        strcpy(buf, "HTTP_");
-
-        k = wstrlen(header);
-        /* The length of header field should less than 250 */
-        if (k > (sizeof(buf) - 6))
-            k = sizeof(buf) - 6;
-
-        for (j = 0; j < k; j++) {
-            if (header[j] == '-')
-                buf[5 + j] = '_';
-            else
-                buf[5 + j] = toupper(header[j]);
-        }
-        buf[5 + j] = '\0';
-
-        if (!strcmp(buf, "HTTP_CONTENT_TYPE") ||
-                !strcmp(buf, "HTTP_CONTENT_LENGTH")) {
-            /* Strip HTTP_ */
-            if (envPutString(environ, &buf[5], value))
-                goto cleanup;
-        } else if (!strcmp(buf, "HTTP_X_FORWARDED_FOR")) {
-            if (envPutString(environ, buf, value))
-                goto cleanup;
-            parserForward(value, &host, &port);
-        } else if (!strcmp(buf, "HTTP_EXPECT")) {
-            if (envPutString(environ, buf, value))
-                goto cleanup;
-            wstrLower(value);
-            if (!strcmp(value, "100-continue")) {
-                // No need to free `h`
-                struct slice s;
-                sliceTo(&s, (uint8_t *)HTTP_CONTINUE, sizeof(HTTP_CONTINUE));
-                sendClientData(c, &s);
-            }
-        } else if (!strcmp(buf, "HTTP_HOST")) {
-            if (envPutString(environ, buf, value))
-                goto cleanup;
-            server = wstrDup(value);
-        } else if (!strcmp(buf, "HTTP_SCRIPT_NAME")) {
-            if (envPutString(environ, "SCRIPT_NAME", value))
-                goto cleanup;
-        } else {
-            if (envPutString(environ, buf, value))
-                goto cleanup;
-        }
-    }
-    dictReleaseIterator(iter);
-    if (!host) {
-        host = wstrNew(getConnIP(c));
-        snprintf(buf, 255, "%d", getConnPort(c));
-        port = wstrNew(buf);
-    }
-    if (envPutString(environ, "REMOTE_ADDR", host))
-        goto cleanup;
-    if (envPutString(environ, "REMOTE_PORT", port))
-        goto cleanup;
-    char *sep = strchr(server, ':');
-    if (sep) {
-        if (envPutString(environ, "SERVER_PORT", sep+1))
+    for (i = 0; i < narray(headers); i++) {
+        header = arrayIndex(headers, i);
+        if ((key = headerKey(header)) == NULL)
             goto cleanup;
-        server = wstrRange(server, (int)(sep-server+1), 0);
-    } else if (!strcmp(httpGetUrlScheme(c), "HTTP")) {
-        if (envPutString(environ, "SERVER_PORT", "80"))
+        ret = envSet(environ, key, PyString_FromStringAndSize(
+                    (const char *)header->value.data, header->value.len));
+        Py_DECREF(key);
+        if (ret)
             goto cleanup;
-    } else if (!strcmp(httpGetUrlScheme(c), "HTTPS")) {
-        if (envPutString(environ, "SERVER_PORT", "443"))
-            goto cleanup;
-    }
-    if (envPutString(environ, "SERVER_NAME", server))
-        goto cleanup;
-
-    if ((req_uri = wsgiUnquote(httpGetPath(c))) == NULL) {
-        goto cleanup;
+        if (header->id == HTTP_HEADER_HOST && !host)
+            host = header;
+        else if (header->id == HTTP_HEADER_X_FORWARDED_FOR && !forward)
+            forward = header;
     }
-    if (envPutString(environ, "PATH_INFO", req_uri))
+    if (envRemote(environ, c, forward) || envServer(environ, c, host))
         goto cleanup;
-    result = 0;
+    return environ;
 
 cleanup:
-    if (req_uri)
-        wfree((void *)req_uri);
-    wstrFree(host);
-    wstrFree(port);
-
-    if (server)
-        wstrFree(server);
-    if (result) {
-        Py_DECREF(environ);
-        return NULL;
-    }
-    return environ;
+    Py_DECREF(environ);
+    return NULL;
 }
 
 void wsgiCallClose(PyObject *result)
@@ -485,9 +842,10 @@ static PyObject * startResponse(struct response *self, PyObject *args)
         return NULL;
 
     if (exc_info != NULL && exc_info != Py_None) {
+        wsgiCacheSkip(data);
         /* If the headers have already been sent, just propagate the
            exception. */
-        if (ishttpHeaderSended(self->c)) {
+        if (isResponseStarted(self->c)) {
             PyObject *type, *value, *tb;
             if (!PyArg_ParseTuple(exc_info, "OOO", &type, &value, &tb))
                 return NULL;
@@ -497,7 +855,7 @@ static PyObject * startResponse(struct response *self, PyObject *args)
             PyErr_Restore(type, value, tb);
             return NULL;
         }
-    } else if (ishttpHeaderSended(self->c)) {
+    } else if (isResponseStarted(self->c)) {
         data->err = "headers already set";
         return NULL;
     }
@@ -518,6 +876,7 @@ static PyObject * startResponse(struct response *self, PyObject *args)
             return NULL;
         }
         appendToResHeaders(self->c, field, value);
+        wsgiCacheAddHeader(data, field, value);
         Py_DECREF(item);
     }
 
@@ -533,6 +892,7 @@ static PyObject * startResponse(struct response *self, PyObject *args)
         return NULL;
 
     fillResInfo(self->c, (int)strtol(status_p, NULL, 10), &status_p[4]);
+    wsgiCacheSetStatus(data, (int)strtol(status_p, NULL, 10), &status_p[4]);
 
     return PyObject_GetAttrString((PyObject *)self, "write");
 }
@@ -544,8 +904,9 @@ static PyObject *responseWrite(struct response *self, PyObject *args)
     struct conn *c = self->c;
     const char *data;
     int datalen;
+    PyObject *item;
 
-    if (httpGetResStatus(c) != 0) {
+    if (httpGetResStatus(c) == 0) {
         wsgi_data->err = "write() before start_response()";
         return NULL;
     }
@@ -553,13 +914,32 @@ static PyObject *responseWrite(struct response *self, PyObject *args)
     if (!PyArg_ParseTuple(args, "s#:write", &data, &datalen))
         return NULL;
 
-    /* Send headers if necessary */
-    if (!ishttpHeaderSended(c)) {
-        if (httpSendHeaders(c))
+    item = PyTuple_GET_ITEM(args, 0);
+    if (isPooled(wsgi_data)) {
+        // Worker sends body items as strings later
+        wsgi_data->started = 1;
+        if (PyString_Check(item))
+            Py_INCREF(item);
+        else if ((item = PyString_FromStringAndSize(data, datalen)) == NULL)
             return NULL;
-    }
+    } else {
+        /* Send headers if necessary */
+        if (!ishttpHeaderSended(c)) {
+            if (httpSendHeaders(c))
+                return NULL;
+        }
 
-    if (httpSendBody(c, data, datalen)) {
+        if (httpSendBody(c, data, datalen)) {
+            return NULL;
+        }
+        // Send queue refers to `data`, keep it alive like body items
+        Py_INCREF(item);
+    }
+    wsgiCacheAddBody(wsgi_data, data, datalen);
+    if (!isPooled(wsgi_data)) {
+        arrayPush(wsgi_data->body_items, &item);
+    } else if (wsgiPoolPush(wsgi_data, item, datalen)) {
+        PyErr_SetString(PyExc_IOError, "client closed");
         return NULL;
     }
 
@@ -650,45 +1030,85 @@ init_wsgisup(void)
     PyModule_AddObject(m, "InputStream", (PyObject *)&InputStream_Type);
 }
 
-/* Send a file as the HTTP response body. */
-int wsgiSendFile(struct conn *c, int fd)
+/* Call method `name` of file-like without arguments and get an integer */
+static int callFileMethod(PyObject *filelike, char *name, long long *out)
 {
-    int ret = 0;
-
-    ret = sendClientFile(c, fd, 0);
+    PyObject *ret;
 
-    return ret;
+    if ((ret = PyObject_CallMethod(filelike, name, NULL)) == NULL)
+        return -1;
+    *out = PyLong_AsLongLong(ret);
+    Py_DECREF(ret);
+    return PyErr_Occurred() ? -1 : 0;
 }
 
-/* Send a wrapped file using wsgiSendFile */
+/* Send a wrapped file from its current position. Small file is read into
+   body and closed at once, otherwise file is sent by fd and kept open until
+   it's sent. Return 1 if file can't be sent by fd, then wrapper is iterated
+   instead. */
 static int wsgiSendFileWrapper(struct conn *c, FileWrapper *wrapper)
 {
-    PyObject *pFileno, *args, *pFD;
-    int fd;
+    struct wsgiData *data = c->app_private_data;
+    long long fd, off;
+    struct stat st;
+    PyObject *item;
+    size_t len;
+    ssize_t n;
 
     /* file-like must have fileno */
-    if (!PyObject_HasAttrString((PyObject *)wrapper->filelike, "fileno"))
+    if (!PyObject_HasAttrString(wrapper->filelike, "fileno"))
         return 1;
-
-    if ((pFileno = PyObject_GetAttrString((PyObject *)wrapper->filelike,
-                    "fileno")) == NULL)
+    if (callFileMethod(wrapper->filelike, "fileno", &fd))
         return -1;
+    // Pipe and the like are read by iteration
+    if (fstat((int)fd, &st) == -1 || !S_ISREG(st.st_mode))
+        return 1;
 
-    if ((args = PyTuple_New(0)) == NULL) {
-        Py_DECREF(pFileno);
-        return -1;
+    // Data buffered by file-like is counted by tell() but not fd offset
+    if (PyObject_HasAttrString(wrapper->filelike, "tell")) {
+        if (callFileMethod(wrapper->filelike, "tell", &off))
+            return -1;
+    } else if ((off = lseek((int)fd, 0, SEEK_CUR)) == -1) {
+        return 1;
     }
+    len = off < st.st_size ? st.st_size - off : 0;
+    if (wrapper->length >= 0 && wrapper->length < len)
+        len = wrapper->length;
 
-    pFD = PyObject_CallObject(pFileno, args);
-    Py_DECREF(args);
-    Py_DECREF(pFileno);
-    if (pFD == NULL)
-        return -1;
+    if (len <= WSGI_FILE_BUFFERED_MAX) {
+        if ((item = PyString_FromStringAndSize(NULL, len)) == NULL)
+            return -1;
+        Py_BEGIN_ALLOW_THREADS
+        n = pread((int)fd, PyString_AS_STRING(item), len, (off_t)off);
+        Py_END_ALLOW_THREADS
+        if (n == -1) {
+            Py_DECREF(item);
+            PyErr_SetFromErrno(PyExc_IOError);
+            return -1;
+        }
+        if (n != len && _PyString_Resize(&item, n))
+            return -1;
+        if (isPooled(data)) {
+            data->started = 1;
+            return wsgiPoolPush(data, item, n) ? -1 : 0;
+        }
+        // Send queue refers to item
+        arrayPush(data->body_items, &item);
+        if (!ishttpHeaderSended(c) && httpSendHeaders(c))
+            return -1;
+        return httpSendBody(c, PyString_AS_STRING(item), n);
+    }
 
-    fd = (int)PyInt_AsLong(pFD);
-    Py_DECREF(pFD);
-    if (PyErr_Occurred())
-        return -1;
+    // Keep file open until it's sent
+    Py_INCREF(wrapper);
+    data->result = (PyObject *)wrapper;
+    data->file_fd = (int)fd;
+    data->file_off = (off_t)off;
+    data->file_len = len;
+    if (isPooled(data)) {
+        data->started = 1;
+        return 0;
+    }
 
     /* Send headers if necessary */
     if (!ishttpHeaderSended(c)) {
@@ -696,10 +1116,7 @@ static int wsgiSendFileWrapper(struct conn *c, FileWrapper *wrapper)
             return -1;
     }
 
-    if (wsgiSendFile(c, fd))
-        return -1;
-
-    return 0;
+    return httpSendFile(c, (int)fd, (off_t)off, len);
 }
 
 /* Send the application's response */
@@ -707,10 +1124,12 @@ int wsgiSendResponse(struct conn *c, PyObject *result)
 {
     PyObject *iter, *item;
     int ret = 0;
+    size_t queued = 0;
     struct wsgiData *wsgi_data = c->app_private_data;
 
     /* Check if it's a FileWrapper */
     if (result->ob_type == &FileWrapper_Type) {
+        wsgiCacheSkip(wsgi_data);
         ret = wsgiSendFileWrapper(c, (FileWrapper *)result);
         if (ret < 0)
             return -1;
@@ -720,7 +1139,9 @@ int wsgiSendResponse(struct conn *c, PyObject *result)
     }
 
     /* Send headers if necessary */
-    if (!ishttpHeaderSended(c)) {
+    if (isPooled(wsgi_data)) {
+        wsgi_data->started = 1;
+    } else if (!ishttpHeaderSended(c)) {
         if (httpSendHeaders(c)) {
             return -1;
         }
@@ -746,16 +1167,24 @@ int wsgiSendResponse(struct conn *c, PyObject *result)
                 break;
             }
 
-            if (httpSendBody(c, data, datalen)) {
+            if (!isPooled(wsgi_data) &&
+                    sendBodyItem(c, data, datalen, &queued)) {
                 wheatLog(WHEAT_DEBUG, "send data failed %d", datalen);
                 ret = -1;
                 Py_DECREF(item);
                 break;
             }
+            wsgiCacheAddBody(wsgi_data, data, datalen);
         }
-        Py_INCREF(item);
-        arrayPush(wsgi_data->body_items, item);
-        Py_DECREF(item);
+        if (isPooled(wsgi_data)) {
+            if (wsgiPoolPush(wsgi_data, item, datalen)) {
+                ret = -1;
+                break;
+            }
+            continue;
+        }
+        // Keep item alive until conn freed, send queue refers to its buffer
+        arrayPush(wsgi_data->body_items, &item);
     }
     Py_DECREF(iter);
 
@@ -20,10 +20,13 @@ struct response {
     struct conn *c;
 };
 
+// `length`: bytes left to send from current position of file, -1 means
+// until end of file
 typedef struct {
     PyObject_HEAD
     PyObject *filelike;
     int blocksize;
+    long length;
 } FileWrapper;
 
 typedef struct {
@@ -32,15 +35,81 @@ typedef struct {
     size_t readed;
     const struct slice *curr;
     int pos;
+    int started;
 } InputStream;
 
+// With `wsgi-threads`, app is called on a pool thread and response is
+// collected in `body_items`. Items are handed to worker every
+// `wsgi-flush-size` bytes while app is running, the rest is sent when the
+// thread is done.
+//
+// `c`: conn of pooled request, only used by worker
+// `shadow`: copy of `c` without client, app is called on it by pool thread
+// `remote_ip` and `remote_port`: client address taken when request queued
+// `request`: request data taken from `c` if it's freed while app running
+// `result`: file wrapper returned by app, it's closed after file sent
+// `file_fd`: file of `result` to send from `file_off`, -1 if none
+// `job`: state of request in thread pool
+// `started`: response is started as far as app knows
+// `failed`: app raised, 500 is sent or body is truncated
+// `queued`: time request is queued
+// `wait`: microseconds request waited for a thread
+// `node`: position in list of thread pool
+// `handed`: items before it are handed to worker, which sends items from
+// `sent` to it
+// `written`: items before it are written to client, items before
+// `released` are freed by pool thread
+// `unhanded`: bytes given by app and not handed to worker yet
+// `buffered`: bytes handed to worker and not written yet, app waits while
+// it's over `wsgi-buffer-size`
+// `unwritten`: bytes sent by worker and not written yet
+// `flush_node`: position in list of jobs having body handed
+// `stream_node`: position in list of jobs having body not written
+// `waiting`: cache entry being filled by another request this one waits
+// for, or stored entry to reply from once woken
+// `wait_list` and `wait_node`: position in waiters of entry or woken list
 struct wsgiData {
     PyObject *environ;
     void *response;
     struct array *body_items;
     char *err;
+    struct wsgiCacheEntry *cache;
+    struct wsgiCacheEntry *waiting;
+    struct list *wait_list;
+    struct listNode *wait_node;
+
+    struct conn *c;
+    struct conn *shadow;
+    wstr remote_ip;
+    int remote_port;
+    void *request;
+    PyObject *result;
+    int file_fd;
+    off_t file_off;
+    size_t file_len;
+    int job;
+    unsigned started:1;
+    unsigned failed:1;
+    struct timeval queued;
+    long long wait;
+    struct listNode *node;
+    size_t handed;
+    size_t sent;
+    size_t written;
+    size_t released;
+    size_t unhanded;
+    size_t buffered;
+    size_t unwritten;
+    struct listNode *flush_node;
+    struct listNode *stream_node;
 };
 
+#define WSGI_JOB_NONE     0
+#define WSGI_JOB_QUEUED   1
+#define WSGI_JOB_RUNNING  2
+#define WSGI_JOB_DONE     3
+#define WSGI_JOB_ORPHAN   4
+
 PyTypeObject responseType;
 PyTypeObject FileWrapper_Type;
 PyTypeObject InputStream_Type;
@@ -51,6 +120,35 @@ PyTypeObject InputStream_Type;
 PyMODINIT_FUNC
 init_wsgisup(void);
 PyObject *createEnviron(struct conn *c);
+PyObject *createInputStream(struct conn *c);
 void wsgiCallClose(PyObject *result);
 
+/* ========== wsgi response cache ========== */
+int initWsgiCache();
+void deallocWsgiCache();
+int wsgiCacheLookup(struct conn *c, struct wsgiData *data);
+void wsgiCacheSetStatus(struct wsgiData *data, int status, const char *msg);
+void wsgiCacheAddHeader(struct wsgiData *data, const char *field,
+        const char *value);
+void wsgiCacheAddBody(struct wsgiData *data, const char *buf, size_t len);
+void wsgiCacheStore(struct conn *c, struct wsgiData *data);
+void wsgiCacheDrop(struct wsgiData *data);
+void wsgiCacheCancel(struct wsgiData *data);
+void wsgiCacheSkip(struct wsgiData *data);
+void wsgiCacheCron();
+
+/* ========== wsgi thread pool ========== */
+int initWsgiPool(int threads, size_t depth, size_t flush_size,
+        size_t buffer_size);
+void deallocWsgiPool();
+int wsgiPoolSubmit(struct wsgiData *data);
+int wsgiPoolPush(struct wsgiData *data, PyObject *item, size_t len);
+void wsgiPoolRelease(struct wsgiData *data);
+void wsgiPoolCron();
+int wsgiSubmitJob(struct conn *c);
+void wsgiRunJob(struct wsgiData *data);
+int wsgiSendItems(struct wsgiData *data, PyObject **items, size_t count);
+void wsgiFinishJob(struct wsgiData *data);
+void wsgiReleaseData(struct wsgiData *data);
+
 #endif
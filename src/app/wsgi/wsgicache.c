@@ -0,0 +1,570 @@
+// Response cache in front of WSGI application
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "../application.h"
+#include "app_wsgi.h"
+
+#define WSGI_CACHE_MAX_VARY     8
+
+// Anonymous GET responses allowing shared caching by `Cache-Control` are
+// kept per worker for min(s-maxage or max-age, `wsgi-cache-ttl`) seconds.
+// Cache is bounded by `wsgi-cache-size` bytes and evicts least recently
+// used entries, one entry is limited to 1/8 of it.
+//
+// Entry is keyed by "path?query" plus values of `wsgi-cache-vary` headers.
+// Body is sent from entry directly, `refs` keeps evicted entry alive until
+// conns sending it are freed.
+//
+// Application is called synchronously in worker, so misses of the same key
+// are naturally coalesced: the first one fills entry before next request is
+// dispatched. With `wsgi-threads` entry being filled by pooled request is
+// kept in `filling`, misses of the same key wait for it and are answered
+// from it once stored. If response isn't cacheable or app failed, waiters
+// call application themselves.
+//
+// `headers`: "field\0value\0" pairs given by application
+// `ttl`: max seconds to cache, route's "cache-ttl=" or `wsgi-cache-ttl`
+// `waiters`: conns waiting for entry being filled, NULL if it isn't in
+// `filling`. Only worker touches it, the other fields are filled by pool
+// thread
+struct wsgiCacheEntry {
+    wstr key;
+    int status;
+    wstr status_msg;
+    wstr headers;
+    wstr body;
+    time_t created;
+    time_t expire;
+    time_t ttl;
+    size_t size;
+    int refs;
+    unsigned evicted:1;
+    unsigned has_content_length:1;
+    unsigned uncacheable:1;
+    struct listNode *node;
+    struct list *waiters;
+};
+
+static struct wsgiCache {
+    struct dict *entries;
+    struct dict *filling;
+    struct list *woken;
+    struct list *lru;
+    size_t size;
+    size_t used;
+    size_t max_entry;
+    time_t ttl;
+    int nvary;
+    struct {
+        wstr name;
+        int id;
+    } vary[WSGI_CACHE_MAX_VARY];
+    int vary_cookie;
+    long long *hits;
+    long long *misses;
+} WsgiCache;
+
+static unsigned int cacheKeyHash(const void *key)
+{
+    return dictGenHashFunction(key, wstrlen((wstr)key));
+}
+
+static int cacheKeyCompare(const void *key1, const void *key2)
+{
+    return wstrlen((wstr)key1) == wstrlen((wstr)key2) &&
+        !memcmp(key1, key2, wstrlen((wstr)key1));
+}
+
+// Entries own their keys
+static struct dictType WsgiCacheDictType = {
+    cacheKeyHash,               /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    cacheKeyCompare,            /* key compare */
+    NULL,                       /* key destructor */
+    NULL,                       /* val destructor */
+};
+
+static void freeEntry(struct wsgiCacheEntry *entry)
+{
+    wstrFree(entry->key);
+    wstrFree(entry->status_msg);
+    wstrFree(entry->headers);
+    wstrFree(entry->body);
+    wfree(entry);
+}
+
+static void evictEntry(struct wsgiCacheEntry *entry)
+{
+    dictDelete(WsgiCache.entries, entry->key);
+    removeListNode(WsgiCache.lru, entry->node);
+    WsgiCache.used -= entry->size;
+    entry->evicted = 1;
+    if (!entry->refs)
+        freeEntry(entry);
+}
+
+static void releaseEntry(void *data)
+{
+    struct wsgiCacheEntry *entry = data;
+
+    if (--entry->refs == 0 && entry->evicted)
+        freeEntry(entry);
+}
+
+static const struct slice *getVaryHeader(struct conn *c, int i)
+{
+    if (WsgiCache.vary[i].id != HTTP_HEADER_UNKNOWN)
+        return httpGetReqHeader(c, WsgiCache.vary[i].id);
+    return httpFindReqHeader(c, WsgiCache.vary[i].name,
+            wstrlen(WsgiCache.vary[i].name));
+}
+
+static wstr buildKey(struct conn *c)
+{
+    const struct slice *path = httpGetPath(c), *query, *value;
+    wstr key;
+    int i;
+
+    key = wstrNewLen(NULL, (int)path->len+64);
+    key = wstrCatLen(key, (const char *)path->data, path->len);
+    query = httpGetQueryString(c);
+    if (query->len) {
+        key = wstrCatLen(key, "?", 1);
+        key = wstrCatLen(key, (const char *)query->data, query->len);
+    }
+    for (i = 0; i < WsgiCache.nvary; i++) {
+        key = wstrCatLen(key, "\n", 1);
+        value = getVaryHeader(c, i);
+        if (value)
+            key = wstrCatLen(key, (const char *)value->data, value->len);
+    }
+    return key;
+}
+
+// Requests carrying credentials are answered per user
+static int isCacheableRequest(struct conn *c)
+{
+    const char *method = httpGetMethod(c);
+
+    if (strcmp(method, "GET") && strcmp(method, "HEAD"))
+        return 0;
+    if (httpFindReqHeader(c, "Authorization", 13))
+        return 0;
+    if (httpGetReqHeader(c, HTTP_HEADER_COOKIE) && !WsgiCache.vary_cookie)
+        return 0;
+    return 1;
+}
+
+static void serveEntry(struct conn *c, struct wsgiCacheEntry *entry)
+{
+    const char *field, *value, *end;
+    char age[32];
+
+    fillResInfo(c, entry->status, entry->status_msg);
+    field = entry->headers;
+    end = entry->headers + wstrlen(entry->headers);
+    while (field < end) {
+        value = field + strlen(field) + 1;
+        appendToResHeaders(c, field, value);
+        field = value + strlen(value) + 1;
+    }
+    snprintf(age, sizeof(age), "%ld",
+            (long)(Server.cron_time.tv_sec - entry->created));
+    appendToResHeaders(c, "Age", age);
+    if (httpSendHeaders(c))
+        return ;
+    entry->refs++;
+    registerConnFree(c, releaseEntry, entry);
+    if (!httpSendBody(c, entry->body, wstrlen(entry->body)))
+        httpSendBodyEnd(c);
+}
+
+// Waiters are moved to `woken` and answered by wsgiCacheCron, since entry
+// may be given up while a client is being freed. Woken waiter holds a ref
+// of stored entry in `waiting`, NULL means it calls application itself.
+static void wakeWaiters(struct wsgiCacheEntry *entry, int stored)
+{
+    struct listNode *node;
+    struct wsgiData *data;
+    struct conn *c;
+
+    dictDelete(WsgiCache.filling, entry->key);
+    while ((node = listFirst(entry->waiters)) != NULL) {
+        c = listNodeValue(node);
+        removeListNode(entry->waiters, node);
+        data = c->app_private_data;
+        data->wait_list = WsgiCache.woken;
+        data->wait_node = appendToListTail(WsgiCache.woken, c);
+        data->waiting = NULL;
+        if (stored) {
+            data->waiting = entry;
+            entry->refs++;
+        }
+    }
+    freeList(entry->waiters);
+    entry->waiters = NULL;
+}
+
+void wsgiCacheCron()
+{
+    struct wsgiCacheEntry *entry;
+    struct listNode *node;
+    struct wsgiData *data;
+    struct client *client;
+    struct conn *c;
+
+    if (!WsgiCache.woken)
+        return ;
+    // Freeing a client removes its conns from `woken`
+    while ((node = listFirst(WsgiCache.woken)) != NULL) {
+        c = listNodeValue(node);
+        removeListNode(WsgiCache.woken, node);
+        data = c->app_private_data;
+        entry = data->waiting;
+        data->waiting = NULL;
+        data->wait_list = NULL;
+        data->wait_node = NULL;
+        client = c->client;
+        if (entry) {
+            (*WsgiCache.hits)++;
+            serveEntry(c, entry);
+            releaseEntry(entry);
+        } else {
+            (*WsgiCache.misses)++;
+            if (wsgiSubmitJob(c) == WHEAT_OK)
+                continue;
+            sendResponse503(c);
+        }
+        httpFinishResponse(c);
+        tryFreeClient(client);
+    }
+}
+
+// Return 1 if response is sent from cache or deferred until entry being
+// filled is stored. Otherwise response of GET request is recorded in
+// `data->cache` to be stored by `wsgiCacheStore`.
+int wsgiCacheLookup(struct conn *c, struct wsgiData *data)
+{
+    struct wsgiCacheEntry *entry;
+    struct httpRoute *route = httpGetRoute(c);
+    wstr key;
+
+    if (!WsgiCache.size || !route->cache_ttl || !isCacheableRequest(c))
+        return 0;
+
+    key = buildKey(c);
+    entry = dictFetchValue(WsgiCache.entries, key);
+    if (entry && entry->expire <= Server.cron_time.tv_sec) {
+        evictEntry(entry);
+        entry = NULL;
+    }
+    if (entry) {
+        wstrFree(key);
+        removeListNode(WsgiCache.lru, entry->node);
+        entry->node = appendToListTail(WsgiCache.lru, entry);
+        (*WsgiCache.hits)++;
+        serveEntry(c, entry);
+        return 1;
+    }
+
+    if (strcmp(httpGetMethod(c), "GET")) {
+        (*WsgiCache.misses)++;
+        wstrFree(key);
+        return 0;
+    }
+    // Waiter is counted as hit or miss when it's woken
+    if (WsgiCache.filling) {
+        entry = dictFetchValue(WsgiCache.filling, key);
+        if (entry) {
+            wstrFree(key);
+            data->wait_node = appendToListTail(entry->waiters, c);
+            if (data->wait_node == NULL)
+                return 0;
+            data->wait_list = entry->waiters;
+            data->waiting = entry;
+            httpDeferResponse(c);
+            return 1;
+        }
+    }
+    (*WsgiCache.misses)++;
+    entry = wmalloc(sizeof(*entry));
+    if (entry == NULL) {
+        wstrFree(key);
+        return 0;
+    }
+    memset(entry, 0, sizeof(*entry));
+    entry->key = key;
+    entry->ttl = route->cache_ttl == -1 ? WsgiCache.ttl : route->cache_ttl;
+    entry->headers = wstrEmpty();
+    entry->body = wstrEmpty();
+    entry->size = sizeof(*entry) + wstrlen(key);
+    if (WsgiCache.filling) {
+        entry->waiters = createList();
+        if (entry->waiters &&
+                dictAdd(WsgiCache.filling, key, entry) == DICT_WRONG) {
+            freeList(entry->waiters);
+            entry->waiters = NULL;
+        }
+    }
+    data->cache = entry;
+    return 0;
+}
+
+// Entry of pooled request is freed by pool thread, worker must cancel it
+// first
+void wsgiCacheDrop(struct wsgiData *data)
+{
+    if (data->cache) {
+        if (data->cache->waiters)
+            wakeWaiters(data->cache, 0);
+        freeEntry(data->cache);
+        data->cache = NULL;
+    }
+}
+
+// Called by worker when request stops waiting for entry, or its own entry
+// won't be stored
+void wsgiCacheCancel(struct wsgiData *data)
+{
+    if (data->wait_node) {
+        removeListNode(data->wait_list, data->wait_node);
+        if (data->wait_list == WsgiCache.woken && data->waiting)
+            releaseEntry(data->waiting);
+        data->waiting = NULL;
+        data->wait_list = NULL;
+        data->wait_node = NULL;
+    }
+    if (data->cache && data->cache->waiters)
+        wakeWaiters(data->cache, 0);
+}
+
+static void markUncacheable(struct wsgiCacheEntry *entry)
+{
+    entry->uncacheable = 1;
+    wstrClear(entry->headers);
+    wstrClear(entry->body);
+}
+
+// Safe for pool thread, entry is freed later by worker or when data freed
+void wsgiCacheSkip(struct wsgiData *data)
+{
+    if (data->cache)
+        markUncacheable(data->cache);
+}
+
+void wsgiCacheSetStatus(struct wsgiData *data, int status, const char *msg)
+{
+    struct wsgiCacheEntry *entry = data->cache;
+
+    if (entry == NULL || entry->uncacheable)
+        return ;
+    entry->status = status;
+    wstrFree(entry->status_msg);
+    entry->status_msg = wstrNew(msg);
+}
+
+void wsgiCacheAddHeader(struct wsgiData *data, const char *field,
+        const char *value)
+{
+    struct wsgiCacheEntry *entry = data->cache;
+    size_t field_len = strlen(field), value_len = strlen(value);
+
+    if (entry == NULL || entry->uncacheable)
+        return ;
+    if (!strcasecmp(field, "Set-Cookie")) {
+        markUncacheable(entry);
+        return ;
+    }
+    if (!strcasecmp(field, "Date"))
+        return ;
+    if (!strcasecmp(field, CONTENT_LENGTH))
+        entry->has_content_length = 1;
+    entry->headers = wstrCatLen(entry->headers, field, field_len+1);
+    entry->headers = wstrCatLen(entry->headers, value, value_len+1);
+    entry->size += field_len + value_len + 2;
+}
+
+void wsgiCacheAddBody(struct wsgiData *data, const char *buf, size_t len)
+{
+    struct wsgiCacheEntry *entry = data->cache;
+
+    if (entry == NULL || entry->uncacheable)
+        return ;
+    if (entry->size + len > WsgiCache.max_entry) {
+        markUncacheable(entry);
+        return ;
+    }
+    entry->body = wstrCatLen(entry->body, buf, len);
+    entry->size += len;
+}
+
+static const char *findDirective(const char *value, const char *name)
+{
+    size_t len = strlen(name);
+
+    for (; *value; value++) {
+        if (!strncasecmp(value, name, len))
+            return value;
+    }
+    return NULL;
+}
+
+// Shared caches may store response for `s-maxage` or `max-age` seconds
+// unless private, no-cache or no-store is specified
+static time_t getMaxAge(struct wsgiCacheEntry *entry)
+{
+    const char *field, *value, *end, *p;
+    long max_age = -1, s_maxage = -1;
+
+    field = entry->headers;
+    end = entry->headers + wstrlen(entry->headers);
+    while (field < end) {
+        value = field + strlen(field) + 1;
+        if (!strcasecmp(field, "Vary") && strchr(value, '*'))
+            return 0;
+        if (!strcasecmp(field, "Cache-Control")) {
+            if (findDirective(value, "private") || findDirective(value, "no-cache") ||
+                    findDirective(value, "no-store"))
+                return 0;
+            if ((p = findDirective(value, "s-maxage=")) != NULL)
+                s_maxage = strtol(p+9, NULL, 10);
+            p = value;
+            while ((p = findDirective(p, "max-age=")) != NULL) {
+                if (p == value || p[-1] != '-')
+                    max_age = strtol(p+8, NULL, 10);
+                p += 8;
+            }
+        }
+        field = value + strlen(value) + 1;
+    }
+    if (s_maxage >= 0)
+        return s_maxage;
+    return max_age > 0 ? max_age : 0;
+}
+
+static int isCacheableStatus(int status)
+{
+    switch (status) {
+        case 200:
+        case 203:
+        case 301:
+        case 404:
+        case 410:
+            return 1;
+    }
+    return 0;
+}
+
+// Called when application returned successfully
+void wsgiCacheStore(struct conn *c, struct wsgiData *data)
+{
+    struct wsgiCacheEntry *entry = data->cache, *old;
+    time_t max_age;
+    char buf[32];
+
+    if (entry == NULL)
+        return ;
+    max_age = getMaxAge(entry);
+    if (entry->uncacheable || !isCacheableStatus(entry->status) ||
+            max_age <= 0 || entry->size > WsgiCache.max_entry) {
+        wsgiCacheDrop(data);
+        return ;
+    }
+    if (max_age > entry->ttl)
+        max_age = entry->ttl;
+    if (!entry->has_content_length) {
+        ll2string(buf, sizeof(buf), wstrlen(entry->body));
+        wsgiCacheAddHeader(data, CONTENT_LENGTH, buf);
+    }
+    data->cache = NULL;
+    entry->headers = wstrRemoveFreeSpace(entry->headers);
+    entry->body = wstrRemoveFreeSpace(entry->body);
+    entry->created = Server.cron_time.tv_sec;
+    entry->expire = entry->created + max_age;
+
+    old = dictFetchValue(WsgiCache.entries, entry->key);
+    if (old)
+        evictEntry(old);
+    while (WsgiCache.used + entry->size > WsgiCache.size &&
+            listFirst(WsgiCache.lru))
+        evictEntry(listNodeValue(listFirst(WsgiCache.lru)));
+    if (dictAdd(WsgiCache.entries, entry->key, entry) == DICT_WRONG) {
+        if (entry->waiters)
+            wakeWaiters(entry, 0);
+        freeEntry(entry);
+        return ;
+    }
+    entry->node = appendToListTail(WsgiCache.lru, entry);
+    WsgiCache.used += entry->size;
+    if (entry->waiters)
+        wakeWaiters(entry, 1);
+}
+
+int initWsgiCache()
+{
+    wstr vary, *names;
+    int count, i;
+    char *conf;
+
+    memset(&WsgiCache, 0, sizeof(WsgiCache));
+    WsgiCache.size = getConfiguration("wsgi-cache-size")->target.val;
+    if (!WsgiCache.size)
+        return WHEAT_OK;
+    WsgiCache.max_entry = WsgiCache.size / 8;
+    WsgiCache.ttl = getConfiguration("wsgi-cache-ttl")->target.val;
+    WsgiCache.hits = &getStatValByName("Total wsgi cache hit");
+    WsgiCache.misses = &getStatValByName("Total wsgi cache miss");
+    WsgiCache.entries = dictCreate(&WsgiCacheDictType);
+    WsgiCache.lru = createList();
+    if (getConfiguration("wsgi-threads")->target.val) {
+        WsgiCache.filling = dictCreate(&WsgiCacheDictType);
+        WsgiCache.woken = createList();
+    }
+
+    conf = getConfiguration("wsgi-cache-vary")->target.ptr;
+    if (conf == NULL)
+        return WHEAT_OK;
+    vary = wstrNew(conf);
+    names = wstrNewSplit(vary, ",", 1, &count);
+    wstrFree(vary);
+    if (names == NULL || count > WSGI_CACHE_MAX_VARY) {
+        wheatLog(WHEAT_WARNING, "wsgi-cache-vary allows at most %d headers",
+                WSGI_CACHE_MAX_VARY);
+        if (names)
+            wstrFreeSplit(names, count);
+        return WHEAT_WRONG;
+    }
+    for (i = 0; i < count; i++) {
+        WsgiCache.vary[i].name = wstrStrip(wstrDup(names[i]), " ");
+        WsgiCache.vary[i].id = getHttpHeaderId(WsgiCache.vary[i].name,
+                wstrlen(WsgiCache.vary[i].name));
+        if (WsgiCache.vary[i].id == HTTP_HEADER_COOKIE)
+            WsgiCache.vary_cookie = 1;
+    }
+    WsgiCache.nvary = count;
+    wstrFreeSplit(names, count);
+    return WHEAT_OK;
+}
+
+void deallocWsgiCache()
+{
+    int i;
+
+    if (!WsgiCache.size)
+        return ;
+    while (listFirst(WsgiCache.lru))
+        evictEntry(listNodeValue(listFirst(WsgiCache.lru)));
+    dictRelease(WsgiCache.entries);
+    if (WsgiCache.filling) {
+        dictRelease(WsgiCache.filling);
+        freeList(WsgiCache.woken);
+    }
+    freeList(WsgiCache.lru);
+    for (i = 0; i < WsgiCache.nvary; i++)
+        wstrFree(WsgiCache.vary[i].name);
+    WsgiCache.size = 0;
+}
@@ -17,6 +17,29 @@ static int InputStream_findChar(InputStream *self, struct slice *s, int c)
     return -1;
 }
 
+/* Spilled body is read from file, let other wsgi threads run meanwhile */
+static const struct slice *InputStream_next(InputStream *self)
+{
+    const struct slice *s;
+
+    if (httpBodyGetFile(self->c) == -1)
+        return httpGetBodyNext(self->c);
+    Py_BEGIN_ALLOW_THREADS
+    s = httpGetBodyNext(self->c);
+    Py_END_ALLOW_THREADS
+    return s;
+}
+
+/* Body is fetched when it's first read */
+static void InputStream_start(InputStream *self)
+{
+    if (!self->started) {
+        self->started = 1;
+        self->curr = InputStream_next(self);
+        self->pos = 0;
+    }
+}
+
 /* Consume characters between self->pos and newPos, returning it as a
    new Python string. */
 static PyObject *InputStream_consume(InputStream *self, int size)
@@ -25,13 +48,14 @@ static PyObject *InputStream_consume(InputStream *self, int size)
     char *data;
     size_t total = 0;
 
+    InputStream_start(self);
     if (size <= 0 || !self->curr)
         return PyString_FromString("");
     result = PyString_FromStringAndSize(NULL, size);
     data = PyString_AS_STRING(result);
     do {
         if (self->pos >= self->curr->len) {
-            self->curr = httpGetBodyNext(self->c);
+            self->curr = InputStream_next(self);
             self->pos = 0;
         }
         size_t remaining = self->curr->len - self->pos;
@@ -59,11 +83,23 @@ static PyObject *InputStream_new(PyTypeObject *type, PyObject *args, PyObject *k
         self->c = NULL;
         self->pos = 0;
         self->readed = 0;
+        self->started = 0;
     }
 
     return (PyObject *)self;
 }
 
+/* wsgi.input of request, created without calling constructor */
+PyObject *createInputStream(struct conn *c)
+{
+    InputStream *self = (InputStream *)InputStream_new(&InputStream_Type,
+            NULL, NULL);
+
+    if (self != NULL)
+        self->c = c;
+    return (PyObject *)self;
+}
+
 /* InputStream constructor. Expects to be passed the parent Request and
    the received Content-Length. */
 static int InputStream_init(InputStream *self, PyObject *args, PyObject *kwds)
@@ -74,7 +110,6 @@ static int InputStream_init(InputStream *self, PyObject *args, PyObject *kwds)
         return -1;
 
     self->c = PyCObject_AsVoidPtr(c);
-    self->curr = httpGetBodyNext(self->c);
     return 0;
 }
 
@@ -87,6 +122,7 @@ static PyObject *InputStream_read(InputStream *self, PyObject *args)
     if (!PyArg_ParseTuple(args, "|i:read", &size))
         return NULL;
 
+    InputStream_start(self);
     if (size <= 0 || !self->curr)
         return PyString_FromString("");
 
@@ -106,7 +142,8 @@ static PyObject *InputStream_readline(InputStream *self, PyObject *args)
     if (!PyArg_ParseTuple(args, "|i:readline", &size))
         return NULL;
 
-    if (size <= 0)
+    InputStream_start(self);
+    if (size <= 0 || !self->curr)
         return PyString_FromString("");
 
     remaining = self->curr->len - self->pos + httpBodyGetSize(self->c);
@@ -0,0 +1,472 @@
+// Thread pool calling WSGI application off worker loop
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <pthread.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "../application.h"
+#include "app_wsgi.h"
+
+// Worker loop never holds the GIL once pool started. Request is queued to
+// `pending` and a pool thread takes the GIL to build environ, call app and
+// collect its response, app releases the GIL around its own I/O as usual.
+// Finished request is moved to `done` and worker is woken by `notify_fd`
+// to send response from loop.
+//
+// Body of a running request is handed to worker every `flush_size` bytes
+// by putting it to `flushed`, so long response is streamed. Job having body
+// not written to client is kept in `streaming` and checked by worker cron,
+// app waits on `drained` while it has more than `buffer_size` bytes not
+// written.
+//
+// Python objects of freed conn are released by pool threads too: they are
+// queued to `garbage` and freed in batch under one GIL hold. Conn freed
+// while its request is running leaves the request to the job, which goes
+// to `garbage` instead of `done` when app returns.
+static struct wsgiPool {
+    pthread_t *threads;
+    int count;
+    size_t depth;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    pthread_cond_t drained;
+    struct list *pending;
+    struct list *done;
+    struct list *garbage;
+    struct list *flushed;
+    struct list *streaming;
+    size_t flush_size;
+    size_t buffer_size;
+    int notify_fd[2];
+    PyThreadState *main_state;
+    long long *pooled;
+    long long *rejected;
+    long long *queue_wait;
+    long long *max_queue_wait;
+} WsgiPool;
+
+static void wakeWorker()
+{
+#ifdef __linux__
+    uint64_t one = 1;
+    ssize_t n = write(WsgiPool.notify_fd[1], &one, sizeof(one));
+#else
+    char one = 1;
+    ssize_t n = write(WsgiPool.notify_fd[1], &one, sizeof(one));
+#endif
+    (void)n;
+}
+
+static void drainNotify()
+{
+    char buf[64];
+
+    while (read(WsgiPool.notify_fd[0], buf, sizeof(buf)) > 0)
+        ;
+}
+
+static void releaseGarbage()
+{
+    struct wsgiData *data;
+    struct listNode *node;
+
+    while (1) {
+        pthread_mutex_lock(&WsgiPool.lock);
+        node = listFirst(WsgiPool.garbage);
+        data = node ? listNodeValue(node) : NULL;
+        if (node)
+            removeListNode(WsgiPool.garbage, node);
+        pthread_mutex_unlock(&WsgiPool.lock);
+        if (data == NULL)
+            break;
+        wsgiReleaseData(data);
+    }
+}
+
+static void runJob(struct wsgiData *data, PyThreadState *state)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    data->wait = getMicroseconds(now) - getMicroseconds(data->queued);
+    PyEval_RestoreThread(state);
+    wsgiRunJob(data);
+    PyEval_SaveThread();
+
+    pthread_mutex_lock(&WsgiPool.lock);
+    if (data->job == WSGI_JOB_ORPHAN) {
+        data->job = WSGI_JOB_NONE;
+        data->node = appendToListTail(WsgiPool.garbage, data);
+        pthread_mutex_unlock(&WsgiPool.lock);
+        return ;
+    }
+    data->job = WSGI_JOB_DONE;
+    data->node = appendToListTail(WsgiPool.done, data);
+    pthread_mutex_unlock(&WsgiPool.lock);
+    wakeWorker();
+}
+
+static void *poolThread(void *arg)
+{
+    PyGILState_STATE gil = PyGILState_Ensure();
+    PyThreadState *state = PyEval_SaveThread();
+    struct wsgiData *data;
+    struct listNode *node;
+
+    pthread_mutex_lock(&WsgiPool.lock);
+    while (!WsgiPool.stop) {
+        if (listLength(WsgiPool.garbage)) {
+            pthread_mutex_unlock(&WsgiPool.lock);
+            PyEval_RestoreThread(state);
+            releaseGarbage();
+            PyEval_SaveThread();
+            pthread_mutex_lock(&WsgiPool.lock);
+            continue;
+        }
+        node = listFirst(WsgiPool.pending);
+        if (node == NULL) {
+            pthread_cond_wait(&WsgiPool.wakeup, &WsgiPool.lock);
+            continue;
+        }
+        data = listNodeValue(node);
+        removeListNode(WsgiPool.pending, node);
+        data->node = NULL;
+        data->job = WSGI_JOB_RUNNING;
+        pthread_mutex_unlock(&WsgiPool.lock);
+        runJob(data, state);
+        pthread_mutex_lock(&WsgiPool.lock);
+    }
+    pthread_mutex_unlock(&WsgiPool.lock);
+
+    PyEval_RestoreThread(state);
+    PyGILState_Release(gil);
+    return NULL;
+}
+
+// Called by pool thread with the GIL for each body item given by app, it's
+// kept in `body_items` until written. Return -1 if conn is gone, app should
+// stop then.
+int wsgiPoolPush(struct wsgiData *data, PyObject *item, size_t len)
+{
+    size_t written;
+    PyObject **slot;
+    int job;
+
+    pthread_mutex_lock(&WsgiPool.lock);
+    arrayPush(data->body_items, &item);
+    pthread_mutex_unlock(&WsgiPool.lock);
+    data->unhanded += len;
+    if (!len || data->unhanded < WsgiPool.flush_size)
+        return 0;
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&WsgiPool.lock);
+    data->handed = narray(data->body_items);
+    data->buffered += data->unhanded;
+    data->unhanded = 0;
+    if (data->flush_node == NULL && data->job == WSGI_JOB_RUNNING) {
+        data->flush_node = appendToListTail(WsgiPool.flushed, data);
+        wakeWorker();
+    }
+    while (data->job == WSGI_JOB_RUNNING && !WsgiPool.stop &&
+            data->buffered > WsgiPool.buffer_size)
+        pthread_cond_wait(&WsgiPool.drained, &WsgiPool.lock);
+    job = data->job;
+    written = data->written;
+    pthread_mutex_unlock(&WsgiPool.lock);
+    Py_END_ALLOW_THREADS
+
+    // Worker only reads items after `written`, so slots are cleared
+    // without lock
+    for (; data->released < written; data->released++) {
+        slot = arrayIndex(data->body_items, data->released);
+        Py_CLEAR(*slot);
+    }
+    return job == WSGI_JOB_RUNNING ? 0 : -1;
+}
+
+// Called with lock held
+static void markWritten(struct wsgiData *data)
+{
+    data->written = data->sent;
+    data->buffered -= data->unwritten;
+    data->unwritten = 0;
+    pthread_cond_broadcast(&WsgiPool.drained);
+}
+
+// Send items handed by pool thread, a few at a time because `body_items`
+// may be enlarged by pool thread unless lock is held. Broken client is
+// freed, and running job is orphaned then.
+static void sendHanded(struct wsgiData *data)
+{
+    struct client *client = data->c->client;
+    PyObject *items[64];
+    size_t count, i;
+    int ret = 0;
+
+    while (1) {
+        pthread_mutex_lock(&WsgiPool.lock);
+        for (count = 0; count < 64 && data->sent + count < data->handed;
+                count++)
+            items[count] = *(PyObject **)arrayIndex(data->body_items,
+                    data->sent + count);
+        pthread_mutex_unlock(&WsgiPool.lock);
+        if (count == 0)
+            break;
+        ret = wsgiSendItems(data, items, count);
+        for (i = 0; i < count; i++)
+            data->unwritten += PyString_GET_SIZE(items[i]);
+        data->sent += count;
+        if (ret) {
+            tryFreeClient(client);
+            return ;
+        }
+    }
+
+    pthread_mutex_lock(&WsgiPool.lock);
+    if (!listLength(data->c->send_queue))
+        markWritten(data);
+    else if (data->stream_node == NULL)
+        data->stream_node = appendToListTail(WsgiPool.streaming, data);
+    pthread_mutex_unlock(&WsgiPool.lock);
+}
+
+// Called with lock held, `data` leaves lists of running job
+static void stopStreaming(struct wsgiData *data)
+{
+    if (data->flush_node) {
+        removeListNode(WsgiPool.flushed, data->flush_node);
+        data->flush_node = NULL;
+    }
+    if (data->stream_node) {
+        removeListNode(WsgiPool.streaming, data->stream_node);
+        data->stream_node = NULL;
+    }
+}
+
+// Wake app whose body is written to client, worker loop runs it after
+// each round of events
+void wsgiPoolCron()
+{
+    struct wsgiData *data;
+    struct listNode *node, *next;
+
+    // `streaming` is only changed by worker
+    if (!listLength(WsgiPool.streaming))
+        return ;
+    pthread_mutex_lock(&WsgiPool.lock);
+    for (node = listFirst(WsgiPool.streaming); node; node = next) {
+        next = node->next;
+        data = listNodeValue(node);
+        if (listLength(data->c->send_queue))
+            continue;
+        markWritten(data);
+        removeListNode(WsgiPool.streaming, node);
+        data->stream_node = NULL;
+    }
+    pthread_mutex_unlock(&WsgiPool.lock);
+}
+
+// Send body handed by running requests first, then responses of finished
+// requests one at a time because sending may free a client and conns of it
+// still in `done`.
+static void handleFinished(struct evcenter *center, int fd, void *client_data,
+        int mask)
+{
+    struct wsgiData *data;
+    struct listNode *node;
+
+    drainNotify();
+    while (1) {
+        pthread_mutex_lock(&WsgiPool.lock);
+        node = listFirst(WsgiPool.flushed);
+        data = node ? listNodeValue(node) : NULL;
+        if (node) {
+            removeListNode(WsgiPool.flushed, node);
+            data->flush_node = NULL;
+        }
+        pthread_mutex_unlock(&WsgiPool.lock);
+        if (data == NULL)
+            break;
+        sendHanded(data);
+    }
+    while (1) {
+        pthread_mutex_lock(&WsgiPool.lock);
+        node = listFirst(WsgiPool.done);
+        data = node ? listNodeValue(node) : NULL;
+        if (node) {
+            removeListNode(WsgiPool.done, node);
+            data->node = NULL;
+            data->job = WSGI_JOB_NONE;
+            stopStreaming(data);
+        }
+        pthread_mutex_unlock(&WsgiPool.lock);
+        if (data == NULL)
+            break;
+
+        (*WsgiPool.pooled)++;
+        *WsgiPool.queue_wait += data->wait;
+        if (data->wait > *WsgiPool.max_queue_wait)
+            *WsgiPool.max_queue_wait = data->wait;
+        wsgiFinishJob(data);
+    }
+}
+
+// Return WHEAT_WRONG if queue is full
+int wsgiPoolSubmit(struct wsgiData *data)
+{
+    pthread_mutex_lock(&WsgiPool.lock);
+    if (listLength(WsgiPool.pending) >= WsgiPool.depth) {
+        pthread_mutex_unlock(&WsgiPool.lock);
+        (*WsgiPool.rejected)++;
+        return WHEAT_WRONG;
+    }
+    gettimeofday(&data->queued, NULL);
+    data->job = WSGI_JOB_QUEUED;
+    data->node = appendToListTail(WsgiPool.pending, data);
+    pthread_cond_signal(&WsgiPool.wakeup);
+    pthread_mutex_unlock(&WsgiPool.lock);
+    return WHEAT_OK;
+}
+
+// Conn of `data` is being freed. Request still queued is dropped, running
+// one takes request data of conn and is released by pool thread when app
+// returns, otherwise `data` is released by pool thread now.
+void wsgiPoolRelease(struct wsgiData *data)
+{
+    pthread_mutex_lock(&WsgiPool.lock);
+    stopStreaming(data);
+    if (data->job == WSGI_JOB_RUNNING) {
+        data->job = WSGI_JOB_ORPHAN;
+        data->request = httpOrphanRequest(data->c);
+        pthread_cond_broadcast(&WsgiPool.drained);
+        pthread_mutex_unlock(&WsgiPool.lock);
+        return ;
+    }
+    if (data->job == WSGI_JOB_QUEUED)
+        removeListNode(WsgiPool.pending, data->node);
+    else if (data->job == WSGI_JOB_DONE)
+        removeListNode(WsgiPool.done, data->node);
+    data->job = WSGI_JOB_NONE;
+    data->node = appendToListTail(WsgiPool.garbage, data);
+    pthread_cond_signal(&WsgiPool.wakeup);
+    pthread_mutex_unlock(&WsgiPool.lock);
+}
+
+static int openNotify()
+{
+#ifdef __linux__
+    WsgiPool.notify_fd[0] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (WsgiPool.notify_fd[0] == -1)
+        return WHEAT_WRONG;
+    WsgiPool.notify_fd[1] = WsgiPool.notify_fd[0];
+#else
+    if (pipe(WsgiPool.notify_fd) == -1)
+        return WHEAT_WRONG;
+    wheatNonBlock(Server.neterr, WsgiPool.notify_fd[0]);
+    wheatNonBlock(Server.neterr, WsgiPool.notify_fd[1]);
+#endif
+    return WHEAT_OK;
+}
+
+// Called with the GIL held, which is given up to pool threads on success
+int initWsgiPool(int threads, size_t depth, size_t flush_size,
+        size_t buffer_size)
+{
+    sigset_t all, old;
+    int i;
+
+    memset(&WsgiPool, 0, sizeof(WsgiPool));
+    WsgiPool.depth = depth;
+    WsgiPool.flush_size = flush_size;
+    WsgiPool.buffer_size = buffer_size;
+    WsgiPool.pooled = &getStatValByName("Total wsgi pooled request");
+    WsgiPool.rejected = &getStatValByName("Total wsgi rejected request");
+    WsgiPool.queue_wait = &getStatValByName("Total wsgi queue wait");
+    WsgiPool.max_queue_wait = &getStatValByName("Max wsgi queue wait(us)");
+    WsgiPool.pending = createList();
+    WsgiPool.done = createList();
+    WsgiPool.garbage = createList();
+    WsgiPool.flushed = createList();
+    WsgiPool.streaming = createList();
+    WsgiPool.threads = wmalloc(sizeof(pthread_t)*threads);
+    if (!WsgiPool.pending || !WsgiPool.done || !WsgiPool.garbage ||
+            !WsgiPool.flushed || !WsgiPool.streaming || !WsgiPool.threads)
+        return WHEAT_WRONG;
+    if (openNotify() == WHEAT_WRONG) {
+        wheatLog(WHEAT_WARNING, "create wsgi pool notify fd failed: %s",
+                strerror(errno));
+        return WHEAT_WRONG;
+    }
+    if (createEvent(WorkerProcess->center, WsgiPool.notify_fd[0],
+                EVENT_READABLE, handleFinished, NULL) == WHEAT_WRONG)
+        return WHEAT_WRONG;
+    pthread_mutex_init(&WsgiPool.lock, NULL);
+    pthread_cond_init(&WsgiPool.wakeup, NULL);
+    pthread_cond_init(&WsgiPool.drained, NULL);
+
+    PyEval_InitThreads();
+    // Signals are left to worker loop
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&WsgiPool.threads[i], NULL, poolThread, NULL))
+            break;
+        WsgiPool.count++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    WsgiPool.main_state = PyEval_SaveThread();
+    if (WsgiPool.count != threads) {
+        wheatLog(WHEAT_WARNING, "create wsgi thread failed");
+        deallocWsgiPool();
+        return WHEAT_WRONG;
+    }
+    return WHEAT_OK;
+}
+
+// Wait for pool threads to exit and take the GIL back
+void deallocWsgiPool()
+{
+    int i;
+
+    if (WsgiPool.threads == NULL)
+        return ;
+    if (WsgiPool.main_state) {
+        pthread_mutex_lock(&WsgiPool.lock);
+        WsgiPool.stop = 1;
+        pthread_cond_broadcast(&WsgiPool.wakeup);
+        pthread_cond_broadcast(&WsgiPool.drained);
+        pthread_mutex_unlock(&WsgiPool.lock);
+        for (i = 0; i < WsgiPool.count; i++)
+            pthread_join(WsgiPool.threads[i], NULL);
+        PyEval_RestoreThread(WsgiPool.main_state);
+        releaseGarbage();
+        deleteEvent(WorkerProcess->center, WsgiPool.notify_fd[0],
+                EVENT_READABLE);
+        close(WsgiPool.notify_fd[0]);
+        if (WsgiPool.notify_fd[1] != WsgiPool.notify_fd[0])
+            close(WsgiPool.notify_fd[1]);
+        pthread_mutex_destroy(&WsgiPool.lock);
+        pthread_cond_destroy(&WsgiPool.wakeup);
+        pthread_cond_destroy(&WsgiPool.drained);
+    }
+    if (WsgiPool.pending)
+        freeList(WsgiPool.pending);
+    if (WsgiPool.done)
+        freeList(WsgiPool.done);
+    if (WsgiPool.garbage)
+        freeList(WsgiPool.garbage);
+    if (WsgiPool.flushed)
+        freeList(WsgiPool.flushed);
+    if (WsgiPool.streaming)
+        freeList(WsgiPool.streaming);
+    wfree(WsgiPool.threads);
+    memset(&WsgiPool, 0, sizeof(WsgiPool));
+}
@@ -24,23 +24,30 @@ FileWrapper_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
     self = (FileWrapper *)type->tp_alloc(type, 0);
     if (self != NULL) {
         self->filelike = NULL;
+        self->length = -1;
     }
 
     return (PyObject *)self;
 }
 
+/* wsgi.file_wrapper(filelike, blocksize=4096, length=-1), `length` isn't
+   in WSGI spec and limits bytes sent from current position of file. */
     static int
 FileWrapper_init(FileWrapper *self, PyObject *args, PyObject *kwds)
 {
+    static char *kwlist[] = {"filelike", "blocksize", "length", NULL};
     PyObject *filelike;
     int blocksize = 4096;
+    long length = -1;
 
-    if (!PyArg_ParseTuple(args, "O|i", &filelike, &blocksize))
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|il", kwlist, &filelike,
+                &blocksize, &length))
         return -1;
 
     Py_INCREF(filelike);
     self->filelike = filelike;
     self->blocksize = blocksize;
+    self->length = length < 0 ? -1 : length;
 
     return 0;
 }
@@ -61,12 +68,17 @@ static PyObject *
 FileWrapper_iternext(FileWrapper *self)
 {
     PyObject *pRead, *args, *data;
-    long len;
+    long len = self->blocksize;
+
+    if (self->length == 0)
+        return NULL;
+    if (self->length > 0 && self->length < len)
+        len = self->length;
 
     if ((pRead = PyObject_GetAttrString(self->filelike, "read")) == NULL)
         return NULL;
 
-    if ((args = Py_BuildValue("(i)", self->blocksize)) == NULL) {
+    if ((args = Py_BuildValue("(l)", len)) == NULL) {
         Py_DECREF(pRead);
         return NULL;
     }
@@ -88,6 +100,8 @@ FileWrapper_iternext(FileWrapper *self)
         PyErr_Clear();
         return NULL;
     }
+    if (self->length > 0)
+        self->length -= len;
 
     return data;
 }
@@ -4,14 +4,118 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
+#include <fcntl.h>
+#include <sys/stat.h>
+
 #include "wheatserver.h"
 
 #define WHEAT_MAX_LOGFILE    (100*1024*1024)
+#define WHEAT_LOG_BUFFER     (16*1024)
+
+// Log file is opened once and kept. Lines are appended to `buf` and written
+// out by wheatLogFlush, which is called every cron, when buffer is full
+// and immediately for WARNING level and raw messages. Rotation is checked
+// at most once per second after flush.
+//
+// `fd`: -1 means not opened yet
+// `failed`: last open failed, don't retry until reopen requested
+// `last_check`: the last time checking file size for rotation
+// `dropped`: lines discarded because flush couldn't make room, reported
+// with the next line that fits
+static struct logFile {
+    int fd;
+    int failed;
+    size_t len;
+    size_t dropped;
+    time_t last_check;
+    char buf[WHEAT_LOG_BUFFER];
+} LogFile = {-1};
+
+// Set by SIGUSR1 handler or reload, log file will be reopened before next
+// write. It make logrotate's "move and signal" work.
+static volatile sig_atomic_t LogReopen = 0;
+
+static void openLogFile()
+{
+    static int registered = 0;
+
+    LogReopen = 0;
+    if (LogFile.fd != -1 && LogFile.fd != STDOUT_FILENO)
+        close(LogFile.fd);
+    if (Server.logfile == NULL || !strcasecmp(Server.logfile, "stdout"))
+        LogFile.fd = STDOUT_FILENO;
+    else
+        LogFile.fd = open(Server.logfile, O_WRONLY|O_APPEND|O_CREAT, 0644);
+    LogFile.failed = LogFile.fd == -1;
+    if (!registered) {
+        atexit(wheatLogFlush);
+        registered = 1;
+    }
+}
+
+// Other process may have rotated file already, only reopen if the path
+// doesn't refer to our fd.
+static void rotateLogFile()
+{
+    struct stat fd_stat, path_stat;
+    char newname[WHEATSERVER_PATH_LEN], date[32];
+    time_t now = time(NULL);
+
+    if (now == LogFile.last_check)
+        return ;
+    LogFile.last_check = now;
+    if (fstat(LogFile.fd, &fd_stat) == -1 || fd_stat.st_size <= WHEAT_MAX_LOGFILE)
+        return ;
+    if (stat(Server.logfile, &path_stat) == 0 &&
+            path_stat.st_ino == fd_stat.st_ino &&
+            path_stat.st_dev == fd_stat.st_dev) {
+        strftime(date, sizeof(date), "%Y%m%d-%H%M%S", localtime(&now));
+        snprintf(newname, sizeof(newname), "%s.%s", Server.logfile, date);
+        rename(Server.logfile, newname);
+    }
+    openLogFile();
+}
+
+void wheatLogReopen()
+{
+    LogReopen = 1;
+}
+
+void wheatLogFlush()
+{
+    ssize_t nwritten;
+    size_t pos = 0;
+
+    if (LogReopen)
+        openLogFile();
+    if (LogFile.fd == -1) {
+        LogFile.len = 0;
+        return ;
+    }
+    while (pos < LogFile.len) {
+        nwritten = write(LogFile.fd, LogFile.buf+pos, LogFile.len-pos);
+        if (nwritten == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        pos += nwritten;
+    }
+    if (pos < LogFile.len && errno == EAGAIN) {
+        memmove(LogFile.buf, LogFile.buf+pos, LogFile.len-pos);
+        LogFile.len -= pos;
+    } else {
+        LogFile.len = 0;
+    }
+    if (LogFile.fd != STDOUT_FILENO)
+        rotateLogFile();
+}
 
 // TODO: When reload config file if specify logfile is stdout,
 // now code can't redirect back to stdout.
 void logRedirect()
 {
+    wheatLogReopen();
     if (Server.logfile && strcasecmp(Server.logfile, "stdout")) {
         FILE *fp;
         fclose(stdin);
@@ -34,40 +138,22 @@ void logRedirect()
     }
 }
 
-// Now, logging will open file and flush it to disk if logfile is file, close
-// it finally. It may slower process jobs and not effective.
-// TODO: Open file and keep file description. Export flush policy to users.
 void wheatLogRaw(int level, const char *msg)
 {
     static char *c = ".-* #";
-    FILE *fp;
-    char buf[64];
-    off_t len;
+    char buf[64], line[WHEATSERVER_MAX_LOG_LEN+128];
     int rawmode = (level & WHEAT_LOG_RAW);
+    int len;
 
     level &= 0xff; /* clear flags */
     if (level < Server.verbose) return;
 
-    if (Server.logfile == NULL || !strcasecmp(Server.logfile, "stdout")) {
-        fp = stdout;
-    } else {
-        fp = fopen(Server.logfile, "a");
-        if (getFileSizeAndMtime(fileno(fp), &len, NULL)) {
-            if (len > WHEAT_MAX_LOGFILE) {
-                char newname[WHEATSERVER_PATH_LEN];
-                time_t now;
-                fclose(fp);
-                now = time(NULL);
-                snprintf(newname, sizeof(newname), "%s.%s", Server.logfile, ctime(&now));
-                rename(Server.logfile, newname);
-                fp = fopen(Server.logfile, "a");
-            }
-        }
-    }
-    if (!fp) return;
+    if (LogReopen || (LogFile.fd == -1 && !LogFile.failed))
+        openLogFile();
+    if (LogFile.fd == -1) return;
 
     if (rawmode) {
-        fprintf(fp,"%s",msg);
+        len = snprintf(line, sizeof(line), "%s", msg);
     } else {
         size_t off;
         struct timeval tv;
@@ -75,11 +161,35 @@ void wheatLogRaw(int level, const char *msg)
         gettimeofday(&tv,NULL);
         off = strftime(buf, sizeof(buf), "%d %b %H:%M:%S.", localtime(&tv.tv_sec));
         snprintf(buf+off, sizeof(buf)-off, "%03d", (int)tv.tv_usec/1000);
-        fprintf(fp,"[%d] %s %c %s\n", (int)getpid(), buf, c[level], msg);
+        len = snprintf(line, sizeof(line), "[%d] %s %c %s\n", (int)getpid(),
+                buf, c[level], msg);
     }
-    fflush(fp);
+    if (len < 0)
+        return ;
+    if (len >= sizeof(line))
+        len = sizeof(line) - 1;
 
-    if (fp != stdout) fclose(fp);
+    if (LogFile.len + len > sizeof(LogFile.buf))
+        wheatLogFlush();
+    // Flush keeps unwritten bytes on EAGAIN, writing this line around the
+    // buffer would reorder output, so drop it
+    if (LogFile.len + len > sizeof(LogFile.buf)) {
+        LogFile.dropped++;
+        return ;
+    }
+    if (LogFile.dropped) {
+        int n = snprintf(buf, sizeof(buf), "[%d] %zu log lines dropped\n",
+                (int)getpid(), LogFile.dropped);
+        if (n > 0 && LogFile.len + n + len <= sizeof(LogFile.buf)) {
+            memcpy(LogFile.buf+LogFile.len, buf, n);
+            LogFile.len += n;
+            LogFile.dropped = 0;
+        }
+    }
+    memcpy(LogFile.buf+LogFile.len, line, len);
+    LogFile.len += len;
+    if (rawmode || level >= WHEAT_WARNING)
+        wheatLogFlush();
 }
 
 // `level`: different log level setting will decide whether log message or not.
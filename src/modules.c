@@ -2,6 +2,7 @@
 extern struct moduleAttr AppWsgiAttr;
 extern struct moduleAttr AppStaticAttr;
 extern struct moduleAttr AppRedisAttr;
+extern struct moduleAttr AppHttpProxyAttr;
 extern struct moduleAttr AppRamcloudAttr;
 extern struct moduleAttr ProtocolHttpAttr;
 extern struct moduleAttr ProtocolMemcacheAttr;
@@ -12,6 +13,7 @@ struct moduleAttr *ModuleTable[] = {
 &AppWsgiAttr,
 &AppStaticAttr,
 &AppRedisAttr,
+&AppHttpProxyAttr,
 &AppRamcloudAttr,
 &ProtocolHttpAttr,
 &ProtocolMemcacheAttr,
@@ -59,6 +59,26 @@ int writeBulkTo(int fd, struct slice *slice)
     return (int)nwritten;
 }
 
+int writeVecTo(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t nwritten;
+
+    nwritten = writev(fd, iov, iovcnt);
+    if (nwritten == -1) {
+        if (errno == EAGAIN) {
+            nwritten = 0;
+        } else if (errno == EPIPE) {
+            wheatLog(WHEAT_DEBUG, "Receive RST, peer closed", strerror(errno));
+            return WHEAT_WRONG;
+        } else {
+            wheatLog(WHEAT_NOTICE,
+                "Error writing to client: %s", strerror(errno));
+            return WHEAT_WRONG;
+        }
+    }
+    return (int)nwritten;
+}
+
 int syncWriteBulkTo(int fd, struct slice *slice)
 {
     int totallen, ret;
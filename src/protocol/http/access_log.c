@@ -0,0 +1,319 @@
+// Buffered access log of Http protocol
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "proto_http.h"
+
+// Records are preformatted into `buf` on request path and written out with
+// one `write` from cron, when `flush_interval` milliseconds passed since
+// last flush or `buf` is above `high_water`. If a record can't fit into
+// `buf`, "Block" policy flushes synchronously and "Drop" policy discards the
+// record and counts it in stat "Total dropped access log".
+//
+// Binary record layout(little-endian):
+//     | magic(1) | version(1) | record len(2) | time(4) | status(2) |
+//     | response length(8) | method len(1) | http major(1) | http minor(1) |
+//     | remote addr len(2) | path len(2) | referer len(2) | agent len(2) |
+//     | method | remote addr | path | referer | user agent |
+// client/accesslog.py converts it back to text format.
+#define ACCESS_LOG_MAGIC          0xA7
+#define ACCESS_LOG_VERSION        3
+#define ACCESS_LOG_BINARY_HEADER  29
+#define ACCESS_LOG_FIELD_MAX      1024
+#define ACCESS_LOG_MIN_BUFFER     4096
+
+struct accessLog {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t size;
+    size_t high_water;
+    long long flush_interval;
+    int drop;
+    int binary;
+    struct timeval last_flush;
+    long long *dropped;
+    char date[64];
+    size_t date_len;
+    time_t date_time;
+};
+
+static struct accessLog AccessLog = {-1};
+
+static int openAccessLog()
+{
+    char *access_log = getConfiguration("access-log")->target.ptr;
+
+    if (access_log == NULL)
+        return -1;
+    if (!strcasecmp(access_log, "stdout"))
+        return STDOUT_FILENO;
+    return open(access_log, O_WRONLY|O_APPEND|O_CREAT, 0644);
+}
+
+static void closeAccessLog()
+{
+    if (AccessLog.fd != -1 && AccessLog.fd != STDOUT_FILENO)
+        close(AccessLog.fd);
+    AccessLog.fd = -1;
+}
+
+// Write out as much as possible, the remainder is kept at the head of
+// buffer if write is interrupted.
+static void flushAccessLog()
+{
+    ssize_t nwritten;
+    size_t pos = 0;
+
+    AccessLog.last_flush = Server.cron_time;
+    while (pos < AccessLog.len) {
+        nwritten = write(AccessLog.fd, AccessLog.buf+pos, AccessLog.len-pos);
+        if (nwritten == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            wheatLog(WHEAT_WARNING, "log access failed: %s", strerror(errno));
+            closeAccessLog();
+            AccessLog.fd = openAccessLog();
+            if (AccessLog.fd == -1) {
+                wheatLog(WHEAT_WARNING, "open access log failed");
+                halt(1);
+            }
+            continue;
+        }
+        pos += nwritten;
+    }
+    if (pos != AccessLog.len)
+        memmove(AccessLog.buf, AccessLog.buf+pos, AccessLog.len-pos);
+    AccessLog.len -= pos;
+}
+
+static char *reserveAccessLog(size_t need)
+{
+    if (AccessLog.len + need > AccessLog.size) {
+        if (!AccessLog.drop)
+            flushAccessLog();
+        if (AccessLog.len + need > AccessLog.size) {
+            (*AccessLog.dropped)++;
+            return NULL;
+        }
+    }
+    return AccessLog.buf + AccessLog.len;
+}
+
+static void refreshAccessLogDate()
+{
+    struct tm tm;
+    time_t now = Server.cron_time.tv_sec;
+
+    if (now == AccessLog.date_time)
+        return ;
+    gmtime_r(&now, &tm);
+    AccessLog.date_len = strftime(AccessLog.date, sizeof(AccessLog.date),
+            "%d/%b/%Y:%H:%M:%S +0000", &tm);
+    AccessLog.date_time = now;
+}
+
+static inline char *putLittle16(char *p, unsigned v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    return p + 2;
+}
+
+static inline char *putLittle32(char *p, unsigned long v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+    return p + 4;
+}
+
+static inline char *putLittle64(char *p, unsigned long long v)
+{
+    p = putLittle32(p, v & 0xffffffff);
+    return putLittle32(p, v >> 32);
+}
+
+#define APPEND(p, s, l) do {          \
+    memcpy((p), (s), (l));            \
+    (p) += (l);                       \
+} while (0)
+
+static void logAccessBinary(struct conn *c, const char *method,
+        const struct slice *fields)
+{
+    size_t total, method_len;
+    const char *version;
+    char *p;
+    int i;
+
+    method_len = strlen(method);
+    total = ACCESS_LOG_BINARY_HEADER + method_len;
+    for (i = 0; i < 4; i++)
+        total += fields[i].len;
+    if ((p = reserveAccessLog(total)) == NULL)
+        return ;
+
+    version = httpGetProtocolVersion(c);
+    *p++ = (char)ACCESS_LOG_MAGIC;
+    *p++ = ACCESS_LOG_VERSION;
+    p = putLittle16(p, total);
+    p = putLittle32(p, Server.cron_time.tv_sec);
+    p = putLittle16(p, httpGetResStatus(c));
+    p = putLittle64(p, httpGetResLength(c));
+    *p++ = method_len;
+    *p++ = version[HTTP_VERSION_LEN-3] - '0';
+    *p++ = version[HTTP_VERSION_LEN-1] - '0';
+    for (i = 0; i < 4; i++)
+        p = putLittle16(p, fields[i].len);
+    APPEND(p, method, method_len);
+    for (i = 0; i < 4; i++)
+        APPEND(p, fields[i].data, fields[i].len);
+    AccessLog.len += total;
+}
+
+// Apache combined log format:
+// remote_addr - - [date] "method path version" status length "referer" "agent"
+static void logAccessText(struct conn *c, const char *method,
+        const struct slice *fields)
+{
+    char status[16], length[32];
+    const char *version;
+    size_t total, method_len, status_len, length_len;
+    char *p;
+    int i;
+
+    method_len = strlen(method);
+    version = httpGetProtocolVersion(c);
+    status_len = ll2string(status, sizeof(status), httpGetResStatus(c));
+    length_len = ll2string(length, sizeof(length), httpGetResLength(c));
+    total = AccessLog.date_len + method_len + HTTP_VERSION_LEN + status_len +
+        length_len + 21;
+    for (i = 0; i < 4; i++)
+        total += fields[i].len;
+    if ((p = reserveAccessLog(total)) == NULL)
+        return ;
+
+    APPEND(p, fields[0].data, fields[0].len);
+    APPEND(p, " - - [", 6);
+    APPEND(p, AccessLog.date, AccessLog.date_len);
+    APPEND(p, "] \"", 3);
+    APPEND(p, method, method_len);
+    *p++ = ' ';
+    APPEND(p, fields[1].data, fields[1].len);
+    *p++ = ' ';
+    APPEND(p, version, HTTP_VERSION_LEN);
+    APPEND(p, "\" ", 2);
+    APPEND(p, status, status_len);
+    *p++ = ' ';
+    APPEND(p, length, length_len);
+    APPEND(p, " \"", 2);
+    APPEND(p, fields[2].data, fields[2].len);
+    APPEND(p, "\" \"", 3);
+    APPEND(p, fields[3].data, fields[3].len);
+    APPEND(p, "\"\n", 2);
+    AccessLog.len += total;
+}
+
+void logAccess(struct conn *c)
+{
+    const struct slice *s;
+    struct slice fields[4];
+    const char *method;
+    int i;
+
+    if (AccessLog.fd == -1)
+        return ;
+
+    // remote addr, path, referer, user agent
+    s = httpGetReqHeader(c, HTTP_HEADER_REMOTE_ADDR);
+    if (s)
+        fields[0] = *s;
+    else
+        sliceTo(&fields[0], (uint8_t *)getConnIP(c), wstrlen(getConnIP(c)));
+    fields[1] = *httpGetPath(c);
+    s = httpGetReqHeader(c, HTTP_HEADER_REFERER);
+    if (s)
+        fields[2] = *s;
+    else
+        sliceTo(&fields[2], (uint8_t *)"-", 1);
+    s = httpGetReqHeader(c, HTTP_HEADER_USER_AGENT);
+    if (s)
+        fields[3] = *s;
+    else
+        sliceTo(&fields[3], (uint8_t *)"-", 1);
+    for (i = 0; i < 4; i++) {
+        if (fields[i].len > ACCESS_LOG_FIELD_MAX)
+            fields[i].len = ACCESS_LOG_FIELD_MAX;
+    }
+
+    method = httpGetMethod(c);
+    if (AccessLog.binary) {
+        logAccessBinary(c, method, fields);
+    } else {
+        refreshAccessLogDate();
+        logAccessText(c, method, fields);
+    }
+}
+
+void accessLogCron()
+{
+    long long elapsed;
+
+    if (AccessLog.fd == -1 || !AccessLog.len)
+        return ;
+    elapsed = (getMicroseconds(Server.cron_time) -
+            getMicroseconds(AccessLog.last_flush)) / 1000;
+    if (elapsed >= AccessLog.flush_interval ||
+            AccessLog.len >= AccessLog.high_water)
+        flushAccessLog();
+}
+
+int initAccessLog()
+{
+    struct configuration *conf;
+
+    AccessLog.fd = openAccessLog();
+    if (AccessLog.fd == -1) {
+        if (getConfiguration("access-log")->target.ptr)
+            wheatLog(WHEAT_NOTICE, "open access log failed: %s", strerror(errno));
+        return WHEAT_OK;
+    }
+
+    conf = getConfiguration("access-log-buffer-size");
+    AccessLog.size = conf->target.val;
+    if (AccessLog.size < ACCESS_LOG_MIN_BUFFER)
+        AccessLog.size = ACCESS_LOG_MIN_BUFFER;
+    AccessLog.high_water = AccessLog.size / 4 * 3;
+    AccessLog.buf = wmalloc(AccessLog.size);
+    if (AccessLog.buf == NULL) {
+        closeAccessLog();
+        return WHEAT_WRONG;
+    }
+    AccessLog.len = 0;
+    AccessLog.flush_interval = getConfiguration("access-log-flush-interval")->target.val;
+    AccessLog.drop = getConfiguration("access-log-policy")->target.enum_ptr->id;
+    AccessLog.binary = getConfiguration("access-log-format")->target.enum_ptr->id;
+    AccessLog.dropped = &getStatValByName("Total dropped access log");
+    AccessLog.last_flush = Server.cron_time;
+    AccessLog.date_time = 0;
+    return WHEAT_OK;
+}
+
+void deallocAccessLog()
+{
+    if (AccessLog.fd != -1 && AccessLog.len)
+        flushAccessLog();
+    closeAccessLog();
+    wfree(AccessLog.buf);
+    AccessLog.buf = NULL;
+    AccessLog.len = AccessLog.size = 0;
+}
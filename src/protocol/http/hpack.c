@@ -0,0 +1,623 @@
+// HPACK header compression for HTTP/2(RFC 7541)
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "hpack.h"
+#include "../../memalloc.h"
+
+#define HPACK_STATIC_COUNT   61
+#define HPACK_HUFFMAN_EOS    256
+#define HPACK_HUFFMAN_MAXLEN 30
+
+static const struct {
+    const char *name;
+    const char *value;
+} StaticTable[HPACK_STATIC_COUNT] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+// Huffman code of RFC 7541 Appendix B is canonical, so code lengths are
+// enough to rebuild it: codes of the same length are consecutive in symbol
+// order and the first code of each length follows the last one shorter.
+static const uint8_t HuffmanCodeLen[HPACK_HUFFMAN_EOS+1] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+static uint16_t HuffmanSymbols[HPACK_HUFFMAN_EOS+1];
+static uint32_t HuffmanFirst[HPACK_HUFFMAN_MAXLEN+1];
+static uint16_t HuffmanCount[HPACK_HUFFMAN_MAXLEN+1];
+static uint16_t HuffmanOffset[HPACK_HUFFMAN_MAXLEN+1];
+static int HuffmanReady = 0;
+
+static void buildHuffman()
+{
+    uint32_t code = 0;
+    int len, sym, n = 0;
+
+    for (len = 1; len <= HPACK_HUFFMAN_MAXLEN; len++) {
+        HuffmanOffset[len] = n;
+        for (sym = 0; sym <= HPACK_HUFFMAN_EOS; sym++) {
+            if (HuffmanCodeLen[sym] == len)
+                HuffmanSymbols[n++] = sym;
+        }
+        HuffmanCount[len] = n - HuffmanOffset[len];
+        HuffmanFirst[len] = code;
+        code = (code + HuffmanCount[len]) << 1;
+    }
+    HuffmanReady = 1;
+}
+
+// Decoded string is at most 8/5 of encoded one since the shortest code is
+// 5 bits. Padding must be the most significant bits of EOS and shorter
+// than 8 bits.
+static int huffmanDecode(const uint8_t *p, size_t len, wstr *store)
+{
+    const uint8_t *end = p + len;
+    uint32_t code = 0, idx;
+    int bits = 0, i;
+    size_t old_len;
+    char *out;
+    wstr s;
+
+    if (!HuffmanReady)
+        buildHuffman();
+    s = wstrMakeRoom(*store, len * 8 / 5 + 1);
+    if (s == NULL)
+        return -1;
+    *store = s;
+    old_len = wstrlen(s);
+    out = s + old_len;
+    for (; p < end; p++) {
+        for (i = 7; i >= 0; i--) {
+            code = (code << 1) | ((*p >> i) & 1);
+            if (++bits > HPACK_HUFFMAN_MAXLEN)
+                return -1;
+            idx = code - HuffmanFirst[bits];
+            if (code >= HuffmanFirst[bits] && idx < HuffmanCount[bits]) {
+                idx = HuffmanSymbols[HuffmanOffset[bits] + idx];
+                if (idx == HPACK_HUFFMAN_EOS)
+                    return -1;
+                *out++ = (char)idx;
+                code = 0;
+                bits = 0;
+            }
+        }
+    }
+    if (bits > 7 || code != (1U << bits) - 1)
+        return -1;
+    wstrupdatelen(s, (int)(old_len + (out - (s + old_len))));
+    return 0;
+}
+
+static int decodeInt(const uint8_t **pp, const uint8_t *end, int prefix,
+        size_t *value)
+{
+    const uint8_t *p = *pp;
+    size_t max = (1 << prefix) - 1, v;
+    int shift = 0;
+
+    if (p == end)
+        return -1;
+    v = *p++ & max;
+    if (v == max) {
+        do {
+            if (p == end || shift > 28)
+                return -1;
+            v += (size_t)(*p & 0x7f) << shift;
+            shift += 7;
+        } while (*p++ & 0x80);
+    }
+    *pp = p;
+    *value = v;
+    return 0;
+}
+
+static int appendString(wstr *store, const char *s, size_t len)
+{
+    wstr copy = wstrCatLen(*store, s, len);
+
+    if (copy == NULL)
+        return -1;
+    copy = wstrCatLen(copy, "", 1);
+    if (copy == NULL)
+        return -1;
+    *store = copy;
+    return 0;
+}
+
+// Append string literal to `store` and set its offset and length
+static int decodeString(const uint8_t **pp, const uint8_t *end, wstr *store,
+        size_t *off, size_t *len)
+{
+    const uint8_t *p = *pp;
+    size_t n;
+    int huffman;
+
+    if (p == end)
+        return -1;
+    huffman = *p & 0x80;
+    if (decodeInt(&p, end, 7, &n) == -1 || n > (size_t)(end - p))
+        return -1;
+    *off = wstrlen(*store);
+    if (huffman) {
+        if (huffmanDecode(p, n, store) == -1 ||
+                appendString(store, "", 0) == -1)
+            return -1;
+    } else if (appendString(store, (const char *)p, n) == -1) {
+        return -1;
+    }
+    *len = wstrlen(*store) - *off - 1;
+    *pp = p + n;
+    return 0;
+}
+
+void hpackInitTable(struct hpackTable *table, size_t limit)
+{
+    memset(table, 0, sizeof(*table));
+    table->max_size = table->limit = limit;
+}
+
+static struct hpackEntry *tableEntry(struct hpackTable *table, size_t pos)
+{
+    return &table->entries[(table->head + table->cap - pos) % table->cap];
+}
+
+static void evictEntries(struct hpackTable *table, size_t size)
+{
+    struct hpackEntry *entry;
+
+    while (table->count && table->size + size > table->max_size) {
+        entry = tableEntry(table, table->count - 1);
+        table->size -= wstrlen(entry->field) - 1 + HPACK_ENTRY_OVERHEAD;
+        wstrFree(entry->field);
+        entry->field = NULL;
+        table->count--;
+    }
+}
+
+static int addEntry(struct hpackTable *table, const char *name,
+        size_t name_len, const char *value, size_t value_len)
+{
+    struct hpackEntry *entries;
+    size_t size = name_len + value_len + HPACK_ENTRY_OVERHEAD, i, cap;
+    wstr field;
+
+    evictEntries(table, size);
+    // Entry larger than table empties it and isn't added
+    if (size > table->max_size)
+        return 0;
+    if (table->count == table->cap) {
+        cap = table->cap ? table->cap * 2 : 16;
+        entries = wmalloc(sizeof(*entries) * cap);
+        if (entries == NULL)
+            return -1;
+        for (i = 0; i < table->count; i++)
+            entries[i] = *tableEntry(table, table->count - 1 - i);
+        wfree(table->entries);
+        table->entries = entries;
+        table->cap = cap;
+        table->head = table->count ? table->count - 1 : cap - 1;
+    }
+    field = wstrNewLen(name, (int)name_len);
+    if (field == NULL || (field = wstrCatLen(field, "", 1)) == NULL ||
+            (field = wstrCatLen(field, value, value_len)) == NULL)
+        return -1;
+    table->head = (table->head + 1) % table->cap;
+    table->entries[table->head].field = field;
+    table->entries[table->head].name_len = name_len;
+    table->count++;
+    table->size += size;
+    return 0;
+}
+
+void hpackFreeTable(struct hpackTable *table)
+{
+    table->max_size = 0;
+    evictEntries(table, 0);
+    wfree(table->entries);
+    table->entries = NULL;
+    table->cap = 0;
+}
+
+// Index 1 to 61 is static table, later ones are dynamic table from newest
+static int lookupIndex(struct hpackTable *table, size_t index,
+        const char **name, size_t *name_len, const char **value,
+        size_t *value_len)
+{
+    struct hpackEntry *entry;
+
+    if (index == 0)
+        return -1;
+    if (index <= HPACK_STATIC_COUNT) {
+        *name = StaticTable[index-1].name;
+        *name_len = strlen(*name);
+        *value = StaticTable[index-1].value;
+        *value_len = strlen(*value);
+        return 0;
+    }
+    index -= HPACK_STATIC_COUNT + 1;
+    if (index >= table->count)
+        return -1;
+    entry = tableEntry(table, index);
+    *name = entry->field;
+    *name_len = entry->name_len;
+    *value = entry->field + entry->name_len + 1;
+    *value_len = wstrlen(entry->field) - entry->name_len - 1;
+    return 0;
+}
+
+int hpackDecode(struct hpackTable *table, const uint8_t *p, size_t len,
+        wstr *store, struct array *fields)
+{
+    const uint8_t *end = p + len;
+    const char *name, *value;
+    size_t index, name_len, value_len;
+    struct hpackField field;
+    int indexing, prefix;
+
+    while (p < end) {
+        if (*p & 0x80) {
+            if (decodeInt(&p, end, 7, &index) == -1 ||
+                    lookupIndex(table, index, &name, &name_len, &value,
+                        &value_len) == -1)
+                return -1;
+            field.name = wstrlen(*store);
+            field.name_len = name_len;
+            field.value = field.name + name_len + 1;
+            field.value_len = value_len;
+            if (appendString(store, name, name_len) == -1 ||
+                    appendString(store, value, value_len) == -1)
+                return -1;
+            arrayPush(fields, &field);
+            continue;
+        }
+        if ((*p & 0xe0) == 0x20) {
+            // Dynamic table size update is only allowed before fields
+            if (narray(fields) || decodeInt(&p, end, 5, &index) == -1 ||
+                    index > table->limit)
+                return -1;
+            table->max_size = index;
+            evictEntries(table, 0);
+            continue;
+        }
+        indexing = (*p & 0xc0) == 0x40;
+        prefix = indexing ? 6 : 4;
+        if (decodeInt(&p, end, prefix, &index) == -1)
+            return -1;
+        if (index) {
+            if (lookupIndex(table, index, &name, &name_len, &value,
+                        &value_len) == -1)
+                return -1;
+            field.name = wstrlen(*store);
+            field.name_len = name_len;
+            if (appendString(store, name, name_len) == -1)
+                return -1;
+        } else if (decodeString(&p, end, store, &field.name,
+                    &field.name_len) == -1) {
+            return -1;
+        }
+        if (decodeString(&p, end, store, &field.value, &field.value_len) == -1)
+            return -1;
+        if (indexing && addEntry(table, *store + field.name, field.name_len,
+                    *store + field.value, field.value_len) == -1)
+            return -1;
+        arrayPush(fields, &field);
+    }
+    return 0;
+}
+
+static wstr encodeInt(wstr out, uint8_t flags, int prefix, size_t value)
+{
+    size_t max = (1 << prefix) - 1;
+    uint8_t buf[16];
+    int n = 0;
+
+    if (value < max) {
+        buf[n++] = flags | (uint8_t)value;
+    } else {
+        buf[n++] = flags | (uint8_t)max;
+        value -= max;
+        while (value >= 0x80) {
+            buf[n++] = (uint8_t)(value & 0x7f) | 0x80;
+            value >>= 7;
+        }
+        buf[n++] = (uint8_t)value;
+    }
+    return wstrCatLen(out, (const char *)buf, n);
+}
+
+static wstr encodeString(wstr out, const char *s, size_t len, int lower)
+{
+    size_t i, old_len;
+
+    out = encodeInt(out, 0, 7, len);
+    if (out == NULL || (out = wstrMakeRoom(out, len)) == NULL)
+        return NULL;
+    old_len = wstrlen(out);
+    if (lower) {
+        for (i = 0; i < len; i++)
+            out[old_len+i] = tolower((unsigned char)s[i]);
+    } else {
+        memcpy(out + old_len, s, len);
+    }
+    wstrupdatelen(out, (int)(old_len + len));
+    return out;
+}
+
+wstr hpackEncodeStatus(wstr out, int status)
+{
+    char buf[8];
+    int i;
+
+    // ":status" entries of static table are 8 to 14
+    for (i = 7; i < 14; i++) {
+        if (atoi(StaticTable[i].value) == status)
+            return encodeInt(out, 0x80, 7, i + 1);
+    }
+    snprintf(buf, sizeof(buf), "%03d", status % 1000);
+    out = encodeInt(out, 0x00, 4, 8);
+    if (out == NULL)
+        return NULL;
+    return encodeString(out, buf, 3, 0);
+}
+
+// Literal header field without indexing, name refers static table if
+// possible. HTTP/2 requires lowercase field name.
+wstr hpackEncodeField(wstr out, const char *name, size_t name_len,
+        const char *value, size_t value_len)
+{
+    size_t index = 0, i;
+
+    for (i = 0; i < HPACK_STATIC_COUNT; i++) {
+        if (strlen(StaticTable[i].name) != name_len ||
+                strncasecmp(StaticTable[i].name, name, name_len))
+            continue;
+        if (!index)
+            index = i + 1;
+        if (strlen(StaticTable[i].value) == value_len &&
+                !memcmp(StaticTable[i].value, value, value_len))
+            return encodeInt(out, 0x80, 7, i + 1);
+    }
+    out = encodeInt(out, 0x00, 4, index);
+    if (out == NULL)
+        return NULL;
+    if (!index && (out = encodeString(out, name, name_len, 1)) == NULL)
+        return NULL;
+    return encodeString(out, value, value_len, 0);
+}
+
+#ifdef HPACK_TEST_MAIN
+#include "../../test_help.h"
+
+static int fromHex(const char *hex, uint8_t *buf)
+{
+    int n = 0;
+    unsigned int byte;
+
+    while (*hex) {
+        if (*hex == ' ') {
+            hex++;
+            continue;
+        }
+        sscanf(hex, "%2x", &byte);
+        buf[n++] = (uint8_t)byte;
+        hex += 2;
+    }
+    return n;
+}
+
+// Decode `hex` and check fields against "name: value\n" lines
+static int checkDecode(struct hpackTable *table, const char *hex,
+        const char *expect, size_t size)
+{
+    struct array *fields = arrayCreate(sizeof(struct hpackField), 8);
+    struct hpackField *field;
+    wstr store = wstrEmpty(), text = wstrEmpty();
+    uint8_t buf[512];
+    size_t i;
+    int ok;
+
+    ok = hpackDecode(table, buf, fromHex(hex, buf), &store, fields) == 0;
+    for (i = 0; ok && i < narray(fields); i++) {
+        field = arrayIndex(fields, i);
+        text = wstrCatLen(text, store + field->name, field->name_len);
+        text = wstrCatLen(text, ": ", 2);
+        text = wstrCatLen(text, store + field->value, field->value_len);
+        text = wstrCatLen(text, "\n", 1);
+    }
+    ok = ok && !strcmp(text, expect) && table->size == size;
+    wstrFree(store);
+    wstrFree(text);
+    arrayDealloc(fields);
+    return ok;
+}
+
+int main(int argc, const char *argv[])
+{
+    struct hpackTable table;
+    wstr out;
+    uint8_t buf[64];
+
+    {
+        hpackInitTable(&table, HPACK_DEFAULT_TABLE_SIZE);
+        test_cond("hpackDecode literal with indexing(C.2.1)",
+                checkDecode(&table, "400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f"
+                    "6d2d 6865 6164 6572", "custom-key: custom-header\n", 55));
+        hpackFreeTable(&table);
+    }
+    {
+        hpackInitTable(&table, HPACK_DEFAULT_TABLE_SIZE);
+        test_cond("hpackDecode request(C.3.1)",
+                checkDecode(&table, "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63"
+                    "6f6d", ":method: GET\n:scheme: http\n:path: /\n"
+                    ":authority: www.example.com\n", 57));
+        test_cond("hpackDecode request(C.3.2)",
+                checkDecode(&table, "8286 84be 5808 6e6f 2d63 6163 6865",
+                    ":method: GET\n:scheme: http\n:path: /\n"
+                    ":authority: www.example.com\ncache-control: no-cache\n", 110));
+        test_cond("hpackDecode request(C.3.3)",
+                checkDecode(&table, "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63"
+                    "7573 746f 6d2d 7661 6c75 65", ":method: GET\n:scheme: https\n"
+                    ":path: /index.html\n:authority: www.example.com\n"
+                    "custom-key: custom-value\n", 164));
+        hpackFreeTable(&table);
+    }
+    {
+        hpackInitTable(&table, HPACK_DEFAULT_TABLE_SIZE);
+        test_cond("hpackDecode huffman request(C.4.1)",
+                checkDecode(&table, "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+                    ":method: GET\n:scheme: http\n:path: /\n"
+                    ":authority: www.example.com\n", 57));
+        test_cond("hpackDecode huffman request(C.4.2)",
+                checkDecode(&table, "8286 84be 5886 a8eb 1064 9cbf",
+                    ":method: GET\n:scheme: http\n:path: /\n"
+                    ":authority: www.example.com\ncache-control: no-cache\n", 110));
+        test_cond("hpackDecode huffman request(C.4.3)",
+                checkDecode(&table, "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849"
+                    "e95b b8e8 b4bf", ":method: GET\n:scheme: https\n"
+                    ":path: /index.html\n:authority: www.example.com\n"
+                    "custom-key: custom-value\n", 164));
+        hpackFreeTable(&table);
+    }
+    {
+        hpackInitTable(&table, 256);
+        test_cond("hpackDecode huffman response(C.6.1)",
+                checkDecode(&table, "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410"
+                    "54d4 44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad 1718"
+                    "63c7 8f0b 97c8 e9ae 82ae 43d3", ":status: 302\n"
+                    "cache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n"
+                    "location: https://www.example.com\n", 222));
+        test_cond("hpackDecode eviction(C.6.2)",
+                checkDecode(&table, "4883 640e ffc1 c0bf", ":status: 307\n"
+                    "cache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n"
+                    "location: https://www.example.com\n", 222));
+        test_cond("hpackDecode eviction(C.6.3)",
+                checkDecode(&table, "88c1 6196 d07a be94 1054 d444 a820 0595 040b"
+                    "8166 e084 a62d 1bff c05a 839b d9ab 77ad 94e7 821d d7f2 e6c7"
+                    "b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587"
+                    "3160 65c0 03ed 4ee5 b106 3d50 07", ":status: 200\n"
+                    "cache-control: private\ndate: Mon, 21 Oct 2013 20:13:22 GMT\n"
+                    "location: https://www.example.com\ncontent-encoding: gzip\n"
+                    "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; "
+                    "version=1\n", 215));
+        hpackFreeTable(&table);
+    }
+    {
+        hpackInitTable(&table, HPACK_DEFAULT_TABLE_SIZE);
+        test_cond("hpackDecode bad index",
+                !checkDecode(&table, "be", "", 0));
+        test_cond("hpackDecode EOS in huffman",
+                !checkDecode(&table, "0001 6184 ffff fffc", "", 0));
+        test_cond("hpackDecode long padding",
+                !checkDecode(&table, "0001 6182 1fff", "", 0));
+        test_cond("hpackDecode size update over limit",
+                !checkDecode(&table, "3fe2 1f", "", 0));
+        test_cond("hpackDecode truncated",
+                !checkDecode(&table, "400a 6375", "", 0));
+        hpackFreeTable(&table);
+    }
+    {
+        out = hpackEncodeStatus(wstrEmpty(), 200);
+        out = hpackEncodeStatus(out, 302);
+        out = hpackEncodeField(out, "Content-Type", 12, "text/html", 9);
+        out = hpackEncodeField(out, "X-Wheat", 7, "1", 1);
+        out = hpackEncodeField(out, "Accept-Encoding", 15, "gzip, deflate", 13);
+        test_cond("hpackEncode", wstrlen(out) == fromHex("8808 0333 3032 0f10"
+                    "0974 6578 742f 6874 6d6c 0007 782d 7768 6561 7401 3190", buf) &&
+                !memcmp(out, buf, wstrlen(out)));
+        hpackInitTable(&table, HPACK_DEFAULT_TABLE_SIZE);
+        test_cond("hpackEncode decodable", checkDecode(&table, "8808 0333 3032"
+                    "0f10 0974 6578 742f 6874 6d6c 0007 782d 7768 6561 7401 3190",
+                    ":status: 200\n:status: 302\ncontent-type: text/html\n"
+                    "x-wheat: 1\naccept-encoding: gzip, deflate\n", 0));
+        hpackFreeTable(&table);
+        wstrFree(out);
+    }
+    test_report();
+    return 0;
+}
+#endif
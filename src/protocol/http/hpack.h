@@ -0,0 +1,60 @@
+// HPACK header compression for HTTP/2(RFC 7541)
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef WHEATSERVER_HPACK_H
+#define WHEATSERVER_HPACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../../wstr.h"
+#include "../../array.h"
+
+#define HPACK_DEFAULT_TABLE_SIZE  4096
+// Size of entry is its name and value length plus 32 bytes overhead
+#define HPACK_ENTRY_OVERHEAD      32
+
+// Decoded field refers `store` by offsets because `store` grows while
+// decoding, each name and value is followed by '\0' there.
+struct hpackField {
+    size_t name;
+    size_t name_len;
+    size_t value;
+    size_t value_len;
+};
+
+// Dynamic table is a ring of entries, `head` is the newest one which is
+// index 62 for decoder. `limit` is the max size we announce in SETTINGS,
+// encoder may lower `max_size` by dynamic table size update.
+struct hpackEntry {
+    wstr field;
+    size_t name_len;
+};
+
+struct hpackTable {
+    struct hpackEntry *entries;
+    size_t cap;
+    size_t head;
+    size_t count;
+    size_t size;
+    size_t max_size;
+    size_t limit;
+};
+
+void hpackInitTable(struct hpackTable *table, size_t limit);
+void hpackFreeTable(struct hpackTable *table);
+// Decode a complete header block into `fields`, return 0 on success and -1
+// if block is malformed(COMPRESSION_ERROR of connection)
+int hpackDecode(struct hpackTable *table, const uint8_t *p, size_t len,
+        wstr *store, struct array *fields);
+
+// Encoder never inserts into dynamic table, so peer doesn't need to keep
+// state for us. Return NULL if out of memory.
+wstr hpackEncodeStatus(wstr out, int status);
+wstr hpackEncodeField(wstr out, const char *name, size_t name_len,
+        const char *value, size_t value_len);
+
+#endif
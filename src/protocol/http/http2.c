@@ -0,0 +1,1091 @@
+// HTTP/2 cleartext(h2c) of Http protocol
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "proto_http.h"
+
+// HTTP/2 connection is a client whose `client_data` is http2Session, it
+// starts by prior knowledge(connection preface instead of request) or by
+// "Upgrade: h2c" request(see parseHttp). Frames are parsed into streams of
+// session, and when a stream ends its request is filled into the conn being
+// parsed and passed to app like HTTP/1.x request. So each stream is a conn
+// of client and responses are written in the order requests completed.
+//
+// Response API in proto_http.c calls back here to compress headers and
+// frame body as DATA, body beyond peer's flow control window is kept in
+// `pending` of stream until WINDOW_UPDATE comes. Control frames are queued
+// on the conn being parsed.
+
+#define HTTP2_PREFACE            "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LEN        24
+#define HTTP2_FRAME_HEADER_LEN   9
+#define HTTP2_DEFAULT_WINDOW     65535
+#define HTTP2_MAX_WINDOW         0x7fffffff
+#define HTTP2_FRAME_SIZE         16384
+#define HTTP2_MAX_FRAME_SIZE     16777215
+#define HTTP2_MAX_HEADER_BLOCK   (64*1024)
+// Receiving window we announce for connection and each stream
+#define HTTP2_RECV_WINDOW        (1024*1024)
+
+enum http2FrameType {
+    HTTP2_DATA = 0,
+    HTTP2_HEADERS,
+    HTTP2_PRIORITY,
+    HTTP2_RST_STREAM,
+    HTTP2_SETTINGS,
+    HTTP2_PUSH_PROMISE,
+    HTTP2_PING,
+    HTTP2_GOAWAY,
+    HTTP2_WINDOW_UPDATE,
+    HTTP2_CONTINUATION
+};
+
+#define HTTP2_FLAG_END_STREAM    0x1
+#define HTTP2_FLAG_ACK           0x1
+#define HTTP2_FLAG_END_HEADERS   0x4
+#define HTTP2_FLAG_PADDED        0x8
+#define HTTP2_FLAG_PRIORITY      0x20
+
+enum http2Error {
+    HTTP2_NO_ERROR = 0,
+    HTTP2_PROTOCOL_ERROR,
+    HTTP2_INTERNAL_ERROR,
+    HTTP2_FLOW_CONTROL_ERROR,
+    HTTP2_SETTINGS_TIMEOUT,
+    HTTP2_STREAM_CLOSED,
+    HTTP2_FRAME_SIZE_ERROR,
+    HTTP2_REFUSED_STREAM,
+    HTTP2_CANCEL,
+    HTTP2_COMPRESSION_ERROR,
+    HTTP2_CONNECT_ERROR,
+    HTTP2_ENHANCE_YOUR_CALM
+};
+
+enum http2Setting {
+    HTTP2_SETTINGS_HEADER_TABLE_SIZE = 1,
+    HTTP2_SETTINGS_ENABLE_PUSH,
+    HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS,
+    HTTP2_SETTINGS_INITIAL_WINDOW_SIZE,
+    HTTP2_SETTINGS_MAX_FRAME_SIZE,
+    HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE
+};
+
+// Body blocked by flow control, `data` is app buffer which is kept until
+// conn freed like other queued data. `fd` is -1 unless it's file range.
+struct http2Pending {
+    int fd;
+    const char *data;
+    off_t off;
+    size_t len;
+};
+
+// `store` and `fields`: decoded header block(see hpackDecode), moved to
+// conn with `body` when stream is dispatched
+// `conn`: conn the stream is dispatched to, stream is freed with it
+// `end_stream`: peer has sent END_STREAM
+// `closed`: we have sent END_STREAM or RST_STREAM, or peer reset it
+// `finishing`: app finished but `pending` isn't sent yet
+struct http2Stream {
+    uint32_t id;
+    struct http2Session *session;
+    struct conn *conn;
+    wstr store;
+    struct array *fields;
+    wstr body;
+    long send_window;
+    size_t recv_unacked;
+    struct list *pending;
+    unsigned end_stream:1;
+    unsigned closed:1;
+    unsigned finishing:1;
+    unsigned refused:1;
+};
+
+// `preface`: bytes of client connection preface matched
+// `head` and `payload`: frame being received, payload is only collected
+// when frame spans reads
+// `header_stream`: stream of HEADERS waiting for CONTINUATION
+// `send_window`: connection level window of peer
+// `initial_window` and `max_frame_size`: SETTINGS of peer
+// `recv_unacked`: received DATA not replenished by WINDOW_UPDATE yet
+struct http2Session {
+    struct client *client;
+    size_t preface;
+    uint8_t head[HTTP2_FRAME_HEADER_LEN];
+    size_t head_len;
+    size_t frame_len;
+    uint8_t frame_type;
+    uint8_t frame_flags;
+    uint32_t frame_stream;
+    wstr payload;
+    struct hpackTable decoder;
+    struct list *streams;
+    uint32_t last_stream_id;
+    struct http2Stream *header_stream;
+    int header_end_stream;
+    wstr header_block;
+    wstr encode_buf;
+    long send_window;
+    long initial_window;
+    size_t max_frame_size;
+    size_t recv_unacked;
+    int error;
+    unsigned failed:1;
+};
+
+static int Http2Enabled = 1;
+static size_t MaxConcurrentStreams = 100;
+
+static void resumeStreams(struct http2Session *s);
+
+static inline uint32_t get32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+        ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint8_t *put32(uint8_t *p, uint32_t v)
+{
+    *p++ = (uint8_t)(v >> 24);
+    *p++ = (uint8_t)(v >> 16);
+    *p++ = (uint8_t)(v >> 8);
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static void putFrameHeader(uint8_t *p, size_t len, int type, int flags,
+        uint32_t id)
+{
+    p[0] = (uint8_t)(len >> 16);
+    p[1] = (uint8_t)(len >> 8);
+    p[2] = (uint8_t)len;
+    p[3] = (uint8_t)type;
+    p[4] = (uint8_t)flags;
+    put32(p + 5, id & HTTP2_MAX_WINDOW);
+}
+
+// Queue frame with small payload on `c`
+static int sendFrame(struct conn *c, int type, int flags, uint32_t id,
+        const uint8_t *payload, size_t len)
+{
+    struct slice slice;
+    char *p;
+
+    p = httpReserveSendBuf(c, HTTP2_FRAME_HEADER_LEN + len);
+    if (p == NULL)
+        return -1;
+    putFrameHeader((uint8_t *)p, len, type, flags, id);
+    if (len)
+        memcpy(p + HTTP2_FRAME_HEADER_LEN, payload, len);
+    sliceTo(&slice, (uint8_t *)p, HTTP2_FRAME_HEADER_LEN + len);
+    if (sendClientData(c, &slice) == WHEAT_WRONG)
+        return -1;
+    return 0;
+}
+
+static int sendWindowUpdate(struct conn *c, uint32_t id, uint32_t inc)
+{
+    uint8_t buf[4];
+
+    put32(buf, inc);
+    return sendFrame(c, HTTP2_WINDOW_UPDATE, 0, id, buf, sizeof(buf));
+}
+
+static int sendRstStream(struct conn *c, uint32_t id, int error)
+{
+    uint8_t buf[4];
+
+    put32(buf, error);
+    return sendFrame(c, HTTP2_RST_STREAM, 0, id, buf, sizeof(buf));
+}
+
+static int sendGoaway(struct conn *c, uint32_t last_id, int error)
+{
+    uint8_t buf[8];
+
+    put32(put32(buf, last_id), error);
+    return sendFrame(c, HTTP2_GOAWAY, 0, 0, buf, sizeof(buf));
+}
+
+// Our SETTINGS and enlarging connection window to HTTP2_RECV_WINDOW
+static int sendServerPreface(struct conn *c)
+{
+    uint8_t buf[12], *p = buf;
+
+    *p++ = 0;
+    *p++ = HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    p = put32(p, MaxConcurrentStreams);
+    *p++ = 0;
+    *p++ = HTTP2_SETTINGS_INITIAL_WINDOW_SIZE;
+    p = put32(p, HTTP2_RECV_WINDOW);
+    if (sendFrame(c, HTTP2_SETTINGS, 0, 0, buf, sizeof(buf)) == -1)
+        return -1;
+    return sendWindowUpdate(c, 0, HTTP2_RECV_WINDOW - HTTP2_DEFAULT_WINDOW);
+}
+
+static int connError(struct http2Session *s, int error)
+{
+    s->error = error;
+    return -1;
+}
+
+// ==================================================================
+// ============================ Stream ==============================
+// ==================================================================
+
+static struct http2Stream *createStream(struct http2Session *s, uint32_t id)
+{
+    struct http2Stream *stream = wmalloc(sizeof(*stream));
+
+    if (stream == NULL)
+        return NULL;
+    memset(stream, 0, sizeof(*stream));
+    stream->id = id;
+    stream->session = s;
+    stream->send_window = s->initial_window;
+    stream->store = wstrEmpty();
+    stream->body = wstrEmpty();
+    stream->fields = arrayCreate(sizeof(struct hpackField), 16);
+    if (stream->store == NULL || stream->body == NULL ||
+            stream->fields == NULL ||
+            appendToListTail(s->streams, stream) == NULL) {
+        wstrFree(stream->store);
+        wstrFree(stream->body);
+        if (stream->fields)
+            arrayDealloc(stream->fields);
+        wfree(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+static void destroyStream(struct http2Stream *stream)
+{
+    wstrFree(stream->store);
+    wstrFree(stream->body);
+    if (stream->fields)
+        arrayDealloc(stream->fields);
+    if (stream->pending)
+        freeList(stream->pending);
+    wfree(stream);
+}
+
+static void removeStream(struct http2Stream *stream)
+{
+    struct listNode *node;
+
+    node = searchListKey(stream->session->streams, stream);
+    if (node)
+        removeListNode(stream->session->streams, node);
+    destroyStream(stream);
+}
+
+// Called when conn of stream is freed
+void http2FreeStream(struct http2Stream *stream)
+{
+    if (stream->session)
+        removeStream(stream);
+    else
+        destroyStream(stream);
+}
+
+static struct http2Stream *findStream(struct http2Session *s, uint32_t id)
+{
+    struct listNode *node;
+    struct http2Stream *stream;
+
+    for (node = listFirst(s->streams); node; node = node->next) {
+        stream = listNodeValue(node);
+        if (stream->id == id)
+            return stream;
+    }
+    return NULL;
+}
+
+static size_t countOpenStreams(struct http2Session *s)
+{
+    struct listNode *node;
+    size_t count = 0;
+
+    for (node = listFirst(s->streams); node; node = node->next) {
+        if (!((struct http2Stream *)listNodeValue(node))->closed)
+            count++;
+    }
+    return count;
+}
+
+// END_STREAM after all body sent, conn of stream may be freed then
+static void endStreamOutput(struct http2Stream *stream)
+{
+    struct conn *c = stream->conn;
+
+    stream->closed = 1;
+    stream->finishing = 0;
+    sendFrame(c, HTTP2_DATA, HTTP2_FLAG_END_STREAM, stream->id, NULL, 0);
+    finishConn(c);
+}
+
+static void resetStream(struct http2Stream *stream)
+{
+    if (stream->conn == NULL) {
+        removeStream(stream);
+        return ;
+    }
+    stream->closed = 1;
+    if (stream->pending)
+        listClear(stream->pending);
+    if (stream->finishing) {
+        stream->finishing = 0;
+        finishConn(stream->conn);
+    }
+}
+
+// Pass request of ended stream to `c`
+static int dispatchStream(struct http2Session *s, struct http2Stream *stream,
+        struct conn *c)
+{
+    stream->end_stream = 1;
+    if (httpFillStreamRequest(c, stream, stream->store, stream->fields,
+                stream->body) == -1) {
+        sendRstStream(c, stream->id, HTTP2_PROTOCOL_ERROR);
+        removeStream(stream);
+        return 0;
+    }
+    stream->store = NULL;
+    stream->body = NULL;
+    arrayDealloc(stream->fields);
+    stream->fields = NULL;
+    stream->conn = c;
+    return 1;
+}
+
+// ==================================================================
+// ============================ Frames ==============================
+// ==================================================================
+
+static int stripPadding(struct http2Session *s, const uint8_t **p,
+        size_t *len)
+{
+    size_t pad;
+
+    if (!(s->frame_flags & HTTP2_FLAG_PADDED))
+        return 0;
+    if (*len < 1)
+        return -1;
+    pad = **p;
+    (*p)++;
+    (*len)--;
+    if (pad > *len)
+        return -1;
+    *len -= pad;
+    return 0;
+}
+
+static int onHeaderBlockEnd(struct http2Session *s, struct conn *c)
+{
+    struct http2Stream *stream = s->header_stream;
+
+    s->header_stream = NULL;
+    // Trailers are decoded after headers as regular fields
+    if (hpackDecode(&s->decoder, (const uint8_t *)s->header_block,
+                wstrlen(s->header_block), &stream->store, stream->fields) == -1)
+        return connError(s, HTTP2_COMPRESSION_ERROR);
+    if (stream->refused) {
+        sendRstStream(c, stream->id, HTTP2_REFUSED_STREAM);
+        removeStream(stream);
+        return 0;
+    }
+    if (s->header_end_stream)
+        return dispatchStream(s, stream, c);
+    return 0;
+}
+
+static int appendHeaderBlock(struct http2Session *s, const uint8_t *p,
+        size_t len)
+{
+    if (wstrlen(s->header_block) + len > HTTP2_MAX_HEADER_BLOCK)
+        return connError(s, HTTP2_ENHANCE_YOUR_CALM);
+    s->header_block = wstrCatLen(s->header_block, (const char *)p, len);
+    if (s->header_block == NULL)
+        return connError(s, HTTP2_INTERNAL_ERROR);
+    return 0;
+}
+
+static int onHeaders(struct http2Session *s, struct conn *c,
+        const uint8_t *p, size_t len)
+{
+    uint32_t id = s->frame_stream;
+    struct http2Stream *stream;
+
+    if (id == 0 || !(id & 1) || stripPadding(s, &p, &len) == -1)
+        return connError(s, HTTP2_PROTOCOL_ERROR);
+    if (s->frame_flags & HTTP2_FLAG_PRIORITY) {
+        if (len < 5)
+            return connError(s, HTTP2_PROTOCOL_ERROR);
+        p += 5;
+        len -= 5;
+    }
+    stream = findStream(s, id);
+    if (stream == NULL) {
+        if (id <= s->last_stream_id)
+            return connError(s, HTTP2_STREAM_CLOSED);
+        s->last_stream_id = id;
+        stream = createStream(s, id);
+        if (stream == NULL)
+            return connError(s, HTTP2_INTERNAL_ERROR);
+        // Header block must be decoded anyway to keep table synchronized
+        if (countOpenStreams(s) > MaxConcurrentStreams)
+            stream->refused = 1;
+    } else if (stream->end_stream || !(s->frame_flags & HTTP2_FLAG_END_STREAM)) {
+        return connError(s, HTTP2_PROTOCOL_ERROR);
+    }
+    s->header_stream = stream;
+    s->header_end_stream = s->frame_flags & HTTP2_FLAG_END_STREAM;
+    wstrupdatelen(s->header_block, 0);
+    if (appendHeaderBlock(s, p, len) == -1)
+        return -1;
+    if (s->frame_flags & HTTP2_FLAG_END_HEADERS)
+        return onHeaderBlockEnd(s, c);
+    return 0;
+}
+
+static int onContinuation(struct http2Session *s, struct conn *c,
+        const uint8_t *p, size_t len)
+{
+    if (s->header_stream == NULL || s->header_stream->id != s->frame_stream)
+        return connError(s, HTTP2_PROTOCOL_ERROR);
+    if (appendHeaderBlock(s, p, len) == -1)
+        return -1;
+    if (s->frame_flags & HTTP2_FLAG_END_HEADERS)
+        return onHeaderBlockEnd(s, c);
+    return 0;
+}
+
+static int onData(struct http2Session *s, struct conn *c, const uint8_t *p,
+        size_t len)
+{
+    uint32_t id = s->frame_stream;
+    struct http2Stream *stream;
+    size_t frame_len = len;
+
+    if (id == 0 || stripPadding(s, &p, &len) == -1)
+        return connError(s, HTTP2_PROTOCOL_ERROR);
+    // Padding counts in flow control too
+    s->recv_unacked += frame_len;
+    if (s->recv_unacked >= HTTP2_RECV_WINDOW / 2) {
+        sendWindowUpdate(c, 0, s->recv_unacked);
+        s->recv_unacked = 0;
+    }
+    stream = findStream(s, id);
+    if (stream == NULL || stream->end_stream) {
+        if (id > s->last_stream_id)
+            return connError(s, HTTP2_PROTOCOL_ERROR);
+        sendRstStream(c, id, HTTP2_STREAM_CLOSED);
+        return 0;
+    }
+    if (Server.max_buffer_size &&
+            wstrlen(stream->body) + len > Server.max_buffer_size) {
+        wheatLog(WHEAT_VERBOSE, "http2 stream body larger than limit %d",
+                Server.max_buffer_size);
+        sendRstStream(c, id, HTTP2_ENHANCE_YOUR_CALM);
+        removeStream(stream);
+        return 0;
+    }
+    stream->body = wstrCatLen(stream->body, (const char *)p, len);
+    if (stream->body == NULL)
+        return connError(s, HTTP2_INTERNAL_ERROR);
+    if (s->frame_flags & HTTP2_FLAG_END_STREAM)
+        return dispatchStream(s, stream, c);
+    stream->recv_unacked += frame_len;
+    if (stream->recv_unacked >= HTTP2_RECV_WINDOW / 2) {
+        sendWindowUpdate(c, id, stream->recv_unacked);
+        stream->recv_unacked = 0;
+    }
+    return 0;
+}
+
+static int applySettings(struct http2Session *s, const uint8_t *p,
+        size_t len)
+{
+    struct listNode *node;
+    struct http2Stream *stream;
+    uint32_t value;
+    long delta;
+
+    if (len % 6)
+        return connError(s, HTTP2_FRAME_SIZE_ERROR);
+    for (; len; p += 6, len -= 6) {
+        value = get32(p + 2);
+        switch ((p[0] << 8) | p[1]) {
+            case HTTP2_SETTINGS_ENABLE_PUSH:
+                if (value > 1)
+                    return connError(s, HTTP2_PROTOCOL_ERROR);
+                break;
+            case HTTP2_SETTINGS_INITIAL_WINDOW_SIZE:
+                if (value > HTTP2_MAX_WINDOW)
+                    return connError(s, HTTP2_FLOW_CONTROL_ERROR);
+                delta = (long)value - s->initial_window;
+                s->initial_window = value;
+                for (node = listFirst(s->streams); node; node = node->next) {
+                    stream = listNodeValue(node);
+                    stream->send_window += delta;
+                }
+                break;
+            case HTTP2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < HTTP2_FRAME_SIZE || value > HTTP2_MAX_FRAME_SIZE)
+                    return connError(s, HTTP2_PROTOCOL_ERROR);
+                s->max_frame_size = value;
+                break;
+        }
+    }
+    return 0;
+}
+
+static int onSettings(struct http2Session *s, struct conn *c,
+        const uint8_t *p, size_t len)
+{
+    if (s->frame_stream)
+        return connError(s, HTTP2_PROTOCOL_ERROR);
+    if (s->frame_flags & HTTP2_FLAG_ACK)
+        return len ? connError(s, HTTP2_FRAME_SIZE_ERROR) : 0;
+    if (applySettings(s, p, len) == -1)
+        return -1;
+    sendFrame(c, HTTP2_SETTINGS, HTTP2_FLAG_ACK, 0, NULL, 0);
+    resumeStreams(s);
+    return 0;
+}
+
+static int onWindowUpdate(struct http2Session *s, struct conn *c,
+        const uint8_t *p, size_t len)
+{
+    struct http2Stream *stream;
+    uint32_t inc;
+
+    if (len != 4)
+        return connError(s, HTTP2_FRAME_SIZE_ERROR);
+    inc = get32(p) & HTTP2_MAX_WINDOW;
+    if (s->frame_stream == 0) {
+        if (inc == 0)
+            return connError(s, HTTP2_PROTOCOL_ERROR);
+        if (s->send_window + inc > HTTP2_MAX_WINDOW)
+            return connError(s, HTTP2_FLOW_CONTROL_ERROR);
+        s->send_window += inc;
+    } else {
+        stream = findStream(s, s->frame_stream);
+        if (stream == NULL || stream->closed)
+            return 0;
+        if (inc == 0 || stream->send_window + inc > HTTP2_MAX_WINDOW) {
+            sendRstStream(c, stream->id, inc ? HTTP2_FLOW_CONTROL_ERROR :
+                    HTTP2_PROTOCOL_ERROR);
+            resetStream(stream);
+            return 0;
+        }
+        stream->send_window += inc;
+    }
+    resumeStreams(s);
+    return 0;
+}
+
+static int processFrame(struct http2Session *s, struct conn *c,
+        const uint8_t *p, size_t len)
+{
+    struct http2Stream *stream;
+
+    if (s->header_stream && s->frame_type != HTTP2_CONTINUATION)
+        return connError(s, HTTP2_PROTOCOL_ERROR);
+    switch (s->frame_type) {
+        case HTTP2_DATA:
+            return onData(s, c, p, len);
+        case HTTP2_HEADERS:
+            return onHeaders(s, c, p, len);
+        case HTTP2_CONTINUATION:
+            return onContinuation(s, c, p, len);
+        case HTTP2_SETTINGS:
+            return onSettings(s, c, p, len);
+        case HTTP2_WINDOW_UPDATE:
+            return onWindowUpdate(s, c, p, len);
+        case HTTP2_PING:
+            if (len != 8)
+                return connError(s, HTTP2_FRAME_SIZE_ERROR);
+            if (s->frame_stream)
+                return connError(s, HTTP2_PROTOCOL_ERROR);
+            if (!(s->frame_flags & HTTP2_FLAG_ACK))
+                sendFrame(c, HTTP2_PING, HTTP2_FLAG_ACK, 0, p, len);
+            return 0;
+        case HTTP2_RST_STREAM:
+            if (len != 4)
+                return connError(s, HTTP2_FRAME_SIZE_ERROR);
+            if (s->frame_stream == 0 || s->frame_stream > s->last_stream_id)
+                return connError(s, HTTP2_PROTOCOL_ERROR);
+            stream = findStream(s, s->frame_stream);
+            if (stream)
+                resetStream(stream);
+            return 0;
+        case HTTP2_PRIORITY:
+            if (len != 5)
+                return connError(s, HTTP2_FRAME_SIZE_ERROR);
+            return 0;
+        case HTTP2_GOAWAY:
+            // Streams in flight are still answered, peer closes connection
+            if (s->frame_stream)
+                return connError(s, HTTP2_PROTOCOL_ERROR);
+            return 0;
+        case HTTP2_PUSH_PROMISE:
+            return connError(s, HTTP2_PROTOCOL_ERROR);
+    }
+    // Unknown frame type is ignored
+    return 0;
+}
+
+static int readFrameHeader(struct http2Session *s)
+{
+    const uint8_t *h = s->head;
+
+    s->frame_len = (h[0] << 16) | (h[1] << 8) | h[2];
+    s->frame_type = h[3];
+    s->frame_flags = h[4];
+    s->frame_stream = get32(h + 5) & HTTP2_MAX_WINDOW;
+    if (s->frame_len > HTTP2_FRAME_SIZE)
+        return connError(s, HTTP2_FRAME_SIZE_ERROR);
+    wstrupdatelen(s->payload, 0);
+    return 0;
+}
+
+// Parse frames until a stream ends, then its request is filled into `c`
+// and WHEAT_OK is returned. Otherwise all bytes are consumed and 1 is
+// returned, frames queued on `c` are sent when it's the first conn.
+int http2Parse(struct conn *c, struct slice *slice, size_t *out)
+{
+    struct http2Session *s = c->client->client_data;
+    const uint8_t *p = slice->data, *end = slice->data + slice->len;
+    const uint8_t *payload;
+    size_t n;
+    int ret = 0;
+
+    while (p < end && ret == 0 && !s->failed) {
+        if (s->preface < HTTP2_PREFACE_LEN) {
+            n = end - p;
+            if (n > HTTP2_PREFACE_LEN - s->preface)
+                n = HTTP2_PREFACE_LEN - s->preface;
+            if (memcmp(p, HTTP2_PREFACE + s->preface, n)) {
+                ret = connError(s, HTTP2_PROTOCOL_ERROR);
+                break;
+            }
+            s->preface += n;
+            p += n;
+            continue;
+        }
+        if (s->head_len < HTTP2_FRAME_HEADER_LEN) {
+            n = end - p;
+            if (n > HTTP2_FRAME_HEADER_LEN - s->head_len)
+                n = HTTP2_FRAME_HEADER_LEN - s->head_len;
+            memcpy(s->head + s->head_len, p, n);
+            s->head_len += n;
+            p += n;
+            if (s->head_len < HTTP2_FRAME_HEADER_LEN)
+                break;
+            if ((ret = readFrameHeader(s)) == -1)
+                break;
+        }
+        // Payload is used in place unless it spans reads
+        if (!wstrlen(s->payload) && (size_t)(end - p) >= s->frame_len) {
+            payload = p;
+            p += s->frame_len;
+        } else {
+            n = end - p;
+            if (n > s->frame_len - wstrlen(s->payload))
+                n = s->frame_len - wstrlen(s->payload);
+            s->payload = wstrCatLen(s->payload, (const char *)p, n);
+            if (s->payload == NULL) {
+                ret = connError(s, HTTP2_INTERNAL_ERROR);
+                break;
+            }
+            p += n;
+            if (wstrlen(s->payload) < s->frame_len)
+                break;
+            payload = (const uint8_t *)s->payload;
+        }
+        s->head_len = 0;
+        ret = processFrame(s, c, payload, s->frame_len);
+    }
+
+    if (ret == -1) {
+        wheatLog(WHEAT_VERBOSE, "http2 connection error %d from %s:%d",
+                s->error, c->client->ip, c->client->port);
+        sendGoaway(c, s->last_stream_id, s->error);
+        s->failed = 1;
+        setClientClose(c);
+    }
+    // Failed session swallows the rest until client closed
+    if (s->failed)
+        p = end;
+    if (out) *out = p - slice->data;
+    // Nothing received refers `req_buf`
+    msgClean(c->client->req_buf);
+    return ret == 1 ? WHEAT_OK : 1;
+}
+
+// ==================================================================
+// =========================== Response =============================
+// ==================================================================
+
+// Send as much of `item` as flow control allows
+static int sendPending(struct http2Stream *stream, struct http2Pending *item)
+{
+    struct http2Session *s = stream->session;
+    struct conn *c = stream->conn;
+    struct slice slice;
+    long avail;
+    size_t n;
+    char *p;
+    int ret;
+
+    while (item->len) {
+        avail = s->send_window < stream->send_window ?
+            s->send_window : stream->send_window;
+        if (avail <= 0)
+            break;
+        n = item->len < (size_t)avail ? item->len : (size_t)avail;
+        if (n > s->max_frame_size)
+            n = s->max_frame_size;
+        p = httpReserveSendBuf(c, HTTP2_FRAME_HEADER_LEN);
+        if (p == NULL)
+            return -1;
+        putFrameHeader((uint8_t *)p, n, HTTP2_DATA, 0, stream->id);
+        sliceTo(&slice, (uint8_t *)p, HTTP2_FRAME_HEADER_LEN);
+        if (sendClientData(c, &slice) == WHEAT_WRONG)
+            return -1;
+        if (item->fd == -1) {
+            sliceTo(&slice, (uint8_t *)item->data, n);
+            ret = sendClientData(c, &slice);
+            item->data += n;
+        } else {
+            ret = sendClientFileRange(c, item->fd, item->off, n);
+            item->off += n;
+        }
+        if (ret == WHEAT_WRONG)
+            return -1;
+        item->len -= n;
+        s->send_window -= n;
+        stream->send_window -= n;
+    }
+    return 0;
+}
+
+static int queueOutput(struct http2Stream *stream, struct http2Pending *item)
+{
+    struct http2Pending *pending;
+
+    if (stream->session == NULL || stream->closed)
+        return 0;
+    if (stream->pending == NULL || !listLength(stream->pending)) {
+        if (sendPending(stream, item) == -1)
+            return -1;
+        if (!item->len)
+            return 0;
+    }
+    if (stream->pending == NULL) {
+        stream->pending = createList();
+        if (stream->pending == NULL)
+            return -1;
+        listSetFree(stream->pending, wfree);
+    }
+    pending = wmalloc(sizeof(*pending));
+    if (pending == NULL)
+        return -1;
+    *pending = *item;
+    appendToListTail(stream->pending, pending);
+    return 0;
+}
+
+// Sending may free conns of closed streams and remove them from `streams`,
+// so iteration restarts from the first stream whenever something is sent
+static void resumeStreams(struct http2Session *s)
+{
+    struct listNode *node, *first;
+    struct http2Stream *stream;
+    struct http2Pending *item;
+    size_t left;
+    int sent;
+
+restart:
+    for (node = listFirst(s->streams); node && s->send_window > 0;
+            node = node->next) {
+        stream = listNodeValue(node);
+        if (stream->pending == NULL || stream->closed ||
+                stream->send_window <= 0 || !listLength(stream->pending))
+            continue;
+        first = listFirst(stream->pending);
+        item = listNodeValue(first);
+        left = item->len;
+        if (sendPending(stream, item) == -1)
+            return ;
+        sent = item->len != left;
+        if (!item->len)
+            removeListNode(stream->pending, first);
+        if (stream->finishing && !listLength(stream->pending))
+            endStreamOutput(stream);
+        else if (!sent)
+            continue;
+        goto restart;
+    }
+}
+
+static int isHopHeader(const char *name, size_t len)
+{
+    switch (len) {
+        case 7:
+            return !strncasecmp(name, "Upgrade", len);
+        case 10:
+            return !strncasecmp(name, "Connection", len) ||
+                !strncasecmp(name, "Keep-Alive", len);
+        case 16:
+            return !strncasecmp(name, "Proxy-Connection", len);
+        case 17:
+            return !strncasecmp(name, "Transfer-Encoding", len);
+    }
+    return 0;
+}
+
+// `headers` are rendered "Field: value\r\n" lines. Header block is split
+// into HEADERS and CONTINUATION frames in one buffer.
+int http2SendHeaders(struct conn *c, struct http2Stream *stream, int status,
+        const char *headers, size_t len)
+{
+    struct http2Session *s = stream->session;
+    const char *end = headers + len, *line_end, *colon, *value;
+    size_t value_len, block_len, off, n, nframes, i;
+    struct slice slice;
+    wstr block;
+    char *buf, *p;
+
+    if (s == NULL || stream->closed)
+        return 0;
+    wstrupdatelen(s->encode_buf, 0);
+    block = hpackEncodeStatus(s->encode_buf, status);
+    while (block && headers < end) {
+        line_end = memchr(headers, '\n', end - headers);
+        if (line_end == NULL)
+            break;
+        colon = memchr(headers, ':', line_end - headers);
+        if (colon && !isHopHeader(headers, colon - headers)) {
+            value = colon + 1;
+            while (value < line_end && *value == ' ')
+                value++;
+            value_len = line_end - value;
+            if (value_len && value[value_len-1] == '\r')
+                value_len--;
+            block = hpackEncodeField(block, headers, colon - headers,
+                    value, value_len);
+        }
+        headers = line_end + 1;
+    }
+    if (block == NULL)
+        return -1;
+    s->encode_buf = block;
+
+    block_len = wstrlen(block);
+    nframes = (block_len + s->max_frame_size - 1) / s->max_frame_size;
+    buf = httpReserveSendBuf(c, block_len + nframes * HTTP2_FRAME_HEADER_LEN);
+    if (buf == NULL)
+        return -1;
+    for (i = 0, off = 0, p = buf; i < nframes; i++) {
+        n = block_len - off < s->max_frame_size ? block_len - off :
+            s->max_frame_size;
+        putFrameHeader((uint8_t *)p, n, i ? HTTP2_CONTINUATION : HTTP2_HEADERS,
+                i == nframes - 1 ? HTTP2_FLAG_END_HEADERS : 0, stream->id);
+        memcpy(p + HTTP2_FRAME_HEADER_LEN, block + off, n);
+        p += HTTP2_FRAME_HEADER_LEN + n;
+        off += n;
+    }
+    sliceTo(&slice, (uint8_t *)buf, p - buf);
+    if (sendClientData(c, &slice) == WHEAT_WRONG)
+        return -1;
+    return 0;
+}
+
+int http2SendData(struct conn *c, struct http2Stream *stream,
+        const char *data, size_t len)
+{
+    struct http2Pending item = {-1, data, 0, len};
+
+    return queueOutput(stream, &item);
+}
+
+int http2SendFile(struct conn *c, struct http2Stream *stream, int fd,
+        off_t off, size_t len)
+{
+    struct http2Pending item = {fd, NULL, off, len};
+
+    return queueOutput(stream, &item);
+}
+
+// Response without headers sent means app failed, stream is reset then
+void http2FinishStream(struct conn *c, struct http2Stream *stream,
+        int headers_sent)
+{
+    if (stream->session == NULL || stream->closed) {
+        finishConn(c);
+        return ;
+    }
+    if (!headers_sent) {
+        stream->closed = 1;
+        sendRstStream(c, stream->id, HTTP2_INTERNAL_ERROR);
+        finishConn(c);
+        return ;
+    }
+    if (stream->pending && listLength(stream->pending)) {
+        stream->finishing = 1;
+        return ;
+    }
+    endStreamOutput(stream);
+}
+
+// ==================================================================
+// =========================== Session ==============================
+// ==================================================================
+
+// Client free notify, streams dispatched are left to their conns
+static void closeSession(struct client *client)
+{
+    struct http2Session *s = client->client_data;
+    struct http2Stream *stream;
+    struct listNode *node;
+
+    while ((node = listFirst(s->streams)) != NULL) {
+        stream = listNodeValue(node);
+        removeListNode(s->streams, node);
+        stream->session = NULL;
+        if (stream->conn == NULL)
+            destroyStream(stream);
+    }
+    freeList(s->streams);
+    hpackFreeTable(&s->decoder);
+    wstrFree(s->payload);
+    wstrFree(s->header_block);
+    wstrFree(s->encode_buf);
+    wfree(s);
+    client->client_data = NULL;
+    setClientFreeNotify(client, NULL);
+}
+
+int isHttp2Client(struct client *c)
+{
+    return c->notify == closeSession;
+}
+
+static struct http2Session *createSession(struct conn *c)
+{
+    struct http2Session *s = wmalloc(sizeof(*s));
+
+    if (s == NULL)
+        return NULL;
+    memset(s, 0, sizeof(*s));
+    s->client = c->client;
+    s->streams = createList();
+    s->payload = wstrEmpty();
+    s->header_block = wstrEmpty();
+    s->encode_buf = wstrEmpty();
+    hpackInitTable(&s->decoder, HPACK_DEFAULT_TABLE_SIZE);
+    s->send_window = s->initial_window = HTTP2_DEFAULT_WINDOW;
+    s->max_frame_size = HTTP2_FRAME_SIZE;
+    c->client->client_data = s;
+    setClientFreeNotify(c->client, closeSession);
+    setClientMultiplexed(c->client);
+    if (s->streams == NULL || s->payload == NULL || s->header_block == NULL ||
+            s->encode_buf == NULL) {
+        closeSession(c->client);
+        return NULL;
+    }
+    return s;
+}
+
+// HTTP/2 takes over client only if no HTTP/1.x request is in flight, so
+// `req_buf` can be released as frames are parsed
+int http2Start(struct conn *c)
+{
+    if (!Http2Enabled || listLength(c->client->conns) != 1 ||
+            createSession(c) == NULL)
+        return WHEAT_WRONG;
+    if (sendServerPreface(c) == -1)
+        return WHEAT_WRONG;
+    return WHEAT_OK;
+}
+
+// HTTP2-Settings is base64url encoded SETTINGS payload
+static int decodeBase64Url(const uint8_t *src, size_t len, uint8_t *dst,
+        size_t size)
+{
+    uint32_t acc = 0;
+    size_t i, n = 0;
+    int bits = 0, v;
+
+    for (i = 0; i < len && src[i] != '='; i++) {
+        if (src[i] >= 'A' && src[i] <= 'Z')
+            v = src[i] - 'A';
+        else if (src[i] >= 'a' && src[i] <= 'z')
+            v = src[i] - 'a' + 26;
+        else if (src[i] >= '0' && src[i] <= '9')
+            v = src[i] - '0' + 52;
+        else if (src[i] == '-' || src[i] == '+')
+            v = 62;
+        else if (src[i] == '_' || src[i] == '/')
+            v = 63;
+        else
+            return -1;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n == size)
+                return -1;
+            dst[n++] = (uint8_t)(acc >> bits);
+        }
+    }
+    return (int)n;
+}
+
+// Request with "Upgrade: h2c" becomes stream 1 which is half closed already,
+// its response follows "101 Switching Protocols" and our SETTINGS
+struct http2Stream *http2Upgrade(struct conn *c, const struct slice *settings)
+{
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\n"
+        "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    struct http2Session *s;
+    struct http2Stream *stream;
+    struct slice slice;
+    uint8_t buf[256];
+    int len;
+
+    if (!Http2Enabled || listLength(c->client->conns) != 1)
+        return NULL;
+    len = decodeBase64Url(settings->data, settings->len, buf, sizeof(buf));
+    if (len == -1 || (s = createSession(c)) == NULL)
+        return NULL;
+    if (applySettings(s, buf, len) == -1 ||
+            (stream = createStream(s, 1)) == NULL) {
+        closeSession(c->client);
+        return NULL;
+    }
+    stream->end_stream = 1;
+    stream->conn = c;
+    s->last_stream_id = 1;
+    sliceTo(&slice, (uint8_t *)switching, sizeof(switching)-1);
+    if (sendClientData(c, &slice) == WHEAT_WRONG || sendServerPreface(c) == -1) {
+        // Client may have got part of 101, it can't go on as HTTP/1.1
+        stream->conn = NULL;
+        closeSession(c->client);
+        setClientClose(c);
+        return NULL;
+    }
+    return stream;
+}
+
+int initHttp2()
+{
+    Http2Enabled = getConfiguration("http2")->target.val;
+    MaxConcurrentStreams = getConfiguration("http2-max-concurrent-streams")->target.val;
+    return WHEAT_OK;
+}
@@ -0,0 +1,356 @@
+// Path router of Http protocol
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "proto_http.h"
+
+// Routes are compiled into a radix trie keyed by path. Each node holds the
+// route of a path prefix and the route of exact path ending at the node,
+// lookup walks edges along request path and remembers the last prefix route
+// passed, so it's O(path length) and never allocates.
+//
+// `label`: bytes of edge from parent
+// `firsts`: first byte of each child label, scanned before comparing labels
+struct routeNode {
+    wstr label;
+    struct routeNode **children;
+    unsigned char *firsts;
+    int nchild;
+    struct httpRoute *prefix;
+    struct httpRoute *exact;
+};
+
+static struct routeNode *RouteRoot = NULL;
+static struct array *Routes = NULL;
+
+static struct routeNode *createRouteNode(const char *label, size_t len)
+{
+    struct routeNode *node = wmalloc(sizeof(*node));
+
+    if (node == NULL)
+        return NULL;
+    memset(node, 0, sizeof(*node));
+    node->label = wstrNewLen(label, (int)len);
+    return node;
+}
+
+static void freeRouteNode(struct routeNode *node)
+{
+    int i;
+
+    for (i = 0; i < node->nchild; i++)
+        freeRouteNode(node->children[i]);
+    wfree(node->children);
+    wfree(node->firsts);
+    wstrFree(node->label);
+    wfree(node);
+}
+
+static int addChild(struct routeNode *node, struct routeNode *child)
+{
+    struct routeNode **children;
+    unsigned char *firsts;
+
+    children = wrealloc(node->children, sizeof(*children)*(node->nchild+1));
+    if (children == NULL)
+        return WHEAT_WRONG;
+    node->children = children;
+    firsts = wrealloc(node->firsts, node->nchild+1);
+    if (firsts == NULL)
+        return WHEAT_WRONG;
+    node->firsts = firsts;
+    node->children[node->nchild] = child;
+    node->firsts[node->nchild] = (unsigned char)child->label[0];
+    node->nchild++;
+    return WHEAT_OK;
+}
+
+static inline int findChild(struct routeNode *node, unsigned char c)
+{
+    int i;
+
+    for (i = 0; i < node->nchild; i++) {
+        if (node->firsts[i] == c)
+            return i;
+    }
+    return -1;
+}
+
+// Split edge of `node->children[i]` after `len` bytes, return the new
+// middle node
+static struct routeNode *splitChild(struct routeNode *node, int i, size_t len)
+{
+    struct routeNode *child = node->children[i], *mid;
+
+    mid = createRouteNode(child->label, len);
+    if (mid == NULL || addChild(mid, child) == WHEAT_WRONG)
+        return NULL;
+    wstrRange(child->label, (int)len, 0);
+    mid->firsts[0] = (unsigned char)child->label[0];
+    node->children[i] = mid;
+    return mid;
+}
+
+static int insertRoute(struct httpRoute *route)
+{
+    struct routeNode *node = RouteRoot, *child;
+    const char *path = route->path;
+    size_t len = wstrlen(route->path), pos = 0, k, label_len;
+    int i;
+
+    while (pos < len) {
+        i = findChild(node, (unsigned char)path[pos]);
+        if (i == -1) {
+            child = createRouteNode(&path[pos], len - pos);
+            if (child == NULL || addChild(node, child) == WHEAT_WRONG)
+                return WHEAT_WRONG;
+            node = child;
+            break;
+        }
+        child = node->children[i];
+        label_len = wstrlen(child->label);
+        for (k = 0; k < label_len && pos + k < len; k++) {
+            if (child->label[k] != path[pos+k])
+                break;
+        }
+        if (k < label_len) {
+            child = splitChild(node, i, k);
+            if (child == NULL)
+                return WHEAT_WRONG;
+        }
+        node = child;
+        pos += k;
+    }
+
+    if (route->exact) {
+        if (node->exact)
+            goto duplicated;
+        node->exact = route;
+    } else {
+        if (node->prefix)
+            goto duplicated;
+        node->prefix = route;
+    }
+    return WHEAT_OK;
+
+duplicated:
+    wheatLog(WHEAT_WARNING, "http-routes %s%s is duplicated",
+            route->exact ? "=" : "", route->path);
+    return WHEAT_WRONG;
+}
+
+struct httpRoute *httpRouteLookup(const char *path, size_t len)
+{
+    struct routeNode *node = RouteRoot, *child;
+    struct httpRoute *best;
+    size_t pos = 0, label_len;
+    int i;
+
+    if (node == NULL)
+        return NULL;
+    best = node->prefix;
+    while (pos < len) {
+        i = findChild(node, (unsigned char)path[pos]);
+        if (i == -1)
+            return best;
+        child = node->children[i];
+        label_len = wstrlen(child->label);
+        if (len - pos < label_len || memcmp(child->label, &path[pos], label_len))
+            return best;
+        pos += label_len;
+        node = child;
+        if (node->prefix)
+            best = node->prefix;
+    }
+    return node->exact ? node->exact : best;
+}
+
+static int setRouteRoot(struct httpRoute *route, const char *dir)
+{
+    char path[1024];
+
+    if (realpath(dir, path) == NULL) {
+        wheatLog(WHEAT_WARNING, "document root %s is unvalid: %s", dir,
+                strerror(errno));
+        return WHEAT_WRONG;
+    }
+    wstrFree(route->root);
+    route->root = wstrNew(path);
+    return WHEAT_OK;
+}
+
+static struct httpRoute *addRoute(const char *path, size_t len,
+        const char *app_name)
+{
+    struct moduleAttr *module = getModule(APP, app_name);
+    struct httpRoute route;
+    int exact = 0;
+
+    if (module == NULL || strcmp(getApp(module)->proto_belong, "Http")) {
+        wheatLog(WHEAT_WARNING, "http-routes app %s is unvalid", app_name);
+        return NULL;
+    }
+    if (*path == '=') {
+        exact = 1;
+        path++;
+        len--;
+    }
+    if (len == 0 || *path != '/') {
+        wheatLog(WHEAT_WARNING, "http-routes path %s must start with '/'", path);
+        return NULL;
+    }
+    memset(&route, 0, sizeof(route));
+    route.exact = exact;
+    route.path = wstrNewLen(path, (int)len);
+    route.app = getApp(module);
+    route.cache_ttl = -1;
+    arrayPush(Routes, &route);
+    return arrayIndex(Routes, narray(Routes)-1);
+}
+
+// Route line: PATH APP [OPTION=VALUE]...
+static struct httpRoute *parseRoute(wstr line)
+{
+    struct httpRoute *route = NULL;
+    wstr *frags, *args;
+    int count, nargs = 0, i;
+    char *value;
+
+    frags = wstrNewSplit(line, " ", 1, &count);
+    if (frags == NULL)
+        return NULL;
+    args = wmalloc(sizeof(wstr)*count);
+    for (i = 0; i < count; i++) {
+        if (wstrlen(frags[i]))
+            args[nargs++] = frags[i];
+    }
+    if (nargs < 2) {
+        wheatLog(WHEAT_WARNING, "http-routes %s is unvalid", line);
+        goto out;
+    }
+    route = addRoute(args[0], wstrlen(args[0]), args[1]);
+    if (route == NULL)
+        goto out;
+    for (i = 2; i < nargs; i++) {
+        value = strchr(args[i], '=');
+        if (value == NULL)
+            goto unvalid;
+        *value++ = '\0';
+        if (!strcmp(args[i], "root")) {
+            if (setRouteRoot(route, value) == WHEAT_WRONG)
+                goto unvalid;
+        } else if (!strcmp(args[i], "upstreams")) {
+            route->upstreams = wstrNew(value);
+        } else if (!strcmp(args[i], "cache-ttl") && isdigit(*value)) {
+            route->cache_ttl = atoi(value);
+        } else {
+            goto unvalid;
+        }
+    }
+    goto out;
+
+unvalid:
+    wheatLog(WHEAT_WARNING, "http-routes option %s of %s is unvalid", args[i],
+            route->path);
+    route = NULL;
+out:
+    wfree(args);
+    wstrFreeSplit(frags, count);
+    return route;
+}
+
+// Without `http-routes`, requests under `static-file-dir` are served by
+// static-file and others by http-proxy if `proxy-upstreams` is set or wsgi
+static int addDefaultRoutes()
+{
+    struct httpRoute *route;
+    char *root = getConfiguration("document-root")->target.ptr;
+    char *static_dir = getConfiguration("static-file-dir")->target.ptr;
+    char path[1024];
+    wstr static_path;
+
+    if (root && static_dir) {
+        route = addRoute(static_dir, strlen(static_dir), "static-file");
+        if (route == NULL || setRouteRoot(route, root) == WHEAT_WRONG)
+            return WHEAT_WRONG;
+        static_path = wstrCat(wstrDup(route->root), static_dir);
+        if (realpath(static_path, path) == NULL) {
+            wheatLog(WHEAT_WARNING, "static-file-dir is unvalid");
+            wstrFree(static_path);
+            return WHEAT_WRONG;
+        }
+        wstrFree(static_path);
+    }
+    if (getConfiguration("proxy-upstreams")->target.ptr)
+        route = addRoute("/", 1, "http-proxy");
+    else
+        route = addRoute("/", 1, "wsgi");
+    return route ? WHEAT_OK : WHEAT_WRONG;
+}
+
+int initHttpRouter()
+{
+    struct list *lines = getConfiguration("http-routes")->target.ptr;
+    struct listIterator *iter;
+    struct listNode *node;
+    struct httpRoute *route;
+    char *root = getConfiguration("document-root")->target.ptr;
+    int i, ret = WHEAT_OK;
+
+    Routes = arrayCreate(sizeof(struct httpRoute), lines ? listLength(lines) : 2);
+    RouteRoot = createRouteNode(NULL, 0);
+    if (Routes == NULL || RouteRoot == NULL)
+        return WHEAT_WRONG;
+
+    if (lines == NULL)
+        ret = addDefaultRoutes();
+    else {
+        iter = listGetIterator(lines, START_HEAD);
+        while ((node = listNext(iter)) != NULL) {
+            if (parseRoute(listNodeValue(node)) == NULL) {
+                ret = WHEAT_WRONG;
+                break;
+            }
+        }
+        freeListIterator(iter);
+    }
+    if (ret == WHEAT_WRONG)
+        return ret;
+
+    // Routes array isn't changed from now on, so pointers are stable
+    for (i = 0; i < narray(Routes); i++) {
+        route = arrayIndex(Routes, i);
+        if (route->app == spotApp("static-file") && route->root == NULL &&
+                (root == NULL || setRouteRoot(route, root) == WHEAT_WRONG)) {
+            wheatLog(WHEAT_WARNING, "static-file route %s needs document root",
+                    route->path);
+            return WHEAT_WRONG;
+        }
+        if (insertRoute(route) == WHEAT_WRONG)
+            return WHEAT_WRONG;
+    }
+    return WHEAT_OK;
+}
+
+void deallocHttpRouter()
+{
+    struct httpRoute *route;
+    int i;
+
+    if (RouteRoot) {
+        freeRouteNode(RouteRoot);
+        RouteRoot = NULL;
+    }
+    if (Routes) {
+        for (i = 0; i < narray(Routes); i++) {
+            route = arrayIndex(Routes, i);
+            wstrFree(route->path);
+            wstrFree(route->root);
+            wstrFree(route->upstreams);
+        }
+        arrayDealloc(Routes);
+        Routes = NULL;
+    }
+}
@@ -0,0 +1,29 @@
+// Fast path of HTTP/1.x request parsing
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef WHEATSERVER_HTTP_SCAN_H
+#define WHEATSERVER_HTTP_SCAN_H
+
+#include <stddef.h>
+
+#include "http_parser.h"
+
+// Most requests are a complete request line and header block(and small
+// body) in the first read, `httpScanRequest` parses this common shape with
+// SIMD scanning and calls `settings` just like `http_parser_execute` would
+// do for the whole message. Anything else, such as partial message, chunked
+// body, upgrade or obsolete syntax, returns 0 without calling any callback
+// and caller should fall back to `http_parser_execute`.
+//
+// `parser` must be freshly initialized as HTTP_REQUEST. Return bytes of the
+// message consumed, on callback error it's less than `len` and
+// `parser->http_errno` is set like `http_parser_execute`.
+void httpScanInit();
+size_t httpScanRequest(http_parser *parser,
+        const struct http_parser_settings *settings,
+        const char *data, size_t len);
+
+#endif
@@ -4,81 +4,166 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
+#include <limits.h>
+#include <fcntl.h>
+
 #include "proto_http.h"
+#include "../str_macro.h"
 
-static FILE *AccessFp = NULL;
 static struct http_parser_settings HttpPaserSettings;
 #define WHEAT_BODY_LEN 10
 
 int httpSpot(struct conn*);
+static int httpSpotUpstream(struct conn *c);
 int parseHttp(struct conn *, struct slice *, size_t *);
 void *initHttpData();
-void freeHttpData(void *data);
 int initHttp();
 void deallocHttp();
 
+static struct enumIdName AccessLogPolicies[] = {
+    {0, "Block"}, {1, "Drop"}, {-1, NULL}
+};
+
+static struct enumIdName AccessLogFormats[] = {
+    {0, "Text"}, {1, "Binary"}, {-1, NULL}
+};
+
+#define HTTP_PARSER_FAST      0
+#define HTTP_PARSER_STANDARD  1
+static struct enumIdName HttpParsers[] = {
+    {HTTP_PARSER_FAST, "Fast"}, {HTTP_PARSER_STANDARD, "Standard"}, {-1, NULL}
+};
+static int HttpParser = HTTP_PARSER_FAST;
+
 // Http
 static struct configuration HttpConf[] = {
     {"access-log",        2, stringValidator,      {.ptr=NULL},
         NULL,                   STRING_FORMAT},
+    {"access-log-buffer-size", 2, unsignedIntValidator, {.val=256*1024},
+        (void *)(64*1024*1024), INT_FORMAT},
+    {"access-log-flush-interval", 2, unsignedIntValidator, {.val=1000},
+        (void *)(60*1000),      INT_FORMAT},
+    {"access-log-policy", 2, enumValidator,        {.enum_ptr=&AccessLogPolicies[0]},
+        &AccessLogPolicies[0],  ENUM_FORMAT},
+    {"access-log-format", 2, enumValidator,        {.enum_ptr=&AccessLogFormats[0]},
+        &AccessLogFormats[0],   ENUM_FORMAT},
     {"document-root",     2, stringValidator,      {.ptr=NULL},
         NULL,                   STRING_FORMAT},
+    {"body-spill-size",   2, unsignedIntValidator, {.val=1024*1024},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+    {"body-temp-dir",     2, stringValidator,      {.ptr=NULL},
+        NULL,                   STRING_FORMAT},
+    {"http-routes",       WHEAT_ARGS_NO_LIMIT,listValidator, {.ptr=NULL},
+        NULL,                   LIST_FORMAT},
+    {"http2",             2, boolValidator,        {.val=1},
+        NULL,                   BOOL_FORMAT},
+    {"http2-max-concurrent-streams", 2, unsignedIntValidator, {.val=100},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+    {"http-parser",       2, enumValidator,        {.enum_ptr=&HttpParsers[0]},
+        &HttpParsers[0],        ENUM_FORMAT},
 };
 
 struct protocol ProtocolHttp = {
     httpSpot, parseHttp, initHttpData, freeHttpData,
-        initHttp, deallocHttp
+        initHttp, deallocHttp, httpCron
+};
+
+static struct statItem HttpStats[] = {
+    {"Total dropped access log", SUM_STAT, RAW, 0, 0},
+    {"Total spilled request body", SUM_STAT, RAW, 0, 0},
 };
 
 struct moduleAttr ProtocolHttpAttr = {
-    "Http", PROTOCOL, {.protocol=&ProtocolHttp}, NULL, 0,
+    "Http", PROTOCOL, {.protocol=&ProtocolHttp},
+    HttpStats, sizeof(HttpStats)/sizeof(struct statItem),
     HttpConf, sizeof(HttpConf)/sizeof(struct configuration),
     NULL, 0
 };
 
-struct staticHandler {
-    wstr abs_path;
-    wstr root;
-    wstr static_dir;
-};
-
+// Body larger than `body-spill-size` is written to an unlinked temp file
+// `spill_fd` as it arrives instead of being kept in `client->req_buf`,
+// `body` slices are unused then and reading goes through `spill_buf`.
 struct httpBody {
     struct slice *body;
     struct slice *curr_body;
     struct slice *end_body;
     int body_len;
     int slice_len;
+    int spill_fd;
+    off_t spill_off;
+    char *spill_buf;
+    struct slice spill_slice;
 };
 
+// Parsed request data only references bytes in `client->req_buf`, which is
+// kept until all conns of client finished. Only pieces splited by mbuf
+// boundary are copied into `copies`. If body is spilled, url and headers
+// are copied once so that consumed mbufs can be released early.
+//
+// `parse_start` and `parse_end`: the range of slice being parsed, used to
+// decide whether a callback continues the last field, value or url
+// `req_headers`: array of struct httpHeader in received order, for response
+// of backend server(see httpSpotUpstream) it keeps response headers
+// `deferred`: app replies later and calls httpFinishResponse itself
+// `header_index`: position + 1 in `req_headers` of the first header with
+// each well-known id, 0 means absent
+// `stream`: request came from HTTP/2 stream(http2.c), response is framed
+// by it instead of written as HTTP/1.x
 struct httpData {
     //Intern use
     http_parser *parser;
-    struct dictEntry *last_entry;
+    const char *parse_start;
+    const char *parse_end;
+    struct array *copies;
     unsigned last_was_value:1;
+    unsigned partial:1;
     unsigned complete:1;
     unsigned is_chunked_in_header:1;
     unsigned upgrade:1;
     unsigned keep_live:1;
     unsigned headers_sent:1;
     unsigned can_compress:1;
-    unsigned send;
-
-    wstr query_string;
-    wstr path;
+    unsigned has_connection:1;
+    unsigned has_content_length:1;
+    unsigned chunked:1;
+    unsigned headers_complete:1;
+    unsigned deferred:1;
+    unsigned skip_body:1;
+    unsigned until_eof:1;
+    off_t send;
+    struct conn *conn;
+    struct httpRoute *route;
+    struct http2Stream *stream;
+
+    struct slice url;
+    struct slice query_string;
+    struct slice path;
     struct httpBody body;
     const char *url_scheme;
     const char *method;
     const char *protocol_version;
-    struct dict *req_headers;
+    struct array *req_headers;
+    unsigned char header_index[HTTP_HEADER_COUNT];
 
+    // `res_status_line` points to a preformatted "200 OK\r\n" like line,
+    // either static or `res_status_custom`. `res_headers` keeps headers
+    // appended by application already rendered as "Field: value\r\n".
     int res_status;
-    wstr res_status_msg;
-    int response_length;
-    struct dict *res_headers;
+    const char *res_status_line;
+    size_t res_status_len;
+    wstr res_status_custom;
+    off_t response_length;
+    wstr res_headers;
     wstr send_header;
+    // Small pieces of response like size lines of chunked body and HTTP/2
+    // frame headers are carved from `send_block`, full blocks are moved to
+    // `copies` because queued slices still refer them.
+    wstr send_block;
 };
 
-static struct staticHandler StaticPathHandler;
+static size_t BodySpillSize = 0;
+static const char *BodyTempDir = NULL;
+static long long *StatSpilledBody = NULL;
 
 const char *URL_SCHEME[] = {
     "http",
@@ -87,9 +172,87 @@ const char *URL_SCHEME[] = {
 
 const char *PROTOCOL_VERSION[] = {
     "HTTP/1.0",
-    "HTTP/1.1"
+    "HTTP/1.1",
+    "HTTP/2.0"
 };
 
+#define HEADER_NAME(n)  {n, sizeof(n)-1}
+// Indexed by enum httpHeaderId
+static const struct httpHeaderName {
+    const char *name;
+    size_t len;
+} HttpHeaderNames[] = {
+    {NULL, 0},
+    HEADER_NAME("Host"),
+    HEADER_NAME("Connection"),
+    HEADER_NAME("Content-Length"),
+    HEADER_NAME("Content-Type"),
+    HEADER_NAME("Transfer-Encoding"),
+    HEADER_NAME("Last-Modified"),
+    HEADER_NAME("If-Modified-Since"),
+    HEADER_NAME("If-None-Match"),
+    HEADER_NAME("User-Agent"),
+    HEADER_NAME("Referer"),
+    HEADER_NAME("X-Forwarded-For"),
+    HEADER_NAME("Remote_Addr"),
+    HEADER_NAME("Expect"),
+    HEADER_NAME("Cookie"),
+    HEADER_NAME("Set-Cookie"),
+    HEADER_NAME("Accept"),
+    HEADER_NAME("Accept-Encoding"),
+    HEADER_NAME("Cache-Control"),
+    HEADER_NAME("Location"),
+    HEADER_NAME("Upgrade"),
+    HEADER_NAME("Date"),
+    HEADER_NAME("Server"),
+    HEADER_NAME("ETag"),
+    HEADER_NAME("Expires"),
+    HEADER_NAME("Vary"),
+};
+
+#define STATUS_LINE(code, msg)  {code, msg, #code " " msg "\r\n", sizeof(#code " " msg "\r\n")-1}
+static const struct httpStatusLine {
+    int status;
+    const char *msg;
+    const char *line;
+    size_t len;
+} HttpStatusLines[] = {
+    STATUS_LINE(200, "OK"),
+    STATUS_LINE(304, "Not Modified"),
+    STATUS_LINE(404, "Not Found"),
+    STATUS_LINE(500, "Internal Server Error"),
+    STATUS_LINE(100, "Continue"),
+    STATUS_LINE(201, "Created"),
+    STATUS_LINE(202, "Accepted"),
+    STATUS_LINE(204, "No Content"),
+    STATUS_LINE(206, "Partial Content"),
+    STATUS_LINE(301, "Moved Permanently"),
+    STATUS_LINE(302, "Found"),
+    STATUS_LINE(400, "Bad Request"),
+    STATUS_LINE(401, "Unauthorized"),
+    STATUS_LINE(403, "Forbidden"),
+    STATUS_LINE(405, "Method Not Allowed"),
+    STATUS_LINE(502, "Bad Gateway"),
+    STATUS_LINE(503, "Service Unavailable"),
+    STATUS_LINE(504, "Gateway Timeout"),
+};
+
+static const char ConnectionUpgrade[] = "Connection: upgrade\r\n";
+static const char ConnectionKeepAlive[] = "Connection: keep-alive\r\n";
+static const char ConnectionClose[] = "Connection: close\r\n";
+static const char TransferChunked[] = "Transfer-Encoding: chunked\r\n";
+
+#define HTTP_SEND_BLOCK      512
+// "\r\n" ending last chunk, hex size and "\r\n"
+#define HTTP_CHUNK_LINE_MAX  (2+sizeof(size_t)*2+2)
+
+// "Server: xxx\r\n" is fixed after initHttp and "Date: xxx\r\n" is refreshed
+// by httpCron once per second
+static wstr ServerHeader = NULL;
+static char DateHeader[64];
+static size_t DateHeaderLen = 0;
+static time_t DateHeaderTime = 0;
+
 int convertHttpDate(time_t date, char *buf, size_t len)
 {
     struct tm tm = *localtime(&date);
@@ -108,15 +271,111 @@ time_t fromHttpDate(char *buf)
     return mktime(&tm);
 }
 
-char *httpDate()
+static void refreshDateHeader(time_t now)
 {
-    static char buf[255];
-    static time_t now = 0;
-    if (now != Server.cron_time.tv_sec || now == 0) {
-        now = Server.cron_time.tv_sec;
-        convertHttpDate(now, buf, sizeof(buf));
+    struct tm tm;
+    size_t ret;
+
+    gmtime_r(&now, &tm);
+    ret = strftime(DateHeader, sizeof(DateHeader),
+            "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+    if (ret == 0)
+        return ;
+    DateHeaderLen = ret;
+    DateHeaderTime = now;
+}
+
+void httpCron()
+{
+    if (Server.cron_time.tv_sec != DateHeaderTime)
+        refreshDateHeader(Server.cron_time.tv_sec);
+    accessLogCron();
+}
+
+int getHttpHeaderId(const char *m, size_t len)
+{
+    switch (len) {
+        case 4:
+            if (str4icmp(m, 'H', 'o', 's', 't'))
+                return HTTP_HEADER_HOST;
+            if (str4icmp(m, 'D', 'a', 't', 'e'))
+                return HTTP_HEADER_DATE;
+            if (str4icmp(m, 'E', 'T', 'a', 'g'))
+                return HTTP_HEADER_ETAG;
+            if (str4icmp(m, 'V', 'a', 'r', 'y'))
+                return HTTP_HEADER_VARY;
+            break;
+        case 6:
+            if (str6icmp(m, 'C', 'o', 'o', 'k', 'i', 'e'))
+                return HTTP_HEADER_COOKIE;
+            if (str6icmp(m, 'A', 'c', 'c', 'e', 'p', 't'))
+                return HTTP_HEADER_ACCEPT;
+            if (str6icmp(m, 'E', 'x', 'p', 'e', 'c', 't'))
+                return HTTP_HEADER_EXPECT;
+            if (str6icmp(m, 'S', 'e', 'r', 'v', 'e', 'r'))
+                return HTTP_HEADER_SERVER;
+            break;
+        case 7:
+            if (str7icmp(m, 'R', 'e', 'f', 'e', 'r', 'e', 'r'))
+                return HTTP_HEADER_REFERER;
+            if (str7icmp(m, 'U', 'p', 'g', 'r', 'a', 'd', 'e'))
+                return HTTP_HEADER_UPGRADE;
+            if (str7icmp(m, 'E', 'x', 'p', 'i', 'r', 'e', 's'))
+                return HTTP_HEADER_EXPIRES;
+            break;
+        case 8:
+            if (str8icmp(m, 'L', 'o', 'c', 'a', 't', 'i', 'o', 'n'))
+                return HTTP_HEADER_LOCATION;
+            break;
+        case 10:
+            if (str10icmp(m, 'C', 'o', 'n', 'n', 'e', 'c', 't', 'i', 'o', 'n'))
+                return HTTP_HEADER_CONNECTION;
+            if (str10icmp(m, 'U', 's', 'e', 'r', '-', 'A', 'g', 'e', 'n', 't'))
+                return HTTP_HEADER_USER_AGENT;
+            if (str10icmp(m, 'S', 'e', 't', '-', 'C', 'o', 'o', 'k', 'i', 'e'))
+                return HTTP_HEADER_SET_COOKIE;
+            break;
+        case 11:
+            if (str11icmp(m, 'R', 'e', 'm', 'o', 't', 'e', '_', 'A', 'd', 'd', 'r'))
+                return HTTP_HEADER_REMOTE_ADDR;
+            break;
+        case 12:
+            if (str12icmp(m, 'C', 'o', 'n', 't', 'e', 'n', 't', '-', 'T', 'y', 'p', 'e'))
+                return HTTP_HEADER_CONTENT_TYPE;
+            break;
+        case 13:
+            if (str13icmp(m, 'L', 'a', 's', 't', '-', 'M', 'o', 'd', 'i', 'f', 'i', 'e', 'd'))
+                return HTTP_HEADER_LAST_MODIFIED;
+            if (str13icmp(m, 'C', 'a', 'c', 'h', 'e', '-', 'C', 'o', 'n', 't', 'r', 'o', 'l'))
+                return HTTP_HEADER_CACHE_CONTROL;
+            if (str13icmp(m, 'I', 'f', '-', 'N', 'o', 'n', 'e', '-', 'M', 'a', 't', 'c', 'h'))
+                return HTTP_HEADER_IF_NONE_MATCH;
+            break;
+        case 14:
+            if (str14icmp(m, 'C', 'o', 'n', 't', 'e', 'n', 't', '-', 'L', 'e', 'n', 'g', 't', 'h'))
+                return HTTP_HEADER_CONTENT_LENGTH;
+            break;
+        case 15:
+            if (str15icmp(m, 'X', '-', 'F', 'o', 'r', 'w', 'a', 'r', 'd', 'e', 'd', '-', 'F', 'o', 'r'))
+                return HTTP_HEADER_X_FORWARDED_FOR;
+            if (str15icmp(m, 'A', 'c', 'c', 'e', 'p', 't', '-', 'E', 'n', 'c', 'o', 'd', 'i', 'n', 'g'))
+                return HTTP_HEADER_ACCEPT_ENCODING;
+            break;
+        case 17:
+            if (str17icmp(m, 'T', 'r', 'a', 'n', 's', 'f', 'e', 'r', '-', 'E', 'n', 'c', 'o', 'd', 'i', 'n', 'g'))
+                return HTTP_HEADER_TRANSFER_ENCODING;
+            if (str17icmp(m, 'I', 'f', '-', 'M', 'o', 'd', 'i', 'f', 'i', 'e', 'd', '-', 'S', 'i', 'n', 'c', 'e'))
+                return HTTP_HEADER_IF_MODIFIED_SINCE;
+            break;
     }
-    return buf;
+    return HTTP_HEADER_UNKNOWN;
+}
+
+const char *getHttpHeaderName(int id)
+{
+    if (id <= HTTP_HEADER_UNKNOWN || id >= HTTP_HEADER_COUNT)
+        return NULL;
+    return HttpHeaderNames[id].name;
 }
 
 const char *httpGetUrlScheme(struct conn *c)
@@ -124,6 +383,11 @@ const char *httpGetUrlScheme(struct conn *c)
     return ((struct httpData*)c->protocol_data)->url_scheme;
 }
 
+struct httpRoute *httpGetRoute(struct conn *c)
+{
+    return ((struct httpData*)c->protocol_data)->route;
+}
+
 const char *httpGetMethod(struct conn *c)
 {
     return ((struct httpData*)c->protocol_data)->method;
@@ -134,22 +398,41 @@ const char *httpGetProtocolVersion(struct conn *c)
     return ((struct httpData*)c->protocol_data)->protocol_version;
 }
 
-const wstr httpGetQueryString(struct conn *c)
+const struct slice *httpGetQueryString(struct conn *c)
 {
-    return ((struct httpData*)c->protocol_data)->query_string;
+    return &((struct httpData*)c->protocol_data)->query_string;
 }
 
-const wstr httpGetPath(struct conn *c)
+const struct slice *httpGetPath(struct conn *c)
 {
-    return ((struct httpData*)c->protocol_data)->path;
+    return &((struct httpData*)c->protocol_data)->path;
 }
 
 const struct slice *httpGetBodyNext(struct conn *c)
 {
     struct httpData *data;
     struct slice *s;
+    struct httpBody *body;
+    ssize_t nread;
 
     data = c->protocol_data;
+    body = &data->body;
+    if (body->spill_fd != -1) {
+        if (body->spill_buf == NULL) {
+            body->spill_buf = wmalloc(Server.mbuf_size);
+            if (body->spill_buf == NULL)
+                return NULL;
+        }
+        do {
+            nread = pread(body->spill_fd, body->spill_buf, Server.mbuf_size,
+                    body->spill_off);
+        } while (nread == -1 && errno == EINTR);
+        if (nread <= 0)
+            return NULL;
+        body->spill_off += nread;
+        sliceTo(&body->spill_slice, (uint8_t *)body->spill_buf, nread);
+        return &body->spill_slice;
+    }
     s = data->body.curr_body;
     if (s == data->body.end_body)
         return NULL;
@@ -162,11 +445,84 @@ int httpBodyGetSize(struct conn *c)
     return ((struct httpData*)c->protocol_data)->body.body_len;
 }
 
-struct dict *httpGetReqHeaders(struct conn *c)
+// Spilled body file or -1, body can be sent by `sendClientFile` then
+int httpBodyGetFile(struct conn *c)
+{
+    return ((struct httpData*)c->protocol_data)->body.spill_fd;
+}
+
+void httpBodyRewind(struct conn *c)
+{
+    struct httpBody *body = &((struct httpData*)c->protocol_data)->body;
+
+    body->curr_body = body->body;
+    body->spill_off = 0;
+}
+
+int httpIsComplete(struct conn *c)
+{
+    return ((struct httpData*)c->protocol_data)->complete;
+}
+
+int httpIsKeepAlive(struct conn *c)
+{
+    return ((struct httpData*)c->protocol_data)->keep_live;
+}
+
+// Below are for response of backend server
+int httpGetStatusCode(struct conn *c)
+{
+    return ((struct httpData*)c->protocol_data)->parser->status_code;
+}
+
+int httpIsBodyUntilEOF(struct conn *c)
+{
+    return ((struct httpData*)c->protocol_data)->until_eof;
+}
+
+void httpSkipBody(struct conn *c)
+{
+    ((struct httpData*)c->protocol_data)->skip_body = 1;
+}
+
+struct array *httpGetReqHeaders(struct conn *c)
 {
     return ((struct httpData*)c->protocol_data)->req_headers;
 }
 
+const struct slice *httpGetReqHeader(struct conn *c, int id)
+{
+    struct httpData *data = c->protocol_data;
+    struct httpHeader *header;
+
+    if (id <= HTTP_HEADER_UNKNOWN || id >= HTTP_HEADER_COUNT ||
+            !data->header_index[id])
+        return NULL;
+    header = arrayIndex(data->req_headers, data->header_index[id]-1);
+    return &header->value;
+}
+
+const struct slice *httpFindReqHeader(struct conn *c, const char *name,
+        size_t len)
+{
+    struct httpData *data = c->protocol_data;
+    struct httpHeader *header;
+    size_t i, count;
+    int id;
+
+    id = getHttpHeaderId(name, len);
+    if (id != HTTP_HEADER_UNKNOWN)
+        return httpGetReqHeader(c, id);
+    count = narray(data->req_headers);
+    for (i = 0; i < count; i++) {
+        header = arrayIndex(data->req_headers, i);
+        if (header->id == HTTP_HEADER_UNKNOWN && header->name.len == len &&
+                !strncasecmp((const char *)header->name.data, name, len))
+            return &header->value;
+    }
+    return NULL;
+}
+
 int ishttpHeaderSended(struct conn *c)
 {
     return ((struct httpData*)c->protocol_data)->headers_sent;
@@ -177,12 +533,85 @@ int httpGetResStatus(struct conn *c)
     return ((struct httpData*)c->protocol_data)->res_status;
 }
 
-static int isChunked(struct httpData *http_data)
+off_t httpGetResLength(struct conn *c)
+{
+    struct httpData *http_data = c->protocol_data;
+
+    if (http_data->has_content_length)
+        return http_data->response_length;
+    return http_data->send;
+}
+
+/* `copy` is freed with httpData */
+static int keepCopy(struct httpData *data, wstr copy)
 {
-    return http_data->is_chunked_in_header &&
-        http_data->response_length == 0 &&
+    if (data->copies == NULL) {
+        data->copies = arrayCreate(sizeof(wstr), 2);
+        if (data->copies == NULL)
+            return -1;
+    }
+    arrayPush(data->copies, &copy);
+    return 0;
+}
+
+// Body length must be delimited by chunked encoding when application
+// doesn't give Content-Length, otherwise connection has to be closed.
+static int canChunked(struct httpData *http_data)
+{
+    int status = http_data->res_status;
+
+    return !http_data->has_content_length &&
         http_data->protocol_version == PROTOCOL_VERSION[1] &&
-        http_data->res_status == 200;
+        strcasecmp(http_data->method, "HEAD") &&
+        status >= 200 && status != 204 && status != 304;
+}
+
+// Return `len` bytes kept until conn is freed, piece larger than a block
+// gets its own copy
+char *httpReserveSendBuf(struct conn *c, size_t len)
+{
+    struct httpData *http_data = c->protocol_data;
+    wstr block = http_data->send_block;
+    char *p;
+
+    if (len > HTTP_SEND_BLOCK / 4) {
+        block = wstrNewLen(NULL, (int)len);
+        if (block == NULL || keepCopy(http_data, block) == -1) {
+            wstrFree(block);
+            return NULL;
+        }
+        wstrupdatelen(block, (int)len);
+        return block;
+    }
+    if (block == NULL || wstrlen(block) + len > HTTP_SEND_BLOCK) {
+        if (block)
+            keepCopy(http_data, block);
+        block = wstrNewLen(NULL, HTTP_SEND_BLOCK);
+        if (block == NULL)
+            return NULL;
+        http_data->send_block = block;
+    }
+    p = block + wstrlen(block);
+    wstrupdatelen(block, (int)(wstrlen(block)+len));
+    return p;
+}
+
+// Ending "\r\n" of the previous chunk is merged into the size line of next
+// one, so each chunk costs one extra slice instead of two.
+static int chunkLine(struct conn *c, size_t len, struct slice *s)
+{
+    struct httpData *http_data = c->protocol_data;
+    char buf[HTTP_CHUNK_LINE_MAX+1], *p;
+    int ret;
+
+    ret = snprintf(buf, sizeof(buf), "%s%zx\r\n",
+            http_data->send ? "\r\n" : "", len);
+    p = httpReserveSendBuf(c, ret);
+    if (p == NULL)
+        return -1;
+    memcpy(p, buf, ret);
+    sliceTo(s, (uint8_t *)p, ret);
+    return 0;
 }
 
 static int enlargeHttpBody(struct httpBody *body)
@@ -200,71 +629,161 @@ static int enlargeHttpBody(struct httpBody *body)
     return 0;
 }
 
-static const char *connectionField(struct conn *c)
+static const char *connectionLine(struct conn *c, size_t *len)
 {
-    char *connection = NULL;
     struct httpData *data = c->protocol_data;
 
     if (data->upgrade) {
-        connection = "upgrade";
+        *len = sizeof(ConnectionUpgrade) - 1;
+        return ConnectionUpgrade;
     } else if (data->keep_live) {
-        connection = "keep-live";
-    } else if (!data->keep_live) {
-        connection = "close";
-        setClientClose(c);
+        *len = sizeof(ConnectionKeepAlive) - 1;
+        return ConnectionKeepAlive;
     }
-    return connection;
+    setClientClose(c);
+    *len = sizeof(ConnectionClose) - 1;
+    return ConnectionClose;
 }
 
-int appendToResHeaders(struct conn *c, const char *field,
-        const char *value)
+static int renderResHeader(struct httpData *http_data, const char *field,
+        size_t field_len, const char *value, size_t value_len)
 {
-    struct httpData *http_data;
-    int ret;
+    wstr headers;
+    char *p;
+    size_t len, old_len;
 
-    http_data = c->protocol_data;
-    ret = dictAdd(http_data->res_headers, wstrNew(field), wstrNew(value));
-    if (ret == DICT_WRONG)
+    len = field_len + value_len + 4;
+    headers = wstrMakeRoom(http_data->res_headers, len);
+    if (headers == NULL)
         return -1;
+    old_len = wstrlen(headers);
+    p = headers + old_len;
+    memcpy(p, field, field_len);
+    p += field_len;
+    *p++ = ':';
+    *p++ = ' ';
+    memcpy(p, value, value_len);
+    p += value_len;
+    *p++ = '\r';
+    *p++ = '\n';
+    wstrupdatelen(headers, (int)(old_len+len));
+    http_data->res_headers = headers;
     return 0;
 }
 
+// Append well-known header `id`, header name is taken from constant table
+// and semantic headers are recorded as flags here instead of being searched
+// again when sending.
+int httpAppendResHeader(struct conn *c, int id, const char *value, size_t len)
+{
+    struct httpData *http_data = c->protocol_data;
+    long long length;
+
+    if (id <= HTTP_HEADER_UNKNOWN || id >= HTTP_HEADER_COUNT)
+        return -1;
+    switch (id) {
+        case HTTP_HEADER_CONTENT_LENGTH:
+            if (string2ll(value, len, &length) == WHEAT_WRONG)
+                return -1;
+            http_data->response_length = length;
+            http_data->has_content_length = 1;
+            break;
+        case HTTP_HEADER_TRANSFER_ENCODING:
+            if (len == 7 && str7icmp(value, 'c', 'h', 'u', 'n', 'k', 'e', 'd'))
+                http_data->is_chunked_in_header = 1;
+            break;
+        case HTTP_HEADER_CONNECTION:
+            http_data->has_connection = 1;
+            break;
+    }
+    return renderResHeader(http_data, HttpHeaderNames[id].name,
+            HttpHeaderNames[id].len, value, len);
+}
+
+// Append "Field: value\r\n" lines rendered before, such as by a cache.
+// `content_length` is the value of Content-Length line in them, -1 if none.
+int httpAppendRenderedHeaders(struct conn *c, const char *headers,
+        size_t len, long long content_length)
+{
+    struct httpData *http_data = c->protocol_data;
+
+    if (content_length != -1) {
+        http_data->response_length = content_length;
+        http_data->has_content_length = 1;
+    }
+    http_data->res_headers = wstrCatLen(http_data->res_headers, headers, len);
+    return http_data->res_headers ? 0 : -1;
+}
+
+int httpAppendResHeaderLen(struct conn *c, const char *field,
+        size_t field_len, const char *value, size_t value_len)
+{
+    int id = getHttpHeaderId(field, field_len);
+
+    if (id != HTTP_HEADER_UNKNOWN)
+        return httpAppendResHeader(c, id, value, value_len);
+    return renderResHeader(c->protocol_data, field, field_len,
+            value, value_len);
+}
+
+int appendToResHeaders(struct conn *c, const char *field,
+        const char *value)
+{
+    return httpAppendResHeaderLen(c, field, strlen(field), value,
+            strlen(value));
+}
+
+// Used when only status code is known, such as relaying backend response
+void httpFillResStatus(struct conn *c, int status)
+{
+    int i;
+
+    for (i = 0; i < sizeof(HttpStatusLines)/sizeof(struct httpStatusLine); i++) {
+        if (HttpStatusLines[i].status == status) {
+            fillResInfo(c, status, HttpStatusLines[i].msg);
+            return ;
+        }
+    }
+    fillResInfo(c, status, "Unknown");
+}
+
 void fillResInfo(struct conn *c, int status, const char *msg)
 {
     struct httpData *data = c->protocol_data;
+    const struct httpStatusLine *line;
+    char buf[256];
+    int i, ret;
+
     data->res_status = status;
-    data->res_status_msg = wstrNew(msg);
+    for (i = 0; i < sizeof(HttpStatusLines)/sizeof(struct httpStatusLine); i++) {
+        line = &HttpStatusLines[i];
+        if (line->status == status && !strcmp(line->msg, msg)) {
+            data->res_status_line = line->line;
+            data->res_status_len = line->len;
+            return ;
+        }
+    }
+
+    ret = snprintf(buf, sizeof(buf), "%d %s\r\n", status, msg);
+    if (ret < 0 || ret >= sizeof(buf)) {
+        // Too long reason phrase, only status code is kept
+        ret = snprintf(buf, sizeof(buf), "%d \r\n", status);
+    }
+    wstrFree(data->res_status_custom);
+    data->res_status_custom = wstrNewLen(buf, ret);
+    data->res_status_line = data->res_status_custom;
+    data->res_status_len = ret;
 }
 
-static wstr defaultResHeader(struct conn *c, wstr headers)
+// Discard headers appended by application but not sent yet, used when
+// replying error page instead
+static void resetResHeaders(struct httpData *http_data)
 {
-    char buf[256];
-    int ret;
-    struct httpData *http_data = c->protocol_data;
-    ASSERT(http_data->res_status && http_data->res_status_msg);
-
-    ret = snprintf(buf, sizeof(buf), "%s %d %s\r\n", http_data->protocol_version,
-            http_data->res_status, http_data->res_status_msg);
-    if (ret < 0 || ret > sizeof(buf))
-        goto cleanup;
-    if ((headers = wstrCatLen(headers, buf, ret)) == NULL)
-        goto cleanup;
-
-    ret = snprintf(buf, 255, "Server: %s\r\n", Server.master_name);
-    if (ret < 0 || ret > sizeof(buf))
-        goto cleanup;
-    if ((headers = wstrCatLen(headers, buf, ret)) == NULL)
-        goto cleanup;
-    ret = snprintf(buf, 255, "Date: %s\r\n", httpDate());
-    if (ret < 0 || ret > sizeof(buf))
-        goto cleanup;
-    if ((headers = wstrCatLen(headers, buf, ret)) == NULL)
-        goto cleanup;
-    return headers;;
-
-cleanup:
-    wstrFree(headers);
-    return NULL;
+    wstrupdatelen(http_data->res_headers, 0);
+    http_data->response_length = 0;
+    http_data->is_chunked_in_header = 0;
+    http_data->has_connection = 0;
+    http_data->has_content_length = 0;
 }
 
 /* `value` is the value of http header x-forwarded-for.
@@ -313,52 +832,237 @@ void parserForward(wstr value, wstr *h, wstr *p)
     wstrFree(remote_addr);
 }
 
-/* three situation called
- * 1. init header, no header exists
- * 2. new header comes
- * 3. last header remainder comes
+/* http_parser only splits a field, value or url when it reaches the end of
+ * the buffer passed in, the remainder comes from the start of next buffer.
  */
+static int isContinued(struct httpData *data, const char *at)
+{
+    return data->partial && at == data->parse_start;
+}
+
+/* Remainder is contiguous with `s` if it was read into the same mbuf,
+ * otherwise both pieces are copied.
+ */
+static int extendSlice(struct httpData *data, struct slice *s,
+        const char *at, size_t len)
+{
+    wstr copy;
+
+    if ((const char *)s->data + s->len == at) {
+        s->len += len;
+        return 0;
+    }
+    copy = wstrNewLen(s->data, (int)s->len);
+    if (copy == NULL)
+        return 1;
+    copy = wstrCatLen(copy, at, len);
+    if (copy == NULL)
+        return 1;
+    keepCopy(data, copy);
+    sliceTo(s, (uint8_t *)copy, wstrlen(copy));
+    return 0;
+}
+
+/* Header name is complete when its value starts or headers end */
+static void indexLastHeader(struct httpData *data)
+{
+    struct httpHeader *header;
+    size_t pos = narray(data->req_headers);
+
+    if (!pos)
+        return ;
+    header = arrayIndex(data->req_headers, pos-1);
+    header->id = getHttpHeaderId((const char *)header->name.data,
+            header->name.len);
+    if (header->id != HTTP_HEADER_UNKNOWN && !data->header_index[header->id]
+            && pos <= UCHAR_MAX)
+        data->header_index[header->id] = pos;
+}
+
 int on_header_field(http_parser *parser, const char *at, size_t len)
 {
-    int ret;
-    wstr key;
+    struct httpHeader header, *last;
     struct httpData *data = parser->data;
+    int ret = 0;
 
-    if (!data->last_was_value && data->last_entry != NULL) {
-        key = data->last_entry->key;
-        ret = dictDeleteNoFree(data->req_headers, key);
-        if (ret == DICT_WRONG)
-            return 1;
-        key = wstrCatLen(key, at, len);
+    if (!data->last_was_value && narray(data->req_headers) &&
+            isContinued(data, at)) {
+        last = arrayLast(data->req_headers);
+        ret = extendSlice(data, &last->name, at, len);
+    } else {
+        sliceTo(&header.name, (uint8_t *)at, len);
+        sliceTo(&header.value, NULL, 0);
+        header.id = HTTP_HEADER_UNKNOWN;
+        arrayPush(data->req_headers, &header);
     }
-    else
-        key = wstrNewLen(at, (int)len);
     data->last_was_value = 0;
-
-    data->last_entry = dictReplaceRaw(data->req_headers, key);
-    if (data->last_entry == NULL)
-        return 1;
-    return 0;
+    data->partial = (at + len == data->parse_end);
+    return ret;
 }
 
-/* two situation called
- * 1. new header value comes
- * 2. last header value remainder comes
- */
 int on_header_value(http_parser *parser, const char *at, size_t len)
 {
-    wstr value;
+    struct httpHeader *last;
     struct httpData *data = parser->data;
-    if (data->last_was_value) {
-        value = dictGetVal(data->last_entry);
-        value = wstrCatLen(value, at, len);
-    } else
-        value = wstrNewLen(at, (int)len);
+    int ret = 0;
 
-    data->last_was_value = 1;
-    if (value == NULL)
+    if (!narray(data->req_headers))
         return 1;
-    dictSetVal(data->req_headers, data->last_entry, value);
+    last = arrayLast(data->req_headers);
+    if (data->last_was_value && isContinued(data, at)) {
+        ret = extendSlice(data, &last->value, at, len);
+    } else {
+        indexLastHeader(data);
+        sliceTo(&last->value, (uint8_t *)at, len);
+    }
+    data->last_was_value = 1;
+    data->partial = (at + len == data->parse_end);
+    return ret;
+}
+
+static int writeSpill(int fd, const char *buf, size_t len)
+{
+    ssize_t nwritten;
+
+    while (len) {
+        nwritten = write(fd, buf, len);
+        if (nwritten == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += nwritten;
+        len -= nwritten;
+    }
+    return 0;
+}
+
+/* Url and headers are copied into one wstr so they don't refer req_buf */
+static int detachRequest(struct httpData *data)
+{
+    struct httpHeader *header;
+    size_t i, total;
+    wstr copy;
+    char *p;
+
+    total = data->url.len;
+    for (i = 0; i < narray(data->req_headers); i++) {
+        header = arrayIndex(data->req_headers, i);
+        total += header->name.len + header->value.len;
+    }
+    copy = wstrNewLen(NULL, (int)total);
+    if (copy == NULL || keepCopy(data, copy) == -1) {
+        wstrFree(copy);
+        return -1;
+    }
+
+    p = copy;
+    memcpy(p, data->url.data, data->url.len);
+    sliceTo(&data->path, (uint8_t *)p + (data->path.data - data->url.data),
+            data->path.len);
+    sliceTo(&data->query_string,
+            (uint8_t *)p + (data->query_string.data - data->url.data),
+            data->query_string.len);
+    sliceTo(&data->url, (uint8_t *)p, data->url.len);
+    p += data->url.len;
+    for (i = 0; i < narray(data->req_headers); i++) {
+        header = arrayIndex(data->req_headers, i);
+        memcpy(p, header->name.data, header->name.len);
+        sliceTo(&header->name, (uint8_t *)p, header->name.len);
+        p += header->name.len;
+        memcpy(p, header->value.data, header->value.len);
+        sliceTo(&header->value, (uint8_t *)p, header->value.len);
+        p += header->value.len;
+    }
+    wstrupdatelen(copy, (int)total);
+    return 0;
+}
+
+// Request is copied out of `client->req_buf` so it stays valid after client
+// is freed, e.g. while a thread of application still reads it. Spilled and
+// HTTP/2 requests are kept by httpData already.
+int httpDetachRequest(struct conn *c)
+{
+    struct httpData *data = c->protocol_data;
+    struct httpBody *body = &data->body;
+    struct slice *s;
+    size_t total = 0;
+    wstr copy;
+    char *p;
+
+    if (data->stream || body->spill_fd != -1)
+        return WHEAT_OK;
+    if (detachRequest(data) == -1)
+        return WHEAT_WRONG;
+    if (body->curr_body == body->end_body)
+        return WHEAT_OK;
+    for (s = body->curr_body; s != body->end_body; s++)
+        total += s->len;
+    copy = wstrNewLen(NULL, (int)total);
+    if (copy == NULL || keepCopy(data, copy) == -1) {
+        wstrFree(copy);
+        return WHEAT_WRONG;
+    }
+    p = copy;
+    for (s = body->curr_body; s != body->end_body; s++) {
+        memcpy(p, s->data, s->len);
+        p += s->len;
+    }
+    wstrupdatelen(copy, (int)total);
+    sliceTo(body->body, (uint8_t *)copy, total);
+    body->curr_body = body->body;
+    body->end_body = body->body + 1;
+    return WHEAT_OK;
+}
+
+// Take detached request away from `c` which is being freed, it's freed by
+// freeHttpData later. HTTP/2 stream can't outlive its conn, it's released
+// now.
+void *httpOrphanRequest(struct conn *c)
+{
+    struct httpData *data = c->protocol_data;
+
+    if (data->stream) {
+        http2FreeStream(data->stream);
+        data->stream = NULL;
+    }
+    c->protocol_data = NULL;
+    return data;
+}
+
+/* Move body received so far to temp file, later body goes there directly */
+static int spillHttpBody(struct httpData *data)
+{
+    struct httpBody *body = &data->body;
+    char path[WHEATSERVER_PATH_LEN];
+    struct slice *s;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/wheatserver-body-XXXXXX",
+            BodyTempDir);
+    fd = mkstemp(path);
+    if (fd == -1) {
+        wheatLog(WHEAT_WARNING, "create body temp file in %s failed: %s",
+                BodyTempDir, strerror(errno));
+        return -1;
+    }
+    unlink(path);
+    for (s = body->curr_body; s != body->end_body; s++) {
+        if (writeSpill(fd, (const char *)s->data, s->len) == -1) {
+            wheatLog(WHEAT_WARNING, "write body temp file failed: %s",
+                    strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    if (detachRequest(data) == -1) {
+        close(fd);
+        return -1;
+    }
+    body->curr_body = body->end_body = body->body;
+    body->spill_fd = fd;
+    body->spill_off = 0;
+    (*StatSpilledBody)++;
     return 0;
 }
 
@@ -369,6 +1073,21 @@ int on_body(http_parser *parser, const char *at, size_t len)
 
     data = parser->data;
     body = &data->body;
+    if (body->spill_fd == -1 && BodySpillSize &&
+            parser->type == HTTP_REQUEST &&
+            body->body_len + len > BodySpillSize) {
+        if (spillHttpBody(data) == -1)
+            return 1;
+    }
+    if (body->spill_fd != -1) {
+        if (writeSpill(body->spill_fd, at, len) == -1) {
+            wheatLog(WHEAT_WARNING, "write body temp file failed: %s",
+                    strerror(errno));
+            return 1;
+        }
+        body->body_len += len;
+        return 0;
+    }
     if (body->end_body == body->body + body->slice_len) {
         if (enlargeHttpBody(&data->body) == -1)
             return 1;
@@ -380,13 +1099,61 @@ int on_body(http_parser *parser, const char *at, size_t len)
     return 0;
 }
 
+// "Upgrade: h2c" is the only upgrade of HTTP/1.1 we know
+static int isH2cUpgrade(struct conn *c)
+{
+    const struct slice *upgrade = httpGetReqHeader(c, HTTP_HEADER_UPGRADE);
+
+    return upgrade && upgrade->len == 3 &&
+        !strncasecmp((const char *)upgrade->data, "h2c", 3);
+}
+
 int on_header_complete(http_parser *parser)
 {
+    struct http_parser_url parser_url;
     struct httpData *data = parser->data;
+    int status;
+
+    if (!data->last_was_value)
+        indexLastHeader(data);
+    data->headers_complete = 1;
+    if (parser->type == HTTP_RESPONSE) {
+        status = parser->status_code;
+        data->until_eof = (parser->flags & F_CHUNKED) == 0 &&
+            parser->content_length == ULLONG_MAX && status / 100 != 1 &&
+            status != 204 && status != 304;
+        // App may ask to skip body here, such as response to HEAD request
+        if (httpSpotUpstream(data->conn) == WHEAT_WRONG)
+            return 2;
+        if (data->skip_body)
+            data->until_eof = 0;
+        return data->skip_body;
+    }
+    memset(&parser_url, 0, sizeof(struct http_parser_url));
+    if (http_parser_parse_url((const char *)data->url.data, data->url.len,
+                parser->method == HTTP_CONNECT, &parser_url))
+        return 1;
+    sliceTo(&data->query_string, data->url.data+parser_url.field_data[UF_QUERY].off,
+            parser_url.field_data[UF_QUERY].len);
+    sliceTo(&data->path, data->url.data+parser_url.field_data[UF_PATH].off,
+            parser_url.field_data[UF_PATH].len);
+
     if (http_should_keep_alive(parser) == 0)
         data->keep_live = 0;
     else
         data->keep_live = 1;
+
+    // "Upgrade: h2c" with body isn't taken, request is served by HTTP/1.1
+    if (parser->upgrade && parser->method != HTTP_CONNECT &&
+            ((parser->flags & F_CHUNKED) || (parser->content_length &&
+            parser->content_length != ULLONG_MAX)) && isH2cUpgrade(data->conn))
+        parser->upgrade = 0;
+
+    // Announced big body is spilled before any of it is buffered
+    if (BodySpillSize && (parser->flags & F_CHUNKED) == 0 &&
+            parser->content_length != ULLONG_MAX &&
+            parser->content_length > BodySpillSize)
+        return spillHttpBody(data) == -1;
     return 0;
 }
 
@@ -394,30 +1161,101 @@ int on_message_complete(http_parser *parser)
 {
     struct httpData *data = parser->data;
     data->complete = 1;
+    if (parser->type == HTTP_RESPONSE)
+        data->keep_live = http_should_keep_alive(parser) != 0;
+    // Stop at message boundary, pipelined message after it is parsed into
+    // next conn
+    http_parser_pause(parser, 1);
     return 0;
 }
 
 int on_url(http_parser *parser, const char *at, size_t len)
 {
-    struct http_parser_url parser_url;
     struct httpData *data = parser->data;
+    int ret = 0;
 
-    memset(&parser_url, 0, sizeof(struct http_parser_url));
-    if (http_parser_parse_url(at, len, 0, &parser_url))
-        return 1;
-    data->query_string = wstrNewLen(at+parser_url.field_data[UF_QUERY].off, parser_url.field_data[UF_QUERY].len);
-    data->path = wstrNewLen(at+parser_url.field_data[UF_PATH].off, parser_url.field_data[UF_PATH].len);
-    return 0;
+    if (data->url.data && isContinued(data, at))
+        ret = extendSlice(data, &data->url, at, len);
+    else
+        sliceTo(&data->url, (uint8_t *)at, len);
+    data->partial = (at + len == data->parse_end);
+    return ret;
+}
+
+// "Upgrade: h2c" request without body is answered as stream 1 of HTTP/2
+// connection(RFC 7540 3.2)
+static int upgradeHttp2(struct conn *c)
+{
+    struct httpData *http_data = c->protocol_data;
+    const struct slice *settings;
+    struct http2Stream *stream;
+
+    settings = httpFindReqHeader(c, "HTTP2-Settings", 14);
+    if (settings == NULL || http_data->parser->http_minor != 1 ||
+            http_data->body.body_len ||
+            httpGetReqHeader(c, HTTP_HEADER_CONTENT_LENGTH))
+        return WHEAT_WRONG;
+    // Request is kept by stream 1 while later frames are parsed
+    if (detachRequest(http_data) == -1)
+        return WHEAT_WRONG;
+    stream = http2Upgrade(c, settings);
+    if (stream == NULL)
+        return WHEAT_WRONG;
+    http_data->stream = stream;
+    http_data->method = http_method_str(http_data->parser->method);
+    http_data->protocol_version = PROTOCOL_VERSION[2];
+    http_data->keep_live = 1;
+    return WHEAT_OK;
 }
 
 int parseHttp(struct conn *c, struct slice *slice, size_t *out)
 {
-    size_t nparsed;
+    size_t nparsed = 0;
     struct httpData *http_data = c->protocol_data;
+    int fresh = http_data->parse_start == NULL;
+
+    if (isOuterClient(c->client)) {
+        if (isHttp2Client(c->client))
+            return http2Parse(c, slice, out);
+        // Client with prior knowledge starts with HTTP/2 connection preface
+        if (http_data->parse_start == NULL && slice->len >= 4 &&
+                !memcmp(slice->data, "PRI ", 4)) {
+            if (http2Start(c) == WHEAT_WRONG)
+                return WHEAT_WRONG;
+            return http2Parse(c, slice, out);
+        }
+    }
 
-    nparsed = http_parser_execute(http_data->parser, &HttpPaserSettings, (const char *)slice->data, slice->len);
+    // Inner client is connected to backend server, we receive responses
+    if (!isOuterClient(c->client) && http_data->parser->type != HTTP_RESPONSE)
+        http_parser_init(http_data->parser, HTTP_RESPONSE);
+    http_data->conn = c;
+    http_data->parse_start = (const char *)slice->data;
+    http_data->parse_end = (const char *)slice->data + slice->len;
+    // Request complete in its first slice takes the fast path, others and
+    // what it declines are parsed by http_parser from the start
+    if (fresh && HttpParser == HTTP_PARSER_FAST &&
+            http_data->parser->type == HTTP_REQUEST)
+        nparsed = httpScanRequest(http_data->parser, &HttpPaserSettings,
+                (const char *)slice->data, slice->len);
+    if (nparsed == 0)
+        nparsed = http_parser_execute(http_data->parser, &HttpPaserSettings, (const char *)slice->data, slice->len);
+
+    // Bytes after upgrade request belong to HTTP/2 connection, upgrade
+    // declined is ignored and request is served by HTTP/1.1. Client is
+    // closed if 101 failed to be sent.
+    if (http_data->parser->upgrade && http_data->complete &&
+            isOuterClient(c->client) && isH2cUpgrade(c)) {
+        if (upgradeHttp2(c) == WHEAT_OK) {
+            if (out) *out = nparsed;
+            return WHEAT_OK;
+        }
+        if (c->client->should_close)
+            return WHEAT_WRONG;
+        http_data->parser->upgrade = 0;
+    }
 
-    if (nparsed != slice->len) {
+    if (nparsed != slice->len && !http_data->complete) {
         /* Handle error. Usually just close the connection. */
         wheatLog(WHEAT_WARNING, "parseHttp() nparsed %d != recved %d", nparsed, slice->len);
         return WHEAT_WRONG;
@@ -435,6 +1273,21 @@ int parseHttp(struct conn *c, struct slice *slice, size_t *out)
     }
 
     if (out) *out = nparsed;
+    // Spilled body is written out already, release consumed mbufs unless
+    // previous conns of this client are still around
+    if (http_data->body.spill_fd != -1 && !http_data->complete &&
+            listLength(c->client->conns) == 1)
+        msgClean(c->client->req_buf);
+    // Let app stream the part of response body received, it's consumed
+    // then and mbufs can be released like spilled body
+    if (http_data->parser->type == HTTP_RESPONSE && !http_data->complete &&
+            http_data->body.curr_body != http_data->body.end_body) {
+        if (httpSpotUpstream(c) == WHEAT_WRONG)
+            return WHEAT_WRONG;
+        http_data->body.curr_body = http_data->body.end_body = http_data->body.body;
+        if (listLength(c->client->conns) == 1)
+            msgClean(c->client->req_buf);
+    }
     if (http_data->complete) {
         http_data->method = http_method_str(http_data->parser->method);
         if (http_data->parser->http_minor == 0)
@@ -455,6 +1308,136 @@ int parseHttp(struct conn *c, struct slice *slice, size_t *out)
     return 1;
 }
 
+static void pushHeader(struct httpData *data, const char *name, size_t name_len,
+        const char *value, size_t value_len)
+{
+    struct httpHeader header;
+
+    sliceTo(&header.name, (uint8_t *)name, name_len);
+    sliceTo(&header.value, (uint8_t *)value, value_len);
+    arrayPush(data->req_headers, &header);
+    indexLastHeader(data);
+}
+
+// Cookie may be split into several fields by HTTP/2, join them as HTTP/1.x
+static int joinCookie(struct httpData *data, const char *value, size_t len)
+{
+    struct httpHeader *header;
+    wstr cookie;
+
+    header = arrayIndex(data->req_headers, data->header_index[HTTP_HEADER_COOKIE]-1);
+    cookie = wstrNewLen(header->value.data, (int)header->value.len);
+    if (cookie == NULL || (cookie = wstrCatLen(cookie, "; ", 2)) == NULL ||
+            (cookie = wstrCatLen(cookie, value, len)) == NULL ||
+            keepCopy(data, cookie) == -1) {
+        wstrFree(cookie);
+        return -1;
+    }
+    sliceTo(&header->value, (uint8_t *)cookie, wstrlen(cookie));
+    return 0;
+}
+
+// Request of HTTP/2 stream decoded by http2.c is filled like a parsed one,
+// `store` and `body` belong to conn if success. Pseudo-header fields must
+// come first, ":authority" is taken as Host.
+int httpFillStreamRequest(struct conn *c, struct http2Stream *stream,
+        wstr store, struct array *fields, wstr body)
+{
+    struct httpData *data = c->protocol_data;
+    struct http_parser_url parser_url;
+    struct hpackField *field;
+    struct httpBody *http_body = &data->body;
+    const char *name, *value, *method = NULL, *path = NULL;
+    const char *authority = NULL, *scheme = NULL;
+    size_t i, path_len = 0, authority_len = 0, regular;
+    char buf[32];
+    int has_length = 0, len;
+    wstr length;
+
+    for (i = 0; i < narray(fields); i++) {
+        field = arrayIndex(fields, i);
+        name = store + field->name;
+        value = store + field->value;
+        if (name[0] != ':')
+            break;
+        if (!strcmp(name, ":method")) {
+            method = value;
+        } else if (!strcmp(name, ":path")) {
+            path = value;
+            path_len = field->value_len;
+        } else if (!strcmp(name, ":scheme")) {
+            scheme = value;
+        } else if (!strcmp(name, ":authority")) {
+            authority = value;
+            authority_len = field->value_len;
+        } else {
+            return -1;
+        }
+    }
+    regular = i;
+    for (; i < narray(fields); i++) {
+        field = arrayIndex(fields, i);
+        if (store[field->name] == ':')
+            return -1;
+        if (field->name_len == 14 && !strcmp(store + field->name, "content-length"))
+            has_length = 1;
+    }
+    memset(&parser_url, 0, sizeof(parser_url));
+    if (method == NULL || path == NULL || scheme == NULL ||
+            http_parser_parse_url(path, path_len, 0, &parser_url))
+        return -1;
+
+    sliceTo(&data->url, (uint8_t *)path, path_len);
+    sliceTo(&data->query_string, data->url.data+parser_url.field_data[UF_QUERY].off,
+            parser_url.field_data[UF_QUERY].len);
+    sliceTo(&data->path, data->url.data+parser_url.field_data[UF_PATH].off,
+            parser_url.field_data[UF_PATH].len);
+    if (authority)
+        pushHeader(data, "Host", 4, authority, authority_len);
+    for (i = regular; i < narray(fields); i++) {
+        field = arrayIndex(fields, i);
+        name = store + field->name;
+        value = store + field->value;
+        if (data->header_index[HTTP_HEADER_COOKIE] && field->name_len == 6 &&
+                !strcmp(name, "cookie")) {
+            if (joinCookie(data, value, field->value_len) == -1)
+                return -1;
+            continue;
+        }
+        if (authority && field->name_len == 4 && !strcmp(name, "host"))
+            continue;
+        pushHeader(data, name, field->name_len, value, field->value_len);
+    }
+    // App may rely on Content-Length to read body
+    if (body && wstrlen(body) && !has_length) {
+        len = ll2string(buf, sizeof(buf), wstrlen(body));
+        length = wstrNewLen(buf, len);
+        if (length == NULL || keepCopy(data, length) == -1) {
+            wstrFree(length);
+            return -1;
+        }
+        pushHeader(data, "Content-Length", 14, length, len);
+    }
+    if (keepCopy(data, store) == -1)
+        return -1;
+    if (body && wstrlen(body)) {
+        keepCopy(data, body);
+        sliceTo(http_body->end_body, (uint8_t *)body, wstrlen(body));
+        http_body->end_body++;
+        http_body->body_len = wstrlen(body);
+    } else {
+        wstrFree(body);
+    }
+    data->conn = c;
+    data->stream = stream;
+    data->method = method;
+    data->url_scheme = strcmp(scheme, "https") ? URL_SCHEME[0] : URL_SCHEME[1];
+    data->protocol_version = PROTOCOL_VERSION[2];
+    data->keep_live = 1;
+    data->complete = 1;
+    return 0;
+}
+
 void *initHttpData()
 {
     struct httpData *data = wmalloc(sizeof(struct httpData));
@@ -470,14 +1453,15 @@ void *initHttpData()
     http_parser_init(data->parser, HTTP_REQUEST);
     data->url_scheme = URL_SCHEME[0];
     memset(&data->body, 0, sizeof(data->body));
+    data->body.spill_fd = -1;
     int ret = enlargeHttpBody(&data->body);
     if (ret == -1) {
         wfree(data);
         wfree(data->parser);
         return NULL;
     }
-    data->req_headers = dictCreate(&wstrDictType);
-    data->res_headers = dictCreate(&wstrDictType);
+    data->req_headers = arrayCreate(sizeof(struct httpHeader), 16);
+    data->res_headers = wstrNewLen(NULL, 256);
     data->send_header = wstrNewLen(NULL, 500);
     return data;
 }
@@ -485,66 +1469,46 @@ void *initHttpData()
 void freeHttpData(void *data)
 {
     struct httpData *d = data;
-    dictRelease(d->req_headers);
-    dictRelease(d->res_headers);
-    wstrFree(d->query_string);
+    size_t i;
+
+    arrayDealloc(d->req_headers);
+    if (d->copies) {
+        for (i = 0; i < narray(d->copies); i++)
+            wstrFree(*(wstr *)arrayIndex(d->copies, i));
+        arrayDealloc(d->copies);
+    }
+    wstrFree(d->res_headers);
     wfree(d->parser);
-    wstrFree(d->res_status_msg);
-    wstrFree(d->path);
+    wstrFree(d->res_status_custom);
     wstrFree(d->send_header);
+    wstrFree(d->send_block);
+    if (d->stream)
+        http2FreeStream(d->stream);
     wfree(d->body.body);
+    if (d->body.spill_fd != -1)
+        close(d->body.spill_fd);
+    wfree(d->body.spill_buf);
     wfree(d);
 }
 
-static FILE *openAccessLog()
-{
-    struct configuration *conf;
-    FILE *fp;
-    char *access_log;
-
-    conf = getConfiguration("access-log");
-    access_log = conf->target.ptr;
-    if (access_log == NULL)
-        fp = NULL;
-    else if (!strcasecmp(access_log, "stdout"))
-        fp = stdout;
-    else {
-        fp = fopen(access_log, "a");
-        if (!fp) {
-            wheatLog(WHEAT_NOTICE, "open access log failed");
-        }
-    }
-
-    return fp;
-}
-
 int initHttp()
 {
-    struct configuration *conf1, *conf2;
-
-    AccessFp = openAccessLog();
-    memset(&StaticPathHandler, 0 , sizeof(struct staticHandler));
-    conf1 = getConfiguration("document-root");
-    conf2 = getConfiguration("static-file-dir");
-    if (conf1->target.ptr && conf2->target.ptr) {
-        char path[1024];
-        char *real_path = realpath(conf1->target.ptr, path);
-        if (!real_path) {
-            wheatLog(WHEAT_WARNING, "document-root %s is unvalid",
-                    conf1->target.ptr);
-            return WHEAT_WRONG;
-        }
-        StaticPathHandler.abs_path = wstrNew(real_path);
-        StaticPathHandler.root = wstrDup(StaticPathHandler.abs_path);
-        StaticPathHandler.static_dir = wstrNew(conf2->target.ptr);
-        StaticPathHandler.abs_path = wstrCat(StaticPathHandler.abs_path,
-                StaticPathHandler.static_dir);
-        real_path = realpath(StaticPathHandler.abs_path, path);
-        if (!real_path) {
-            wheatLog(WHEAT_WARNING, "static-file-dir is unvalid");
-            return WHEAT_WRONG;
-        }
-    }
+
+    if (initAccessLog() == WHEAT_WRONG)
+        return WHEAT_WRONG;
+    ServerHeader = wstrNew("Server: ");
+    ServerHeader = wstrCat(ServerHeader, Server.master_name);
+    ServerHeader = wstrCatLen(ServerHeader, "\r\n", 2);
+    refreshDateHeader(time(NULL));
+    BodySpillSize = getConfiguration("body-spill-size")->target.val;
+    BodyTempDir = getConfiguration("body-temp-dir")->target.ptr;
+    if (BodyTempDir == NULL)
+        BodyTempDir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    StatSpilledBody = &getStatValByName("Total spilled request body");
+    if (initHttpRouter() == WHEAT_WRONG || initHttp2() == WHEAT_WRONG)
+        return WHEAT_WRONG;
+    HttpParser = getConfiguration("http-parser")->target.enum_ptr->id;
+    httpScanInit();
 
     memset(&HttpPaserSettings, 0 , sizeof(HttpPaserSettings));
     HttpPaserSettings.on_header_field = on_header_field;
@@ -558,78 +1522,17 @@ int initHttp()
 
 void deallocHttp()
 {
-    if (AccessFp)
-        fclose(AccessFp);
-    wstrFree(StaticPathHandler.abs_path);
-    memset(&StaticPathHandler, 0, sizeof(struct staticHandler));
-}
-
-static const char *apacheDateFormat()
-{
-    static char buf[255];
-    time_t now = time(0);
-    struct tm tm = *gmtime(&now);
-    strftime(buf, sizeof buf, "%d/%m/%Y:%H:%M:%S %z", &tm);
-    return buf;
+    deallocAccessLog();
+    wstrFree(ServerHeader);
+    ServerHeader = NULL;
+    deallocHttpRouter();
 }
 
-void logAccess(struct conn *c)
-{
-    if (!AccessFp)
-        return ;
-    const char *remote_addr, *hyphen, *user, *datetime, *request;
-    const char *refer, *user_agent;
-    char status_str[100], resp_length[32];
-    char buf[255];
-    wstr temp;
-    int ret;
-    struct httpData *http_data = c->protocol_data;
-
-    temp = wstrNew("Remote_Addr");
-    remote_addr = dictFetchValue(http_data->req_headers, temp);
-    if (!remote_addr)
-        remote_addr = getConnIP(c);
-    wstrFree(temp);
-
-    hyphen = user = "-";
-    datetime = apacheDateFormat();
-    snprintf(buf, 255, "%s %s %s", http_data->method, http_data->path, http_data->protocol_version);
-    request = buf;
-    gcvt(http_data->res_status, 0, status_str);
-    gcvt(http_data->response_length, 0, resp_length);
-
-    temp = wstrNew("Referer");
-    refer = dictFetchValue(http_data->req_headers, temp);
-    if (!refer)
-        refer = "-";
-    wstrFree(temp);
-
-    temp = wstrNew("User-Agent");
-    user_agent = dictFetchValue(http_data->req_headers, temp);
-    if (!user_agent)
-        user_agent = "-";
-    wstrFree(temp);
-
-    ret = fprintf(AccessFp, "%s %s %s [%s] %s %s \"%s\" %s %s\n",
-            remote_addr, hyphen, user, datetime, request, status_str,
-            resp_length, refer, user_agent);
-    if (ret == -1) {
-        wheatLog(WHEAT_WARNING, "log access failed: %s", strerror(errno));
-        fclose(AccessFp);
-        AccessFp = openAccessLog();
-        if (!AccessFp) {
-            wheatLog(WHEAT_WARNING, "open access log failed");
-            halt(1);
-        }
-    }
-    else
-        fflush(AccessFp);
-}
-
-/* Send a chunk of data */
+/* Send a chunk of data, `data` is referred by send queue until sent */
 int httpSendBody(struct conn *c, const char *data, size_t len)
 {
-    size_t tosend, restsend;
+    size_t tosend;
+    off_t restsend;
     ssize_t ret;
     struct slice slice;
     struct httpData *http_data;
@@ -638,15 +1541,21 @@ int httpSendBody(struct conn *c, const char *data, size_t len)
     http_data = c->protocol_data;
     if (!len || !strcasecmp(http_data->method, "HEAD"))
         return 0;
-    if (http_data->response_length != 0) {
+    if (http_data->has_content_length) {
         if (http_data->send > http_data->response_length)
             return 0;
         restsend = http_data->response_length - http_data->send;
-        tosend = restsend > tosend ? tosend: restsend;
-    } else if (isChunked(http_data))
-        return 0;
+        tosend = restsend > (off_t)tosend ? tosend: (size_t)restsend;
+    } else if (http_data->chunked) {
+        if (chunkLine(c, tosend, &slice) == -1)
+            return -1;
+        if (sendClientData(c, &slice) == WHEAT_WRONG)
+            return -1;
+    }
 
     http_data->send += tosend;
+    if (http_data->stream)
+        return http2SendData(c, http_data->stream, data, tosend);
     sliceTo(&slice, (uint8_t *)data, tosend);
     ret = sendClientData(c, &slice);
     if (ret == WHEAT_WRONG)
@@ -654,66 +1563,207 @@ int httpSendBody(struct conn *c, const char *data, size_t len)
     return 0;
 }
 
-int httpSendHeaders(struct conn *c)
+/* Terminate chunked body, nothing to do for other responses */
+int httpSendBodyEnd(struct conn *c)
 {
+    static const char last_chunk[] = "\r\n0\r\n\r\n";
     struct httpData *http_data = c->protocol_data;
-    int ok, len, ret, is_connection;
-    struct dictIterator *iter;
-    struct dictEntry *entry;
-    const char *connection;
-    char buf[256];
-    wstr field, value, headers;
     struct slice slice;
 
-    if (http_data->headers_sent)
+    if (!http_data->chunked)
         return 0;
+    http_data->chunked = 0;
+    // No chunk sent, skip the ending of previous chunk
+    if (http_data->send)
+        sliceTo(&slice, (uint8_t *)last_chunk, sizeof(last_chunk)-1);
+    else
+        sliceTo(&slice, (uint8_t *)last_chunk+2, sizeof(last_chunk)-3);
+    if (sendClientData(c, &slice) == WHEAT_WRONG)
+        return -1;
+    return 0;
+}
 
-    is_connection = 0;
-    ok = 0;
-    iter = dictGetIterator(http_data->res_headers);
-    headers = defaultResHeader(c, http_data->send_header);
-    while((entry = dictNext(iter)) != NULL) {
-        field = dictGetKey(entry);
-        value = dictGetVal(entry);
-        ASSERT(field && value);
-        if (!strncasecmp(field, TRANSFER_ENCODING,
-                    sizeof(TRANSFER_ENCODING))) {
-            if (!strncasecmp(value, CHUNKED, sizeof(CHUNKED)))
-                http_data->is_chunked_in_header = 1;
-        } else if (!strncasecmp(field, CONTENT_LENGTH, sizeof(CONTENT_LENGTH))) {
-            http_data->response_length = atoi(value);
-        } else if (!strncasecmp(field, CONNECTION, sizeof(CONNECTION))) {
-            is_connection = 1;
-        }
-        ret = snprintf(buf, sizeof(buf), "%s: %s\r\n", field, value);
-        if (ret == -1 || ret > sizeof(buf))
-            goto cleanup;
-        headers = wstrCatLen(headers, buf, ret);
+/* Send `len` bytes of file from `off`, `fd` must be kept until conn freed.
+ * Like httpSendBody, file is cut to Content-Length or sent as a chunk */
+int httpSendFile(struct conn *c, int fd, off_t off, size_t len)
+{
+    struct httpData *http_data = c->protocol_data;
+    struct slice slice;
+
+    if (!len || !strcasecmp(http_data->method, "HEAD"))
+        return 0;
+    if (http_data->has_content_length) {
+        if (http_data->send >= http_data->response_length)
+            return 0;
+        if ((off_t)len > http_data->response_length - http_data->send)
+            len = http_data->response_length - http_data->send;
+    } else if (http_data->chunked) {
+        if (chunkLine(c, len, &slice) == -1)
+            return -1;
+        if (sendClientData(c, &slice) == WHEAT_WRONG)
+            return -1;
     }
-    if (!http_data->response_length && http_data->res_status != 302)
+    http_data->send += len;
+    if (http_data->stream)
+        return http2SendFile(c, http_data->stream, fd, off, len);
+    if (sendClientFileRange(c, fd, off, len) == WHEAT_WRONG)
+        return -1;
+    return 0;
+}
+
+/* Reply "Expect: 100-continue", HTTP/2 stream has got whole body already */
+int httpSendContinue(struct conn *c)
+{
+    struct httpData *http_data = c->protocol_data;
+    struct slice slice;
+
+    if (http_data->stream)
+        return 0;
+    sliceTo(&slice, (uint8_t *)HTTP_CONTINUE, sizeof(HTTP_CONTINUE)-1);
+    if (sendClientData(c, &slice) == WHEAT_WRONG)
+        return -1;
+    return 0;
+}
+
+// HTTP/2 response has no status line, connection and chunked headers, the
+// rest is compressed and framed by http2.c
+static int sendStreamHeaders(struct conn *c)
+{
+    struct httpData *http_data = c->protocol_data;
+    wstr headers = http_data->send_header;
+
+    wstrupdatelen(headers, 0);
+    headers = wstrMakeRoom(headers, wstrlen(ServerHeader) + DateHeaderLen +
+            wstrlen(http_data->res_headers));
+    if (headers == NULL)
+        return -1;
+    http_data->send_header = headers;
+    headers = wstrCatLen(headers, ServerHeader, wstrlen(ServerHeader));
+    headers = wstrCatLen(headers, DateHeader, DateHeaderLen);
+    headers = wstrCatLen(headers, http_data->res_headers,
+            wstrlen(http_data->res_headers));
+    if (http2SendHeaders(c, http_data->stream, http_data->res_status,
+                headers, wstrlen(headers)) == -1)
+        return -1;
+    http_data->headers_sent = 1;
+    return 0;
+}
+
+// All pieces are already rendered, compute total length and copy them into
+// `send_header` once. `body` is copied after headers if it isn't NULL.
+static int sendHeaders(struct conn *c, const char *body, size_t body_len)
+{
+    struct httpData *http_data = c->protocol_data;
+    const char *connection = NULL;
+    size_t connection_len = 0, chunked_len = 0, server_len, total;
+    wstr headers;
+    char *p;
+    struct slice slice;
+
+    if (http_data->headers_sent)
+        return 0;
+    ASSERT(http_data->res_status && http_data->res_status_line);
+    if (http_data->stream) {
+        if (sendStreamHeaders(c) == -1)
+            return -1;
+        if (body == NULL)
+            return 0;
+        // Stream frames refer body until sent
+        p = httpReserveSendBuf(c, body_len);
+        if (p == NULL)
+            return -1;
+        memcpy(p, body, body_len);
+        return httpSendBody(c, p, body_len);
+    }
+
+    if (canChunked(http_data)) {
+        http_data->chunked = 1;
+        if (!http_data->is_chunked_in_header)
+            chunked_len = sizeof(TransferChunked) - 1;
+    } else if (!http_data->has_content_length && http_data->res_status != 302 &&
+            http_data->res_status != 204 && http_data->res_status != 304 &&
+            strcasecmp(http_data->method, "HEAD")) {
         http_data->keep_live = 0;
-    if (!is_connection) {
-        connection = connectionField(c);
-        ret = snprintf(buf, sizeof(buf), "Connection: %s\r\n", connection);
-        if (ret == -1 || ret > sizeof(buf))
-            goto cleanup;
-        if ((headers = wstrCatLen(headers, buf, ret)) == NULL)
-            goto cleanup;
     }
+    if (!http_data->has_connection)
+        connection = connectionLine(c, &connection_len);
+
+    server_len = wstrlen(ServerHeader);
+    total = HTTP_VERSION_LEN + 1 + http_data->res_status_len + server_len +
+        DateHeaderLen + wstrlen(http_data->res_headers) + chunked_len +
+        connection_len + 2;
+    if (body == NULL || !strcasecmp(http_data->method, "HEAD"))
+        body_len = 0;
+    http_data->send += body_len;
+    headers = http_data->send_header;
+    wstrupdatelen(headers, 0);
+    headers = wstrMakeRoom(headers, total+body_len);
+    if (headers == NULL)
+        return -1;
+    http_data->send_header = headers;
+
+    p = headers;
+    memcpy(p, http_data->protocol_version, HTTP_VERSION_LEN);
+    p += HTTP_VERSION_LEN;
+    *p++ = ' ';
+    memcpy(p, http_data->res_status_line, http_data->res_status_len);
+    p += http_data->res_status_len;
+    memcpy(p, ServerHeader, server_len);
+    p += server_len;
+    memcpy(p, DateHeader, DateHeaderLen);
+    p += DateHeaderLen;
+    memcpy(p, http_data->res_headers, wstrlen(http_data->res_headers));
+    p += wstrlen(http_data->res_headers);
+    memcpy(p, TransferChunked, chunked_len);
+    p += chunked_len;
+    if (connection) {
+        memcpy(p, connection, connection_len);
+        p += connection_len;
+    }
+    *p++ = '\r';
+    *p++ = '\n';
+    if (body_len) {
+        memcpy(p, body, body_len);
+        total += body_len;
+    }
+    wstrupdatelen(headers, (int)total);
+
+    sliceTo(&slice, (uint8_t *)headers, total);
+    if (sendClientData(c, &slice) < 0)
+        return -1;
+    http_data->headers_sent = 1;
+    return 0;
+}
 
-    headers = wstrCatLen(headers, "\r\n", 2);
-    sliceTo(&slice, (uint8_t *)headers, wstrlen(headers));
+int httpSendHeaders(struct conn *c)
+{
+    return sendHeaders(c, NULL, 0);
+}
+
+// Small response goes out in one piece with its headers, `body` is whole
+// body of response
+int httpSendHeadersWithBody(struct conn *c, const char *body, size_t len)
+{
+    return sendHeaders(c, body, len);
+}
 
-    len = sendClientData(c, &slice);
-    if (len < 0) {
-        goto cleanup;
+static void sendErrorPage(struct conn *c, int status, const char *msg,
+        const char *body, size_t len)
+{
+    struct httpData *http_data = c->protocol_data;
+    char buf[32];
+    int ret;
+
+    if (!http_data->headers_sent) {
+        resetResHeaders(http_data);
+        ret = ll2string(buf, sizeof(buf), len);
+        httpAppendResHeader(c, HTTP_HEADER_CONTENT_TYPE, "text/html", 9);
+        httpAppendResHeader(c, HTTP_HEADER_CONTENT_LENGTH, buf, ret);
     }
-    http_data->headers_sent = 1;
-    ok = 1;
+    fillResInfo(c, status, msg);
 
-cleanup:
-    dictReleaseIterator(iter);
-    return ok? 0 : -1;
+    if (!httpSendHeaders(c))
+        httpSendBody(c, body, len);
 }
 
 
@@ -727,10 +1777,7 @@ void sendResponse404(struct conn *c)
         "<h1>Not Found</h1>\n"
         "<p>The requested URL was not found on this server</p>\n"
         "</body></html>\n";
-    fillResInfo(c, 404, "NotFound");
-
-    if (!httpSendHeaders(c))
-        httpSendBody(c, body, strlen(body));
+    sendErrorPage(c, 404, "Not Found", body, sizeof(body)-1);
 }
 
 void sendResponse500(struct conn *c)
@@ -744,10 +1791,61 @@ void sendResponse500(struct conn *c)
         "<p>The server encountered an unexpected condition which\n"
         "prevented it from fulfilling the request.</p>\n"
         "</body></html>\n";
-    fillResInfo(c, 500, "Internal Error");
+    sendErrorPage(c, 500, "Internal Server Error", body, sizeof(body)-1);
+}
 
-    if (!httpSendHeaders(c))
-        httpSendBody(c, body, strlen(body));
+void sendResponse502(struct conn *c)
+{
+    static const char body[] =
+        "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\n"
+        "<html><head>\n"
+        "<title>502 Bad Gateway --- From Wheatserver</title>\n"
+        "</head><body>\n"
+        "<h1>Bad Gateway</h1>\n"
+        "<p>The server received an invalid response from upstream server</p>\n"
+        "</body></html>\n";
+    sendErrorPage(c, 502, "Bad Gateway", body, sizeof(body)-1);
+}
+
+void sendResponse503(struct conn *c)
+{
+    static const char body[] =
+        "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\n"
+        "<html><head>\n"
+        "<title>503 Service Unavailable --- From Wheatserver</title>\n"
+        "</head><body>\n"
+        "<h1>Service Unavailable</h1>\n"
+        "<p>The server is too busy to handle the request now</p>\n"
+        "</body></html>\n";
+    sendErrorPage(c, 503, "Service Unavailable", body, sizeof(body)-1);
+}
+
+void sendResponse504(struct conn *c)
+{
+    static const char body[] =
+        "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\n"
+        "<html><head>\n"
+        "<title>504 Gateway Timeout --- From Wheatserver</title>\n"
+        "</head><body>\n"
+        "<h1>Gateway Timeout</h1>\n"
+        "<p>The upstream server didn't respond in time</p>\n"
+        "</body></html>\n";
+    sendErrorPage(c, 504, "Gateway Timeout", body, sizeof(body)-1);
+}
+
+// Response of backend server is passed to "http-proxy" app when headers
+// complete, each time more body parsed and when message complete. App is
+// responsible to finish conn.
+static int httpSpotUpstream(struct conn *c)
+{
+    struct app *app = spotApp("http-proxy");
+    int ret;
+
+    c->app = app;
+    ret = app->appCall(c, NULL);
+    if (ret == WHEAT_WRONG)
+        wheatLog(WHEAT_WARNING, "handle backend response failed");
+    return ret;
 }
 
 int httpSpot(struct conn *c)
@@ -755,37 +1853,56 @@ int httpSpot(struct conn *c)
     struct app *app;
     int ret;
     struct httpData *http_data = c->protocol_data;
-    wstr path = NULL;
-    if (StaticPathHandler.abs_path && fromSameParentDir(StaticPathHandler.static_dir, http_data->path)) {
-        path = wstrNew(StaticPathHandler.root);
-        path = wstrCat(path, http_data->path);
-        app = spotApp("static-file");
-    } else {
-        app = spotApp("wsgi");
+    struct httpRoute *route;
+
+    if (!isOuterClient(c->client))
+        return httpSpotUpstream(c);
+    route = httpRouteLookup((const char *)http_data->path.data,
+            http_data->path.len);
+    if (route == NULL) {
+        sendResponse404(c);
+        httpFinishResponse(c);
+        return WHEAT_OK;
     }
-    if (app->is_init) {
-        ret = app->initApp(c->client->protocol);
-        if (ret == WHEAT_WRONG) {
-            wstrFree(path);
+    http_data->route = route;
+    app = route->app;
+    if (!app->is_init) {
+        ret = initApp(app);
+        if (ret == WHEAT_WRONG)
             return ret;
-        }
-        app->is_init = 1;
     }
     c->app = app;
     ret = initAppData(c);
     if (ret == WHEAT_WRONG) {
-        wstrFree(path);
         wheatLog(WHEAT_WARNING, "init app data failed");
         return WHEAT_WRONG;
     }
-    ret = app->appCall(c, path);
+    ret = app->appCall(c, NULL);
     if (ret == WHEAT_WRONG) {
         wheatLog(WHEAT_WARNING, "app failed, exited");
         app->deallocApp();
         app->is_init = 0;
     }
-    logAccess(c);
-    wstrFree(path);
-    finishConn(c);
+    if (!http_data->deferred || ret == WHEAT_WRONG)
+        httpFinishResponse(c);
     return ret;
 }
+
+// App replying asynchronously calls httpDeferResponse in `appCall` and
+// httpFinishResponse when response is completely queued
+void httpDeferResponse(struct conn *c)
+{
+    ((struct httpData *)c->protocol_data)->deferred = 1;
+}
+
+void httpFinishResponse(struct conn *c)
+{
+    struct httpData *http_data = c->protocol_data;
+
+    http_data->deferred = 0;
+    logAccess(c);
+    if (http_data->stream)
+        http2FinishStream(c, http_data->stream, http_data->headers_sent);
+    else
+        finishConn(c);
+}
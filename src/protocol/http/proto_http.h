@@ -9,6 +9,8 @@
 
 #include "../protocol.h"
 #include "http_parser.h"
+#include "hpack.h"
+#include "http_scan.h"
 
 #define TRANSFER_ENCODING    "Transfer-Encoding"
 #define CONTENT_LENGTH       "Content-Length"
@@ -18,29 +20,152 @@
 #define IF_MODIFIED_SINCE    "If-Modified-Since"
 #define CHUNKED              "Chunked"
 #define HTTP_CONTINUE        "HTTP/1.1 100 Continue\r\n\r\n"
+#define HTTP_VERSION_LEN     8
+
+// Well-known header names are classified once by `getHttpHeaderId` so that
+// hot paths compare integer ids instead of strings.
+enum httpHeaderId {
+    HTTP_HEADER_UNKNOWN = 0,
+    HTTP_HEADER_HOST,
+    HTTP_HEADER_CONNECTION,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_CONTENT_TYPE,
+    HTTP_HEADER_TRANSFER_ENCODING,
+    HTTP_HEADER_LAST_MODIFIED,
+    HTTP_HEADER_IF_MODIFIED_SINCE,
+    HTTP_HEADER_IF_NONE_MATCH,
+    HTTP_HEADER_USER_AGENT,
+    HTTP_HEADER_REFERER,
+    HTTP_HEADER_X_FORWARDED_FOR,
+    HTTP_HEADER_REMOTE_ADDR,
+    HTTP_HEADER_EXPECT,
+    HTTP_HEADER_COOKIE,
+    HTTP_HEADER_SET_COOKIE,
+    HTTP_HEADER_ACCEPT,
+    HTTP_HEADER_ACCEPT_ENCODING,
+    HTTP_HEADER_CACHE_CONTROL,
+    HTTP_HEADER_LOCATION,
+    HTTP_HEADER_UPGRADE,
+    HTTP_HEADER_DATE,
+    HTTP_HEADER_SERVER,
+    HTTP_HEADER_ETAG,
+    HTTP_HEADER_EXPIRES,
+    HTTP_HEADER_VARY,
+    HTTP_HEADER_COUNT
+};
+
+// Request header kept as slices referring to the request buffer, values
+// aren't NUL-terminated. `id` is HTTP_HEADER_UNKNOWN for other names.
+struct httpHeader {
+    struct slice name;
+    struct slice value;
+    int id;
+};
+
+// Request is dispatched to app of the route its path matches, routes are
+// configured by `http-routes`(http_router.c). Options of route are parsed
+// once, `app_data` can be used by app to keep what it builds from them.
+//
+// `root`: absolute document root("root="), static-file serves file
+// `root` + path
+// `upstreams`: backend servers of http-proxy("upstreams=")
+// `cache_ttl`: max seconds wsgi caches response("cache-ttl="), -1 means
+// `wsgi-cache-ttl` is used
+struct httpRoute {
+    wstr path;
+    struct app *app;
+    wstr root;
+    wstr upstreams;
+    int cache_ttl;
+    void *app_data;
+    unsigned exact:1;
+};
 
 // Http protocol API
-const wstr httpGetPath(struct conn *c);
-const wstr httpGetQueryString(struct conn *c);
+const struct slice *httpGetPath(struct conn *c);
+const struct slice *httpGetQueryString(struct conn *c);
 const struct slice *httpGetBodyNext(struct conn *c);
 int httpBodyGetSize(struct conn *c);
+int httpBodyGetFile(struct conn *c);
+void httpBodyRewind(struct conn *c);
+int httpDetachRequest(struct conn *c);
+void *httpOrphanRequest(struct conn *c);
+void freeHttpData(void *data);
+int httpIsComplete(struct conn *c);
+int httpIsKeepAlive(struct conn *c);
+int httpGetStatusCode(struct conn *c);
+int httpIsBodyUntilEOF(struct conn *c);
+void httpSkipBody(struct conn *c);
 const char *httpGetUrlScheme(struct conn *c);
+struct httpRoute *httpGetRoute(struct conn *c);
 const char *httpGetMethod(struct conn *c);
 const char *httpGetProtocolVersion(struct conn *c);
-struct dict *httpGetReqHeaders(struct conn *c);
+struct array *httpGetReqHeaders(struct conn *c);
+const struct slice *httpGetReqHeader(struct conn *c, int id);
+const struct slice *httpFindReqHeader(struct conn *c, const char *name,
+        size_t len);
 int ishttpHeaderSended(struct conn *c);
 int httpGetResStatus(struct conn *c);
+off_t httpGetResLength(struct conn *c);
 void parserForward(wstr value, wstr *h, wstr *p);
 int convertHttpDate(time_t date, char *buf, size_t len);
 time_t fromHttpDate(char *buf);
 int httpSendBody(struct conn *c, const char *data, size_t len);
+int httpSendBodyEnd(struct conn *c);
+int httpSendFile(struct conn *c, int fd, off_t off, size_t len);
+int httpSendContinue(struct conn *c);
 void fillResInfo(struct conn *c, int status, const char *msg);
+void httpFillResStatus(struct conn *c, int status);
 int httpSendHeaders(struct conn *c);
+int httpSendHeadersWithBody(struct conn *c, const char *body, size_t len);
 void sendResponse500(struct conn *c);
 void sendResponse404(struct conn *c);
+void sendResponse502(struct conn *c);
+void sendResponse503(struct conn *c);
+void sendResponse504(struct conn *c);
+void httpDeferResponse(struct conn *c);
+void httpFinishResponse(struct conn *c);
 int appendToResHeaders(struct conn *c, const char *field,
         const char *value);
+int httpAppendResHeaderLen(struct conn *c, const char *field,
+        size_t field_len, const char *value, size_t value_len);
+int httpAppendResHeader(struct conn *c, int id, const char *value, size_t len);
+int httpAppendRenderedHeaders(struct conn *c, const char *headers,
+        size_t len, long long content_length);
+int getHttpHeaderId(const char *name, size_t len);
+const char *getHttpHeaderName(int id);
+void httpCron();
 
+// Access log(access_log.c)
+int initAccessLog();
+void accessLogCron();
+void deallocAccessLog();
 void logAccess(struct conn *c);
 
+// Router(http_router.c)
+int initHttpRouter();
+void deallocHttpRouter();
+struct httpRoute *httpRouteLookup(const char *path, size_t len);
+
+// HTTP/2(http2.c), request of each stream is passed to app as a conn of
+// client and response API above frames it
+struct http2Stream;
+int initHttp2();
+int isHttp2Client(struct client *c);
+int http2Start(struct conn *c);
+struct http2Stream *http2Upgrade(struct conn *c, const struct slice *settings);
+int http2Parse(struct conn *c, struct slice *slice, size_t *out);
+int http2SendHeaders(struct conn *c, struct http2Stream *stream, int status,
+        const char *headers, size_t len);
+int http2SendData(struct conn *c, struct http2Stream *stream,
+        const char *data, size_t len);
+int http2SendFile(struct conn *c, struct http2Stream *stream, int fd,
+        off_t off, size_t len);
+void http2FinishStream(struct conn *c, struct http2Stream *stream,
+        int headers_sent);
+void http2FreeStream(struct http2Stream *stream);
+char *httpReserveSendBuf(struct conn *c, size_t len);
+int httpFillStreamRequest(struct conn *c, struct http2Stream *stream,
+        wstr store, struct array *fields, wstr body);
+
 #endif
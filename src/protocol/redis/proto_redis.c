@@ -25,8 +25,15 @@ static struct protocol ProtocolRedis = {
         initRedis, deallocRedis,
 };
 
+static struct configuration RedisConf[] = {
+    {"hash-tag",          2, stringValidator,      {.ptr=NULL},
+        NULL,                   STRING_FORMAT},
+};
+
 struct moduleAttr ProtocolRedisAttr = {
-    "Redis", PROTOCOL, {.protocol=&ProtocolRedis}, NULL, 0, NULL, 0, NULL, 0
+    "Redis", PROTOCOL, {.protocol=&ProtocolRedis}, NULL, 0,
+    RedisConf, sizeof(RedisConf)/sizeof(struct configuration),
+    NULL, 0
 };
 
 static wstr RedisHashTag = NULL;
@@ -38,6 +45,7 @@ enum redisCommand {
     REDIS_TYPE,
     REDIS_BITCOUNT,
     REDIS_GET,
+    REDIS_MGET,
     REDIS_GETBIT,
     REDIS_GETRANGE,
     REDIS_GETSET,
@@ -78,6 +86,7 @@ enum redisCommand {
     REDIS_INCRBYFLOAT,
     REDIS_PSETEX,
     REDIS_SET,
+    REDIS_MSET,
     REDIS_SETBIT,
     REDIS_SETEX,
     REDIS_SETNX,
@@ -118,6 +127,8 @@ enum reqStage {
     REQ_GET_ARG_VAL_LF,
     REQ_GET_ARG_COMMAND_OR_KEY,
     REQ_GET_ARG_VAL,
+    REQ_GET_ARG_MULTI,
+    REQ_GET_ARG_VAL_END,
     RES_SINGLE,
     RES_SINGLE_LF,
     RES_GET_ARGS,
@@ -126,6 +137,7 @@ enum reqStage {
     RES_GET_ARG_VAL_LF,
     RES_GET_ARG_PREFIX,
     RES_GET_ARG_VAL,
+    RES_GET_ARG_VAL_END,
     RES_NIL_VAL,
     RES_NIL_VAL_LF,
     MES_END,
@@ -139,6 +151,12 @@ enum reqStage {
 //                             |
 //                             |
 //                        key_end_pos(\r)
+//
+// `key_end_pos` is offset from the start of message, it may be parsed
+// from several slices and `parsed` counts bytes of the former ones.
+//
+// Multi-key commands(MGET, MSET, DEL and EXISTS with more than one key)
+// are split by proxy, so all arguments after command are kept in `argv`.
 struct redisProcData {
     int curr_arg_len;
     int curr_arg;
@@ -146,9 +164,11 @@ struct redisProcData {
     wstr key;
     wstr command;
     size_t key_end_pos;
+    size_t parsed;
     enum reqStage stage;
     enum redisCommand command_type;
     int is_read;
+    struct array *argv;
 
     struct array *req_body;
     size_t pos;
@@ -208,6 +228,12 @@ static int redisCommandHandle(struct redisProcData *redis_data,
             if (str4icmp(c, 'l', 's', 'e', 't'))
                 return REDIS_LSET;
 
+            if (str4icmp(c, 'm', 'g', 'e', 't'))
+                return REDIS_MGET;
+
+            if (str4icmp(c, 'm', 's', 'e', 't'))
+                return REDIS_MSET;
+
             if (str4icmp(c, 'r', 'p', 'o', 'p'))
                 return REDIS_RPOP;
 
@@ -459,10 +485,11 @@ static ssize_t redisResParser(struct redisProcData *redis_data, struct slice *s)
             case RES_GET_ARGS:
                 if (isdigit(ch)) {
                     redis_data->args = redis_data->args * 10 + (ch - '0');
-                    if (redis_data->args < 2)
-                        goto redis_err;
                 } else if (ch == CR) {
                     redis_data->stage = RES_GET_ARG_LEN_LF;
+                } else if (ch == '-') {
+                    // "*-1\r\n" is nil multi bulk reply
+                    redis_data->stage = RES_NIL_VAL;
                 } else {
                     goto redis_err;
                 }
@@ -519,11 +546,6 @@ static ssize_t redisResParser(struct redisProcData *redis_data, struct slice *s)
                 }
                 break;
             case RES_GET_ARG_VAL:
-                if (ch == CR) {
-                    redis_data->stage = RES_GET_ARG_LEN_LF;
-                    pos++;
-                    break;
-                }
                 if (redis_data->curr_arg_len + pos > s->len) {
                     redis_data->curr_arg_len -= (s->len-pos);
                     pos = s->len;
@@ -532,6 +554,13 @@ static ssize_t redisResParser(struct redisProcData *redis_data, struct slice *s)
                 pos += redis_data->curr_arg_len;
                 redis_data->curr_arg++;
                 redis_data->curr_arg_len = 0;
+                redis_data->stage = RES_GET_ARG_VAL_END;
+                break;
+            case RES_GET_ARG_VAL_END:
+                if (ch != CR)
+                    goto redis_err;
+                redis_data->stage = RES_GET_ARG_LEN_LF;
+                pos++;
                 break;
             case MES_END:
                 return pos;
@@ -546,9 +575,24 @@ redis_err:
     return -1;
 }
 
+static int isMultiKey(enum redisCommand command_type, int args)
+{
+    switch (command_type) {
+        case REDIS_MGET:
+        case REDIS_DEL:
+        case REDIS_EXISTS:
+            return args > 2;
+        case REDIS_MSET:
+            return args > 3;
+        default:
+            return 0;
+    }
+}
+
 static ssize_t redisReqParser(struct redisProcData *redis_data, struct slice *s)
 {
     enum redisCommand command_type;
+    wstr *arg;
     char ch;
     size_t pos = 0;
     while (pos < s->len) {
@@ -607,10 +651,15 @@ static ssize_t redisReqParser(struct redisProcData *redis_data, struct slice *s)
                 break;
             case REQ_GET_ARG_VAL_LF:
                 if (ch == LF) {
-                    if (redis_data->curr_arg < 2)
+                    if (redis_data->curr_arg < 2) {
                         redis_data->stage = REQ_GET_ARG_COMMAND_OR_KEY;
-                    else
+                    } else if (redis_data->argv) {
+                        wstr arg = wstrEmpty();
+                        arrayPush(redis_data->argv, &arg);
+                        redis_data->stage = REQ_GET_ARG_MULTI;
+                    } else {
                         redis_data->stage = REQ_GET_ARG_VAL;
+                    }
                     pos++;
                 } else {
                     goto redis_err;
@@ -645,29 +694,53 @@ static ssize_t redisReqParser(struct redisProcData *redis_data, struct slice *s)
                         redis_data->is_read = 0;
                     else
                         redis_data->is_read = 1;
+                    if (isMultiKey(command_type, redis_data->args))
+                        redis_data->argv = arrayCreate(sizeof(wstr),
+                                redis_data->args-1);
 
                     // Now duplicate `key` to command
                     redis_data->command = wstrDup(redis_data->key);
                     wstrClear(redis_data->key);
                 } else {
                     // redis_data->key is stand for key
-                    redis_data->key_end_pos = pos;
+                    redis_data->key_end_pos = redis_data->parsed + pos;
+                    if (redis_data->argv) {
+                        wstr arg = wstrDup(redis_data->key);
+                        arrayPush(redis_data->argv, &arg);
+                    }
                 }
                 break;
             case REQ_GET_ARG_VAL:
-                if (ch == CR) {
-                    redis_data->stage = REQ_GET_ARG_LEN_LF;
-                    pos++;
-                    break;
+                if (redis_data->curr_arg_len + pos > s->len) {
+                    redis_data->curr_arg_len -= (s->len-pos);
+                    pos = s->len;
+                    return pos;
                 }
+                pos += redis_data->curr_arg_len;
+                redis_data->curr_arg++;
+                redis_data->curr_arg_len = 0;
+                redis_data->stage = REQ_GET_ARG_VAL_END;
+                break;
+            case REQ_GET_ARG_MULTI:
+                arg = arrayLast(redis_data->argv);
                 if (redis_data->curr_arg_len + pos > s->len) {
+                    *arg = wstrCatLen(*arg, (char *)&s->data[pos], s->len-pos);
                     redis_data->curr_arg_len -= (s->len-pos);
                     pos = s->len;
                     return pos;
                 }
+                *arg = wstrCatLen(*arg, (char *)&s->data[pos],
+                        redis_data->curr_arg_len);
                 pos += redis_data->curr_arg_len;
                 redis_data->curr_arg++;
                 redis_data->curr_arg_len = 0;
+                redis_data->stage = REQ_GET_ARG_VAL_END;
+                break;
+            case REQ_GET_ARG_VAL_END:
+                if (ch != CR)
+                    goto redis_err;
+                redis_data->stage = REQ_GET_ARG_LEN_LF;
+                pos++;
                 break;
             case MES_END:
                 return pos;
@@ -703,6 +776,7 @@ int parseRedis(struct conn *c, struct slice *slice, size_t *out)
     if (out) *out = nparsed;
     slice->len = nparsed;
     arrayPush(redis_data->req_body, slice);
+    redis_data->parsed += nparsed;
     if (REDIS_FINISHED(redis_data)) {
         return WHEAT_OK;
     }
@@ -727,6 +801,30 @@ int getRedisArgs(struct conn *c)
     return ((struct redisProcData *)c->protocol_data)->args;
 }
 
+int getRedisMultiKey(struct conn *c)
+{
+    struct redisProcData *redis_data = c->protocol_data;
+    if (!redis_data->argv)
+        return REDIS_MULTI_NONE;
+    switch (redis_data->command_type) {
+        case REDIS_MGET:
+            return REDIS_MULTI_MGET;
+        case REDIS_MSET:
+            return REDIS_MULTI_MSET;
+        case REDIS_DEL:
+            return REDIS_MULTI_DEL;
+        case REDIS_EXISTS:
+            return REDIS_MULTI_EXISTS;
+        default:
+            return REDIS_MULTI_NONE;
+    }
+}
+
+struct array *getRedisArgv(struct conn *c)
+{
+    return ((struct redisProcData *)c->protocol_data)->argv;
+}
+
 size_t getRedisKeyEndPos(struct conn *c)
 {
     return ((struct redisProcData *)c->protocol_data)->key_end_pos;
@@ -741,18 +839,26 @@ void *initRedisData()
     data->stage = MES_START;
     data->command_type = REDIS_UNKNOWN;
     data->command = NULL;
+    data->argv = NULL;
     data->req_body = arrayCreate(sizeof(struct slice), 4);
     data->key = wstrEmpty();
     data->pos = 0;
     data->key_end_pos = 0;
+    data->parsed = 0;
     return data;
 }
 
 void freeRedisData(void *d)
 {
     struct redisProcData *data = d;
+    size_t i;
     if (data->command)
         wstrFree(data->command);
+    if (data->argv) {
+        for (i = 0; i < narray(data->argv); i++)
+            wstrFree(*(wstr *)arrayIndex(data->argv, i));
+        arrayDealloc(data->argv);
+    }
     wstrFree(data->key);
     arrayDealloc(data->req_body);
     wfree(d);
@@ -760,12 +866,41 @@ void freeRedisData(void *d)
 
 int initRedis()
 {
-    RedisHashTag = wstrEmpty();
+    char *tag = getConfiguration("hash-tag")->target.ptr;
+
+    if (tag && strlen(tag) != 2) {
+        wheatLog(WHEAT_WARNING, "hash-tag must be two characters: %s", tag);
+        return WHEAT_WRONG;
+    }
+    RedisHashTag = tag ? wstrNew(tag) : wstrEmpty();
     return WHEAT_OK;
 }
 
 void deallocRedis()
 {
+    if (RedisHashTag)
+        wstrFree(RedisHashTag);
+    RedisHashTag = NULL;
+}
+
+// Same as Redis Cluster, only the part between the first open tag and the
+// next close tag is hashed if it isn't empty, so "{user1000}.following"
+// and "{user1000}.followers" are dispatched together with "{}" hash tag
+void getRedisHashKey(struct slice *key, struct slice *out)
+{
+    uint8_t *start, *end;
+
+    sliceTo(out, key->data, key->len);
+    if (!wstrlen(RedisHashTag))
+        return ;
+    start = memchr(key->data, RedisHashTag[0], key->len);
+    if (!start)
+        return ;
+    start++;
+    end = memchr(start, RedisHashTag[1], key->data + key->len - start);
+    if (!end || end == start)
+        return ;
+    sliceTo(out, start, end - start);
 }
 
 void redisBodyStart(struct conn *c)
@@ -7,6 +7,15 @@
 #ifndef WHEATSERVER_PROTOCOL_REDIS_PROTO_REDIS_H
 #define WHEATSERVER_PROTOCOL_REDIS_PROTO_REDIS_H
 
+// Multi-key commands split by proxy, see getRedisMultiKey
+enum redisMultiKey {
+    REDIS_MULTI_NONE,
+    REDIS_MULTI_MGET,
+    REDIS_MULTI_MSET,
+    REDIS_MULTI_DEL,
+    REDIS_MULTI_EXISTS
+};
+
 // Protocol Redis API
 struct slice *redisBodyNext(struct conn *c);
 void redisBodyStart(struct conn*c);
@@ -15,5 +24,8 @@ void getRedisCommand(struct conn *c, struct slice *out);
 int getRedisArgs(struct conn *c);
 int isReadCommand(struct conn*);
 size_t getRedisKeyEndPos(struct conn *c);
+void getRedisHashKey(struct slice *key, struct slice *out);
+int getRedisMultiKey(struct conn *c);
+struct array *getRedisArgv(struct conn *c);
 
 #endif
@@ -176,6 +176,7 @@ void handleUsr1()
 {
     wheatLog(WHEAT_NOTICE, "Signal usr1: %s", Server.master_name);
     killAllWorkers(SIGUSR1);
+    wheatLogReopen();
     logStat();
 }
 
@@ -205,6 +206,7 @@ void handleWorkerUsr1(int sig)
     // worker process refresh_time is used to control when to send statistic
     // packet, set to zero means to force worker to send
     WorkerProcess->refresh_time = 0;
+    wheatLogReopen();
     return ;
 }
 
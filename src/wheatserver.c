@@ -278,6 +278,8 @@ void spawnWorker(char *worker_name)
         return ;
     }
 
+    // Avoid buffered log lines being written twice by child
+    wheatLogFlush();
 #ifdef WHEAT_DEBUG_WORKER
     pid = 0;
 #else
@@ -316,6 +318,8 @@ void spawnFakeWorker(void (*func)(void *), void *data)
         return ;
     }
 
+    // Avoid buffered log lines being written twice by child
+    wheatLogFlush();
 #ifdef WHEAT_DEBUG_WORKER
     pid = 0;
 #else
@@ -421,6 +425,7 @@ void run()
             processEvents(Server.master_center, WHEATSERVER_CRON_MILLLISECONDS);
             adjustWorkerNumber();
             findTimeoutWorker();
+            wheatLogFlush();
             runWithPeriod(5000) {
                 if (Server.verbose == WHEAT_DEBUG)
                     logStat();
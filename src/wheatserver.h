@@ -267,6 +267,8 @@ int listValidator(struct configuration *conf, const char *key, const char *val);
 
 // =================== Log =========================
 void wheatLogRaw(int level, const char *msg);
+void wheatLogFlush();
+void wheatLogReopen();
 void wheatLog(int level, const char *fmt, ...);
 
 // ============ Master Client Operation ============
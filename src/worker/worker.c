@@ -10,6 +10,9 @@
 struct workerProcess *WorkerProcess = NULL;
 
 #define WHEAT_CLIENT_MAX      10240
+#define WHEAT_IOV_MAX         1024
+// Bytes of file sent to a client at most before other clients get a turn
+#define WHEAT_SENDFILE_MAX    (512*1024)
 
 // ========= Statistic Cache ===============
 // Cache below stat field avoid too much query on StatItems
@@ -45,6 +48,7 @@ struct callback {
 static struct list *FreeClients = NULL;
 static struct list *Clients = NULL;
 static struct statItem *StatTotalClient = NULL;
+static int CronWait = WHEATSERVER_CRON_MILLLISECONDS;
 
 // Static fucntion declaretion
 static void handleRequest(struct evcenter *center, int fd, void *data, int mask);
@@ -110,6 +114,9 @@ static struct client *createClient(int fd, char *ip, int port, struct protocol *
     listSetFree(c->conns, (void (*)(void*))connDealloc);
     c->req_buf = msgCreate(Server.mbuf_size);
     c->is_outer = 1;
+    c->multiplexed = 0;
+    c->corked = 0;
+    c->sending = NULL;
     c->should_close = 0;
     c->valid = 1;
     c->pending = NULL;
@@ -147,9 +154,25 @@ void freeClient(struct client *c)
     }
 }
 
+// Pipelined conn may be answered before the ones ahead of it, such as
+// deferred by app, client is kept until all of them are sent
+static int isClientWaiting(struct client *c)
+{
+    struct listNode *node;
+    struct conn *conn;
+
+    for (node = listFirst(c->conns); node; node = node->next) {
+        conn = listNodeValue(node);
+        if (!conn->ready_send && conn != c->pending)
+            return 1;
+    }
+    return 0;
+}
+
 void tryFreeClient(struct client *c)
 {
-    if (isClientValid(c) && (isClientNeedSend(c) || !c->should_close))
+    if (isClientValid(c) && (isClientNeedSend(c) || !c->should_close ||
+                isClientWaiting(c)))
         return;
     freeClient(c);
 }
@@ -158,6 +181,14 @@ int isClientNeedSend(struct client *c)
 {
     struct listNode *node;
     struct conn *send_conn;
+    if (c->multiplexed && isClientValid(c)) {
+        for (node = listFirst(c->conns); node; node = node->next) {
+            send_conn = listNodeValue(node);
+            if (listLength(send_conn->send_queue) || send_conn->ready_send)
+                return 1;
+        }
+        return 0;
+    }
     if (listLength(c->conns) && isClientValid(c)) {
         node = listFirst(c->conns);
         send_conn = listNodeValue(node);
@@ -184,12 +215,10 @@ static struct list *createAndFillPool()
 // ========================= Conn Implemation =======================
 // ==================================================================
 
+// Always a new conn, conn of request partly parsed is `client->pending`
+// and requests sent by app shouldn't be queued to it
 struct conn *connGet(struct client *client)
 {
-    if (client->pending) {
-        ASSERT(client->pending->client);
-        return client->pending;
-    }
     struct conn *c = wmalloc(sizeof(*c));
     c->client = client;
     c->protocol_data = client->protocol->initProtocolData();
@@ -204,10 +233,12 @@ struct conn *connGet(struct client *client)
 
 static void connDealloc(struct conn *c)
 {
-    if (c->protocol_data)
-        c->client->protocol->freeProtocolData(c->protocol_data);
+    // App data may still refer to protocol data, such as request body read
+    // by a wsgi thread, so it goes first
     if (c->app_private_data)
         c->app->freeAppData(c->app_private_data);
+    if (c->protocol_data)
+        c->client->protocol->freeProtocolData(c->protocol_data);
     arrayEach(c->cleanup, callbackCall);
     arrayDealloc(c->cleanup);
     freeList(c->send_queue);
@@ -217,7 +248,8 @@ static void connDealloc(struct conn *c)
 void finishConn(struct conn *c)
 {
     c->ready_send = 1;
-    clientSendPacketList(c->client);
+    if (!c->client->corked)
+        clientSendPacketList(c->client);
 }
 
 void registerConnFree(struct conn *conn, void (*clean)(void*), void *data)
@@ -276,6 +308,7 @@ static int sendPacket(struct client *c, struct sendPacket *packet)
     struct slice *data;
     ssize_t nwritten = 0;
     struct fileWrapper *file_wrapper;
+    size_t sent = 0;
     switch (packet->type) {
         case SLICE:
             data = &packet->target.slice;
@@ -298,6 +331,9 @@ static int sendPacket(struct client *c, struct sendPacket *packet)
         case FILE_DESCRIPTION:
             file_wrapper = &packet->target.file;
             while (file_wrapper->len > 0) {
+                // Big file is sent in turns, as if socket were full
+                if (sent >= WHEAT_SENDFILE_MAX)
+                    return 1;
                 nwritten = portable_sendfile(c->clifd, file_wrapper->fd,
                         file_wrapper->off, file_wrapper->len);
                 if (nwritten == -1)
@@ -307,35 +343,207 @@ static int sendPacket(struct client *c, struct sendPacket *packet)
                 }
                 file_wrapper->off += nwritten;
                 file_wrapper->len -= nwritten;
+                sent += nwritten;
             }
     }
     return 0;
 }
 
-void clientSendPacketList(struct client *c)
+// Return 0 if all packets of `send_conn` are sent, 1 if socket is full and
+// -1 if client is broken
+static int sendConnPackets(struct client *c, struct conn *send_conn)
 {
     struct sendPacket *packet;
-    struct conn *send_conn;
-    struct listNode *node, *node2;
+    struct listNode *node;
     ssize_t ret;
 
-    while (isClientNeedSend(c)) {
-        node = listFirst(c->conns);
-        send_conn = listNodeValue(node);
+    while (listLength(send_conn->send_queue)) {
+        node = listFirst(send_conn->send_queue);
+        packet = listNodeValue(node);
+        ret = sendPacket(c, packet);
+        if (ret == -1) {
+            setClientUnvalid(c);
+            return -1;
+        } else if (ret == 1) {
+            return 1;
+        }
+        ASSERT(ret == 0);
+        removeListNode(send_conn->send_queue, node);
+    }
+    return 0;
+}
 
-        while (listLength(send_conn->send_queue)) {
-            node2 = listFirst(send_conn->send_queue);
-            packet = listNodeValue(node2);
-            ret = sendPacket(c, packet);
-            if (ret == -1) {
-                setClientUnvalid(c);
-                return ;
-            } else if (ret == 1) {
-                return ;
+// Conns whose queued packets are all slices are written by one writev,
+// conn written partly is left to be continued first.
+// Return 0 if all gathered slices are sent, 1 if socket is full and -1 if
+// client is broken
+static int sendMultiplexedSlices(struct client *c)
+{
+    struct iovec iov[WHEAT_IOV_MAX];
+    struct listNode *node, *pnode;
+    struct sendPacket *packet;
+    struct conn *send_conn;
+    struct slice *slice;
+    size_t total = 0;
+    ssize_t nwritten;
+    int n = 0, count;
+
+    for (node = listFirst(c->conns); node; node = node->next) {
+        send_conn = listNodeValue(node);
+        count = 0;
+        for (pnode = listFirst(send_conn->send_queue); pnode;
+                pnode = pnode->next) {
+            packet = listNodeValue(pnode);
+            if (packet->type != SLICE || n + count == WHEAT_IOV_MAX)
+                break;
+            iov[n+count].iov_base = packet->target.slice.data;
+            iov[n+count].iov_len = packet->target.slice.len;
+            count++;
+        }
+        if (pnode)
+            break;
+        for (; count; count--, n++)
+            total += iov[n].iov_len;
+    }
+    if (n == 0)
+        return 0;
+    nwritten = writeVecTo(c->clifd, iov, n);
+    if (nwritten == -1) {
+        setClientUnvalid(c);
+        return -1;
+    }
+    for (node = listFirst(c->conns); nwritten; node = node->next) {
+        send_conn = listNodeValue(node);
+        while ((pnode = listFirst(send_conn->send_queue)) != NULL) {
+            slice = &((struct sendPacket *)listNodeValue(pnode))->target.slice;
+            if ((size_t)nwritten < slice->len) {
+                slice->data += nwritten;
+                slice->len -= nwritten;
+                c->sending = send_conn;
+                return 1;
             }
-            ASSERT(ret == 0);
-            removeListNode(send_conn->send_queue, node2);
+            nwritten -= slice->len;
+            total -= slice->len;
+            removeListNode(send_conn->send_queue, pnode);
+            if (listFirst(send_conn->send_queue) && !nwritten) {
+                c->sending = send_conn;
+                return 1;
+            }
+        }
+    }
+    return total != 0;
+}
+
+// Packets of a conn are never interleaved with other conns, so a frame
+// queued as several packets is kept intact
+static void sendMultiplexedPacketList(struct client *c)
+{
+    struct conn *send_conn;
+    struct listNode *node, *next;
+    int ret;
+
+    if (c->sending) {
+        if (sendConnPackets(c, c->sending))
+            return ;
+        c->sending = NULL;
+    }
+    if (sendMultiplexedSlices(c))
+        return ;
+    for (node = listFirst(c->conns); node; node = next) {
+        next = node->next;
+        send_conn = listNodeValue(node);
+        ret = sendConnPackets(c, send_conn);
+        if (ret == -1) {
+            return ;
+        } else if (ret == 1) {
+            c->sending = send_conn;
+            return ;
+        }
+        if (send_conn->ready_send)
+            removeListNode(c->conns, node);
+    }
+}
+
+// Slices queued by the head conn and by finished conns following it are
+// written by one writev, so pipelined responses don't cost syscalls each.
+// Return 0 if all gathered slices are sent, 1 if socket is full and -1 if
+// client is broken
+static int sendGatheredSlices(struct client *c)
+{
+    struct iovec iov[WHEAT_IOV_MAX];
+    struct listNode *node, *pnode;
+    struct sendPacket *packet;
+    struct conn *send_conn;
+    struct slice *slice;
+    size_t total = 0;
+    ssize_t nwritten;
+    int n = 0, ret;
+
+    for (node = listFirst(c->conns); node && n < WHEAT_IOV_MAX;
+            node = node->next) {
+        send_conn = listNodeValue(node);
+        for (pnode = listFirst(send_conn->send_queue);
+                pnode && n < WHEAT_IOV_MAX; pnode = pnode->next) {
+            packet = listNodeValue(pnode);
+            if (packet->type != SLICE)
+                break;
+            iov[n].iov_base = packet->target.slice.data;
+            iov[n].iov_len = packet->target.slice.len;
+            total += iov[n].iov_len;
+            n++;
+        }
+        if (pnode || !send_conn->ready_send)
+            break;
+    }
+    if (n == 0)
+        return 0;
+    nwritten = writeVecTo(c->clifd, iov, n);
+    if (nwritten == -1) {
+        setClientUnvalid(c);
+        return -1;
+    }
+    ret = (size_t)nwritten < total;
+    while (nwritten) {
+        node = listFirst(c->conns);
+        send_conn = listNodeValue(node);
+        pnode = listFirst(send_conn->send_queue);
+        // Only finished conn is gathered past
+        if (pnode == NULL) {
+            removeListNode(c->conns, node);
+            continue;
+        }
+        slice = &((struct sendPacket *)listNodeValue(pnode))->target.slice;
+        if ((size_t)nwritten < slice->len) {
+            slice->data += nwritten;
+            slice->len -= nwritten;
+            break;
         }
+        nwritten -= slice->len;
+        removeListNode(send_conn->send_queue, pnode);
+    }
+    return ret;
+}
+
+void clientSendPacketList(struct client *c)
+{
+    struct conn *send_conn;
+    struct listNode *node, *pnode;
+
+    if (c->multiplexed) {
+        sendMultiplexedPacketList(c);
+        return ;
+    }
+    while (isClientNeedSend(c)) {
+        if (sendGatheredSlices(c))
+            return ;
+        node = listFirst(c->conns);
+        send_conn = listNodeValue(node);
+        // Gathering stopped at iovec limit, rest of slices are gathered again
+        pnode = listFirst(send_conn->send_queue);
+        if (pnode && ((struct sendPacket *)listNodeValue(pnode))->type == SLICE)
+            continue;
+        if (sendConnPackets(c, send_conn))
+            return ;
         if (send_conn->ready_send)
             removeListNode(c->conns, node);
     }
@@ -343,8 +551,14 @@ void clientSendPacketList(struct client *c)
 
 int sendClientFile(struct conn *c, int fd, off_t len)
 {
-    int send = 0;
-    appendFileToSendQueue(c, fd, send, len-send);
+    return sendClientFileRange(c, fd, 0, len);
+}
+
+int sendClientFileRange(struct conn *c, int fd, off_t off, size_t len)
+{
+    appendFileToSendQueue(c, fd, off, len);
+    if (c->client->corked)
+        return WHEAT_OK;
     return WorkerProcess->worker->sendData(c);
 }
 
@@ -353,9 +567,63 @@ int sendClientData(struct conn *c, struct slice *s)
     if (!s->len)
         return WHEAT_OK;
     appendSliceToSendQueue(c, s);
+    if (c->client->corked)
+        return WHEAT_OK;
+    return WorkerProcess->worker->sendData(c);
+}
+
+// Slices queued to conn may refer to buffer of another client, such as
+// reply read from backend server. Copy them to memory owned by conn when
+// that client is freed before conn sent.
+void copyConnData(struct conn *c)
+{
+    struct listNode *node;
+    struct sendPacket *packet;
+    struct slice *data;
+    uint8_t *copy;
+
+    for (node = listFirst(c->send_queue); node; node = node->next) {
+        packet = listNodeValue(node);
+        data = &packet->target.slice;
+        if (packet->type != SLICE || !data->len)
+            continue;
+        copy = wmalloc(data->len);
+        memcpy(copy, data->data, data->len);
+        data->data = copy;
+        registerConnFree(c, wfree, copy);
+    }
+}
+
+// Data of client is only queued until uncorkClient, so pieces of a
+// response are written together. Return previous state to be passed to
+// uncorkClient, client corked by caller is left to it.
+int corkClient(struct client *c)
+{
+    int corked = c->corked;
+
+    c->corked = 1;
+    return corked;
+}
+
+int uncorkClient(struct conn *c, int corked)
+{
+    if (corked)
+        return WHEAT_OK;
+    c->client->corked = 0;
     return WorkerProcess->worker->sendData(c);
 }
 
+// Write data queued so far and keep client corked
+int flushClient(struct conn *c)
+{
+    int corked = c->client->corked, ret;
+
+    c->client->corked = 0;
+    ret = WorkerProcess->worker->sendData(c);
+    c->client->corked = corked;
+    return ret;
+}
+
 // ==================================================================
 // ============= Worker Process Connection Functions ================
 // ==================================================================
@@ -365,7 +633,7 @@ struct client *buildConn(char *ip, int port, struct protocol *p)
     struct client *c = NULL;
     int fd = wheatTcpConnect(Server.neterr, ip, port);
     if (fd == NET_WRONG) {
-        wheatLog(WHEAT_WARNING, "Unable to connect to redis %s:%d: %s %s",
+        wheatLog(WHEAT_WARNING, "Unable to connect to %s:%d: %s %s",
                 ip, port, strerror(errno), Server.neterr);
         return NULL;
     }
@@ -373,6 +641,9 @@ struct client *buildConn(char *ip, int port, struct protocol *p)
         wheatLog(WHEAT_WARNING, "Set nonblock %d failed: %s", fd, Server.neterr);
         return NULL;
     }
+    // Requests to backend are written in batches, one shouldn't wait for
+    // ack of the former
+    wheatTcpNoDelay(Server.neterr, fd);
     c = createClient(fd, ip, port, p, 0);
     if (!c) {
         close(fd);
@@ -398,7 +669,9 @@ static void handleRequest(struct evcenter *center, int fd, void *data, int mask)
 
     gettimeofday(&start, NULL);
     nread = WorkerProcess->worker->recvData(client);
-    if (!isClientValid(client)) {
+    // Backend server may close connection right after response, data read
+    // before that still need to be parsed
+    if (!isClientValid(client) && (isOuterClient(client) || nread <= 0)) {
         freeClient(client);
         return ;
     }
@@ -408,7 +681,7 @@ static void handleRequest(struct evcenter *center, int fd, void *data, int mask)
     }
 
     while (msgCanRead(client->req_buf)) {
-        conn = connGet(client);
+        conn = client->pending ? client->pending : connGet(client);
 
         msgRead(client->req_buf, &slice);
         ret = client->protocol->parser(conn, &slice, &parsed);
@@ -422,6 +695,10 @@ static void handleRequest(struct evcenter *center, int fd, void *data, int mask)
             msgSetReaded(client->req_buf, parsed);
             getStatVal(StatTotalRequest)++;
             client->pending = NULL;
+            // Responses of pipelined requests are sent together after
+            // all of them are handled
+            if (msgCanRead(client->req_buf))
+                client->corked = 1;
             ret = client->protocol->spotAppAndCall(conn);
             if (ret != WHEAT_OK) {
                 getStatVal(StatFailedRequest)++;
@@ -435,6 +712,11 @@ static void handleRequest(struct evcenter *center, int fd, void *data, int mask)
             continue;
         }
     }
+    if (client->corked) {
+        client->corked = 0;
+        if (listLength(client->conns))
+            WorkerProcess->worker->sendData(listNodeValue(listFirst(client->conns)));
+    }
     tryFreeClient(client);
     gettimeofday(&end, NULL);
     time_use = 1000000 * (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec);
@@ -455,6 +737,9 @@ static void acceptClient(struct evcenter *center, int fd, void *data, int mask)
     }
     wheatNonBlock(Server.neterr, cfd);
     wheatCloseOnExec(Server.neterr, cfd);
+    // Response is written as several packets, pipelined responses
+    // shouldn't wait for peer's delayed ack
+    wheatTcpNoDelay(Server.neterr, cfd);
 
     c = createClient(cfd, ip, cport, WorkerProcess->protocol, fd+Server.port_range_start);
 }
@@ -539,7 +824,9 @@ void initWorkerProcess(struct workerProcess *worker, char *worker_name)
     getAppsByProtocol(worker->apps, worker->protocol);
     for (i = 0; i < narray(worker->apps); i++) {
         app = *(struct app**)arrayIndex(worker->apps, i);
-        if (app->initApp(worker->protocol) == WHEAT_WRONG) {
+        // initApp marks app inited, otherwise it's inited again by the
+        // first request
+        if (initApp(app) == WHEAT_WRONG) {
             wheatLog(WHEAT_WARNING, "init app failed %s", getModuleName(APP, app));
             halt(1);
         }
@@ -563,6 +850,14 @@ static inline void appCronRun(void *t)
         (*app)->appCron();
 }
 
+void wakeupWorkerIn(int milliseconds)
+{
+    if (milliseconds < 1)
+        milliseconds = 1;
+    if (milliseconds < CronWait)
+        CronWait = milliseconds;
+}
+
 // workerProcessCron is the cron of worker process, it must be called before
 // worker process initialized.
 //
@@ -575,22 +870,28 @@ void workerProcessCron(void (*fake_func)(void *data), void *data)
     long long interval;
     int refresh_seconds;
     void (*worker_cron)();
+    void (*protocol_cron)();
 
     refresh_seconds = Server.stat_refresh_seconds;
     worker_cron = WorkerProcess->worker->cron;
+    protocol_cron = WorkerProcess->protocol->protocolCron;
     while (WorkerProcess->alive) {
+        CronWait = WHEATSERVER_CRON_MILLLISECONDS;
+        if (protocol_cron)
+            protocol_cron();
         arrayEach(WorkerProcess->apps, appCronRun);
 
         if (worker_cron)
             worker_cron();
         if (fake_func)
             fake_func(data);
-        processEvents(WorkerProcess->center, WHEATSERVER_CRON_MILLLISECONDS);
+        processEvents(WorkerProcess->center, CronWait);
         if (WorkerProcess->ppid != getppid()) {
             wheatLog(WHEAT_NOTICE, "parent change, worker shutdown");
             WorkerProcess->alive = 0;
         }
         clientsCron();
+        wheatLogFlush();
 
         if (Server.cron_time.tv_sec - WorkerProcess->refresh_time > refresh_seconds) {
             sendStatPacket(WorkerProcess);
@@ -616,4 +917,7 @@ void workerProcessCron(void (*fake_func)(void *data), void *data)
         processEvents(WorkerProcess->center, WHEATSERVER_CRON_MILLLISECONDS);
         gettimeofday(&Server.cron_time, NULL);
     }
+    // Let protocol flush buffered data before exit
+    if (WorkerProcess->protocol->deallocProtocol)
+        WorkerProcess->protocol->deallocProtocol();
 }
@@ -86,6 +86,8 @@ struct conn;
 // `initProtocolData`: implement protocol data attached to each request,
 // parsed data useful can store to it.
 // `initProtocol`: used to setup protocol module
+// `protocolCron`: optional, called every worker cron loop so protocol can
+// refresh cached data such as preformatted date strings
 struct protocol {
     int (*spotAppAndCall)(struct conn *);
     int (*parser)(struct conn *conn, struct slice *s, size_t *nparsed);
@@ -93,6 +95,7 @@ struct protocol {
     void (*freeProtocolData)(void *ptcol_data);
     int (*initProtocol)();
     void (*deallocProtocol)();
+    void (*protocolCron)();
 };
 
 // Worker Interface
@@ -229,7 +232,15 @@ struct client {
     void (*notify)(struct client*);
     void *notify_data;
 
+    struct conn *sending;   // Multiplexed client: conn whose packet is partly
+                            // sent, it must be continued first
+
     unsigned is_outer:1;
+    unsigned multiplexed:1;  // Conns are sent as soon as they have data
+                             // instead of in order, like HTTP/2 streams
+    unsigned corked:1;       // Pipelined requests or a response of many pieces
+                             // are being handled, data is only queued and
+                             // sent after all of them
     unsigned should_close:1; // Used to indicate whether closing client
     unsigned valid:1;        // Intern: used to indicate client fd is unused and
                              // need closing, only used by worker IO methods when
@@ -242,6 +253,9 @@ extern struct workerProcess *WorkerProcess;
 void initWorkerProcess(struct workerProcess *worker, char *worker_name);
 void freeWorkerProcess(void *worker);
 void workerProcessCron(void (*fake_func)(void *data), void *data);
+// Cron is called again in `milliseconds` if it's less than
+// WHEATSERVER_CRON_MILLLISECONDS, only affects the current loop
+void wakeupWorkerIn(int milliseconds);
 
 //==================================================================
 //========================== Client operation ======================
@@ -251,7 +265,12 @@ static struct client *createClient(int fd, char *ip, int port, struct protocol *
 void freeClient(struct client *);
 void tryFreeClient(struct client *c);
 int sendClientFile(struct conn *c, int fd, off_t len);
+int sendClientFileRange(struct conn *c, int fd, off_t off, size_t len);
 int sendClientData(struct conn *c, struct slice *s);
+void copyConnData(struct conn *c);
+int corkClient(struct client *c);
+int uncorkClient(struct conn *c, int corked);
+int flushClient(struct conn *c);
 int isClientNeedSend(struct client *);
 // Used by worker module only
 void clientSendPacketList(struct client *c);
@@ -264,6 +283,7 @@ void clientSendPacketList(struct client *c);
 #define refreshClient(c)                   ((c)->last_io = (Server.cron_time))
 #define setClientName(c, n)                ((c)->name = wstrCat(c->name, (n)))
 #define setClientFreeNotify(c, func)       ((c)->notify = (func))
+#define setClientMultiplexed(c)            ((c)->multiplexed = 1)
 
 //==================================================================
 //========================== Conn operation ========================
@@ -64,7 +64,8 @@ int asyncRecvData(struct client *c)
     size_t total = 0;
     struct slice slice;
     // Because os IO notify only once if you don't read all data within this
-    // buffer
+    // buffer. But stop at `max_buffer_size` to let parser consume(or spill
+    // request body) first, the rest will be notified again.
     do {
         n = msgPut(c->req_buf, &slice);
         if (n != 0) {
@@ -77,7 +78,8 @@ int asyncRecvData(struct client *c)
         }
         total += n;
         msgSetWritted(c->req_buf, n);
-    } while (n == slice.len);
+    } while (n == slice.len &&
+            msgGetSize(c->req_buf) < Server.max_buffer_size);
     if (msgGetSize(c->req_buf) > Server.max_buffer_size) {
         wheatLog(WHEAT_VERBOSE, "Client buffer size larger than limit %d>%d",
                 msgGetSize(c->req_buf), Server.max_buffer_size);
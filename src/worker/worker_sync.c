@@ -55,7 +55,8 @@ int syncRecvData(struct client *c)
         }
         total += n;
         msgSetWritted(c->req_buf, n);
-    } while (n == slice.len || n == 0);
+    } while ((n == slice.len || n == 0) &&
+            msgGetSize(c->req_buf) < Server.max_buffer_size);
     if (msgGetSize(c->req_buf) > Server.max_buffer_size) {
         wheatLog(WHEAT_VERBOSE, "Client buffer size larger than limit %d>%d",
                 msgGetSize(c->req_buf), Server.max_buffer_size);
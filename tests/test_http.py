@@ -1,10 +1,43 @@
 from wheatserver_test import WheatServer, PROJECT_PATH, server_socket
+import email.utils
+import hashlib
 import os
+import shutil
+import signal
+import socket
+import struct
+import sys
+import tempfile
+import threading
 import time
 import requests
 
 POST_DATA = b"""POST /asdf HTTP/1.1\r\nHost: 127.0.0.1:10828\r\nContent-Length: 200\r\nContent-Type: multipart/form-data; boundary=25510934abe14960a7309cc7a2c790d8\r\nAccept-Encoding: gzip, deflate, compress\r\nAccept: */*\r\nUser-Agent: python-requests/1.1.0 CPython/2.7.2 Darwin/12.2.0\r\n\r\n--25510934abe14960a7309cc7a2c790d8\r\nContent-Disposition: form-data; name=\"file\"; filename=\"/Users/wanghaomai/Downloads/1.txt\"\r\nContent-Type: text/plain\r\n\r\n1234\n\r\n--25510934abe14960a7309cc7a2c790d8--\r\n"""
 
+def config_file(*lines):
+    """wheatserver.conf with `lines` appended, list options like
+    http-routes can only be given in file"""
+    path = os.path.join(tempfile.gettempdir(), "wheatserver_test.conf")
+    with open(os.path.join(PROJECT_PATH, "wheatserver.conf")) as f:
+        conf = f.read()
+    with open(path, "w") as f:
+        f.write(conf + "\n" + "\n".join(lines) + "\n")
+    return path
+
+def http_get(path, headers=""):
+    if "Host: " not in headers:
+        headers = "Host: 127.0.0.1:10828\r\n" + headers
+    s = server_socket(10828)
+    s.settimeout(2)
+    s.send("GET %s HTTP/1.1\r\n%sConnection: close\r\n\r\n" % (path, headers))
+    a = ""
+    while True:
+        b = s.recv(4096)
+        if not b:
+            break
+        a += b
+    return a
+
 def test_get_two():
     async = WheatServer("", "--worker-type %s" % "AsyncWorker",
                                "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
@@ -50,3 +83,684 @@ def test_document_root_and_static_file_dir():
     time.sleep(0.1)
     r = requests.get("http://127.0.0.1:10828/static/example.jpg",timeout=1)
     assert 200 == r.status_code
+
+def test_response_headers():
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--allowed-extension bmp,gif",
+                               "--protocol Http")
+    time.sleep(0.1)
+    s = server_socket(10828)
+    s.settimeout(2)
+    s.send("GET /cookies HTTP/1.1\r\nHost: 127.0.0.1:10828\r\n\r\n")
+    a = ""
+    while not a.endswith("cookies\n"):
+        a += s.recv(4096)
+    head = a.split("\r\n\r\n")[0].split("\r\n")
+    assert head[0] == "HTTP/1.1 200 OK"
+    fields = [l.split(": ", 1)[0].lower() for l in head[1:]]
+    assert fields.count("server") == 1 and fields.count("date") == 1
+    # Repeated headers of app are all sent
+    assert "Set-Cookie: a=1" in head and "Set-Cookie: b=2" in head
+    assert "Connection: keep-alive" in head
+    date = [l for l in head if l.startswith("Date: ")][0][6:]
+    assert date.endswith(" GMT")
+    assert abs(email.utils.mktime_tz(email.utils.parsedate_tz(date)) - time.time()) < 3
+    # Error page is framed by its own length
+    s.send("GET /static/missing.gif HTTP/1.1\r\nHost: 127.0.0.1:10828\r\nConnection: close\r\n\r\n")
+    a = ""
+    while True:
+        b = s.recv(4096)
+        if not b:
+            break
+        a += b
+    head, body = a.split("\r\n\r\n", 1)
+    assert head.startswith("HTTP/1.1 404") and "Content-Length: %d\r\n" % len(body) in head + "\r\n"
+
+def test_request_headers():
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--allowed-extension bmp,gif",
+                               "--mbuf-size 64",
+                               "--protocol Http")
+    time.sleep(0.1)
+    s = server_socket(10828)
+    s.settimeout(2)
+    # Url, names and values are split by reads and by 64 bytes buffers
+    req = ("GET /environ?HTTP_X_LONG_HEADER_NAME,HTTP_USER_AGENT,HTTP_X_A,CONTENT_TYPE HTTP/1.1\r\n"
+           "Host: 127.0.0.1:10828\r\nx-long-header-name: %s\r\nUSER-agent: test\r\n"
+           "X-A: a\r\ncontent-type: text/x\r\nConnection: close\r\n\r\n" % ("v" * 100))
+    for i in range(0, len(req), 7):
+        s.send(req[i:i+7])
+        time.sleep(0.001)
+    a = ""
+    while True:
+        b = s.recv(4096)
+        if not b:
+            break
+        a += b
+    assert a.startswith("HTTP/1.1 200")
+    assert a.split("\r\n\r\n", 1)[1] == ("HTTP_X_LONG_HEADER_NAME=%s\nHTTP_USER_AGENT=test\n"
+                                         "HTTP_X_A=a\nCONTENT_TYPE=text/x\n" % ("v" * 100))
+
+def test_binary_access_log():
+    sys.path.insert(0, os.path.join(PROJECT_PATH, "client"))
+    import accesslog
+    path = os.path.join(tempfile.gettempdir(), "wheatserver_access.log")
+    if os.path.exists(path):
+        os.remove(path)
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--allowed-extension bmp,gif",
+                               "--access-log %s" % path,
+                               "--access-log-format Binary",
+                               "--access-log-flush-interval 100",
+                               "--protocol Http")
+    time.sleep(0.1)
+    http_get("/cookies", "Referer: http://ref/\r\nUser-Agent: agent/1\r\n")
+    http_get("/static/missing.gif")
+    s = server_socket(10828)
+    s.settimeout(1)
+    s.send(H2_PREFACE + h2_frame(4, 0, 0) + h2_headers(1, "GET", "/", True))
+    h2_response(s, 1)
+    s.close()
+    time.sleep(0.5)
+    lines = [accesslog.format_record(*r) for r in accesslog.records(open(path, "rb").read())]
+    assert len(lines) == 3
+    assert lines[0].startswith("127.0.0.1 - - [")
+    assert lines[0].endswith('] "GET /cookies HTTP/1.1" 200 8 "http://ref/" "agent/1"\n')
+    assert '"GET /static/missing.gif HTTP/1.1" 404 ' in lines[1]
+    assert '"GET / HTTP/2.0" 200 13 ' in lines[2]
+
+def test_log_reopen():
+    path = os.path.join(tempfile.gettempdir(), "wheatserver_error.log")
+    for p in (path, path + ".1"):
+        if os.path.exists(p):
+            os.remove(p)
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--allowed-extension bmp,gif",
+                               "--logfile %s" % path,
+                               "--logfile-level debug",
+                               "--worker-number 1",
+                               "--protocol Http")
+    time.sleep(0.3)
+    # Moved away like logrotate does, master and worker write to new file
+    # once signaled
+    os.rename(path, path + ".1")
+    os.kill(async.exec_pid, signal.SIGUSR1)
+    time.sleep(0.2)
+    # Worker logs peer closing keep-alive connection
+    s = server_socket(10828)
+    s.send("GET / HTTP/1.1\r\nHost: 127.0.0.1:10828\r\n\r\n")
+    s.recv(4096)
+    s.close()
+    time.sleep(1.2)
+    old = open(path + ".1").read()
+    new = open(path).read()
+    assert "is running" in old and "Signal usr1" not in old
+    assert "Signal usr1" in new
+    assert len(set(l.split("]")[0] for l in new.splitlines() if l.startswith("["))) == 2
+
+def test_body_spill():
+    temp_dir = tempfile.mkdtemp()
+    body = "".join(chr(i % 251) for i in range(5 * 1024 * 1024))
+    expect = "%d %s\n" % (len(body), hashlib.md5(body).hexdigest())
+    for threads in ("0", "2"):
+        async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                                   "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                                   "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                                   "--allowed-extension bmp,gif",
+                                   "--body-spill-size 65536",
+                                   "--body-temp-dir %s" % temp_dir,
+                                   "--wsgi-threads %s" % threads,
+                                   "--protocol Http")
+        time.sleep(0.1)
+        # Body larger than max-buffer-size, by length and by chunks
+        s = server_socket(10828)
+        s.settimeout(5)
+        s.sendall("POST /upload HTTP/1.1\r\nHost: 127.0.0.1:10828\r\nContent-Length: %d\r\n\r\n"
+                  % len(body) + body)
+        a = ""
+        while not a.endswith("\n"):
+            a += s.recv(4096)
+        assert a.startswith("HTTP/1.1 200") and a.endswith("\r\n\r\n" + expect)
+        s.send("POST /upload HTTP/1.1\r\nHost: 127.0.0.1:10828\r\nTransfer-Encoding: chunked\r\n"
+               "Connection: close\r\n\r\n")
+        for i in range(0, len(body), 300000):
+            piece = body[i:i+300000]
+            s.sendall("%x\r\n%s\r\n" % (len(piece), piece))
+        s.sendall("0\r\n\r\n")
+        a = ""
+        while True:
+            b = s.recv(4096)
+            if not b:
+                break
+            a += b
+        assert a.startswith("HTTP/1.1 200") and a.endswith("\r\n\r\n" + expect)
+        # Temp file is unlinked once created
+        assert os.listdir(temp_dir) == []
+        del async
+        time.sleep(0.3)
+    shutil.rmtree(temp_dir)
+
+def test_environ():
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--allowed-extension bmp,gif",
+                               "--protocol Http")
+    time.sleep(0.1)
+    keys = ("REQUEST_METHOD,SERVER_PROTOCOL,PATH_INFO,QUERY_STRING,SERVER_NAME,SERVER_PORT,"
+            "REMOTE_ADDR,CONTENT_LENGTH,CONTENT_TYPE,HTTP_X_CUSTOM,wsgi.url_scheme")
+    a = http_get("/environ/a%%20b?%s" % keys, "Host: example.com:8080\r\nX-Custom: c\r\n")
+    assert a.split("\r\n\r\n", 1)[1] == (
+            "REQUEST_METHOD=GET\nSERVER_PROTOCOL=HTTP/1.1\nPATH_INFO=/environ/a b\n"
+            "QUERY_STRING=%s\nSERVER_NAME=example.com\nSERVER_PORT=8080\n"
+            "REMOTE_ADDR=127.0.0.1\nCONTENT_LENGTH=None\nCONTENT_TYPE=None\n"
+            "HTTP_X_CUSTOM=c\nwsgi.url_scheme=http\n" % keys)
+    # Port defaults by scheme, client is given by X-Forwarded-For
+    a = http_get("/environ?SERVER_NAME,SERVER_PORT,REMOTE_ADDR",
+                 "Host: example.com\r\nX-Forwarded-For: 10.0.0.1:1234\r\n")
+    assert a.endswith("\r\n\r\nSERVER_NAME=example.com\nSERVER_PORT=80\nREMOTE_ADDR=10.0.0.1\n")
+    # HTTP/1.0 request may have no Host
+    s = server_socket(10828)
+    s.settimeout(2)
+    s.send("POST /environ?SERVER_PROTOCOL,SERVER_NAME,CONTENT_LENGTH,CONTENT_TYPE HTTP/1.0\r\n"
+           "Content-Type: text/x\r\nContent-Length: 4\r\n\r\nbody")
+    a = ""
+    while True:
+        b = s.recv(4096)
+        if not b:
+            break
+        a += b
+    assert a.endswith("\r\n\r\nSERVER_PROTOCOL=HTTP/1.0\nSERVER_NAME=127.0.0.1\n"
+                      "CONTENT_LENGTH=4\nCONTENT_TYPE=text/x\n")
+
+def test_pipeline():
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--allowed-extension bmp,gif",
+                               "--protocol Http")
+    time.sleep(0.1)
+    s = server_socket(10828)
+    s.settimeout(1)
+    s.send("GET / HTTP/1.1\r\nHost: 127.0.0.1:10828\r\n\r\n" * 9 + POST_DATA +
+           "GET / HTTP/1.1\r\nHost: 127.0.0.1:10828\r\nConnection: close\r\n\r\n")
+    a = ""
+    while True:
+        b = s.recv(4096)
+        if not b:
+            break
+        a += b
+    assert a.count("HTTP/1.1 200") == 11 and "1234" in a
+
+def test_pipeline_wsgi_threads():
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--allowed-extension bmp,gif",
+                               "--wsgi-threads 4",
+                               "--protocol Http")
+    time.sleep(0.1)
+    s = server_socket(10828)
+    s.settimeout(1)
+    s.send("GET /complex HTTP/1.1\r\nHost: 127.0.0.1:10828\r\n\r\n" +
+           "GET / HTTP/1.1\r\nHost: 127.0.0.1:10828\r\n\r\n" * 8 + POST_DATA +
+           "GET / HTTP/1.1\r\nHost: 127.0.0.1:10828\r\nConnection: close\r\n\r\n")
+    a = ""
+    while True:
+        b = s.recv(4096)
+        if not b:
+            break
+        a += b
+    # Responses keep request order even if handled by different threads
+    assert a.count("HTTP/1.1 200") == 11 and "1234" in a
+    assert a.index("Hello world!\n" * 20000) < a.index("1234")
+
+def test_http_routes():
+    async = WheatServer(config_file("http-routes", "- /s wsgi", "- /static/ static-file",
+                                    "- =/static/hello wsgi"),
+                               "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--allowed-extension bmp,gif,jpg",
+                               "--protocol Http")
+    time.sleep(0.1)
+    # Exact path wins over longer prefix
+    a = http_get("/static/hello")
+    assert a.startswith("HTTP/1.1 200") and a.endswith("Hello world!\n")
+    # Longest prefix wins
+    a = http_get("/static/example.jpg")
+    assert a.startswith("HTTP/1.1 200") and "Hello world!" not in a
+    assert http_get("/static/hello/x").startswith("HTTP/1.1 404")
+    assert http_get("/sx?a=1").endswith("Hello world!\n")
+    # No route matches
+    assert http_get("/").startswith("HTTP/1.1 404")
+    assert http_get("/other").startswith("HTTP/1.1 404")
+
+def test_fragments():
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--allowed-extension bmp,gif",
+                               "--wsgi-flush-size 4096",
+                               "--protocol Http")
+    time.sleep(0.1)
+    s = server_socket(10828)
+    s.settimeout(1)
+    s.send("GET /fragments HTTP/1.1\r\nHost: 127.0.0.1:10828\r\nConnection: close\r\n\r\n")
+    a = ""
+    while True:
+        b = s.recv(4096)
+        if not b:
+            break
+        a += b
+    # Items are written together, but each is still a chunk
+    body = a.split("\r\n\r\n", 1)[1]
+    assert body.count("\r\n") == 500 * 2 + 2
+    assert "<li>item 0</li>\n" in body and body.endswith("<li>item 499</li>\n\r\n0\r\n\r\n")
+
+def read_chunked(s, a):
+    """Read chunked body following headers in `a`, return headers, body
+    and bytes after it"""
+    while "\r\n\r\n" not in a:
+        a += s.recv(4096)
+    head, a = a.split("\r\n\r\n", 1)
+    body = ""
+    while True:
+        while "\r\n" not in a:
+            a += s.recv(4096)
+        size, a = a.split("\r\n", 1)
+        size = int(size, 16)
+        while len(a) < size + 2:
+            a += s.recv(4096)
+        assert a[size:size+2] == "\r\n"
+        body += a[:size]
+        a = a[size+2:]
+        if not size:
+            return head, body, a
+
+def test_chunked_response():
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--allowed-extension bmp,gif",
+                               "--protocol Http")
+    time.sleep(0.1)
+    s = server_socket(10828)
+    s.settimeout(2)
+    # Response without Content-Length keeps connection alive
+    s.send("GET /fragments HTTP/1.1\r\nHost: 127.0.0.1:10828\r\n\r\n" +
+           "GET /stream HTTP/1.1\r\nHost: 127.0.0.1:10828\r\n\r\n")
+    head, body, a = read_chunked(s, "")
+    assert "Transfer-Encoding: chunked" in head and "Content-Length" not in head
+    assert body == "".join("<li>item %d</li>\n" % i for i in range(500))
+    head, body, a = read_chunked(s, a)
+    assert "Connection: keep-alive" in head and body == "first\nsecond\n" and a == ""
+    # HEAD has no body to delimit
+    s.send("HEAD /fragments HTTP/1.1\r\nHost: 127.0.0.1:10828\r\n\r\n")
+    a = ""
+    while "\r\n\r\n" not in a:
+        a += s.recv(4096)
+    assert a.startswith("HTTP/1.1 200") and a.endswith("\r\n\r\n")
+    assert "Connection: keep-alive" in a and "chunked" not in a
+    # HTTP/1.0 client doesn't know chunked, body ends by close
+    s.send("GET /fragments HTTP/1.0\r\n\r\n")
+    a = ""
+    while True:
+        b = s.recv(4096)
+        if not b:
+            break
+        a += b
+    head, body = a.split("\r\n\r\n", 1)
+    assert "chunked" not in head and body == "".join("<li>item %d</li>\n" % i for i in range(500))
+
+def test_stream_wsgi_threads():
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--allowed-extension bmp,gif",
+                               "--wsgi-threads 2",
+                               "--wsgi-flush-size 0",
+                               "--wsgi-buffer-size 1000",
+                               "--protocol Http")
+    time.sleep(0.1)
+    s = server_socket(10828)
+    s.settimeout(0.3)
+    s.send("GET /stream HTTP/1.1\r\nHost: 127.0.0.1:10828\r\n\r\n")
+    # First piece is sent while app is still running
+    a = ""
+    while "first\n" not in a:
+        a += s.recv(4096)
+    assert "200" in a and "second" not in a
+    s.settimeout(1)
+    while not a.endswith("0\r\n\r\n"):
+        a += s.recv(4096)
+    assert "second\n" in a
+    # App waits for slow client, body is still complete
+    s.send("GET /fragments HTTP/1.1\r\nHost: 127.0.0.1:10828\r\nConnection: close\r\n\r\n")
+    time.sleep(0.3)
+    a = ""
+    while True:
+        b = s.recv(64)
+        if not b:
+            break
+        a += b
+    body = a.split("\r\n\r\n", 1)[1]
+    assert body.count("\r\n") == 500 * 2 + 2
+    assert "<li>item 0</li>\n" in body and body.endswith("<li>item 499</li>\n\r\n0\r\n\r\n")
+
+def cached_get(path, count):
+    socks = []
+    for i in range(count):
+        s = server_socket(10828)
+        s.settimeout(2)
+        s.send("GET %s HTTP/1.1\r\nHost: 127.0.0.1:10828\r\nConnection: close\r\n\r\n" % path)
+        socks.append(s)
+    bodies = []
+    for s in socks:
+        a = ""
+        while True:
+            b = s.recv(4096)
+            if not b:
+                break
+            a += b
+        assert "HTTP/1.1 200" in a
+        bodies.append(a.split("\r\n\r\n", 1)[1])
+    return bodies
+
+def test_cache():
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--allowed-extension bmp,gif",
+                               "--worker-number 1",
+                               "--wsgi-cache-size 1048576",
+                               "--protocol Http")
+    time.sleep(0.1)
+    a = http_get("/cached?2")
+    assert a.startswith("HTTP/1.1 200") and a.endswith("call 1\n")
+    # Hit is answered with its age, other query is another entry
+    a = http_get("/cached?2")
+    assert a.endswith("call 1\n") and "Age: " in a
+    assert http_get("/cached?60").endswith("call 2\n")
+    # Credentials bypass cache
+    assert http_get("/cached?2", "Authorization: Basic eDp5\r\n").endswith("call 3\n")
+    # Expired after max-age
+    time.sleep(3.1)
+    assert http_get("/cached?2").endswith("call 4\n")
+
+def test_cache_wsgi_threads():
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--allowed-extension bmp,gif",
+                               "--worker-number 1",
+                               "--wsgi-threads 4",
+                               "--wsgi-cache-size 1048576",
+                               "--protocol Http")
+    time.sleep(0.1)
+    # Concurrent misses wait for the first one and get its response
+    assert cached_get("/cached", 4) == ["call 1\n"] * 4
+    assert cached_get("/cached", 1) == ["call 1\n"]
+    # Waiters call app themselves if response isn't cached
+    bodies = cached_get("/cached?0", 3)
+    assert len(set(bodies)) == 3 and "call 2\n" in bodies
+
+def upstream_server(port):
+    """Backend replying path of each request, "/close" makes it close
+    connection without response"""
+    l = socket.socket()
+    l.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    l.bind(("127.0.0.1", port))
+    l.listen(16)
+    def serve(s):
+        buf = ""
+        while True:
+            b = s.recv(4096)
+            if not b:
+                break
+            buf += b
+            while "\r\n\r\n" in buf:
+                head, buf = buf.split("\r\n\r\n", 1)
+                path = head.split(" ")[1]
+                if path.endswith("/close"):
+                    s.close()
+                    return
+                body = "upstream %s" % path
+                s.send("HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n%s" % (len(body), body))
+        s.close()
+    def accept():
+        while True:
+            s, addr = l.accept()
+            t = threading.Thread(target=serve, args=(s,))
+            t.daemon = True
+            t.start()
+    t = threading.Thread(target=accept)
+    t.daemon = True
+    t.start()
+    return l
+
+def test_http_proxy():
+    async = WheatServer(config_file("proxy-upstreams", "- 127.0.0.1:10830"),
+                               "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--allowed-extension bmp,gif",
+                               "--worker-number 1",
+                               "--protocol Http")
+    upstream = upstream_server(10830)
+    time.sleep(0.1)
+    # Backend connection is kept and reused by the second request
+    s = server_socket(10828)
+    s.settimeout(2)
+    for path in ("/api/a?x=1", "/api/b"):
+        s.send("GET %s HTTP/1.1\r\nHost: 127.0.0.1:10828\r\n\r\n" % path)
+        a = ""
+        while not a.endswith("upstream %s" % path):
+            a += s.recv(4096)
+        assert a.startswith("HTTP/1.1 200")
+    # Backend closing before response is a bad gateway
+    a = http_get("/api/close")
+    assert a.startswith("HTTP/1.1 502")
+    a = http_get("/api/c")
+    assert a.startswith("HTTP/1.1 200") and a.endswith("upstream /api/c")
+
+def static_root(**files):
+    """Document root with `files` under static/"""
+    root = tempfile.mkdtemp()
+    os.mkdir(os.path.join(root, "static"))
+    for name, content in files.items():
+        with open(os.path.join(root, "static", name), "w") as f:
+            f.write(content)
+    return root
+
+def test_static_path():
+    root = static_root(**{"index.html": "index\n", "a.txt": "a\n"})
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % root,
+                               "--allowed-extension txt,html",
+                               "--static-cache-ttl 1",
+                               "--protocol Http")
+    time.sleep(0.1)
+    assert http_get("/static/").endswith("\r\n\r\nindex\n")
+    assert http_get("/static/./../static//a.txt").endswith("\r\n\r\na\n")
+    # ".." can't climb above document root even back into it
+    a = http_get("/static/../../%s/static/a.txt" % os.path.basename(root))
+    assert a.startswith("HTTP/1.1 404")
+    # Missing path is remembered until it expires
+    assert http_get("/static/b.txt").startswith("HTTP/1.1 404")
+    with open(os.path.join(root, "static", "b.txt"), "w") as f:
+        f.write("b\n")
+    time.sleep(2.1)
+    assert http_get("/static/b.txt").endswith("\r\n\r\nb\n")
+    shutil.rmtree(root)
+
+def test_static_small_file():
+    root = static_root(**{"small.txt": "old\n"})
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % root,
+                               "--allowed-extension txt",
+                               "--worker-number 1",
+                               "--static-cache-ttl 2",
+                               "--protocol Http")
+    time.sleep(0.1)
+    a = http_get("/static/small.txt")
+    assert "Content-Length: 4\r\n" in a and a.endswith("\r\n\r\nold\n")
+    # Kept in memory until it expires, then read again
+    with open(os.path.join(root, "static", "small.txt"), "w") as f:
+        f.write("changed\n")
+    assert http_get("/static/small.txt").endswith("\r\n\r\nold\n")
+    time.sleep(3.1)
+    s = server_socket(10828)
+    s.settimeout(2)
+    s.send("GET /static/small.txt HTTP/1.1\r\nHost: 127.0.0.1:10828\r\n\r\n" +
+           "GET /static/small.txt HTTP/1.1\r\nHost: 127.0.0.1:10828\r\nConnection: close\r\n\r\n")
+    a = ""
+    while True:
+        b = s.recv(4096)
+        if not b:
+            break
+        a += b
+    assert a.count("Content-Length: 8\r\n") == 2 and a.count("\r\n\r\nchanged\n") == 2
+    shutil.rmtree(root)
+
+def test_file_wrapper():
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--allowed-extension bmp,gif",
+                               "--protocol Http")
+    time.sleep(0.1)
+    image = open(os.path.join(PROJECT_PATH, "example/static/example.jpg"), "rb").read()
+    # Big rest of file is sent by fd, small one is read into body
+    for off in (100, len(image) - 1000):
+        s = server_socket(10828)
+        s.settimeout(1)
+        s.send("GET /file_wrapper?%d HTTP/1.0\r\nHost: 127.0.0.1:10828\r\n\r\n" % off)
+        a = ""
+        while True:
+            b = s.recv(65536)
+            if not b:
+                break
+            a += b
+        assert a.split("\r\n\r\n", 1)[1] == image[off:]
+
+H2_PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+def h2_frame(type, flags, stream_id, payload=""):
+    return struct.pack(">I", len(payload))[1:] + struct.pack(">BBI", type, flags, stream_id) + payload
+
+def h2_headers(stream_id, method, path, end_stream, *fields):
+    # Literal header fields without indexing, no huffman
+    block = ""
+    for name, value in ((":method", method), (":path", path), (":scheme", "http"),
+                        (":authority", "127.0.0.1:10828")) + fields:
+        block += "\x00" + chr(len(name)) + name + chr(len(value)) + value
+    return h2_frame(1, 0x4 | (0x1 if end_stream else 0), stream_id, block)
+
+def h2_read_frame(s):
+    head = ""
+    while len(head) < 9:
+        b = s.recv(9 - len(head))
+        assert b
+        head += b
+    length = struct.unpack(">I", "\x00" + head[:3])[0]
+    type, flags, stream_id = struct.unpack(">BBI", head[3:])
+    payload = ""
+    while len(payload) < length:
+        b = s.recv(length - len(payload))
+        assert b
+        payload += b
+    return type, flags, stream_id & 0x7fffffff, payload
+
+def h2_response(s, stream_id):
+    # Return (first byte of header block, body) when stream ends
+    status, body = None, ""
+    while True:
+        type, flags, sid, payload = h2_read_frame(s)
+        if type == 4 and not flags & 0x1:
+            s.send(h2_frame(4, 0x1, 0))
+        if sid != stream_id:
+            continue
+        if type == 1:
+            status = payload[0]
+        elif type == 0:
+            body += payload
+        if type in (0, 1) and flags & 0x1:
+            return status, body
+
+def h2_requests(s):
+    s.send(h2_headers(3, "GET", "/", True))
+    status, body = h2_response(s, 3)
+    # ":status: 200" is index 8 of static table
+    assert status == "\x88" and body == "Hello world!\n"
+    s.send(h2_headers(5, "POST", "/asdf", False, ("content-length", "4")) +
+           h2_frame(0, 0x1, 5, "1234"))
+    assert h2_response(s, 5) == ("\x88", "1234")
+    # 260000 bytes response stops when 65535 bytes connection window is used
+    # up, 30 bytes of it are sent above
+    s.send(h2_headers(7, "GET", "/complex", True))
+    body = ""
+    s.settimeout(0.3)
+    try:
+        while True:
+            type, flags, sid, payload = h2_read_frame(s)
+            if type == 0 and sid == 7:
+                body += payload
+    except socket.timeout:
+        pass
+    assert len(body) == 65535 - 30
+    s.settimeout(1)
+    s.send(h2_frame(8, 0, 7, struct.pack(">I", 1 << 20)) +
+           h2_frame(8, 0, 0, struct.pack(">I", 1 << 20)))
+    status, rest = h2_response(s, 7)
+    assert body + rest == "Hello world!\n" * 20000
+
+def test_h2c_prior_knowledge():
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--allowed-extension bmp,gif",
+                               "--protocol Http")
+    time.sleep(0.1)
+    s = server_socket(10828)
+    s.settimeout(1)
+    s.send(H2_PREFACE + h2_frame(4, 0, 0))
+    type, flags, sid, payload = h2_read_frame(s)
+    assert type == 4 and flags == 0 and sid == 0
+    s.send(h2_frame(4, 0x1, 0))
+    s.send(h2_headers(1, "GET", "/", True))
+    status, body = h2_response(s, 1)
+    assert status == "\x88" and body == "Hello world!\n"
+    h2_requests(s)
+
+def test_h2c_upgrade():
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--allowed-extension bmp,gif",
+                               "--protocol Http")
+    time.sleep(0.1)
+    s = server_socket(10828)
+    s.settimeout(1)
+    s.send("GET / HTTP/1.1\r\nHost: 127.0.0.1:10828\r\n"
+           "Connection: Upgrade, HTTP2-Settings\r\nUpgrade: h2c\r\n"
+           "HTTP2-Settings: AAMAAABkAAQAAP__\r\n\r\n")
+    a = ""
+    while "\r\n\r\n" not in a:
+        a += s.recv(1)
+    assert a.startswith("HTTP/1.1 101")
+    s.send(H2_PREFACE + h2_frame(4, 0, 0))
+    # Upgrade request is answered as stream 1
+    status, body = h2_response(s, 1)
+    assert status == "\x88" and body == "Hello world!\n"
+    h2_requests(s)
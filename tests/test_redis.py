@@ -96,3 +96,137 @@ def test_redis_conf():
     assert "get config from redis server sucessful" not in content
     os.unlink("test_redis_conf2.log")
     del async
+
+def test_redis_pipeline():
+    redis1 = RedisServer("", "--port 18000")
+    redis2 = RedisServer("", "--port 18001")
+    async = WheatServer("redis.conf", "--worker-type %s" % "AsyncWorker",
+                               "--protocol Redis",
+                               "--config-source UseFile",
+                               "--backup-size 2")
+    time.sleep(0.1)
+    r = redis.StrictRedis(port=10828)
+    # Commands to the same backend within one loop are sent together,
+    # replies must keep order
+    p = r.pipeline(transaction=False)
+    for i in range(200):
+        p.set("pipeline%d" % i, i * 3)
+    for i in range(200):
+        p.get("pipeline%d" % i)
+    result = p.execute()
+    assert result[:200] == [True] * 200
+    assert result[200:] == [str(i * 3) for i in range(200)]
+
+def test_redis_multi_key():
+    redis1 = RedisServer("", "--port 18000")
+    redis2 = RedisServer("", "--port 18001")
+    async = WheatServer("redis.conf", "--worker-type %s" % "AsyncWorker",
+                               "--protocol Redis",
+                               "--config-source UseFile",
+                               "--backup-size 2")
+    time.sleep(0.1)
+    r = redis.StrictRedis(port=10828)
+    # Keys are split to different backends and replies keep key order
+    keys = ["multi%d" % i for i in range(100)]
+    assert r.mset(dict((k, k * 2) for k in keys[:50]))
+    assert r.mget(keys) == [k * 2 for k in keys[:50]] + [None] * 50
+    assert r.mget(keys[0]) == [keys[0] * 2]
+    assert r.exists(*keys) == 50
+    assert r.delete(*keys[40:60]) == 10
+    assert r.exists(*keys) == 40
+    assert r.mget(keys[35:45]) == [k * 2 for k in keys[35:40]] + [None] * 5
+
+def test_redis_hash():
+    redis1 = RedisServer("", "--port 18000")
+    redis2 = RedisServer("", "--port 18001")
+    async = WheatServer("redis.conf", "--worker-type %s" % "AsyncWorker",
+                               "--protocol Redis",
+                               "--config-source UseFile",
+                               "--hash-function Crc16",
+                               "--keyspace 16384",
+                               "--hash-tag {}")
+    time.sleep(0.1)
+    r = redis.StrictRedis(port=10828)
+    assert r.set("{user1000}.following", 1)
+    assert r.set("{user1000}.followers", 2)
+    assert r.get("{user1000}.followers") == "2"
+    # Token of key is Redis Cluster slot of hash tag "user1000"
+    keys = redis.StrictRedis(port=18000).keys() + redis.StrictRedis(port=18001).keys()
+    assert sorted(keys) == ["3443{user1000}.followers", "3443{user1000}.following"]
+
+def test_redis_connections():
+    redis1 = RedisServer("", "--port 18000")
+    redis2 = RedisServer("", "--port 18001")
+    async = WheatServer("redis.conf", "--worker-type %s" % "AsyncWorker",
+                               "--protocol Redis",
+                               "--config-source UseFile",
+                               "--backup-size 2",
+                               "--redis-connections 4")
+    time.sleep(0.1)
+    clients = [redis.StrictRedis(port=10828) for i in range(4)]
+    # Pipelined requests of one client are replied in order even though
+    # backend connections are shared by clients
+    pipes = [r.pipeline(transaction=False) for r in clients]
+    for i, p in enumerate(pipes):
+        for j in range(100):
+            p.set("conn%d:%d" % (i, j % 10), j)
+            p.get("conn%d:%d" % (i, j % 10))
+    for p in pipes:
+        result = p.execute()
+        assert result[0::2] == [True] * 100
+        assert result[1::2] == [str(j) for j in range(100)]
+
+def test_redis_hedge():
+    redis1 = RedisServer("", "--port 18000")
+    redis2 = RedisServer("", "--port 18001")
+    async = WheatServer("redis.conf", "--worker-type %s" % "AsyncWorker",
+                               "--protocol Redis",
+                               "--config-source UseFile",
+                               "--backup-size 2",
+                               "--hedge-percentile 50",
+                               "--hedge-budget 100")
+    time.sleep(0.1)
+    r = redis.StrictRedis(port=10828)
+    # Reads hedged to another backup and the discarded late replies never
+    # reach client, pipelined reads behind write aren't hedged
+    for i in range(200):
+        r.set("hedge%d" % (i % 20), i)
+    for i in range(2000):
+        assert r.get("hedge%d" % (i % 20)) == str(180 + i % 20)
+    p = r.pipeline(transaction=False)
+    for i in range(100):
+        p.get("hedge%d" % (i % 20))
+        p.set("hedge%d" % (i % 20), i)
+    result = p.execute()
+    assert result[1::2] == [True] * 100
+
+def test_redis_cache():
+    redis1 = RedisServer("", "--port 18000")
+    redis2 = RedisServer("", "--port 18001")
+    async = WheatServer("redis.conf", "--worker-type %s" % "AsyncWorker",
+                               "--protocol Redis",
+                               "--config-source UseFile",
+                               "--worker-number 1",
+                               "--redis-cache-size 1048576",
+                               "--redis-cache-commands get,hget")
+    time.sleep(0.1)
+    r = redis.StrictRedis(port=10828)
+    r2 = redis.StrictRedis(port=10828)
+    # Write of one client is seen by others at once
+    for i in range(100):
+        r.set("celebrity", i)
+        assert r2.get("celebrity") == str(i)
+        assert r2.get("celebrity") == str(i)
+    r.hset("celebrity:h", "a", 1)
+    r.hset("celebrity:h", "b", 2)
+    assert r2.hget("celebrity:h", "a") == "1"
+    assert r2.hget("celebrity:h", "b") == "2"
+    r.hset("celebrity:h", "a", 3)
+    assert r2.hget("celebrity:h", "a") == "3"
+    r.delete("celebrity", "celebrity:h")
+    assert r2.get("celebrity") is None
+    p = r.pipeline(transaction=False)
+    for i in range(100):
+        p.set("celebrity", i)
+        p.get("celebrity")
+    assert p.execute()[1::2] == [str(i) for i in range(100)]